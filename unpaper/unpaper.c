@@ -25,20 +25,37 @@ const char* README =
 
 "Input and output files can be in either .pbm , .pgm or .ppm format, thus\n"
 "generally in .pnm format, as also used by the Linux scanning tools scanimage\n"
-"and scanadf.\n"
-"Conversion to PDF can e.g. be achieved with the Linux tools pgm2tiff, tiffcp\n"
-"and tiff2pdf.";
+"and scanadf, or in .tif format. The pages of a multi-page tiff file are\n"
+"processed as a sequence of sheets, and a tiff output file receives one page\n"
+"per sheet. Grayscale and color .pnm files with 16 bits per sample keep their\n"
+"full precision through all processing steps.\n"
+"Instead of files, a stream of pnm images following each other can be read\n"
+"from standard input and written to standard output, so that unpaper can run\n"
+"in a pipeline behind a scanning tool.\n"
+"Conversion to PDF can e.g. be achieved with the Linux tool tiff2pdf.";
 
 const char* COMPILE = 
-"gcc -D TIMESTAMP=\"<yyyy-MM-dd HH:mm:ss>\" -lm -O3 -funroll-all-loops -fomit-frame-pointer -ftree-vectorize -o unpaper unpaper.c\n";
+"gcc -D TIMESTAMP=\"<yyyy-MM-dd HH:mm:ss>\" -lm -lpthread -lz -O3 -funroll-all-loops -fomit-frame-pointer -ftree-vectorize -o unpaper unpaper.c\n";
 
 /* ------------------------------------------------------------------------ */
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <math.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <zlib.h>
  
 #ifdef TIMESTAMP
 const char* BUILD = TIMESTAMP;
@@ -54,7 +71,10 @@ const char* USAGE =
 "Usage: unpaper [options] <input-file(s)> <output-file(s)>\n\n"
 "Filenames may contain a formatting placeholder starting with '%%' to insert a\n"
 "page counter for multi-page processing. E.g.: 'scan%%03d.pbm' to process files\n"
-"scan001.pbm, scan002.pbm, scan003.pbm etc.\n";
+"scan001.pbm, scan002.pbm, scan003.pbm etc.\n"
+"The filename '-' stands for standard input or output, which carry a stream of\n"
+"pnm images one after the other, one image per page. E.g.:\n"
+"'cat scan*.pbm | unpaper - - > book.pbm'.\n";
 
 const char* OPTIONS = 
 "-l --layout single                   Set default layout options for a sheet:\n"
@@ -178,6 +198,20 @@ const char* OPTIONS =
 "--post-zoom <factor>                 Change the sheet size according to the\n"
 "                                     given factor after processing is done.\n\n"
 
+"--stretch-filter box|bilinear        How pixels are sampled when the sheet\n"
+"                 |lanczos            size changes:\n"
+"                                     'box': Each pixel is the average of a\n"
+"                                         block of source pixels when\n"
+"                                         shrinking, or the nearest source\n"
+"                                         pixel when enlarging.\n"
+"                                     'bilinear': Each pixel is interpolated\n"
+"                                         linearly from the source pixels\n"
+"                                         around it.\n"
+"                                     'lanczos': Each pixel is interpolated\n"
+"                                         with a 3-lobed Lanczos kernel, which\n"
+"                                         keeps text sharper.\n"
+"                                     (default: box)\n\n"
+
 "-bn --blackfilter-scan-direction     Directions in which to search for solidly\n"
 "     [v[ertical]][,][h[orizontal]]   black areas. Either 'v' (for vertical\n"
 "                                     scanning), 'h' (for horizontal scanning)\n"
@@ -215,6 +249,16 @@ const char* OPTIONS =
 "                                     cluster which only contains n dark pixels\n"
 "                                     together will be deleted. (default: 4)\n\n"
 
+"--noisefilter-method components      How clusters are found by the noisefilter:\n"
+"                     |rings           'components': Clusters are all dark pixels\n"
+"                                         connected to each other.\n"
+"                                     'rings': Dark pixels are counted in\n"
+"                                         growing square rings around each\n"
+"                                         dark pixel, until a ring without dark\n"
+"                                         pixels is found. This is how previous\n"
+"                                         versions worked.\n"
+"                                     (default: components)\n\n"
+
 "-ls --blurfilter-size                Size of blurfilter area to search for\n"
 "      <size>|<h-size>,<v-size>       'lonely' clusters of pixels.\n"
 "                                     (default: 100,100)\n\n"
@@ -324,10 +368,54 @@ const char* OPTIONS =
 "                                     Lower numbers lead to better results but\n"
 "                                     slow down processing. (default: 0.1)\n\n"
 
+"--deskew-method edges|projection     How rotation is detected:\n"
+"                                     'edges': The edges selected with\n"
+"                                         --deskew-scan-direction are scanned\n"
+"                                         with a virtual line at each tested\n"
+"                                         angle.\n"
+"                                     'projection': The dark pixels of the\n"
+"                                         mask are projected along each tested\n"
+"                                         angle, the angle in which text lines\n"
+"                                         stand out most wins. Angles are\n"
+"                                         first tested on a downsampled copy,\n"
+"                                         then refined at full resolution.\n"
+"                                         This also works on pages with clean\n"
+"                                         margins.\n"
+"                                     (default: edges)\n\n"
+
+"--deskew-scan-search all|refine      How rotation-angles are searched:\n"
+"                                     'all': Every step in the range is tested.\n"
+"                                     'refine': Every other step is tested\n"
+"                                         first, then the steps next to the\n"
+"                                         four best angles found. This needs\n"
+"                                         about half the scans, but may miss a\n"
+"                                         peak that is narrower than the grid.\n"
+"                                     (default: all)\n\n"
+
 "-dv --deskew-scan-deviation <dev>    Maximum statistical deviation allowed\n"
 "                                     among the results from detected edges.\n"
 "                                     No rotation if exceeded. (default: 1.0)\n\n"
 
+"--deskew-interpolation nearest       How pixels are sampled when rotating:\n"
+"                      |bilinear      'nearest': Each pixel is copied from the\n"
+"                                         nearest source pixel.\n"
+"                                     'bilinear': Each pixel is interpolated\n"
+"                                         from the four nearest source pixels.\n"
+"                                         This gives smooth edges without the\n"
+"                                         qpixel-mode, so it is usually\n"
+"                                         combined with --no-qpixels.\n"
+"                      |supersample   'supersample': Each pixel is the average\n"
+"                                         of a grid of samples taken directly\n"
+"                                         from the sheet (see --deskew-\n"
+"                                         supersample). This looks like the\n"
+"                                         qpixel-mode, which is not used then,\n"
+"                                         but needs much less memory and time.\n"
+"                                     (default: nearest)\n\n"
+
+"--deskew-supersample <n>             Number of samples per pixel in each\n"
+"                                     direction with --deskew-interpolation\n"
+"                                     supersample, 1..8. (default: 2)\n\n"
+
 "-W --wipe                            Manually wipe out an area. Any pixel in\n"
 "     <left>,<top>,<right>,<bottom>   a wiped area will be set to white.\n"
 "                                     Multiple --wipe areas may be specified.\n"
@@ -488,9 +576,18 @@ const char* OPTIONS =
 "                                     occur before specifying any size value\n"
 "                                     with measurement suffix. (default: 300)\n\n"
 
-"-t --type pbm|pgm                    Output file type. (default: as input)\n\n"
+"-t --type pbm|pgm|ppm                Output file type. For .tif output files,\n"
+"                                     the pixel format of the pages written.\n"
+"                                     (default: as input)\n\n"
 
-"-d --depth <bits>                    Output pixel depth. (default: as input)\n\n"
+"--tiff-compression lzw|deflate|none  Compression of grayscale and color pages\n"
+"                                     of .tif output files. Black-and-white\n"
+"                                     pages are compressed with CCITT Group 4,\n"
+"                                     unless 'none' is given. (default: lzw)\n\n"
+
+"-d --depth <bits>                    Output pixel depth. 16 writes .pgm and .ppm\n"
+"                                     files with 16 bits per sample, other\n"
+"                                     formats get 8. (default: as input)\n\n"
 
 "-T --test-only                       Do not write any output. May be useful in\n"
 "                                     combination with --verbose to get informa-\n"
@@ -548,6 +645,44 @@ const char* OPTIONS =
 
 "--time                               Output processing time consumed.\n\n"
 
+"--profile                            Output the wall-clock time, cpu time and\n"
+"                                     number of pixels of each stage of\n"
+"                                     processing for every sheet, and a summary\n"
+"                                     of all sheets (mean, median, 95th\n"
+"                                     percentile and maximum). Streamed sheets\n"
+"                                     are measured as a whole. Implies\n"
+"                                     --no-pipeline, and input files are read\n"
+"                                     in full while loading, so that reading\n"
+"                                     and writing files is measured where it\n"
+"                                     happens.\n\n"
+
+"--jobs <n>                           Process up to n sheets at the same time,\n"
+"                                     each one in a separate process. Output\n"
+"                                     files, messages and exit code are the\n"
+"                                     same as with sequential processing.\n"
+"                                     (default: 1)\n\n"
+
+"--threads <n>                        Use up to n threads for processing each\n"
+"                                     sheet. Results are the same as with a\n"
+"                                     single thread. (default: 1)\n\n"
+
+"--no-pipeline                        Load and save each sheet strictly one\n"
+"                                     after the other. By default the input\n"
+"                                     files of the next sheet are read ahead\n"
+"                                     and the previous sheet is saved while a\n"
+"                                     sheet is processed, unless --jobs is\n"
+"                                     used.\n\n"
+
+"--stream <rows>                      Process each sheet in bands of the given\n"
+"                                     number of rows, instead of holding all of\n"
+"                                     it in memory. Masks and rotation are\n"
+"                                     detected on a downscaled copy of the\n"
+"                                     sheet. The blackfilter, mask centering and\n"
+"                                     border scan are not available. Sheets which\n"
+"                                     are mirrored, shifted, rotated or resized,\n"
+"                                     or split into several output files, are\n"
+"                                     processed in memory.\n\n"
+
 "-V --version                         Output version and build information.\n\n";
 
 //-vvv --debug                        Undocumented.
@@ -566,6 +701,7 @@ const char* HELP =
               
 #define abs(value) ( (value) >=0 ? (value) : -(value) )
 #define max(a, b) ( (a >= b) ? (a) : (b) )
+#define min(a, b) ( (a <= b) ? (a) : (b) )
 #define pluralS(i) ( (i > 1) ? "s" : "" )
 #define pixelValue(r, g, b) ( (r)<<16 | (g)<<8 | (b) )
 #define pixelGrayscaleValue(g) ( (g)<<16 | (g)<<8 | (g) )
@@ -575,19 +711,81 @@ const char* HELP =
 #define red(pixel) ( (pixel >> 16) & 0xff )
 #define green(pixel) ( (pixel >> 8) & 0xff )
 #define blue(pixel) ( pixel & 0xff )
+#define isBlackOrWhite(g) ( ((g) == BLACK) || ((g) == WHITE) )
+#define sample16(image, i) ( ((image)->buffer[i] << 8) | (image)->low[i] ) // 16-bit sample at offset i of an image with low bytes
+#define getSample8(high, low, i) ( (void)(low), (high)[i] ) // sample at offset i of the buffer (high) and low bytes (low) of an image, for kernels defined for both widths
+#define putSample8(high, low, i, v) ( (void)(low), (high)[i] = (unsigned char)(v) )
+#define getSample16(high, low, i) ( ((high)[i] << 8) | (low)[i] )
+#define putSample16(high, low, i, v) ( (high)[i] = (unsigned char)((v) >> 8), (low)[i] = (unsigned char)((v) & 0xff) )
+#define getBit(row, x) ( (row)[(x) >> 3] & (128 >> ((x) & 7)) ) // non-zero if pixel x in a packed 1-bit row is set (black)
+#define bitsFrom(x) ( (unsigned char)(0xff >> ((x) & 7)) ) // mask of the bits from pixel x to the end of its byte
+#define bitsUntil(x) ( (unsigned char)(0xff << (7 - ((x) & 7))) ) // mask of the bits from the start of its byte until pixel x
 
 
 /* --- preprocessor constants ---------------------------------------------- */
               
 #define MAX_MULTI_INDEX 10000 // maximum pixel count of virtual line to detect rotation with
 #define MAX_ROTATION_SCAN_SIZE 10000 // maximum pixel count of virtual line to detect rotation with
+#define MAX_ROTATION_STEPS 201 // maximum number of angles tested at once by detectProjectionRotation()
 #define MAX_MASKS 100
 #define MAX_POINTS 100
 #define MAX_FILES 100
 #define MAX_PAGES 2
+#define MAX_JOBS 64
+#define MAX_THREADS 64
+#define MAX_INTEGRALS 4
+#define MAX_SUPERSAMPLE 8 // maximum number of samples per pixel in each direction when rotating
+#define MAX_STREAM_AREAS 4 // maximum number of sets of areas filled before or after the stages of streamRows()
+#define POOL_MINIMUM 4096 // capacity of the smallest size class of the buffer pool
+#define POOL_STEPS 4 // size classes of the buffer pool per doubling of capacity
+#define POOL_CLASSES 160
+#define RESAMPLE_BITS 14 // fixed-point precision of the weights of stretch()
+#define REFINE_STRIDE 2 // maximum number of steps between the angles first tested by a refining rotation search
+#define REFINE_CANDIDATES 4 // number of best angles of the first grid refined by a refining rotation search
+#define PREFETCH_BLOCK (1 << 20) // size of the reads of the prefetch thread
+#define OUTPUT_BLOCK (1 << 20) // size of the writes to output files
+#define MAX_HEADER 64 // maximum length of the header of a pnm file written
+#define MAX_INPUT_HEADER 4096 // maximum length of the header of a pnm image read from standard input
+#define INPUT_BLOCK (1 << 16) // size of the reads from standard input
+#define TIFF_BLOCK 65536 // size of the buffer for compressed data of a tiff page
+#define TIFF_PAGE_FIELDS 11 // maximum number of fields of a tiff page written
+#define TIFF_SHORT 3 // tiff field types
+#define TIFF_LONG 4
+#define TIFF_IMAGE_WIDTH 256 // tiff tags
+#define TIFF_IMAGE_LENGTH 257
+#define TIFF_BITS_PER_SAMPLE 258
+#define TIFF_COMPRESSION 259
+#define TIFF_PHOTOMETRIC 262
+#define TIFF_FILL_ORDER 266
+#define TIFF_STRIP_OFFSETS 273
+#define TIFF_SAMPLES_PER_PIXEL 277
+#define TIFF_ROWS_PER_STRIP 278
+#define TIFF_STRIP_BYTE_COUNTS 279
+#define TIFF_PLANAR_CONFIGURATION 284
+#define TIFF_PREDICTOR 317
+#define TIFF_UNCOMPRESSED 1 // values of the tiff compression field
+#define TIFF_CCITT_G4 4
+#define TIFF_LZW 5
+#define TIFF_DEFLATE 8
+#define TIFF_PACKBITS 32773
+#define TIFF_OLD_DEFLATE 32946
+#define LZW_BITS 12 // maximum width of LZW codes
+#define LZW_CODES 4096
+#define LZW_CLEAR 256
+#define LZW_END 257
+#define LZW_FIRST 258 // first code of strings longer than one byte
+#define LZW_HASH 9001 // size of the hash table of the LZW encoder (prime)
+#define FAX_CODES 104 // number of run length codes per color in CCITT fax compression
+#define FAX_PEEK 13 // length of the longest run length code
+#define FAX_PASS 100 // coding modes of CCITT Group 4 besides the vertical offsets
+#define FAX_HORIZONTAL 101
+#define FLIP_TILE 64 // width and height of the tiles flipRotate() transposes at once
+#define INTEGRAL_TILE 16 // width and height of the tiles summed-area tables are split into (sums of a tile fit into 16 bits)
+#define INTEGRAL_MIN_AREA 256 // smallest rectangle for which summed-area tables are used
 #define WHITE 255
 #define GRAY 127
 #define BLACK 0
+#define WHITE16 65535 // white in 16-bit samples
 #define BLANK_TEXT "<blank>"
 
 
@@ -640,6 +838,38 @@ typedef enum {
 	LAYOUTS_COUNT
 } LAYOUTS;
 
+typedef enum {
+    DESKEW_METHOD_EDGES,
+    DESKEW_METHOD_PROJECTION,
+    DESKEW_METHODS_COUNT
+} DESKEW_METHODS;
+
+typedef enum {
+    DESKEW_SEARCH_ALL,
+    DESKEW_SEARCH_REFINE,
+    DESKEW_SEARCHES_COUNT
+} DESKEW_SEARCHES;
+
+typedef enum {
+    INTERPOLATION_NEAREST,
+    INTERPOLATION_BILINEAR,
+    INTERPOLATION_SUPERSAMPLE,
+    INTERPOLATIONS_COUNT
+} INTERPOLATIONS;
+
+typedef enum {
+    STRETCH_BOX,
+    STRETCH_BILINEAR,
+    STRETCH_LANCZOS,
+    STRETCH_FILTERS_COUNT
+} STRETCH_FILTERS;
+
+typedef enum {
+    NOISEFILTER_COMPONENTS,
+    NOISEFILTER_RINGS,
+    NOISEFILTER_METHODS_COUNT
+} NOISEFILTER_METHODS;
+
 typedef enum {
 	BRIGHT,
 	DARK,
@@ -660,19 +890,402 @@ typedef enum {
 	FILETYPES_COUNT
 } FILETYPES;
 
+typedef enum {
+    TIFF_COMPRESSION_NONE,
+    TIFF_COMPRESSION_LZW,
+    TIFF_COMPRESSION_DEFLATE,
+    TIFF_COMPRESSIONS_COUNT
+} TIFF_COMPRESSIONS;
+
+typedef enum {
+	GRAYSCALE,
+	LIGHTNESS,
+	DARKNESS_INVERSE,
+	CHANNELS_COUNT
+} CHANNELS;
+
+typedef enum {
+    STAGE_LOAD,
+    STAGE_FLIP,
+    STAGE_STRETCH,
+    STAGE_BLACKFILTER,
+    STAGE_NOISEFILTER,
+    STAGE_BLURFILTER,
+    STAGE_MASKS,
+    STAGE_GRAYFILTER,
+    STAGE_DESKEW,
+    STAGE_ROTATE,
+    STAGE_QPIXELS,
+    STAGE_BORDER,
+    STAGE_STREAM,
+    STAGE_SAVE,
+    STAGES_COUNT
+} STAGES;
+
 
 /* --- struct ------------------------------------------------------------- */
 
+struct POOL_BLOCK { // header in front of each buffer handed out by poolAlloc()
+    struct POOL_BLOCK* next; // next free block of the same size class
+    size_t capacity;
+    int sizeClass;
+    BOOLEAN idle; // not handed out since the last poolTrim()
+};
+
+struct POOL { // buffers of freed images, kept to be reused by the next images of similar size
+    struct POOL_BLOCK* free[POOL_CLASSES];
+    pthread_mutex_t mutex;
+    unsigned long hits; // buffers reused
+    unsigned long misses; // buffers newly allocated
+    size_t used; // bytes handed out
+    size_t cached; // bytes kept in the free lists
+    size_t limit; // maximum of used, which used + cached are kept within
+    size_t peak; // maximum of used + cached
+};
+
+struct INTEGRAL { // summed-area table of one kind of pixel statistics, tiles are calculated when needed
+    int channel; // GRAYSCALE, LIGHTNESS or DARKNESS_INVERSE
+    int minColor; // -1: sum up channel values, otherwise count pixels with channel values between minColor and maxBrightness
+    int maxBrightness;
+    unsigned short* table; // per tile: for each pixel, the sum over the tile's pixels above and left of it (inclusive)
+    unsigned int* built; // version of each tile the table has been calculated from
+};
+
+struct INTEGRALS { // summed-area tables set up for an image by requireIntegral()
+    int tilesX;
+    int tilesY;
+    unsigned int* version; // incremented for a tile whenever one of its pixels changes
+    int count;
+    struct INTEGRAL integral[MAX_INTEGRALS];
+};
+
 struct IMAGE {
     unsigned char* buffer;
+    unsigned char* low; // low bytes of the samples of a 16-bit image, laid out like buffer which holds the high bytes, NULL for other bitdepths
     unsigned char* bufferGrayscale;
     unsigned char* bufferLightness;
     unsigned char* bufferDarknessInverse;
+    int channelsValid; // bitmask of derived channels (1<<GRAYSCALE etc.) which are up to date, built on demand for color images
+    struct INTEGRALS* integrals; // summed-area tables, only while a scanning stage uses them
     int width;
     int height;
+    int stride; // number of bytes per row in buffer
     int bitdepth;
     BOOLEAN color;
+    BOOLEAN packed; // 1-bit image stored as bits like in PBM files (8 pixels per byte, most significant bit first, set bit: black)
     int background;
+    unsigned char* mapping; // memory-mapped input file which buffer points into, NULL if buffer is allocated
+    size_t mappingSize;
+    dev_t mappingDevice; // identifies the mapped file, so that it is not overwritten while mapped
+    ino_t mappingInode;
+};
+
+struct OUTPUT_FILE { // file written in blocks of OUTPUT_BLOCK bytes, see writeOutput()
+    int fd;
+    char filename[1024]; // name the file gets once complete, empty if written under its own name
+    char temporaryFilename[1024];
+    unsigned char* buffer; // data not written yet
+    int pending;
+    size_t offset; // position in the file behind the data written so far
+    BOOLEAN success;
+};
+
+struct STANDARD_INPUT { // pnm images read one after the other from standard input, see seekStandardInput()
+    unsigned char* buffer;
+    size_t capacity;
+    size_t size; // bytes read into buffer
+    size_t pos; // position of the next byte not consumed yet
+    int index; // index of the image starting at pos
+    BOOLEAN end; // end of input reached
+};
+
+struct TIFF { // tiff file held in memory, see initTiff()
+    unsigned char* data;
+    size_t size;
+    BOOLEAN bigEndian;
+};
+
+struct FAX_CODE { // code of a run length in CCITT fax compression
+    unsigned short code;
+    unsigned char length; // number of bits
+    unsigned short run;
+};
+
+struct FAX_READER { // compressed data read by decodeG4()
+    unsigned char* data;
+    size_t size;
+    size_t pos;
+    unsigned int bits; // bits read ahead, see peekFaxBits()
+    int bitCount;
+    short runs[2][1 << FAX_PEEK]; // run lengths of white and black codes, by their next FAX_PEEK bits
+    unsigned char lengths[2][1 << FAX_PEEK]; // number of bits of these codes, 0 if invalid
+};
+
+struct TIFF_ENCODER { // compresses the rows of a tiff page, see encodeTiffRow()
+    struct OUTPUT_FILE* file;
+    int compression; // value of the compression field
+    int width;
+    int samples; // bytes per pixel for the horizontal differencing predictor, 0 for none
+    unsigned char* differences;
+    unsigned char buffer[TIFF_BLOCK]; // compressed data not passed on to the file yet
+    int pending;
+    unsigned int bits; // bits not yet making up a whole byte, see putBits()
+    int bitCount;
+    int* reference; // CCITT Group 4: changing elements of the previous row
+    int* changes;
+    short lzwCodes[LZW_HASH]; // LZW: codes of the strings in the hash table, -1 for free entries
+    unsigned int lzwKeys[LZW_HASH]; // LZW: prefix code and last byte of these strings
+    int lzwPrefix; // code of the string matched so far, -1 for none
+    int lzwNext;
+    int lzwWidth;
+    z_stream stream; // Deflate
+};
+
+struct TASKS { // tasks shared by the threads of runTasks()
+    void (*task)(int index, void* data);
+    void* data;
+    int count;
+    int next;
+    pthread_mutex_t mutex;
+};
+
+struct WINDOW_SCAN { // scan over a grid of overlapping windows, row by row from top-left to bottom-right
+    int (*filterWindow)(int left, int top, int right, int bottom, struct WINDOW_SCAN* scan);
+    struct IMAGE* image;
+    int size[DIRECTIONS_COUNT];
+    int step[DIRECTIONS_COUNT];
+    int brightness; // filter parameters
+    int threshold;
+    float intensity;
+    int columns;
+    int rows;
+    int offset; // image row at which the first row of windows starts
+    int lag; // number of windows a row has to stay behind the row above, so that no two windows processed at the same time affect each other
+    int* done; // number of windows finished per row
+    int* result; // filter result per row
+    pthread_mutex_t mutex;
+    pthread_cond_t progress;
+};
+
+struct RESAMPLE { // source pixels and their weights for each target pixel along one axis, see initResample()
+    int* start; // first source pixel
+    int* count; // number of source pixels
+    int* weight; // taps weights per target pixel, summing up to 1<<RESAMPLE_BITS (not used by STRETCH_BOX)
+    int taps;
+};
+
+struct STRETCH_BAND { // parameters of stretch() for processing bands of rows
+    int filter;
+    struct RESAMPLE* columns;
+    struct RESAMPLE* rows;
+    int height; // number of rows per band
+    struct IMAGE* source;
+    struct IMAGE* target;
+};
+
+struct MASKS_BAND { // parameters of applyMasks() for processing bands of rows
+    int (*mask)[EDGES_COUNT];
+    int maskCount;
+    int maskColor;
+    int height; // number of rows per band
+    struct IMAGE* image;
+};
+
+struct ROTATION_SCAN { // rotation detection of several masks, see detectRotations()
+    int method;
+    int edges;
+    int range;
+    float step;
+    int search;
+    int size;
+    float depth;
+    int (*mask)[EDGES_COUNT];
+    double (*rotation)[EDGES_COUNT]; // result of each edge, with DESKEW_METHOD_PROJECTION the result is stored for LEFT
+    struct IMAGE* image;
+};
+
+struct ROTATION { // parameters of rotate() for processing bands of rows
+    double cosval;
+    double sinval;
+    double centerX;
+    double centerY;
+    int interpolation;
+    int supersample; // samples per pixel in each direction with INTERPOLATION_SUPERSAMPLE
+    int width; // size of the rotated area, in source and target
+    int height;
+    int first; // rows of the area to compute
+    int last;
+    int rows; // rows per band
+    long sourceOffset; // offset of the area's top-left pixel in the buffers, which may hold only some rows of the area
+    long targetOffset;
+    struct IMAGE* source;
+    struct IMAGE* target;
+};
+
+struct AREAS { // areas of a sheet to be filled while streaming, see fillAreas()
+    int (*area)[EDGES_COUNT];
+    int count;
+    BOOLEAN outside; // fill everything outside the areas like applyMasks(), instead of the areas themselves like applyWipes()
+};
+
+struct STREAM { // a sheet processed in bands of rows, see streamRows()
+    struct IMAGE* source; // sheet to read rows from, usually memory-mapped
+    struct IMAGE band; // unpacked rows of the sheet, band.height rows starting at sheet row top
+    struct IMAGE out; // unpacked rows to be written next
+    int top;
+    int capacity; // rows allocated for band and out
+    int outCapacity;
+    int rows; // rows read at once
+    int loaded; // number of rows read from the sheet
+    int written; // number of rows written
+    size_t released; // bytes at the start of a memory-mapped source which are not needed anymore
+    struct AREAS before[MAX_STREAM_AREAS]; // filled when rows are read
+    int beforeCount;
+    struct AREAS after[MAX_STREAM_AREAS]; // filled when rows are written
+    int afterCount;
+    int maskColor;
+    float whiteThreshold;
+    float blackThreshold;
+    int noisefilterIntensity; // 0 if the noisefilter is disabled
+    int noisefilterMethod;
+    int noisefilterRow; // next row in which clusters may start
+    int noisefilterCount;
+    int* blurfilterScanSize; // NULL if the blurfilter is disabled
+    int* blurfilterScanStep;
+    float blurfilterIntensity;
+    int blurfilterRow; // next row of windows
+    int blurfilterCount;
+    int* grayfilterScanSize; // NULL if the grayfilter is disabled
+    int* grayfilterScanStep;
+    float grayfilterThreshold;
+    int grayfilterRow; // next row of windows
+    int grayfilterCount;
+    int (*rotationMask)[EDGES_COUNT]; // areas to deskew, inside the sheet
+    double* rotation; // radians per area, 0.0 to leave an area as it is
+    int rotationCount;
+    int interpolation;
+    int supersample;
+    struct OUTPUT_FILE* output; // NULL to write nothing
+    int type; // file type of output
+    struct IMAGE* proxy; // downscaled copy of the rows written, NULL if not needed
+    int factor; // size of the blocks of pixels averaged into one pixel of proxy
+    int* sums; // sums of the blocks of the current row of proxy
+};
+
+struct FILL_CROSS { // a filled cross of lines whose neighbouring pixels are still to be tried by floodFill()
+    int x;
+    int y;
+    int distance[EDGES_COUNT]; // length of the line towards each edge
+    int edge; // line whose neighbours are currently tried
+    int d; // number of neighbours of that line tried so far
+};
+
+struct FLOOD_FILL { // state of floodFill()
+    int color;
+    int maskMin;
+    int maskMax;
+    int intensity;
+    unsigned char* visited; // bitmap of filled pixels
+    int stride;
+    int count;
+    int bounds[EDGES_COUNT];
+    struct FILL_CROSS* stack;
+    int stackSize;
+    int stackCount;
+};
+
+struct COMPONENT { // connected cluster of dark pixels found by labelComponents()
+    int parent; // union-find link, the component itself if it is the root of its set
+    int size; // number of pixels
+    int bounds[EDGES_COUNT]; // bounding box
+    int seedX; // first pixel found
+    int seedY;
+};
+
+struct NOISE_FILTER { // state of noisefilter() while components get labeled
+    int intensity;
+    int whiteMin;
+    int first; // only components whose top row lies in this range are filtered
+    int last;
+    int count;
+    int* stack;
+    struct IMAGE* image;
+};
+
+struct STAGE_TIMES { // time spent in the stages of processing a sheet, see --profile
+    double wall[STAGES_COUNT]; // seconds of monotonic wall-clock time
+    double cpu[STAGES_COUNT]; // seconds of cpu time of all threads of the process
+    unsigned long long pixels[STAGES_COUNT]; // pixels of the images processed
+    double totalWall; // whole sheet, including the time between the stages
+    double totalCpu;
+};
+
+struct PROFILE { // measurements of --profile
+    BOOLEAN enabled; // for the current sheet
+    struct STAGE_TIMES sheet; // current sheet
+    struct timespec sheetWall; // start of the current sheet
+    struct timespec sheetCpu;
+    struct timespec stageWall; // start of the current stage
+    struct timespec stageCpu;
+    struct STAGE_TIMES* sheets; // all sheets measured so far, for the summary
+    int count;
+};
+
+struct SHEET_STAGES { // processing stages done for the current sheet, see stageEnabled()
+    BOOLEAN blackfilter;
+    BOOLEAN noisefilter;
+    BOOLEAN blurfilter;
+    BOOLEAN grayfilter;
+    BOOLEAN maskScan;
+    BOOLEAN maskCenter;
+    BOOLEAN deskew;
+    BOOLEAN wipe;
+    BOOLEAN border;
+    BOOLEAN borderScan;
+    BOOLEAN borderAlign;
+};
+
+struct SHEET_RESULT { // sent back from a worker process to the main process after a sheet has been processed
+    int exitCode;
+    int previousWidth;
+    int previousHeight;
+    int previousBitdepth;
+    BOOLEAN previousColor;
+    unsigned long int totalTime;
+    int totalCount;
+    BOOLEAN profiled;
+    struct STAGE_TIMES stages; // if profiled
+};
+
+struct SHEET_WORKER {
+    pid_t pid;
+    FILE* log; // the worker's standard output, replayed when the sheet gets collected
+    int result; // read end of the pipe carrying the SHEET_RESULT
+    int previous; // inside the worker: read end of the pipe telling if the sheets before succeeded, -1 once read
+    int next; // inside the worker: write end of the pipe telling the following sheet
+    BOOLEAN previousSucceeded;
+};
+
+struct PREFETCH { // input files of the next sheet, read ahead by a thread of their own
+    pthread_t thread;
+    BOOLEAN running;
+    int count;
+    char filenames[MAX_PAGES][255];
+};
+
+struct WRITER { // output of the previous sheet, saved by a thread of its own
+    pthread_t thread;
+    BOOLEAN running;
+    BOOLEAN success; // of the last sheet saved
+    struct IMAGE sheet; // owned by the writer until it has been saved
+    int count;
+    char filenamesBuffer[MAX_PAGES][255];
+    char* filenames[MAX_PAGES];
+    int directories[MAX_PAGES];
+    int type;
+    int compression;
+    BOOLEAN overwrite;
+    float blackThreshold;
 };
 
 
@@ -685,6 +1298,24 @@ const char FILETYPE_NAMES[FILETYPES_COUNT][5] = {
     "ppm"
 };
 
+// names of the stages of processing measured by --profile (see typedef STAGES)
+const char STAGE_NAMES[STAGES_COUNT][12] = {
+    "load",
+    "flip",
+    "stretch",
+    "blackfilter",
+    "noisefilter",
+    "blurfilter",
+    "masks",
+    "grayfilter",
+    "deskew",
+    "rotate",
+    "qpixels",
+    "border",
+    "stream",
+    "save"
+};
+
 // factors for conversion to inches
 #define MEASUREMENTS_COUNT 3
 const char MEASUREMENTS[MEASUREMENTS_COUNT][2][15] = {
@@ -717,9 +1348,93 @@ const char COLORS[COLORS_COUNT][2][50] = {
 };
 
 
+// number of set bits in a byte
+#define B2(n) n, n+1, n+1, n+2
+#define B4(n) B2(n), B2(n+1), B2(n+1), B2(n+2)
+#define B6(n) B4(n), B4(n+1), B4(n+1), B4(n+2)
+const unsigned char BIT_COUNT[256] = {
+    B6(0), B6(1), B6(1), B6(2)
+};
+
+// bytes with reversed bit order
+#define R2(n) n, n+2*64, n+1*64, n+3*64
+#define R4(n) R2(n), R2(n+2*16), R2(n+1*16), R2(n+3*16)
+#define R6(n) R4(n), R4(n+2*4), R4(n+1*4), R4(n+3*4)
+const unsigned char BIT_REVERSE[256] = {
+    R6(0), R6(2), R6(1), R6(3)
+};
+
+// bytes expanded to 8 pixels of one byte each
+#define U1(n) { ((n)&128)?BLACK:WHITE, ((n)&64)?BLACK:WHITE, ((n)&32)?BLACK:WHITE, ((n)&16)?BLACK:WHITE, ((n)&8)?BLACK:WHITE, ((n)&4)?BLACK:WHITE, ((n)&2)?BLACK:WHITE, ((n)&1)?BLACK:WHITE }
+#define U2(n) U1(n), U1(n+1)
+#define U4(n) U2(n), U2(n+2)
+#define U8(n) U4(n), U4(n+4)
+#define U16(n) U8(n), U8(n+8)
+#define U32(n) U16(n), U16(n+16)
+#define U64(n) U32(n), U32(n+32)
+#define U128(n) U64(n), U64(n+64)
+const unsigned char BIT_PIXELS[256][8] = {
+    U128(0), U128(128)
+};
+
+// CCITT fax codes of white and black run lengths: terminating codes for 0 to
+// 63 pixels, followed by make-up codes for multiples of 64 pixels
+const struct FAX_CODE FAX_WHITE[FAX_CODES] = {
+    {0x035, 8, 0}, {0x007, 6, 1}, {0x007, 4, 2}, {0x008, 4, 3}, {0x00b, 4, 4}, {0x00c, 4, 5},
+    {0x00e, 4, 6}, {0x00f, 4, 7}, {0x013, 5, 8}, {0x014, 5, 9}, {0x007, 5, 10}, {0x008, 5, 11},
+    {0x008, 6, 12}, {0x003, 6, 13}, {0x034, 6, 14}, {0x035, 6, 15}, {0x02a, 6, 16}, {0x02b, 6, 17},
+    {0x027, 7, 18}, {0x00c, 7, 19}, {0x008, 7, 20}, {0x017, 7, 21}, {0x003, 7, 22}, {0x004, 7, 23},
+    {0x028, 7, 24}, {0x02b, 7, 25}, {0x013, 7, 26}, {0x024, 7, 27}, {0x018, 7, 28}, {0x002, 8, 29},
+    {0x003, 8, 30}, {0x01a, 8, 31}, {0x01b, 8, 32}, {0x012, 8, 33}, {0x013, 8, 34}, {0x014, 8, 35},
+    {0x015, 8, 36}, {0x016, 8, 37}, {0x017, 8, 38}, {0x028, 8, 39}, {0x029, 8, 40}, {0x02a, 8, 41},
+    {0x02b, 8, 42}, {0x02c, 8, 43}, {0x02d, 8, 44}, {0x004, 8, 45}, {0x005, 8, 46}, {0x00a, 8, 47},
+    {0x00b, 8, 48}, {0x052, 8, 49}, {0x053, 8, 50}, {0x054, 8, 51}, {0x055, 8, 52}, {0x024, 8, 53},
+    {0x025, 8, 54}, {0x058, 8, 55}, {0x059, 8, 56}, {0x05a, 8, 57}, {0x05b, 8, 58}, {0x04a, 8, 59},
+    {0x04b, 8, 60}, {0x032, 8, 61}, {0x033, 8, 62}, {0x034, 8, 63}, {0x01b, 5, 64}, {0x012, 5, 128},
+    {0x017, 6, 192}, {0x037, 7, 256}, {0x036, 8, 320}, {0x037, 8, 384}, {0x064, 8, 448}, {0x065, 8, 512},
+    {0x068, 8, 576}, {0x067, 8, 640}, {0x0cc, 9, 704}, {0x0cd, 9, 768}, {0x0d2, 9, 832}, {0x0d3, 9, 896},
+    {0x0d4, 9, 960}, {0x0d5, 9, 1024}, {0x0d6, 9, 1088}, {0x0d7, 9, 1152}, {0x0d8, 9, 1216}, {0x0d9, 9, 1280},
+    {0x0da, 9, 1344}, {0x0db, 9, 1408}, {0x098, 9, 1472}, {0x099, 9, 1536}, {0x09a, 9, 1600}, {0x018, 6, 1664},
+    {0x09b, 9, 1728}, {0x008, 11, 1792}, {0x00c, 11, 1856}, {0x00d, 11, 1920}, {0x012, 12, 1984}, {0x013, 12, 2048},
+    {0x014, 12, 2112}, {0x015, 12, 2176}, {0x016, 12, 2240}, {0x017, 12, 2304}, {0x01c, 12, 2368}, {0x01d, 12, 2432},
+    {0x01e, 12, 2496}, {0x01f, 12, 2560}
+};
+const struct FAX_CODE FAX_BLACK[FAX_CODES] = {
+    {0x037, 10, 0}, {0x002, 3, 1}, {0x003, 2, 2}, {0x002, 2, 3}, {0x003, 3, 4}, {0x003, 4, 5},
+    {0x002, 4, 6}, {0x003, 5, 7}, {0x005, 6, 8}, {0x004, 6, 9}, {0x004, 7, 10}, {0x005, 7, 11},
+    {0x007, 7, 12}, {0x004, 8, 13}, {0x007, 8, 14}, {0x018, 9, 15}, {0x017, 10, 16}, {0x018, 10, 17},
+    {0x008, 10, 18}, {0x067, 11, 19}, {0x068, 11, 20}, {0x06c, 11, 21}, {0x037, 11, 22}, {0x028, 11, 23},
+    {0x017, 11, 24}, {0x018, 11, 25}, {0x0ca, 12, 26}, {0x0cb, 12, 27}, {0x0cc, 12, 28}, {0x0cd, 12, 29},
+    {0x068, 12, 30}, {0x069, 12, 31}, {0x06a, 12, 32}, {0x06b, 12, 33}, {0x0d2, 12, 34}, {0x0d3, 12, 35},
+    {0x0d4, 12, 36}, {0x0d5, 12, 37}, {0x0d6, 12, 38}, {0x0d7, 12, 39}, {0x06c, 12, 40}, {0x06d, 12, 41},
+    {0x0da, 12, 42}, {0x0db, 12, 43}, {0x054, 12, 44}, {0x055, 12, 45}, {0x056, 12, 46}, {0x057, 12, 47},
+    {0x064, 12, 48}, {0x065, 12, 49}, {0x052, 12, 50}, {0x053, 12, 51}, {0x024, 12, 52}, {0x037, 12, 53},
+    {0x038, 12, 54}, {0x027, 12, 55}, {0x028, 12, 56}, {0x058, 12, 57}, {0x059, 12, 58}, {0x02b, 12, 59},
+    {0x02c, 12, 60}, {0x05a, 12, 61}, {0x066, 12, 62}, {0x067, 12, 63}, {0x00f, 10, 64}, {0x0c8, 12, 128},
+    {0x0c9, 12, 192}, {0x05b, 12, 256}, {0x033, 12, 320}, {0x034, 12, 384}, {0x035, 12, 448}, {0x06c, 13, 512},
+    {0x06d, 13, 576}, {0x04a, 13, 640}, {0x04b, 13, 704}, {0x04c, 13, 768}, {0x04d, 13, 832}, {0x072, 13, 896},
+    {0x073, 13, 960}, {0x074, 13, 1024}, {0x075, 13, 1088}, {0x076, 13, 1152}, {0x077, 13, 1216}, {0x052, 13, 1280},
+    {0x053, 13, 1344}, {0x054, 13, 1408}, {0x055, 13, 1472}, {0x05a, 13, 1536}, {0x05b, 13, 1600}, {0x064, 13, 1664},
+    {0x065, 13, 1728}, {0x008, 11, 1792}, {0x00c, 11, 1856}, {0x00d, 11, 1920}, {0x012, 12, 1984}, {0x013, 12, 2048},
+    {0x014, 12, 2112}, {0x015, 12, 2176}, {0x016, 12, 2240}, {0x017, 12, 2304}, {0x01c, 12, 2368}, {0x01d, 12, 2432},
+    {0x01e, 12, 2496}, {0x01f, 12, 2560}
+};
+
+// CCITT Group 4 codes of vertical mode, for offsets -3 to 3 from the
+// changing element above
+const struct FAX_CODE FAX_VERTICAL[7] = {
+    {0x02, 7, 0}, {0x02, 6, 0}, {0x02, 3, 0}, {0x01, 1, 0}, {0x03, 3, 0}, {0x03, 6, 0}, {0x03, 7, 0}
+};
+
+
 /* --- global variable ---------------------------------------------------- */
 
 VERBOSE_LEVEL verbose;
+int threads; // number of threads to use for processing a sheet
+struct POOL pool; // buffers for image data, see poolAlloc()
+struct STANDARD_INPUT standardInput; // images of input files named '-'
+int standardOutput; // descriptor the images of output files named '-' are written to, -1 until needed
+struct PROFILE profile; // time spent in the stages of processing, see --profile
 
 
 
@@ -1104,6 +1819,21 @@ BOOLEAN isExcluded(int index, int multiIndex[MAX_MULTI_INDEX], int multiIndexCou
 }
 
 
+/**
+ * Tests whether a processing stage is done for a sheet, and tells if it has
+ * been disabled by its --no-xxx option or --ignore.
+ */
+BOOLEAN stageEnabled(int nr, char* name, int multiIndex[MAX_MULTI_INDEX], int multiIndexCount, int ignoreIndex[MAX_MULTI_INDEX], int ignoreIndexCount) {
+    if (isExcluded(nr, multiIndex, multiIndexCount, ignoreIndex, ignoreIndexCount)) {
+        if (verbose >= VERBOSE_MORE) {
+            printf("+ %s DISABLED for sheet %d\n", name, nr);
+        }
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
 /**
  * Outputs all entries in an array of integer to the console.
  */
@@ -1161,1035 +1891,5134 @@ BOOLEAN masksOverlapAny(int m[EDGES_COUNT], int masks[MAX_MASKS][EDGES_COUNT], i
 }
 
 
-/* --- tool functions for image handling ---------------------------------- */
+/* --- tool functions for packed 1-bit rows ------------------------------ */
 
 /**
- * Allocates a memory block for storing image data and fills the IMAGE-struct
- * with the specified values.
+ * Counts the set (black) bits of a span of pixels in a packed 1-bit row.
  */
-void initImage(struct IMAGE* image, int width, int height, int bitdepth, BOOLEAN color, int background) {
-    int size;
-    
-    size = width * height;
-    if ( color ) {
-        image->bufferGrayscale = (unsigned char*)malloc(size);
-        image->bufferLightness = (unsigned char*)malloc(size);
-        image->bufferDarknessInverse = (unsigned char*)malloc(size);
-        memset(image->bufferGrayscale, background, size);
-        memset(image->bufferLightness, background, size);
-        memset(image->bufferDarknessInverse, background, size);
-        size *= 3;
+int countBits(unsigned char* row, int x, int count) {
+    int first;
+    int last;
+    int i;
+    int n;
+
+    if (count <= 0) {
+        return 0;
     }
-    image->buffer = (unsigned char*)malloc(size);
-    memset(image->buffer, background, size);
-    if ( ! color ) {
-        image->bufferGrayscale = image->buffer;
-        image->bufferLightness = image->buffer;
-        image->bufferDarknessInverse = image->buffer;
+    first = x >> 3;
+    last = (x + count - 1) >> 3;
+    if (first == last) {
+        return BIT_COUNT[row[first] & bitsFrom(x) & bitsUntil(x + count - 1)];
     }
-    image->width = width;
-    image->height = height;
-    image->bitdepth = bitdepth;
-    image->color = color;
-    image->background = background;
+    n = BIT_COUNT[row[first] & bitsFrom(x)];
+    for (i = first + 1; i < last; i++) {
+        n += BIT_COUNT[row[i]];
+    }
+    n += BIT_COUNT[row[last] & bitsUntil(x + count - 1)];
+    return n;
 }
 
 
 /**
- * Frees an image.
+ * Sets a span of pixels in a packed 1-bit row to black or white.
+ *
+ * @return number of pixels that have been changed
  */
-void freeImage(struct IMAGE* image) {    
-    free(image->buffer);
-    if (image->color) {
-        free(image->bufferGrayscale);
-        free(image->bufferLightness);
-        free(image->bufferDarknessInverse);
+int fillBits(unsigned char* row, int x, int count, BOOLEAN black) {
+    int first;
+    int last;
+    int i;
+    int changed;
+    unsigned char m;
+
+    if (count <= 0) {
+        return 0;
+    }
+    first = x >> 3;
+    last = (x + count - 1) >> 3;
+    changed = 0;
+    for (i = first; i <= last; i++) {
+        m = 0xff;
+        if (i == first) {
+            m &= bitsFrom(x);
+        }
+        if (i == last) {
+            m &= bitsUntil(x + count - 1);
+        }
+        if (black) {
+            changed += BIT_COUNT[(unsigned char)~row[i] & m];
+            row[i] |= m;
+        } else {
+            changed += BIT_COUNT[row[i] & m];
+            row[i] &= ~m;
+        }
     }
+    return changed;
 }
 
 
 /**
- * Replaces one image with another.
+ * Copies a span of pixels between packed 1-bit rows. Whole bytes are copied
+ * if source and target are equally aligned.
  */
-void replaceImage(struct IMAGE* image, struct IMAGE* newimage) {    
-    freeImage(image);
-    // pass-back new image
-    *image = *newimage; // copy whole struct
+void copyBits(unsigned char* source, int x, unsigned char* target, int toX, int count) {
+    int bytes;
+
+    if (((x ^ toX) & 7) == 0) { // same alignment
+        while ((count > 0) && ((x & 7) != 0)) {
+            fillBits(target, toX, 1, getBit(source, x) != 0);
+            x++;
+            toX++;
+            count--;
+        }
+        bytes = count >> 3;
+        memcpy(&target[toX >> 3], &source[x >> 3], bytes);
+        x += bytes << 3;
+        toX += bytes << 3;
+        count -= bytes << 3;
+    }
+    while (count > 0) {
+        fillBits(target, toX, 1, getBit(source, x) != 0);
+        x++;
+        toX++;
+        count--;
+    }
 }
 
 
 /**
- * Sets the color/grayscale value of a single pixel.
- *
- * @return TRUE if the pixel has been changed, FALSE if the original color was the one to set
- */ 
-BOOLEAN setPixel(int pixel, int x, int y, struct IMAGE* image) {
+ * Expands a span of pixels of a packed 1-bit row to one byte per pixel
+ * (BLACK or WHITE). Whole bytes are expanded at once by table lookup.
+ */
+void unpackBits(unsigned char* row, int x, int count, unsigned char* target) {
+    int i;
+
+    i = 0;
+    while ( (i < count) && (((x + i) & 7) != 0) ) {
+        target[i] = (getBit(row, x + i) != 0) ? BLACK : WHITE;
+        i++;
+    }
+    while (i + 8 <= count) {
+        memcpy(&target[i], BIT_PIXELS[row[(x + i) >> 3]], 8);
+        i += 8;
+    }
+    while (i < count) {
+        target[i] = (getBit(row, x + i) != 0) ? BLACK : WHITE;
+        i++;
+    }
+}
+
+
+/**
+ * Packs a row of one byte per pixel into a packed 1-bit row, setting the
+ * pixels darker than threshold to black. Each byte is written once, 8
+ * comparisons at a time. Unused bits at the end of the row are zero.
+ * Pixels and target may be the same buffer.
+ */
+void packBits(unsigned char* pixels, int count, int threshold, unsigned char* target) {
     unsigned char* p;
-    int w, h;
-    int pos;
-    BOOLEAN result;
-    unsigned char r, g, b;
-    
-    w = image->width;
-    h = image->height;
-    if ( (x < 0) || (x >= w) || (y < 0) || (y >= h) ) {
-        return FALSE; //nop
-    } else {
-        pos = (y * w) + x;
-        r = (pixel >> 16) & 0xff;
-        g = (pixel >> 8) & 0xff;
-        b = pixel & 0xff;
-        if ( ! image->color ) {
-            p = &image->buffer[pos];
-            if ((r == g) && (r == b)) { // optimization (avoid division by 3)
-                pixel = r;
-            } else {
-                pixel = pixelGrayscale(r, g, b); // convert to gray (will already be in most cases, but we can't be sure)
-            }
-            if (*p != (unsigned char)pixel) {
-                *p = (unsigned char)pixel;
-                return TRUE;
-            } else {
-                return FALSE;
-            }
-        } else { // color
-            result = FALSE;
-            p = &image->buffer[pos*3];
-            if (*p != r) {
-                *p = r;
-                result = TRUE;
-            }
-            p++;
-            if (*p != g) {
-                *p = g;
-                result = TRUE;
-            }
-            p++;
-            if (*p != b) {
-                *p = b;
-                result = TRUE;
-            }
-            if ( result ) { // modified: update cached grayscale, lightness and brightnessInverse values
-                image->bufferGrayscale[pos] = pixelGrayscale(r, g, b);
-                image->bufferLightness[pos] = pixelLightness(r, g, b);
-                image->bufferDarknessInverse[pos] = pixelDarknessInverse(r, g, b);
-            }
-            return result;
+    int bits;
+    int i;
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        p = &pixels[i];
+        target[i >> 3] = (unsigned char)( ((p[0] < threshold) << 7) | ((p[1] < threshold) << 6) | ((p[2] < threshold) << 5) | ((p[3] < threshold) << 4)
+                                        | ((p[4] < threshold) << 3) | ((p[5] < threshold) << 2) | ((p[6] < threshold) << 1) | (p[7] < threshold) );
+    }
+    if (i < count) {
+        bits = 0;
+        p = &pixels[i];
+        for ( ; i < count; i++) {
+            bits |= (*p++ < threshold) << (7 - (i & 7));
         }
+        target[(count - 1) >> 3] = (unsigned char)bits;
     }
 }
 
 
 /**
- * Returns the color or grayscale value of a single pixel.
- * Always returns a color-compatible value (which may be interpreted as 8-bit grayscale)
- *
- * @return color or grayscale-value of the requested pixel, or WHITE if the coordinates are outside the image
- */ 
-int getPixel(int x, int y, struct IMAGE* image) {
-    int w, h;
-    int pos;
-    int pix;
-    unsigned char r, g, b;
+ * Writes the bit-reversed pixels of a packed 1-bit row of the given width
+ * into target (mirroring the row horizontally).
+ */
+void reverseBits(unsigned char* row, int width, unsigned char* target) {
+    int bytes;
+    int pad;
+    int i;
 
-    w = image->width;
-    h = image->height;
-    if ( (x < 0) || (x >= w) || (y < 0) || (y >= h) ) {
-        return pixelValue(WHITE, WHITE, WHITE);
-    } else {
-        pos = (y * w) + x;
-        if ( ! image->color ) {
-            pix = (unsigned char)image->buffer[pos];
-            return pixelValue(pix, pix, pix);
-        } else { // color
-            pos *= 3;
-            r = (unsigned char)image->buffer[pos++];
-            g = (unsigned char)image->buffer[pos++];
-            b = (unsigned char)image->buffer[pos];
-            return pixelValue(r, g, b);
+    bytes = (width + 7) >> 3;
+    pad = (bytes << 3) - width; // unused bits at the end of the row, which move to the start
+    for (i = 0; i < bytes; i++) {
+        target[i] = BIT_REVERSE[row[bytes - 1 - i]];
+    }
+    if (pad != 0) {
+        for (i = 0; i < bytes - 1; i++) {
+            target[i] = (unsigned char)((target[i] << pad) | (target[i + 1] >> (8 - pad)));
         }
+        target[bytes - 1] = (unsigned char)(target[bytes - 1] << pad);
     }
 }
 
 
-/**
- * Returns a color component of a single pixel (0-255).
- *
- * @param colorComponent either RED, GREEN or BLUE
- * @return color or grayscale-value of the requested pixel, or WHITE if the coordinates are outside the image
- */ 
- /* (currently not used)
-int getPixelComponent(int x, int y, int colorComponent, struct IMAGE* image) {
-    int w, h;
-    int pos;
+/* --- buffer pool -------------------------------------------------------- */
 
-    w = image->width;
-    h = image->height;
-    if ( (x < 0) || (x >= w) || (y < 0) || (y >= h) ) {
-        return WHITE;
-    } else {
-        pos = (y * w) + x;
-        if ( ! image->color ) {
-            return (unsigned char)image->buffer[pos];
-        } else { // color
-            return (unsigned char)image->buffer[(pos * 3) + colorComponent];
+#define POOL_HEADER ((sizeof(struct POOL_BLOCK) + 31) & ~31) // (keeps buffers aligned)
+
+/**
+ * Returns the size class of a buffer, and its capacity. Capacities grow in
+ * POOL_STEPS steps per doubling, so that no more than a quarter of a buffer
+ * is unused.
+ */
+int poolClass(size_t size, size_t* capacity) {
+    size_t step;
+    int sizeClass;
+
+    *capacity = POOL_MINIMUM;
+    step = POOL_MINIMUM / POOL_STEPS;
+    sizeClass = 0;
+    while ( (*capacity < size) && (sizeClass < POOL_CLASSES - 1) ) {
+        *capacity += step;
+        sizeClass++;
+        if ((sizeClass % POOL_STEPS) == 0) {
+            step *= 2;
         }
     }
+    if (*capacity < size) { // (beyond all classes, not expected)
+        *capacity = size;
+    }
+    return sizeClass;
 }
-*/
+
 
 /**
- * Returns the grayscale (=brightness) value of a single pixel.
- *
- * @return grayscale-value of the requested pixel, or WHITE if the coordinates are outside the image
- */ 
-int getPixelGrayscale(int x, int y, struct IMAGE* image) {
-    int w, h;
-    int pos;
+ * Takes buffers out of the free lists before a buffer of the given capacity
+ * is newly allocated, so that the buffers handed out and kept together take
+ * no more memory than the most ever handed out at once. Idle buffers go
+ * first, then the largest ones. To be called with the pool locked, the
+ * buffers returned are to be freed by the caller after unlocking.
+ */
+struct POOL_BLOCK* poolRelease(size_t capacity) {
+    struct POOL_BLOCK** link;
+    struct POOL_BLOCK* block;
+    struct POOL_BLOCK* released;
+    int pass;
+    int i;
 
-    w = image->width;
-    h = image->height;
-    if ( (x < 0) || (x >= w) || (y < 0) || (y >= h) ) {
-        return WHITE;
+    pool.limit = max(pool.limit, pool.used + capacity);
+    released = NULL;
+    for (pass = 0; pass < 2; pass++) {
+        for (i = POOL_CLASSES - 1; (i >= 0) && (pool.used + pool.cached + capacity > pool.limit); i--) {
+            link = &pool.free[i];
+            while ( (*link != NULL) && (pool.used + pool.cached + capacity > pool.limit) ) {
+                block = *link;
+                if ( (pass == 0) && (!block->idle) ) {
+                    link = &block->next;
+                } else {
+                    *link = block->next;
+                    pool.cached -= block->capacity;
+                    block->next = released;
+                    released = block;
+                }
+            }
+        }
+    }
+    return released;
+}
+
+
+/**
+ * Allocates a buffer for image data, reusing one which has been freed by
+ * poolFree() if there is one of the same size class. Unlike malloc() for
+ * large sizes, a reused buffer does not need to be faulted in again. Other
+ * buffers may be released first, see poolRelease(). The content of the
+ * buffer is undefined.
+ */
+void* poolAlloc(size_t size) {
+    struct POOL_BLOCK* block;
+    struct POOL_BLOCK* released;
+    struct POOL_BLOCK* next;
+    size_t capacity;
+    int sizeClass;
+
+    sizeClass = poolClass(size, &capacity);
+    pthread_mutex_lock(&pool.mutex);
+    block = pool.free[sizeClass];
+    if ( (block != NULL) && (block->capacity >= size) ) {
+        pool.free[sizeClass] = block->next;
+        pool.cached -= block->capacity;
+        pool.hits++;
     } else {
-        pos = (y * w) + x;
-        return image->bufferGrayscale[pos];
+        block = NULL;
+        pool.misses++;
+    }
+    released = (block == NULL) ? poolRelease(capacity) : NULL;
+    pthread_mutex_unlock(&pool.mutex);
+    while (released != NULL) {
+        next = released->next;
+        free(released);
+        released = next;
     }
+    if (block == NULL) {
+        block = (struct POOL_BLOCK*)malloc(POOL_HEADER + capacity);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->capacity = capacity;
+        block->sizeClass = sizeClass;
+    }
+    block->idle = FALSE;
+    pthread_mutex_lock(&pool.mutex);
+    pool.used += block->capacity;
+    if (pool.used + pool.cached > pool.peak) {
+        pool.peak = pool.used + pool.cached;
+    }
+    pthread_mutex_unlock(&pool.mutex);
+    return (unsigned char*)block + POOL_HEADER;
 }
 
 
 /**
- * Returns the 'lightness' value of a single pixel. For color images, this
- * value denotes the minimum brightness of a single color-component in the
- * total color, which means that any color is considered 'dark' which has
- * either the red, the green or the blue component (or, of course, several
- * of them) set to a high value. In some way, this is a measure how close a
- * color is to white.
- * For grayscale images, this value is equal to the pixel brightness.
- *
- * @return lightness-value (the higher, the lighter) of the requested pixel, or WHITE if the coordinates are outside the image
- */ 
-int getPixelLightness(int x, int y, struct IMAGE* image) {
-    int w, h;
-    int pos;
+ * Gives a buffer allocated by poolAlloc() back to the pool.
+ */
+void poolFree(void* buffer) {
+    struct POOL_BLOCK* block;
 
-    w = image->width;
-    h = image->height;
-    if ( (x < 0) || (x >= w) || (y < 0) || (y >= h) ) {
-        return WHITE;
-    } else {
-        pos = (y * w) + x;
-        return image->bufferLightness[pos];
+    if (buffer == NULL) {
+        return;
     }
+    block = (struct POOL_BLOCK*)((unsigned char*)buffer - POOL_HEADER);
+    pthread_mutex_lock(&pool.mutex);
+    block->next = pool.free[block->sizeClass];
+    pool.free[block->sizeClass] = block;
+    pool.used -= block->capacity;
+    pool.cached += block->capacity;
+    pthread_mutex_unlock(&pool.mutex);
 }
 
 
 /**
- * Returns the 'inverse-darkness' value of a single pixel. For color images, this
- * value denotes the maximum brightness of a single color-component in the
- * total color, which means that any color is considered 'light' which has
- * either the red, the green or the blue component (or, of course, several
- * of them) set to a high value. In some way, this is a measure how far away a
- * color is to black.
- * For grayscale images, this value is equal to the pixel brightness.
- *
- * @return inverse-darkness-value (the LOWER, the darker) of the requested pixel, or WHITE if the coordinates are outside the image
- */ 
-int getPixelDarknessInverse(int x, int y, struct IMAGE* image) {
-    int w, h;
-    int pos;
+ * Changes the size of a buffer allocated by poolAlloc(), keeping its content
+ * like realloc() does.
+ */
+void* poolRealloc(void* buffer, size_t size) {
+    struct POOL_BLOCK* block;
+    unsigned char* grown;
 
-    w = image->width;
-    h = image->height;
-    if ( (x < 0) || (x >= w) || (y < 0) || (y >= h) ) {
-        return WHITE;
-    } else {
-        pos = (y * w) + x;
-        return image->bufferDarknessInverse[pos];
+    if (buffer == NULL) {
+        return poolAlloc(size);
+    }
+    block = (struct POOL_BLOCK*)((unsigned char*)buffer - POOL_HEADER);
+    if (block->capacity >= size) {
+        return buffer;
+    }
+    grown = (unsigned char*)poolAlloc(size);
+    if (grown != NULL) {
+        memcpy(grown, buffer, block->capacity);
+        poolFree(buffer);
     }
+    return grown;
 }
 
 
 /**
- * Sets the color/grayscale value of a single pixel to either black or white.
- *
- * @return TRUE if the pixel has been changed, FALSE if the original color was the one to set
- */ 
-BOOLEAN setPixelBW(int x, int y, struct IMAGE* image, int blackwhite) {
-    unsigned char* p;
-    int w, h;
-    int pos;
-    BOOLEAN result;
-    
-    w = image->width;
-    h = image->height;
-    if ( (x < 0) || (x >= w) || (y < 0) || (y >= h) ) {
-        return FALSE; //nop
-    } else {
-        pos = (y * w) + x;
-        if ( ! image->color ) {
-            p = &image->buffer[pos];
-            if (*p != blackwhite) {
-                *p = blackwhite;
-                return TRUE;
+ * Releases the buffers which have not been reused since the last call, to be
+ * called after each sheet. Memory is kept for the sizes which come up sheet
+ * after sheet, but not for sizes which occurred only once.
+ */
+void poolTrim() {
+    struct POOL_BLOCK** link;
+    struct POOL_BLOCK* block;
+    int i;
+
+    pthread_mutex_lock(&pool.mutex);
+    for (i = 0; i < POOL_CLASSES; i++) {
+        link = &pool.free[i];
+        while (*link != NULL) {
+            block = *link;
+            if (block->idle) {
+                *link = block->next;
+                pool.cached -= block->capacity;
+                free(block);
             } else {
-                return FALSE;
-            }
-        } else { // color
-            p = &image->buffer[pos * 3];
-            result = FALSE;
-            if (*p != blackwhite) {
-                *p = blackwhite;
-                result = TRUE;
-            }
-            p++;
-            if (*p != blackwhite) {
-                *p = blackwhite;
-                result = TRUE;
-            }
-            p++;
-            if (*p != blackwhite) {
-                *p = blackwhite;
-                result = TRUE;
+                block->idle = TRUE;
+                link = &block->next;
             }
-            return result;
         }
     }
+    pthread_mutex_unlock(&pool.mutex);
 }
 
 
+/* --- tool functions for image handling ---------------------------------- */
+
 /**
- * Sets the color/grayscale value of a single pixel to white.
- *
- * @return TRUE if the pixel has been changed, FALSE if the original color was the one to set
- */ 
-BOOLEAN clearPixel(int x, int y, struct IMAGE* image) {
-    return setPixelBW(x, y, image, WHITE);
+ * Sets up the derived channels (grayscale, lightness, darknessInverse) of an
+ * image whose buffer has just been allocated. For grayscale images, all
+ * channels are identical to the buffer itself. For color images, the channels
+ * are calculated on demand by requireChannel(). Packed 1-bit images get
+ * unpacked by requireChannel(). No summed-area tables are set up. The buffer
+ * is marked as allocated, not mapped from a file, and as having no low bytes.
+ */
+void initChannels(struct IMAGE* image) {
+    image->integrals = NULL;
+    image->mapping = NULL;
+    image->low = NULL;
+    if ( image->packed ) { // channels are only available after unpacking
+        image->bufferGrayscale = NULL;
+        image->bufferLightness = NULL;
+        image->bufferDarknessInverse = NULL;
+        image->channelsValid = 0;
+    } else if ( ! image->color ) {
+        image->bufferGrayscale = image->buffer;
+        image->bufferLightness = image->buffer;
+        image->bufferDarknessInverse = image->buffer;
+        image->channelsValid = (1<<CHANNELS_COUNT) - 1;
+    } else {
+        image->bufferGrayscale = NULL;
+        image->bufferLightness = NULL;
+        image->bufferDarknessInverse = NULL;
+        image->channelsValid = 0;
+    }
 }
 
 
 /**
- * Clears a rectangular area of pixels with either black or white.
- * @return The number of pixels actually changed from black (dark) to white.
+ * Allocates a memory block for storing image data and fills the IMAGE-struct
+ * with the specified values. 16-bit images also get their low bytes, set to
+ * the background value as well.
  */
-int clearRect(int left, int top, int right, int bottom, struct IMAGE* image, int blackwhite) {
-    int x;
-    int y;
-    int count;
-
-    count = 0;
-    for (y = top; y <= bottom; y++) {
-        for (x = left; x <= right; x++) {
-            if (setPixelBW(x, y, image, blackwhite)) {
-                count++;
-            }
-        }
+void initImage(struct IMAGE* image, int width, int height, int bitdepth, BOOLEAN color, int background) {
+    int size;
+    
+    size = width * height;
+    if ( color ) {
+        size *= 3;
+    }
+    image->buffer = (unsigned char*)poolAlloc(size);
+    memset(image->buffer, background, size);
+    image->width = width;
+    image->height = height;
+    image->stride = color ? width * 3 : width;
+    image->bitdepth = bitdepth;
+    image->color = color;
+    image->packed = FALSE;
+    image->background = background;
+    initChannels(image);
+    if (bitdepth == 16) { // (v * 257 keeps the 8-bit value v in both bytes)
+        image->low = (unsigned char*)poolAlloc(size);
+        memset(image->low, background, size);
     }
-    return count;
 }
 
 
 /**
- * Copies one area of an image into another.
+ * Allocates a packed 1-bit image, background must be either BLACK or WHITE.
  */
-void copyImageArea(int x, int y, int width, int height, struct IMAGE* source, int toX, int toY, struct IMAGE* target) {
-    int row;
-    int col;
-    int pixel;
-    // naive but generic implementation
-    for (row = 0; row < height; row++) {
-        for (col = 0; col < width; col++) {
-            pixel = getPixel(x+col, y+row, source);
-            setPixel(pixel, toX+col, toY+row, target);
+void initPackedImage(struct IMAGE* image, int width, int height, int background) {
+    int y;
+    
+    image->stride = (width + 7) >> 3;
+    image->buffer = (unsigned char*)poolAlloc(image->stride * height);
+    memset(image->buffer, 0, image->stride * height);
+    if (background == BLACK) {
+        for (y = 0; y < height; y++) {
+            fillBits(&image->buffer[y * image->stride], 0, width, TRUE); // (leaves unused bits at row ends zero)
         }
     }
+    image->width = width;
+    image->height = height;
+    image->bitdepth = 1;
+    image->color = FALSE;
+    image->packed = TRUE;
+    image->background = background;
+    initChannels(image);
 }
 
 
 /**
- * Copies a whole image into another.
+ * Allocates an image for a whole sheet. 1-bit sheets on a black or white
+ * background are stored packed, see initPackedImage(), others as initImage()
+ * does.
  */
-void copyImage(struct IMAGE* source, int toX, int toY, struct IMAGE* target) {
-    copyImageArea(0, 0, source->width, source->height, source, toX, toY, target);
+void initSheetImage(struct IMAGE* image, int width, int height, int bitdepth, BOOLEAN color, int background) {
+    if ((bitdepth == 1) && (!color) && isBlackOrWhite(background)) {
+        initPackedImage(image, width, height, background);
+    } else {
+        initImage(image, width, height, bitdepth, color, background);
+    }
 }
 
 
 /**
- * Centers one area of an image inside an area of another image.
- * If the source area is smaller than the target area, is is equally
- * surrounded by a white border, if it is bigger, it gets equally cropped
- * at the edges.
+ * Releases the main buffer of an image, which is either allocated or points
+ * into a memory-mapped input file, and its low bytes.
  */
-void centerImageArea(int x, int y, int w, int h, struct IMAGE* source, int toX, int toY, int ww, int hh, struct IMAGE* target) {
-    if ((w < ww) || (h < hh)) { // white rest-border will remain, so clear first
-        clearRect(toX, toY, toX + ww - 1, toY + hh - 1, target, target->background);
-    }
-    if (w < ww) {
-        toX += (ww - w) / 2;
-    }
-    if (h < hh) {
-        toY += (hh - h) / 2;
-    }
-    if (w > ww) {
-        x += (w - ww) / 2;
-        w = ww;
+void freeBuffer(struct IMAGE* image) {
+    if ( image->buffer == NULL ) {
+        return;
     }
-    if (h > hh) {
-        y += (h - hh) / 2;
-        h = hh;
+    poolFree(image->low);
+    image->low = NULL;
+    if ( image->mapping != NULL ) {
+        munmap(image->mapping, image->mappingSize);
+        image->mapping = NULL;
+    } else {
+        poolFree(image->buffer);
     }
-    copyImageArea(x, y, w, h, source, toX, toY, target);
+    image->buffer = NULL;
 }
 
 
 /**
- * Centers a whole image inside an area of another image.
+ * Replaces the memory-mapped input file of an image by anonymous memory with
+ * the same content at the same address, so that the file may be overwritten
+ * while all pointers into the image stay valid.
+ *
+ * @return FALSE if there is not enough memory
  */
-void centerImage(struct IMAGE* source, int toX, int toY, int ww, int hh, struct IMAGE* target) {
-    centerImageArea(0, 0, source->width, source->height, source, toX, toY, ww, hh, target);
+BOOLEAN detachMapping(struct IMAGE* image) {
+    unsigned char* copy;
+
+    if ( image->mapping == NULL ) {
+        return TRUE;
+    }
+    copy = (unsigned char*)malloc(image->mappingSize);
+    if ( copy == NULL ) {
+        return FALSE;
+    }
+    memcpy(copy, image->mapping, image->mappingSize);
+    if ( mmap(image->mapping, image->mappingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED ) {
+        free(copy);
+        return FALSE;
+    }
+    memcpy(image->mapping, copy, image->mappingSize);
+    free(copy);
+    image->mappingDevice = 0; // (no file any more)
+    image->mappingInode = 0;
+    return TRUE;
 }
 
 
 /**
- * Returns the average brightness of a rectagular area.
+ * Reads all pages of the memory-mapped input file of an image, which would
+ * otherwise be read when they are first touched.
  */
-int brightnessRect(int x1, int y1, int x2, int y2, struct IMAGE* image) {
-    int x;
-    int y;
-    int pixel;
-    int total;
-    int count;
-    total = 0;
-    count = (x2-x1+1)*(y2-y1+1);
-    for (x = x1; x <= x2; x++) {
-        for (y = y1; y <= y2; y++) {
-            pixel = getPixelGrayscale(x, y, image);
-            total += pixel;
-        }
+void prefaultMapping(struct IMAGE* image) {
+    volatile unsigned char* mapping; // (not to be optimized away)
+    size_t pageSize;
+    size_t pos;
+
+    if ( image->mapping == NULL ) {
+        return;
+    }
+    mapping = image->mapping;
+    pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    for (pos = 0; pos < image->mappingSize; pos += pageSize) {
+        (void)mapping[pos];
     }
-    return total / count;
 }
 
 
 /**
- * Returns the average lightness of a rectagular area.
+ * Converts a packed 1-bit image to one byte per pixel, before operations
+ * which may create gray values are applied. The image keeps its bitdepth
+ * of 1. Nothing is done if the image is not packed.
  */
-int lightnessRect(int x1, int y1, int x2, int y2, struct IMAGE* image) {
-    int x;
+void unpackImage(struct IMAGE* image) {
+    unsigned char* buffer;
     int y;
-    int pixel;
-    int total;
-    int count;
-    total = 0;
-    count = (x2-x1+1)*(y2-y1+1);
-    for (x = x1; x <= x2; x++) {
-        for (y = y1; y <= y2; y++) {
-            pixel = getPixelLightness(x, y, image);
-            total += pixel;
-        }
+
+    if ( ! image->packed ) {
+        return;
     }
-    return total / count;
+    buffer = (unsigned char*)poolAlloc(image->width * image->height);
+    for (y = 0; y < image->height; y++) {
+        unpackBits(&image->buffer[y * image->stride], 0, image->width, &buffer[y * image->width]);
+    }
+    freeBuffer(image);
+    image->buffer = buffer;
+    image->stride = image->width;
+    image->packed = FALSE;
+    initChannels(image);
 }
 
 
 /**
- * Returns the average darkness of a rectagular area.
+ * Sets up an image which shares size and layout with a 16-bit image and has
+ * the image's low bytes as its buffer. Operations which only move bytes
+ * around are applied to the low bytes through it the same way as to the image
+ * itself.
+ *
+ * @return FALSE if the image has no low bytes
  */
-int darknessInverseRect(int x1, int y1, int x2, int y2, struct IMAGE* image) {
-    int x;
-    int y;
-    int pixel;
-    int total;
-    int count;
-    total = 0;
-    count = (x2-x1+1)*(y2-y1+1);
-    for (x = x1; x <= x2; x++) {
-        for (y = y1; y <= y2; y++) {
-            pixel = getPixelDarknessInverse(x, y, image);
-            total += pixel;
-        }
+BOOLEAN lowPlane(struct IMAGE* image, struct IMAGE* plane) {
+    if (image->low == NULL) {
+        return FALSE;
     }
-    return total / count;
+    *plane = *image; // copy whole struct
+    plane->buffer = image->low;
+    plane->bitdepth = 8;
+    initChannels(plane);
+    return TRUE;
 }
 
 
 /**
- * Counts the number of pixels in a rectangular area whose grayscale
- * values ranges between minColor and maxBrightness. Optionally, the area can get
- * cleared with white color while counting.
+ * Returns the buffer of a derived channel of an image, calculating it first
+ * if it is not up to date. Memory for color images' channels is allocated on
+ * first use and kept until the image is freed. Packed images are unpacked.
+ *
+ * @param channel either GRAYSCALE, LIGHTNESS or DARKNESS_INVERSE
  */
-int countPixelsRect(int left, int top, int right, int bottom, int minColor, int maxBrightness, BOOLEAN clear, struct IMAGE* image) {
-    int x;
-    int y;
-    int pixel;
-    int count;
-    
-    count = 0;
-    for (y = top; y <= bottom; y++) {
-        for (x = left; x <= right; x++) {
-            pixel = getPixelGrayscale(x, y, image);
-            if ((pixel>=minColor) && (pixel <= maxBrightness)) {
-                if (clear==TRUE) {
-                    clearPixel(x, y, image);
-                }
-                count++;
+unsigned char* requireChannel(int channel, struct IMAGE* image) {
+    unsigned char** buffer;
+    unsigned char* c;
+    unsigned char* p;
+    int size;
+    int pos;
+    unsigned char r, g, b;
+
+    unpackImage(image);
+    if (channel == GRAYSCALE) {
+        buffer = &image->bufferGrayscale;
+    } else if (channel == LIGHTNESS) {
+        buffer = &image->bufferLightness;
+    } else {
+        buffer = &image->bufferDarknessInverse;
+    }
+    if ((image->channelsValid & 1<<channel) == 0) {
+        size = image->width * image->height;
+        if (*buffer == NULL) {
+            *buffer = (unsigned char*)poolAlloc(size);
+        }
+        c = *buffer;
+        p = image->buffer;
+        for (pos = 0; pos < size; pos++) {
+            r = *p++;
+            g = *p++;
+            b = *p++;
+            if (channel == GRAYSCALE) {
+                c[pos] = pixelGrayscale(r, g, b);
+            } else if (channel == LIGHTNESS) {
+                c[pos] = pixelLightness(r, g, b);
+            } else {
+                c[pos] = pixelDarknessInverse(r, g, b);
             }
         }
+        image->channelsValid |= 1<<channel;
     }
-    return count;
+    return *buffer;
 }
 
 
 /**
- * Counts the number of dark pixels around the pixel at (x,y), who have a
- * square-metric distance of 'level' to the (x,y) (thus, testing the values
- * of 9 pixels if level==1, 16 pixels if level==2 and so on).
- * Optionally, the pixels can get cleared after counting.
+ * Marks all derived channels of a color image and all summed-area tables as
+ * outdated, to be called after pixel data has been written directly into the
+ * buffer via getRow(). The channels will be recalculated when they are
+ * needed next time.
  */
-int countPixelNeighborsLevel(int x, int y, BOOLEAN clear, int level, int whiteMin, struct IMAGE* image) {
-    int xx;
-    int yy;
-    int count;
-    int pixel;
-    
-    count = 0;
-    // upper and lower rows
-    for (xx = x - level; xx <= x + level; xx++) {
-        // upper row
-        pixel = getPixelLightness(xx, y - level, image);
-        if (pixel < whiteMin) { // non-light pixel found
-            if (clear == TRUE) {
-                clearPixel(xx, y - level, image);
-            }
-            count++;
-        }        
-        // lower row
-        pixel = getPixelLightness(xx, y + level, image);
-        if (pixel < whiteMin) {
-            if (clear == TRUE) {
-                clearPixel(xx, y + level, image);
-            }
-            count++;
-        }        
+void invalidateChannels(struct IMAGE* image) {
+    int i;
+
+    if (image->color) {
+        image->channelsValid = 0;
     }
-    // middle rows
-    for (yy = y-(level-1); yy <= y+(level-1); yy++) {
-        // first col
-        pixel = getPixelLightness(x - level, yy, image);
-        if (pixel < whiteMin) {
-            if (clear == TRUE) {
-                clearPixel(x - level, yy, image);
-            }
-            count++;
-        }        
-        // last col
-        pixel = getPixelLightness(x + level, yy, image);
-        if (pixel < whiteMin) {
-            if (clear == TRUE) {
-                clearPixel(x + level, yy, image);
-            }
-            count++;
-        }        
+    if (image->integrals != NULL) {
+        for (i = 0; i < image->integrals->tilesX * image->integrals->tilesY; i++) {
+            image->integrals->version[i]++;
+        }
     }
-    /* old version, not optimized:
-    for (yy = y-level; yy <= y+level; yy++) {
-        for (xx = x-level; xx <= x+level; xx++) {
-            if (abs(xx-x)==level || abs(yy-y)==level) {
-                pixel = getPixelLightness(xx, yy, image);
-                if (pixel < whiteMin) {
-                    if (clear==TRUE) {
-                        clearPixel(xx, yy, image);
-                    }
-                    count++;
-                }
-            }
-        }    
-    }*/
-    return count;
 }
 
 
 /**
- * Count all dark pixels in the distance 0..intensity that are directly
- * reachable from the dark pixel at (x,y), without having to cross bright
- * pixels.
+ * Updates the up-to-date derived channels of a color image after the pixel at
+ * buffer position pos has changed to (r, g, b).
  */
-int countPixelNeighbors(int x, int y, int intensity, int whiteMin, struct IMAGE* image) {
-    int level;
-    int count;
-    int lCount;
-    
-    count = 1; // assume self as set
-    lCount = -1;
-    for (level = 1; (lCount != 0) && (level <= intensity); level++) { // can finish when one level is completely zero
-        lCount = countPixelNeighborsLevel(x, y, FALSE, level, whiteMin, image);
-        count += lCount;
+void updateChannels(int pos, unsigned char r, unsigned char g, unsigned char b, struct IMAGE* image) {
+    if ((image->channelsValid & 1<<GRAYSCALE) != 0) {
+        image->bufferGrayscale[pos] = pixelGrayscale(r, g, b);
+    }
+    if ((image->channelsValid & 1<<LIGHTNESS) != 0) {
+        image->bufferLightness[pos] = pixelLightness(r, g, b);
+    }
+    if ((image->channelsValid & 1<<DARKNESS_INVERSE) != 0) {
+        image->bufferDarknessInverse[pos] = pixelDarknessInverse(r, g, b);
     }
-    return count;
 }
 
 
 /**
- * Clears all dark pixels that are directly reachable from the dark pixel at
- * (x,y). This should be called only if it has previously been detected that
- * the amount of pixels to clear will be reasonable small.
+ * Converts an image between 8 and 16 bits per sample. An 8-bit value v
+ * becomes v * 257, 16-bit values are rounded to the nearest 8-bit value.
+ * Packed images are unpacked when converted to 16 bits.
  */
-void clearPixelNeighbors(int x, int y, int whiteMin, struct IMAGE* image) {
-    int level;
-    int lCount;
+void changeDepth(int bitdepth, struct IMAGE* image) {
+    int size;
+    int i;
 
-    clearPixel(x, y, image);    
-    lCount = -1;
-    for (level = 1; lCount != 0; level++) { // lCount will become 0, otherwise countPixelNeighbors() would previously have delivered a bigger value (and this here would not have been called)
-        lCount = countPixelNeighborsLevel(x, y, TRUE, level, whiteMin, image);
+    if ( (bitdepth == 16) && (image->low == NULL) ) {
+        unpackImage(image);
+        size = image->stride * image->height;
+        image->low = (unsigned char*)poolAlloc(size);
+        memcpy(image->low, image->buffer, size);
+        image->bitdepth = 16;
+    } else if ( (bitdepth != 16) && (image->low != NULL) ) {
+        size = image->stride * image->height;
+        for (i = 0; i < size; i++) {
+            image->buffer[i] = (sample16(image, i) + 128) / 257;
+        }
+        poolFree(image->low);
+        image->low = NULL;
+        image->bitdepth = 8;
+        invalidateChannels(image);
     }
 }
 
 
 /**
- * Flood-fill an area of pixels.
- * (Declaration of header for indirect recursive calls.)
- */
-void floodFill(int x, int y, int color, int maskMin, int maskMax, int intensity, struct IMAGE* image);
-
-
-/**
- * Solidly fills a line of pixels heading towards a specified direction
- * until color-changes in the pixels to overwrite exceed the 'intensity'
- * parameter.
- *
- * @param stepX either -1 or 1, if stepY is 0, else 0
- * @param stepY either -1 or 1, if stepX is 0, else 0
+ * Returns the summed-area table set up by requireIntegral(), or NULL if there
+ * is none.
  */
-int fillLine(int x, int y, int stepX, int stepY, int color, int maskMin, int maskMax, int intensity, struct IMAGE* image) {
-    int pixel;
-    int distance;
-    int intensityCount;
-    int w, h;
+struct INTEGRAL* findIntegral(int channel, int minColor, int maxBrightness, struct IMAGE* image) {
+    struct INTEGRAL* integral;
+    int i;
 
-    w = image->width;
-    h = image->height;
-    distance = 0;
-    intensityCount = 1; // first pixel must match, otherwise directly exit
-    while (1==1) { // !
-        x += stepX;
-        y += stepY;
-        pixel = getPixelGrayscale(x, y, image);
-        if ((pixel>=maskMin) && (pixel<=maskMax)) {
-            intensityCount = intensity; // reset counter
-        } else {
-            intensityCount--; // allow maximum of 'intensity' pixels to be bright, until stop
-        }
-        if ((intensityCount > 0) && (x>=0) && (x<w) && (y>=0) && (y<h)) {
-            setPixel(color, x, y, image);
-            distance++;
-        } else {
-            return distance; // exit here
+    if (image->integrals == NULL) {
+        return NULL;
+    }
+    if ( ! image->color ) {
+        channel = GRAYSCALE;
+    }
+    for (i = 0; i < image->integrals->count; i++) {
+        integral = &image->integrals->integral[i];
+        if ((integral->channel == channel) && (integral->minColor == minColor) && (integral->maxBrightness == maxBrightness)) {
+            return integral;
         }
     }
+    return NULL;
 }
 
 
 /**
- * Start flood-filling around the edges of a line which has previously been
- * filled using fillLine(). Here, the flood-fill algorithm performs its
- * indirect recursion.
+ * Sets up a summed-area table for an image, which is then used by
+ * brightnessRect(), lightnessRect(), darknessInverseRect() and
+ * countPixelsRect() until freeIntegrals() is called. The table is split into
+ * tiles which are calculated when first needed, and again after pixels of
+ * the tile have changed. Nothing is done for packed images, which have their
+ * own way of counting pixels.
+ * Must not be called while multiple threads are processing the image.
  *
- * @param stepX either -1 or 1, if stepY is 0, else 0
- * @param stepY either -1 or 1, if stepX is 0, else 0
- * @see fillLine()
+ * @param channel GRAYSCALE, LIGHTNESS or DARKNESS_INVERSE
+ * @param minColor -1 to sum up the channel values of pixels, otherwise pixels with values between minColor and maxBrightness are counted
  */
-void floodFillAroundLine(int x, int y, int stepX, int stepY, int distance, int color, int maskMin, int maskMax, int intensity, struct IMAGE* image) {
-    int d;
-    
-    for (d = 0; d < distance; d++) {
-        if (stepX != 0) {
-            x += stepX;
-            floodFill(x, y + 1, color, maskMin, maskMax, intensity, image); // indirect recursion
-            floodFill(x, y - 1, color, maskMin, maskMax, intensity, image); // indirect recursion
-        } else { // stepY != 0
-            y += stepY;
-            floodFill(x + 1, y, color, maskMin, maskMax, intensity, image); // indirect recursion
-            floodFill(x - 1, y, color, maskMin, maskMax, intensity, image); // indirect recursion
+void requireIntegral(int channel, int minColor, int maxBrightness, struct IMAGE* image) {
+    struct INTEGRALS* integrals;
+    struct INTEGRAL* integral;
+    int tiles;
+    int i;
+
+    if ( image->packed ) {
+        return;
+    }
+    requireChannel(image->color ? channel : GRAYSCALE, image); // (before any threads start reading it, also by getPixelGrayscale() etc.)
+    if (findIntegral(channel, minColor, maxBrightness, image) != NULL) {
+        return;
+    }
+    if (image->integrals == NULL) {
+        integrals = (struct INTEGRALS*)malloc(sizeof(struct INTEGRALS));
+        integrals->tilesX = (image->width + INTEGRAL_TILE - 1) / INTEGRAL_TILE;
+        integrals->tilesY = (image->height + INTEGRAL_TILE - 1) / INTEGRAL_TILE;
+        tiles = integrals->tilesX * integrals->tilesY;
+        integrals->version = (unsigned int*)malloc(tiles * sizeof(unsigned int));
+        for (i = 0; i < tiles; i++) {
+            integrals->version[i] = 1;
         }
+        integrals->count = 0;
+        image->integrals = integrals;
+    }
+    integrals = image->integrals;
+    if (integrals->count == MAX_INTEGRALS) { // should not happen, stages use only few tables at once
+        return;
     }
+    tiles = integrals->tilesX * integrals->tilesY;
+    integral = &integrals->integral[integrals->count++];
+    integral->channel = image->color ? channel : GRAYSCALE; // all channels are the same for grayscale images
+    integral->minColor = minColor;
+    integral->maxBrightness = maxBrightness;
+    integral->table = (unsigned short*)poolAlloc(tiles * INTEGRAL_TILE * INTEGRAL_TILE * sizeof(unsigned short));
+    integral->built = (unsigned int*)calloc(tiles, sizeof(unsigned int)); // version 0: not yet calculated
 }
 
 
 /**
- * Flood-fill an area of pixels. (Naive implementation, optimizable.)
- *
- * @see earlier header-declaration to enable indirect recursive calls
+ * Frees all summed-area tables of an image, to be called at the end of each
+ * stage which has set up tables by requireIntegral().
  */
-void floodFill(int x, int y, int color, int maskMin, int maskMax, int intensity, struct IMAGE* image) {
-    int left;
-    int top;
-    int right;
-    int bottom;
-    int pixel;
-    
-    // is current pixel to be filled?
-    pixel = getPixelGrayscale(x, y, image);
-    if ((pixel>=maskMin) && (pixel<=maskMax)) {
-        // first, fill a 'cross' (both vertical, horizontal line)
-        setPixel(color, x, y, image);
-        left = fillLine(x, y, -1, 0, color, maskMin, maskMax, intensity, image);
-        top = fillLine(x, y, 0, -1, color, maskMin, maskMax, intensity, image);
-        right = fillLine(x, y, 1, 0, color, maskMin, maskMax, intensity, image);
-        bottom = fillLine(x, y, 0, 1, color, maskMin, maskMax, intensity, image);
-        // now recurse on each neighborhood-pixel of the cross (most recursions will immediately return)
-        floodFillAroundLine(x, y, -1, 0, left, color, maskMin, maskMax, intensity, image);
-        floodFillAroundLine(x, y, 0, -1, top, color, maskMin, maskMax, intensity, image);
-        floodFillAroundLine(x, y, 1, 0, right, color, maskMin, maskMax, intensity, image);
-        floodFillAroundLine(x, y, 0, 1, bottom, color, maskMin, maskMax, intensity, image);
+void freeIntegrals(struct IMAGE* image) {
+    int i;
+
+    if (image->integrals == NULL) {
+        return;
+    }
+    for (i = 0; i < image->integrals->count; i++) {
+        poolFree(image->integrals->integral[i].table);
+        free(image->integrals->integral[i].built);
     }
+    free(image->integrals->version);
+    free(image->integrals);
+    image->integrals = NULL;
 }
 
 
-
-/* --- tool function for file handling ------------------------------------ */
-
 /**
- * Tests if a file exists.
+ * Marks the tiles of summed-area tables as outdated which contain the given
+ * span of pixels in a row, to be called whenever pixels change.
  */
-BOOLEAN fileExists(char* filename) {
-    FILE *f;
-    f = fopen(filename,"r");
-    if (f == NULL) {
-        return FALSE;
-    } else {
-        fclose(f);
-        return TRUE;
+void touchIntegrals(int x, int y, int count, struct IMAGE* image) {
+    unsigned int* version;
+    int tile;
+
+    if ((image->integrals == NULL) || (count <= 0)) {
+        return;
+    }
+    version = &image->integrals->version[(y / INTEGRAL_TILE) * image->integrals->tilesX];
+    for (tile = x / INTEGRAL_TILE; tile <= (x + count - 1) / INTEGRAL_TILE; tile++) {
+        version[tile]++;
     }
 }
 
 
 /**
- * Loads image data from a file in pnm format.
- *
- * @param filename name of file to load
- * @param image structure to hold loaded image
- * @param type returns the type of the loaded image
- * @return TRUE on success, FALSE on failure
+ * Calculates the summed-area table of a single tile.
  */
-BOOLEAN loadImage(char* filename, struct IMAGE* image, int* type) {
-    FILE *f;
-    int fileSize;
-    int bytesPerLine;
-    char magic[10];
-    char word[255];
-    char c;
-    int maxColorIndex;
-    int inputSize;
-    int inputSizeFile;
-    int read;
-    unsigned char* buffer2;
-    int lineOffsetInput;
-    int lineOffsetOutput;
+void buildIntegralTile(int tileX, int tileY, struct INTEGRAL* integral, struct IMAGE* image) {
+    unsigned short* t;
+    unsigned char* channel;
+    unsigned char* row;
+    int left;
+    int top;
     int x;
     int y;
-    int bb;
-    int off;
-    int bits;
-    int bit;
-    int pixel;
-    int size;
-    int pos;
-    unsigned char* p;
-    unsigned char r, g, b;
+    int value;
+    int sum;
 
-    if (verbose>=VERBOSE_MORE) {
-        printf("loading file %s.\n", filename);
+    t = &integral->table[(tileY * image->integrals->tilesX + tileX) * INTEGRAL_TILE * INTEGRAL_TILE];
+    left = tileX * INTEGRAL_TILE;
+    top = tileY * INTEGRAL_TILE;
+    channel = requireChannel(integral->channel, image);
+    for (y = 0; y < INTEGRAL_TILE; y++) {
+        sum = 0; // sum of this row so far
+        if (top + y < image->height) {
+            row = &channel[(top + y) * image->width];
+        } else {
+            row = NULL;
+        }
+        for (x = 0; x < INTEGRAL_TILE; x++) {
+            if ((row == NULL) || (left + x >= image->width)) {
+                value = 0; // outside of the image, handled by integralRect()
+            } else {
+                value = row[left + x];
+                if (integral->minColor != -1) {
+                    value = ((value >= integral->minColor) && (value <= integral->maxBrightness)) ? 1 : 0;
+                }
+            }
+            sum += value;
+            t[y * INTEGRAL_TILE + x] = sum + ((y > 0) ? t[(y - 1) * INTEGRAL_TILE + x] : 0);
+        }
     }
+    integral->built[tileY * image->integrals->tilesX + tileX] = image->integrals->version[tileY * image->integrals->tilesX + tileX];
+}
 
-    // open input file
-    f = fopen(filename, "rb");
-    if (f == NULL) {
-        printf("*** error: Unable to open file %s.\n", filename);
-        return FALSE;
-    }
 
-    // get file size
-    fseek(f, 0, SEEK_END); // to end
-    fileSize = ftell(f);
-    rewind(f); // back to start
+/**
+ * Returns the sum of a rectangle inside a single tile's summed-area table,
+ * coordinates are relative to the tile.
+ */
+int integralTileRect(unsigned short* t, int left, int top, int right, int bottom) {
+    int sum;
 
-    // read magic number
-    fread(magic, 1, 2, f);
-    magic[2] = 0; // terminate
-    if (strcmp(magic, "P4")==0) {
-        *type = PBM;
-        image->bitdepth = 1;
-        image->color = FALSE;
-    } else if (strcmp(magic, "P5")==0) {
-        *type = PGM;
-        image->bitdepth = 8;
-        image->color = FALSE;
-    } else if (strcmp(magic, "P6")==0) {
-        *type = PPM;
-        image->bitdepth = 8;
-        image->color = TRUE;
-    } else {
-        printf("*** error: input file format using magic '%s' is unknown.\n", magic);
-        return FALSE;
+    sum = t[bottom * INTEGRAL_TILE + right];
+    if (left > 0) {
+        sum -= t[bottom * INTEGRAL_TILE + left - 1];
     }
-
-    // get image info: width, height, optionally depth
-    fgetc(f); // skip \n after magic number
-    fscanf(f, "%s", word);
-    while (word[0]=='#') { // skip comment lines
-        do {
-            fscanf(f, "%c", &c);
-        } while ((feof(f)==0)&&(c!='\n'));
-        fscanf(f, "%s", word);
-    }
-    // now reached width/height pair as decimal ascii
-    sscanf(word, "%d", &image->width);
-    fscanf(f, "%d", &image->height);
-    fgetc(f); // skip \n after width/height pair
-    if (*type == PBM) {
-        bytesPerLine = (image->width + 7) / 8;
-    } else { // PGM or PPM
-        fscanf(f, "%s", word);
-        while (word[0]=='#') { // skip comment lines
-            do {
-                fscanf(f, "%c", &c);
-            } while ((feof(f) == 0) && (c != '\n'));
-            fscanf(f, "%s", word);
-        }
-        // read max color value
-        sscanf(word, "%d", &maxColorIndex);
-        fgetc(f); // skip \n after max color index
-        if (maxColorIndex > 255) {
-            printf("*** error: grayscale / color-component bit depths above 8 are not supported.\n");
-            return FALSE;
-        }
-        bytesPerLine = image->width;
-        if (*type == PPM) {
-            bytesPerLine *= 3; // 3 color-components per pixel
+    if (top > 0) {
+        sum -= t[(top - 1) * INTEGRAL_TILE + right];
+        if (left > 0) {
+            sum += t[(top - 1) * INTEGRAL_TILE + left - 1];
         }
     }
+    return sum;
+}
 
-    // read binary image data
-    inputSizeFile = fileSize - ftell(f);
-    inputSize = bytesPerLine * image->height;
 
-    image->buffer = (unsigned char*)malloc(inputSize);
-    read = fread(image->buffer, 1, inputSize, f);
-    if (read != inputSize) {
-        printf("*** error: Only %d out of %d could be read.\n", read, inputSize);
-        return FALSE;
-    }
-    
-    if (*type == PBM) { // internally convert b&w to 8-bit for processing
-        buffer2 = (unsigned char*)malloc(image->width * image->height);
-        lineOffsetInput = 0;
-        lineOffsetOutput = 0;
-        for (y = 0; y < image->height; y++) {
-            for (x = 0; x < image->width; x++) {
-                bb = x >> 3;  // x / 8;
-                off = x & 7; // x % 8;
-                bit = 128>>off;
-                bits = image->buffer[lineOffsetInput + bb];
-                bits &= bit;
-                if (bits == 0) { // 0: white pixel
-                    pixel = 0xff;
-                } else {
-                    pixel = 0x00;
+/**
+ * Returns the sum of the values of a summed-area table over a rectangular
+ * area. Pixels outside the image are regarded as white, like
+ * getPixelGrayscale() etc. do. The result wraps around like an unsigned int
+ * does.
+ */
+unsigned int integralRect(int left, int top, int right, int bottom, struct INTEGRAL* integral, struct IMAGE* image) {
+    struct INTEGRALS* integrals;
+    unsigned int sum;
+    unsigned int outside;
+    int tileX;
+    int tileY;
+    int tile;
+    int l, t, r, b;
+
+    integrals = image->integrals;
+    // pixels outside the image
+    outside = (unsigned int)(right - left + 1) * (bottom - top + 1);
+    left = max(left, 0);
+    top = max(top, 0);
+    right = min(right, image->width - 1);
+    bottom = min(bottom, image->height - 1);
+    sum = 0;
+    if ((left <= right) && (top <= bottom)) {
+        outside -= (unsigned int)(right - left + 1) * (bottom - top + 1);
+        for (tileY = top / INTEGRAL_TILE; tileY <= bottom / INTEGRAL_TILE; tileY++) {
+            t = max(top - tileY * INTEGRAL_TILE, 0);
+            b = min(bottom - tileY * INTEGRAL_TILE, INTEGRAL_TILE - 1);
+            for (tileX = left / INTEGRAL_TILE; tileX <= right / INTEGRAL_TILE; tileX++) {
+                l = max(left - tileX * INTEGRAL_TILE, 0);
+                r = min(right - tileX * INTEGRAL_TILE, INTEGRAL_TILE - 1);
+                tile = tileY * integrals->tilesX + tileX;
+                if (integral->built[tile] != integrals->version[tile]) {
+                    buildIntegralTile(tileX, tileY, integral, image);
                 }
-                buffer2[lineOffsetOutput+x] = pixel; // set as whole byte
+                sum += integralTileRect(&integral->table[tile * INTEGRAL_TILE * INTEGRAL_TILE], l, t, r, b);
             }
-            lineOffsetInput += bytesPerLine;
-            lineOffsetOutput += image->width;
         }
-        free(image->buffer);
-        image->buffer = buffer2;
     }
-    fclose(f);
+    if (integral->minColor == -1) {
+        sum += outside * WHITE;
+    } else if ((WHITE >= integral->minColor) && (WHITE <= integral->maxBrightness)) {
+        sum += outside;
+    }
+    return sum;
+}
 
-    if (*type == PPM) {
-        // init cached values for grayscale, lightness and darknessInverse
-        size = image->width * image->height;
-        image->bufferGrayscale = (unsigned char*)malloc(size);
-        image->bufferLightness = (unsigned char*)malloc(size);
-        image->bufferDarknessInverse = (unsigned char*)malloc(size);
-        p = image->buffer;
-        for (pos = 0; pos < size; pos++) {
-            r = *p;
-            p++;
-            g = *p;
-            p++;
-            b = *p;
-            p++;            
-            image->bufferGrayscale[pos] = pixelGrayscale(r, g, b);
-            image->bufferLightness[pos] = pixelLightness(r, g, b);
-            image->bufferDarknessInverse[pos] = pixelDarknessInverse(r, g, b);
-        }
-    } else {
-        image->bufferGrayscale = image->buffer;
-        image->bufferLightness = image->buffer;
-        image->bufferDarknessInverse = image->buffer;
+
+/**
+ * Frees an image.
+ */
+void freeImage(struct IMAGE* image) {    
+    freeIntegrals(image);
+    freeBuffer(image);
+    if (image->color) {
+        poolFree(image->bufferGrayscale);
+        poolFree(image->bufferLightness);
+        poolFree(image->bufferDarknessInverse);
     }
-    
-    return TRUE;
+    image->bufferGrayscale = NULL;
+    image->bufferLightness = NULL;
+    image->bufferDarknessInverse = NULL;
+    image->channelsValid = 0;
 }
 
 
 /**
- * Saves image data to a file in pgm or pbm format.
- *
- * @param filename name of file to save
- * @param image image to save
- * @param type filetype of the image to save
- * @param overwrite allow overwriting existing files
- * @param blackThreshold threshold for grayscale-to-black&white conversion
- * @return TRUE on success, FALSE on failure
+ * Replaces one image with another.
  */
-BOOLEAN saveImage(char* filename, struct IMAGE* image, int type, BOOLEAN overwrite, float blackThreshold) {
-    unsigned char* buf;
-    int bytesPerLine;
-    int inputSize;
-    int outputSize;
-    int lineOffsetOutput;
-    int offsetInput;
-    int offsetOutput;
-    int x;
-    int y;
-    int pixel;
-    int b;
-    int off;
-    unsigned char bit;
-    unsigned char val;
-    char* outputMagic;
-    FILE* outputFile;
-    int blackThresholdAbs;
-    BOOLEAN result;
+void replaceImage(struct IMAGE* image, struct IMAGE* newimage) {    
+    freeImage(image);
+    // pass-back new image
+    *image = *newimage; // copy whole struct
+}
 
-    if (verbose>=VERBOSE_MORE) {
-        printf("saving file %s.\n", filename);
-    }
 
-    result = TRUE;
-    if (type == PBM) { // convert to pbm
-        blackThresholdAbs = WHITE * (1.0 - blackThreshold);
-        bytesPerLine = (image->width + 7) >> 3; // / 8;
-        outputSize = bytesPerLine * image->height;
-        buf = (unsigned char*)malloc(outputSize);
-        memset(buf, 0, outputSize);
-        lineOffsetOutput = 0;
-        for (y = 0; y < image->height; y++) {
-            for (x = 0; x < image->width; x++) {
-                pixel = getPixelGrayscale(x, y, image);
-                b = x >> 3; // / 8;
-                off = x & 7; // % 8;
-                bit = 128>>off;
-                val = buf[lineOffsetOutput + b];
-                if (pixel < blackThresholdAbs) { // dark
-                    val |= bit; // set bit to one: black
-                } else { // bright
-                    val &= (~bit); // set bit to zero: white
+/**
+ * Sets the color/grayscale value of a single pixel.
+ *
+ * @return TRUE if the pixel has been changed, FALSE if the original color was the one to set
+ */ 
+BOOLEAN setPixel(int pixel, int x, int y, struct IMAGE* image) {
+    unsigned char* p;
+    int w, h;
+    int pos;
+    BOOLEAN result;
+    unsigned char r, g, b;
+    
+    w = image->width;
+    h = image->height;
+    if ( (x < 0) || (x >= w) || (y < 0) || (y >= h) ) {
+        return FALSE; //nop
+    } else {
+        pos = (y * w) + x;
+        r = (pixel >> 16) & 0xff;
+        g = (pixel >> 8) & 0xff;
+        b = pixel & 0xff;
+        if ( ! image->color ) {
+            if ((r == g) && (r == b)) { // optimization (avoid division by 3)
+                pixel = r;
+            } else {
+                pixel = pixelGrayscale(r, g, b); // convert to gray (will already be in most cases, but we can't be sure)
+            }
+            if ( image->packed ) {
+                if ( isBlackOrWhite(pixel) ) {
+                    return (fillBits(&image->buffer[y * image->stride], x, 1, pixel == BLACK) != 0);
+                } else { // gray value: continue with one byte per pixel
+                    unpackImage(image);
                 }
-                buf[lineOffsetOutput+b] = val;
             }
-            lineOffsetOutput += bytesPerLine;
-        }
-    } else if (type == PPM) { // maybe convert to color
-        outputSize = image->width * image->height * 3;
-        if (image->color) { // color already
-            buf = image->buffer;
-        } else { // convert to color
-            buf = (unsigned char*)malloc(outputSize);
-            inputSize = image->width * image->height;
-            offsetOutput = 0;
-            for (offsetInput = 0; offsetInput < inputSize; offsetInput++) {
-                pixel = image->buffer[offsetInput];
-                buf[offsetOutput++] = pixel;
-                buf[offsetOutput++] = pixel;
-                buf[offsetOutput++] = pixel;
+            if (image->low != NULL) {
+                image->low[pos] = (unsigned char)pixel;
             }
-        }
-    } else { // PGM
-        outputSize = image->width * image->height;
-        buf = image->buffer;
-    }
-    
-    switch (type) {
-        case PBM:
-            outputMagic = "P4";
-            break;
-        case PPM:
-            outputMagic = "P6";
-            break;
-        default: // PGM
-            outputMagic = "P5";
-            break;
-    }
-
-    // write to file
-    if ( overwrite || ( ! fileExists( filename ) ) ) {
-        outputFile = fopen(filename, "wb");
-        if (outputFile != 0) {
-            fprintf(outputFile, "%s\n", outputMagic);
-            fprintf(outputFile, "# generated by unpaper\n");
-            fprintf(outputFile, "%u %u\n", image->width, image->height);
-            if ((type == PGM)||(type == PPM)) {
-                fprintf(outputFile, "255\n"); // maximum color index per color-component
-            }
-            fwrite(buf, 1, outputSize, outputFile);
-            fclose(outputFile);
-        } else {
-            printf("*** error: Cannot open output file '%s'.\n", filename);
+            p = &image->buffer[pos];
+            if (*p != (unsigned char)pixel) {
+                *p = (unsigned char)pixel;
+                touchIntegrals(x, y, 1, image);
+                return TRUE;
+            } else {
+                return FALSE;
+            }
+        } else { // color
             result = FALSE;
+            if (image->low != NULL) {
+                p = &image->low[pos*3];
+                p[0] = r;
+                p[1] = g;
+                p[2] = b;
+            }
+            p = &image->buffer[pos*3];
+            if (*p != r) {
+                *p = r;
+                result = TRUE;
+            }
+            p++;
+            if (*p != g) {
+                *p = g;
+                result = TRUE;
+            }
+            p++;
+            if (*p != b) {
+                *p = b;
+                result = TRUE;
+            }
+            if ( result && (image->channelsValid != 0) ) { // modified: update cached grayscale, lightness and darknessInverse values
+                updateChannels(pos, r, g, b, image);
+            }
+            if ( result ) {
+                touchIntegrals(x, y, 1, image);
+            }
+            return result;
         }
-    } else {
-        printf("file %s already exists (use --overwrite to replace).\n", filename);
-        result = FALSE;
     }
-    if (buf != image->buffer) {
-        free(buf);
-    }
-    return result;
-}    
+}
 
 
 /**
- * Saves the image if full debugging mode is enabled.
- */
-void saveDebug(char* filename, struct IMAGE* image) {
-    int type;
-    
-    if (verbose >= VERBOSE_DEBUG_SAVE) {
-        if (image->color) {
-            type = PPM;
-        } else if (image->bitdepth == 1) {
-            type = PBM;
-        } else {
-            type = PGM;
+ * Returns the color or grayscale value of a single pixel.
+ * Always returns a color-compatible value (which may be interpreted as 8-bit grayscale)
+ *
+ * @return color or grayscale-value of the requested pixel, or WHITE if the coordinates are outside the image
+ */ 
+int getPixel(int x, int y, struct IMAGE* image) {
+    int w, h;
+    int pos;
+    int pix;
+    unsigned char r, g, b;
+
+    w = image->width;
+    h = image->height;
+    if ( (x < 0) || (x >= w) || (y < 0) || (y >= h) ) {
+        return pixelValue(WHITE, WHITE, WHITE);
+    } else {
+        pos = (y * w) + x;
+        if ( image->packed ) {
+            pix = (getBit(&image->buffer[y * image->stride], x) != 0) ? BLACK : WHITE;
+            return pixelValue(pix, pix, pix);
+        } else if ( ! image->color ) {
+            pix = (unsigned char)image->buffer[pos];
+            return pixelValue(pix, pix, pix);
+        } else { // color
+            pos *= 3;
+            r = (unsigned char)image->buffer[pos++];
+            g = (unsigned char)image->buffer[pos++];
+            b = (unsigned char)image->buffer[pos];
+            return pixelValue(r, g, b);
         }
-        saveImage(filename, image, type, TRUE, 0.5); // 0.5 is a dummy, not used because PGM depth
     }
 }
 
 
-
-/****************************************************************************
- * image processing functions                                               *
- ****************************************************************************/
-
-
-/* --- deskewing ---------------------------------------------------------- */
-
 /**
- * Returns the maximum peak value that occurs when shifting a rotated virtual line above the image,
- * starting from one edge of an area and moving towards the middle point of the area.
- * The peak value is calulated by the absolute difference in the average blackness of pixels that occurs between two single shifting steps.
+ * Returns a color component of a single pixel (0-255).
  *
- * @param m ascending slope of the virtually shifted (m=tan(angle)). Mind that this is negative for negative radians.
- */
-int detectEdgeRotationPeak(double m, int deskewScanSize, float deskewScanDepth, int shiftX, int shiftY, int left, int top, int right, int bottom, struct IMAGE* image) {
-    int width;
-    int height;
-    int mid;
+ * @param colorComponent either RED, GREEN or BLUE
+ * @return color or grayscale-value of the requested pixel, or WHITE if the coordinates are outside the image
+ */ 
+ /* (currently not used)
+int getPixelComponent(int x, int y, int colorComponent, struct IMAGE* image) {
+    int w, h;
+    int pos;
+
+    w = image->width;
+    h = image->height;
+    if ( (x < 0) || (x >= w) || (y < 0) || (y >= h) ) {
+        return WHITE;
+    } else {
+        pos = (y * w) + x;
+        if ( ! image->color ) {
+            return (unsigned char)image->buffer[pos];
+        } else { // color
+            return (unsigned char)image->buffer[(pos * 3) + colorComponent];
+        }
+    }
+}
+*/
+
+/**
+ * Returns the grayscale (=brightness) value of a single pixel.
+ *
+ * For color images, the channel must have been calculated by requireChannel()
+ * before, usually when a filter or scan starts.
+ *
+ * @return grayscale-value of the requested pixel, or WHITE if the coordinates are outside the image
+ */ 
+int getPixelGrayscale(int x, int y, struct IMAGE* image) {
+    int w, h;
+    int pos;
+
+    w = image->width;
+    h = image->height;
+    if ( (x < 0) || (x >= w) || (y < 0) || (y >= h) ) {
+        return WHITE;
+    } else {
+        if ( image->packed ) {
+            return (getBit(&image->buffer[y * image->stride], x) != 0) ? BLACK : WHITE;
+        }
+        pos = (y * w) + x;
+        return image->bufferGrayscale[pos];
+    }
+}
+
+
+/**
+ * Returns the 'lightness' value of a single pixel. For color images, this
+ * value denotes the minimum brightness of a single color-component in the
+ * total color, which means that any color is considered 'dark' which has
+ * either the red, the green or the blue component (or, of course, several
+ * of them) set to a high value. In some way, this is a measure how close a
+ * color is to white.
+ * For grayscale images, this value is equal to the pixel brightness.
+ * For color images, the channel must have been calculated by requireChannel()
+ * before.
+ *
+ * @return lightness-value (the higher, the lighter) of the requested pixel, or WHITE if the coordinates are outside the image
+ */ 
+int getPixelLightness(int x, int y, struct IMAGE* image) {
+    int w, h;
+    int pos;
+
+    w = image->width;
+    h = image->height;
+    if ( (x < 0) || (x >= w) || (y < 0) || (y >= h) ) {
+        return WHITE;
+    } else {
+        if ( image->packed ) {
+            return (getBit(&image->buffer[y * image->stride], x) != 0) ? BLACK : WHITE;
+        }
+        pos = (y * w) + x;
+        return image->bufferLightness[pos];
+    }
+}
+
+
+/**
+ * Returns the 'inverse-darkness' value of a single pixel. For color images, this
+ * value denotes the maximum brightness of a single color-component in the
+ * total color, which means that any color is considered 'light' which has
+ * either the red, the green or the blue component (or, of course, several
+ * of them) set to a high value. In some way, this is a measure how far away a
+ * color is to black.
+ * For grayscale images, this value is equal to the pixel brightness.
+ * For color images, the channel must have been calculated by requireChannel()
+ * before.
+ *
+ * @return inverse-darkness-value (the LOWER, the darker) of the requested pixel, or WHITE if the coordinates are outside the image
+ */ 
+int getPixelDarknessInverse(int x, int y, struct IMAGE* image) {
+    int w, h;
+    int pos;
+
+    w = image->width;
+    h = image->height;
+    if ( (x < 0) || (x >= w) || (y < 0) || (y >= h) ) {
+        return WHITE;
+    } else {
+        if ( image->packed ) {
+            return (getBit(&image->buffer[y * image->stride], x) != 0) ? BLACK : WHITE;
+        }
+        pos = (y * w) + x;
+        return image->bufferDarknessInverse[pos];
+    }
+}
+
+
+/**
+ * Returns a pointer to the first byte of a row of pixel data. Color images
+ * store 3 bytes (red, green, blue) per pixel, grayscale images 1 byte,
+ * packed images 1 bit (see getBit()).
+ * No bounds-checking is done, y must denote a row inside the image.
+ */ 
+unsigned char* getRow(int y, struct IMAGE* image) {
+    return &image->buffer[y * image->stride];
+}
+
+
+/**
+ * Returns a pointer to the first cached grayscale value of a row (1 byte per
+ * pixel).
+ * No bounds-checking is done, y must denote a row inside the image.
+ */ 
+unsigned char* getRowGrayscale(int y, struct IMAGE* image) {
+    return &requireChannel(GRAYSCALE, image)[y * image->width];
+}
+
+
+/**
+ * Returns a pointer to the first cached lightness value of a row (1 byte per
+ * pixel).
+ * No bounds-checking is done, y must denote a row inside the image.
+ *
+ * @see getPixelLightness()
+ */ 
+unsigned char* getRowLightness(int y, struct IMAGE* image) {
+    return &requireChannel(LIGHTNESS, image)[y * image->width];
+}
+
+
+/**
+ * Returns a pointer to the first cached inverse-darkness value of a row (1 byte
+ * per pixel).
+ * No bounds-checking is done, y must denote a row inside the image.
+ *
+ * @see getPixelDarknessInverse()
+ */ 
+unsigned char* getRowDarknessInverse(int y, struct IMAGE* image) {
+    return &requireChannel(DARKNESS_INVERSE, image)[y * image->width];
+}
+
+
+/**
+ * Writes a span of pixels into a row of a 16-bit image, see setRowSpan().
+ * Source values without low bytes are taken as v * 257. Source and target
+ * must not overlap.
+ */
+void setRowSpan16(unsigned char* source, unsigned char* sourceLow, BOOLEAN sourceColor, int x, int y, int count, struct IMAGE* image) {
+    unsigned char* p;
+    unsigned char* q;
+    int pos;
+    int i;
+    int k;
+    int samples;
+    int sourceSamples;
+    unsigned int v[3];
+    unsigned int val;
+
+    samples = image->color ? 3 : 1;
+    sourceSamples = sourceColor ? 3 : 1;
+    p = &getRow(y, image)[x * samples];
+    q = &image->low[y * image->stride + x * samples];
+    pos = (y * image->width) + x;
+    for (i = 0; i < count; i++) {
+        for (k = 0; k < sourceSamples; k++) {
+            v[k] = (source[k] << 8) | ((sourceLow != NULL) ? sourceLow[k] : source[k]);
+        }
+        source += sourceSamples;
+        if (sourceLow != NULL) {
+            sourceLow += sourceSamples;
+        }
+        if ( ! sourceColor ) {
+            v[1] = v[2] = v[0];
+        }
+        if ( ! image->color ) {
+            val = pixelGrayscale(v[0], v[1], v[2]);
+            p[i] = val >> 8;
+            q[i] = val & 0xff;
+        } else {
+            q[0] = v[0] & 0xff;
+            q[1] = v[1] & 0xff;
+            q[2] = v[2] & 0xff;
+            if ((p[0] != (v[0] >> 8)) || (p[1] != (v[1] >> 8)) || (p[2] != (v[2] >> 8))) {
+                p[0] = v[0] >> 8;
+                p[1] = v[1] >> 8;
+                p[2] = v[2] >> 8;
+                updateChannels(pos, p[0], p[1], p[2], image);
+            }
+            p += 3;
+            q += 3;
+            pos++;
+        }
+    }
+    touchIntegrals(x, y, count, image);
+}
+
+
+/**
+ * Writes a span of pixels into a row of an image. Source pixels are converted
+ * between color and grayscale representation if necessary, the same way
+ * setPixel() does. For color images, up-to-date channels are updated for
+ * each pixel that actually changes. Packed images are unpacked if the source
+ * contains gray values. The low bytes of a 16-bit source are passed as
+ * sourceLow, NULL for other sources.
+ * No bounds-checking is done, the span must lie inside the image. Source and
+ * target may only overlap for grayscale images of less than 16 bits.
+ */
+void setRowSpan(unsigned char* source, unsigned char* sourceLow, BOOLEAN sourceColor, int x, int y, int count, struct IMAGE* image) {
+    unsigned char* p;
+    int pos;
+    int i;
+    unsigned char r, g, b;
+    unsigned char* src;
+    int val;
+
+    if (image->low != NULL) {
+        setRowSpan16(source, sourceLow, sourceColor, x, y, count, image);
+        return;
+    }
+    if ( image->packed ) { // write bits as long as only black and white values occur
+        src = source;
+        for (i = 0; i < count; i++) {
+            if (sourceColor) {
+                val = pixelGrayscale(src[0], src[1], src[2]);
+                src += 3;
+            } else {
+                val = *src++;
+            }
+            if ( ! isBlackOrWhite(val) ) {
+                unpackImage(image);
+                break;
+            }
+        }
+    }
+    if ( image->packed ) {
+        p = getRow(y, image);
+        for (i = 0; i < count; i++) {
+            if (sourceColor) {
+                val = pixelGrayscale(source[0], source[1], source[2]);
+                source += 3;
+            } else {
+                val = *source++;
+            }
+            fillBits(p, x + i, 1, val == BLACK);
+        }
+    } else if ( ! image->color ) {
+        p = &getRow(y, image)[x];
+        if ( ! sourceColor ) {
+            memmove(p, source, count);
+        } else {
+            for (i = 0; i < count; i++) {
+                r = *source++;
+                g = *source++;
+                b = *source++;
+                *p++ = pixelGrayscale(r, g, b);
+            }
+        }
+    } else { // color
+        p = &getRow(y, image)[x * 3];
+        pos = (y * image->width) + x;
+        for (i = 0; i < count; i++) {
+            r = *source++;
+            if (sourceColor) {
+                g = *source++;
+                b = *source++;
+            } else {
+                g = b = r;
+            }
+            if ((p[0] != r) || (p[1] != g) || (p[2] != b)) {
+                p[0] = r;
+                p[1] = g;
+                p[2] = b;
+                updateChannels(pos, r, g, b, image);
+            }
+            p += 3;
+            pos++;
+        }
+    }
+    if ( ! image->packed ) {
+        touchIntegrals(x, y, count, image);
+    }
+}
+
+
+/**
+ * Sets a span of pixels in a row of an image to one color value. For color
+ * images, up-to-date channels are updated for each pixel that actually changes.
+ * Packed images are unpacked if the value is neither black nor white.
+ * No bounds-checking is done, the span must lie inside the image.
+ *
+ * @return number of pixels that have been changed
+ */
+int fillRowSpan(int pixel, int x, int y, int count, struct IMAGE* image) {
+    unsigned char* p;
+    unsigned char val;
+    int pos;
+    int i;
+    int changed;
+    unsigned char r, g, b;
+
+    r = red(pixel);
+    g = green(pixel);
+    b = blue(pixel);
+    changed = 0;
+    if ( image->packed ) {
+        val = pixelGrayscale(r, g, b);
+        if ( isBlackOrWhite(val) ) {
+            return fillBits(getRow(y, image), x, count, val == BLACK);
+        }
+        unpackImage(image);
+    }
+    if ( ! image->color ) {
+        p = &getRow(y, image)[x];
+        val = pixelGrayscale(r, g, b);
+        for (i = 0; i < count; i++) {
+            if (p[i] != val) {
+                p[i] = val;
+                changed++;
+            }
+        }
+        if (image->low != NULL) { // (the value v stands for v * 257 in both bytes)
+            p = &image->low[y * image->stride + x];
+            for (i = 0; i < count; i++) {
+                p[i] = val;
+            }
+        }
+    } else { // color
+        p = &getRow(y, image)[x * 3];
+        pos = (y * image->width) + x;
+        for (i = 0; i < count; i++) {
+            if ((p[0] != r) || (p[1] != g) || (p[2] != b)) {
+                p[0] = r;
+                p[1] = g;
+                p[2] = b;
+                updateChannels(pos, r, g, b, image);
+                changed++;
+            }
+            p += 3;
+            pos++;
+        }
+        if (image->low != NULL) {
+            p = &image->low[y * image->stride + x * 3];
+            for (i = 0; i < count; i++) {
+                p[0] = r;
+                p[1] = g;
+                p[2] = b;
+                p += 3;
+            }
+        }
+    }
+    if (changed != 0) {
+        touchIntegrals(x, y, count, image);
+    }
+    return changed;
+}
+
+
+/**
+ * Copies a single pixel between two unpacked images of the same color mode. Source
+ * coordinates outside the source image deliver white. Channels of the target
+ * are not updated, invalidateChannels() has to be called afterwards.
+ * No bounds-checking is done on the target coordinates.
+ */
+void copyPixel(int x, int y, struct IMAGE* source, int toX, int toY, struct IMAGE* target) {
+    unsigned char* s;
+    unsigned char* t;
+
+    if ( ! target->color ) {
+        t = &target->buffer[toY * target->stride + toX];
+        if ( (x < 0) || (x >= source->width) || (y < 0) || (y >= source->height) ) {
+            *t = WHITE;
+        } else {
+            *t = source->buffer[y * source->stride + x];
+        }
+    } else { // color
+        t = &target->buffer[toY * target->stride + toX * 3];
+        if ( (x < 0) || (x >= source->width) || (y < 0) || (y >= source->height) ) {
+            t[0] = t[1] = t[2] = WHITE;
+        } else {
+            s = &source->buffer[y * source->stride + x * 3];
+            t[0] = s[0];
+            t[1] = s[1];
+            t[2] = s[2];
+        }
+    }
+}
+
+
+/**
+ * Sets the color/grayscale value of a single pixel to either black or white.
+ *
+ * @return TRUE if the pixel has been changed, FALSE if the original color was the one to set
+ */ 
+BOOLEAN setPixelBW(int x, int y, struct IMAGE* image, int blackwhite) {
+    unsigned char* p;
+    int w, h;
+    int pos;
+    BOOLEAN result;
+    
+    w = image->width;
+    h = image->height;
+    if ( (x < 0) || (x >= w) || (y < 0) || (y >= h) ) {
+        return FALSE; //nop
+    } else {
+        pos = (y * w) + x;
+        if ( image->packed ) {
+            if ( isBlackOrWhite(blackwhite) ) {
+                return (fillBits(getRow(y, image), x, 1, blackwhite == BLACK) != 0);
+            }
+            unpackImage(image);
+        }
+        if ( ! image->color ) {
+            if (image->low != NULL) {
+                image->low[pos] = blackwhite;
+            }
+            p = &image->buffer[pos];
+            if (*p != blackwhite) {
+                *p = blackwhite;
+                touchIntegrals(x, y, 1, image);
+                return TRUE;
+            } else {
+                return FALSE;
+            }
+        } else { // color
+            if (image->low != NULL) {
+                memset(&image->low[pos * 3], blackwhite, 3);
+            }
+            p = &image->buffer[pos * 3];
+            result = FALSE;
+            if (*p != blackwhite) {
+                *p = blackwhite;
+                result = TRUE;
+            }
+            p++;
+            if (*p != blackwhite) {
+                *p = blackwhite;
+                result = TRUE;
+            }
+            p++;
+            if (*p != blackwhite) {
+                *p = blackwhite;
+                result = TRUE;
+            }
+            if ( result && (image->channelsValid != 0) ) {
+                updateChannels(pos, blackwhite, blackwhite, blackwhite, image);
+            }
+            if ( result ) {
+                touchIntegrals(x, y, 1, image);
+            }
+            return result;
+        }
+    }
+}
+
+
+/**
+ * Sets the color/grayscale value of a single pixel to white.
+ *
+ * @return TRUE if the pixel has been changed, FALSE if the original color was the one to set
+ */ 
+BOOLEAN clearPixel(int x, int y, struct IMAGE* image) {
+    return setPixelBW(x, y, image, WHITE);
+}
+
+
+/**
+ * Clears a rectangular area of pixels with either black or white.
+ * @return The number of pixels actually changed from black (dark) to white.
+ */
+int clearRect(int left, int top, int right, int bottom, struct IMAGE* image, int blackwhite) {
+    int x;
+    int y;
+    int count;
+
+    count = 0;
+    if ( image->packed && isBlackOrWhite(blackwhite) ) {
+        left = max(left, 0);
+        right = min(right, image->width - 1);
+        for (y = max(top, 0); y <= min(bottom, image->height - 1); y++) {
+            count += fillBits(getRow(y, image), left, right - left + 1, blackwhite == BLACK);
+        }
+        return count;
+    }
+    for (y = top; y <= bottom; y++) {
+        for (x = left; x <= right; x++) {
+            if (setPixelBW(x, y, image, blackwhite)) {
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+
+/**
+ * Copies one area of an image into another.
+ */
+void copyImageArea(int x, int y, int width, int height, struct IMAGE* source, int toX, int toY, struct IMAGE* target) {
+    int i;
+    int left;
+    int right;
+    int sourceLeft;
+    int sourceRight;
+    int sourceY;
+    int targetY;
+    int bytesPerPixel;
+    int offset;
+    int white;
+    unsigned char* row;
+
+    // target columns to write, clipped to the target image (right exclusive)
+    left = max(toX, 0);
+    right = min(toX + width, target->width);
+    // part of these columns that is covered by the source image, the rest gets white
+    sourceLeft = max(left, toX - x);
+    sourceRight = min(right, toX - x + source->width);
+    bytesPerPixel = source->color ? 3 : 1;
+    white = pixelValue(WHITE, WHITE, WHITE);
+    row = NULL;
+    if ( source->packed && (sourceLeft < sourceRight) ) {
+        row = (unsigned char*)malloc(sourceRight - sourceLeft);
+    }
+    for (i = 0; i < height; i++) {
+        targetY = toY + i;
+        if ((left < right) && (targetY >= 0) && (targetY < target->height)) {
+            sourceY = y + i;
+            if ((sourceY < 0) || (sourceY >= source->height) || (sourceLeft >= sourceRight)) {
+                fillRowSpan(white, left, targetY, right - left, target);
+            } else {
+                if (left < sourceLeft) {
+                    fillRowSpan(white, left, targetY, sourceLeft - left, target);
+                }
+                if ( ! source->packed ) {
+                    offset = sourceY * source->stride + (sourceLeft - toX + x) * bytesPerPixel;
+                    setRowSpan(&source->buffer[offset], (source->low != NULL) ? &source->low[offset] : NULL, source->color, sourceLeft, targetY, sourceRight - sourceLeft, target);
+                } else if ( target->packed ) {
+                    copyBits(getRow(sourceY, source), sourceLeft - toX + x, getRow(targetY, target), sourceLeft, sourceRight - sourceLeft);
+                } else {
+                    unpackBits(getRow(sourceY, source), sourceLeft - toX + x, sourceRight - sourceLeft, row);
+                    setRowSpan(row, NULL, FALSE, sourceLeft, targetY, sourceRight - sourceLeft, target);
+                }
+                if (sourceRight < right) {
+                    fillRowSpan(white, sourceRight, targetY, right - sourceRight, target);
+                }
+            }
+        }
+    }
+    free(row);
+}
+
+
+/**
+ * Copies a whole image into another.
+ */
+void copyImage(struct IMAGE* source, int toX, int toY, struct IMAGE* target) {
+    copyImageArea(0, 0, source->width, source->height, source, toX, toY, target);
+}
+
+
+/**
+ * Centers one area of an image inside an area of another image.
+ * If the source area is smaller than the target area, is is equally
+ * surrounded by a white border, if it is bigger, it gets equally cropped
+ * at the edges.
+ */
+void centerImageArea(int x, int y, int w, int h, struct IMAGE* source, int toX, int toY, int ww, int hh, struct IMAGE* target) {
+    if ((w < ww) || (h < hh)) { // white rest-border will remain, so clear first
+        clearRect(toX, toY, toX + ww - 1, toY + hh - 1, target, target->background);
+    }
+    if (w < ww) {
+        toX += (ww - w) / 2;
+    }
+    if (h < hh) {
+        toY += (hh - h) / 2;
+    }
+    if (w > ww) {
+        x += (w - ww) / 2;
+        w = ww;
+    }
+    if (h > hh) {
+        y += (h - hh) / 2;
+        h = hh;
+    }
+    copyImageArea(x, y, w, h, source, toX, toY, target);
+}
+
+
+/**
+ * Centers a whole image inside an area of another image.
+ */
+void centerImage(struct IMAGE* source, int toX, int toY, int ww, int hh, struct IMAGE* target) {
+    centerImageArea(0, 0, source->width, source->height, source, toX, toY, ww, hh, target);
+}
+
+
+/**
+ * Counts the black pixels inside a rectangular area of a packed image.
+ */
+int countBlackPixels(int left, int top, int right, int bottom, struct IMAGE* image) {
+    int y;
+    int count;
+
+    left = max(left, 0);
+    right = min(right, image->width - 1);
+    count = 0;
+    for (y = max(top, 0); y <= min(bottom, image->height - 1); y++) {
+        count += countBits(getRow(y, image), left, right - left + 1);
+    }
+    return count;
+}
+
+
+/**
+ * Returns the average brightness of a rectagular area.
+ */
+int brightnessRect(int x1, int y1, int x2, int y2, struct IMAGE* image) {
+    struct INTEGRAL* integral;
+    int x;
+    int y;
+    int pixel;
+    int total;
+    int count;
+    total = 0;
+    count = (x2-x1+1)*(y2-y1+1);
+    if ( image->packed && (x1 <= x2) && (y1 <= y2) ) { // pixels are either black or white (also outside the image)
+        return (WHITE * (count - countBlackPixels(x1, y1, x2, y2, image))) / count;
+    }
+    if ( (x1 <= x2) && (y1 <= y2) && (count >= INTEGRAL_MIN_AREA) ) {
+        integral = findIntegral(GRAYSCALE, -1, -1, image);
+        if (integral != NULL) {
+            return (int)integralRect(x1, y1, x2, y2, integral, image) / count;
+        }
+    }
+    for (x = x1; x <= x2; x++) {
+        for (y = y1; y <= y2; y++) {
+            pixel = getPixelGrayscale(x, y, image);
+            total += pixel;
+        }
+    }
+    return total / count;
+}
+
+
+/**
+ * Returns the average lightness of a rectagular area.
+ */
+int lightnessRect(int x1, int y1, int x2, int y2, struct IMAGE* image) {
+    struct INTEGRAL* integral;
+    int x;
+    int y;
+    int pixel;
+    int total;
+    int count;
+    total = 0;
+    count = (x2-x1+1)*(y2-y1+1);
+    if ( image->packed && (x1 <= x2) && (y1 <= y2) ) { // pixels are either black or white (also outside the image)
+        return (WHITE * (count - countBlackPixels(x1, y1, x2, y2, image))) / count;
+    }
+    if ( (x1 <= x2) && (y1 <= y2) && (count >= INTEGRAL_MIN_AREA) ) {
+        integral = findIntegral(LIGHTNESS, -1, -1, image);
+        if (integral != NULL) {
+            return (int)integralRect(x1, y1, x2, y2, integral, image) / count;
+        }
+    }
+    for (x = x1; x <= x2; x++) {
+        for (y = y1; y <= y2; y++) {
+            pixel = getPixelLightness(x, y, image);
+            total += pixel;
+        }
+    }
+    return total / count;
+}
+
+
+/**
+ * Returns the average darkness of a rectagular area.
+ */
+int darknessInverseRect(int x1, int y1, int x2, int y2, struct IMAGE* image) {
+    struct INTEGRAL* integral;
+    int x;
+    int y;
+    int pixel;
+    int total;
+    int count;
+    total = 0;
+    count = (x2-x1+1)*(y2-y1+1);
+    if ( image->packed && (x1 <= x2) && (y1 <= y2) ) { // pixels are either black or white (also outside the image)
+        return (WHITE * (count - countBlackPixels(x1, y1, x2, y2, image))) / count;
+    }
+    if ( (x1 <= x2) && (y1 <= y2) && (count >= INTEGRAL_MIN_AREA) ) {
+        integral = findIntegral(DARKNESS_INVERSE, -1, -1, image);
+        if (integral != NULL) {
+            return (int)integralRect(x1, y1, x2, y2, integral, image) / count;
+        }
+    }
+    for (x = x1; x <= x2; x++) {
+        for (y = y1; y <= y2; y++) {
+            pixel = getPixelDarknessInverse(x, y, image);
+            total += pixel;
+        }
+    }
+    return total / count;
+}
+
+
+/**
+ * Counts the number of pixels in a rectangular area whose grayscale
+ * values ranges between minColor and maxBrightness. Optionally, the area can get
+ * cleared with white color while counting.
+ */
+int countPixelsRect(int left, int top, int right, int bottom, int minColor, int maxBrightness, BOOLEAN clear, struct IMAGE* image) {
+    struct INTEGRAL* integral;
+    int x;
+    int y;
+    int pixel;
+    int count;
+    int black;
+    
+    count = 0;
+    if ( (left <= right) && (top <= bottom) && ((right - left + 1) * (bottom - top + 1) >= INTEGRAL_MIN_AREA) ) {
+        integral = findIntegral(GRAYSCALE, minColor, maxBrightness, image);
+        if (integral != NULL) {
+            count = integralRect(left, top, right, bottom, integral, image);
+            if ((clear == FALSE) || (count == 0)) { // otherwise count again while clearing
+                return count;
+            }
+            count = 0;
+        }
+    }
+    if ( image->packed && (left <= right) ) { // count black and white pixels in each row at once
+        for (y = top; y <= bottom; y++) {
+            black = countBlackPixels(left, y, right, y, image);
+            if ((minColor <= BLACK) && (BLACK <= maxBrightness)) {
+                count += black;
+                if ((clear == TRUE) && (black != 0)) {
+                    clearRect(left, y, right, y, image, WHITE);
+                }
+            }
+            if ((minColor <= WHITE) && (WHITE <= maxBrightness)) {
+                count += (right - left + 1) - black;
+            }
+        }
+        return count;
+    }
+    for (y = top; y <= bottom; y++) {
+        for (x = left; x <= right; x++) {
+            pixel = getPixelGrayscale(x, y, image);
+            if ((pixel>=minColor) && (pixel <= maxBrightness)) {
+                if (clear==TRUE) {
+                    clearPixel(x, y, image);
+                }
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+
+/**
+ * Counts the number of dark pixels around the pixel at (x,y), who have a
+ * square-metric distance of 'level' to the (x,y) (thus, testing the values
+ * of 9 pixels if level==1, 16 pixels if level==2 and so on).
+ * Optionally, the pixels can get cleared after counting.
+ */
+int countPixelNeighborsLevel(int x, int y, BOOLEAN clear, int level, int whiteMin, struct IMAGE* image) {
+    int xx;
+    int yy;
+    int count;
+    int pixel;
+    
+    count = 0;
+    // upper and lower rows
+    for (xx = x - level; xx <= x + level; xx++) {
+        // upper row
+        pixel = getPixelLightness(xx, y - level, image);
+        if (pixel < whiteMin) { // non-light pixel found
+            if (clear == TRUE) {
+                clearPixel(xx, y - level, image);
+            }
+            count++;
+        }        
+        // lower row
+        pixel = getPixelLightness(xx, y + level, image);
+        if (pixel < whiteMin) {
+            if (clear == TRUE) {
+                clearPixel(xx, y + level, image);
+            }
+            count++;
+        }        
+    }
+    // middle rows
+    for (yy = y-(level-1); yy <= y+(level-1); yy++) {
+        // first col
+        pixel = getPixelLightness(x - level, yy, image);
+        if (pixel < whiteMin) {
+            if (clear == TRUE) {
+                clearPixel(x - level, yy, image);
+            }
+            count++;
+        }        
+        // last col
+        pixel = getPixelLightness(x + level, yy, image);
+        if (pixel < whiteMin) {
+            if (clear == TRUE) {
+                clearPixel(x + level, yy, image);
+            }
+            count++;
+        }        
+    }
+    /* old version, not optimized:
+    for (yy = y-level; yy <= y+level; yy++) {
+        for (xx = x-level; xx <= x+level; xx++) {
+            if (abs(xx-x)==level || abs(yy-y)==level) {
+                pixel = getPixelLightness(xx, yy, image);
+                if (pixel < whiteMin) {
+                    if (clear==TRUE) {
+                        clearPixel(xx, yy, image);
+                    }
+                    count++;
+                }
+            }
+        }    
+    }*/
+    return count;
+}
+
+
+/**
+ * Count all dark pixels in the distance 0..intensity that are directly
+ * reachable from the dark pixel at (x,y), without having to cross bright
+ * pixels.
+ */
+int countPixelNeighbors(int x, int y, int intensity, int whiteMin, struct IMAGE* image) {
+    int level;
+    int count;
+    int lCount;
+    
+    count = 1; // assume self as set
+    lCount = -1;
+    for (level = 1; (lCount != 0) && (level <= intensity); level++) { // can finish when one level is completely zero
+        lCount = countPixelNeighborsLevel(x, y, FALSE, level, whiteMin, image);
+        count += lCount;
+    }
+    return count;
+}
+
+
+/**
+ * Clears all dark pixels that are directly reachable from the dark pixel at
+ * (x,y). This should be called only if it has previously been detected that
+ * the amount of pixels to clear will be reasonable small.
+ */
+void clearPixelNeighbors(int x, int y, int whiteMin, struct IMAGE* image) {
+    int level;
+    int lCount;
+
+    clearPixel(x, y, image);    
+    lCount = -1;
+    for (level = 1; lCount != 0; level++) { // lCount will become 0, otherwise countPixelNeighbors() would previously have delivered a bigger value (and this here would not have been called)
+        lCount = countPixelNeighborsLevel(x, y, TRUE, level, whiteMin, image);
+    }
+}
+
+
+/**
+ * Finds the root component of the set the component at index belongs to,
+ * shortening the path on the way.
+ */
+int findComponent(int index, struct COMPONENT* components) {
+    while (components[index].parent != index) {
+        components[index].parent = components[components[index].parent].parent;
+        index = components[index].parent;
+    }
+    return index;
+}
+
+
+/**
+ * Labels all 8-connected clusters of dark pixels in one pass from top to
+ * bottom. Only the components touching the previous row are kept in memory:
+ * after each row, the components still growing are renumbered, and the ones
+ * which did not reach the row are complete and get passed to closed(). The
+ * pixels of a closed component lie entirely above the current row, so they
+ * may be changed by closed() without disturbing the labeling.
+ * The lightness channel of color images must be up to date, see
+ * requireChannel().
+ *
+ * @param whiteMin pixels with a lightness below this value are dark
+ * @return number of components found
+ */
+int labelComponents(int whiteMin, void (*closed)(struct COMPONENT* component, void* data), void* data, struct IMAGE* image) {
+    struct COMPONENT* components;
+    struct COMPONENT* next;
+    struct COMPONENT* swap;
+    struct COMPONENT* c;
+    int* labels; // labels of the previous row, offset by 1 so that labels[0] and labels[width+1] stay unset
+    int* current; // labels of the current row
+    int* remap;
+    int* swapLabels;
+    int neighbors[4];
+    unsigned char* row;
+    int capacity;
+    int count;
+    int nextCount;
+    int total;
+    int label;
+    int root;
+    int x;
+    int y;
+    int i;
+
+    // a row holds at most (width+1)/2 separate components, plus as many new ones
+    capacity = image->width + 2;
+    components = (struct COMPONENT*)malloc(capacity * sizeof(struct COMPONENT));
+    next = (struct COMPONENT*)malloc(capacity * sizeof(struct COMPONENT));
+    labels = (int*)malloc(capacity * sizeof(int));
+    current = (int*)malloc(capacity * sizeof(int));
+    remap = (int*)malloc(capacity * sizeof(int));
+    for (x = 0; x < capacity; x++) {
+        labels[x] = -1;
+        current[x] = -1;
+    }
+    count = 0;
+    total = 0;
+    for (y = 0; y <= image->height; y++) { // one more row without pixels closes the remaining components
+        for (x = 0; x < image->width; x++) {
+            if (y == image->height) {
+                current[x+1] = -1;
+                continue;
+            }
+            if ( image->packed && ((x & 7) == 0) ) {
+                row = getRow(y, image);
+                if (row[x >> 3] == 0) { // 8 white pixels at once
+                    for (i = x; (i < x + 8) && (i < image->width); i++) {
+                        current[i+1] = -1;
+                    }
+                    x += 7;
+                    continue;
+                }
+            }
+            if (getPixelLightness(x, y, image) >= whiteMin) {
+                current[x+1] = -1;
+                continue;
+            }
+            neighbors[0] = current[x]; // left
+            neighbors[1] = labels[x]; // top-left
+            neighbors[2] = labels[x+1]; // top
+            neighbors[3] = labels[x+2]; // top-right
+            label = -1;
+            for (i = 0; i < 4; i++) {
+                if (neighbors[i] != -1) {
+                    root = findComponent(neighbors[i], components);
+                    if (label == -1) {
+                        label = root;
+                    } else if (root != label) { // two components meet: join them
+                        c = &components[label];
+                        components[root].parent = label;
+                        c->size += components[root].size;
+                        c->bounds[LEFT] = min(c->bounds[LEFT], components[root].bounds[LEFT]);
+                        c->bounds[TOP] = min(c->bounds[TOP], components[root].bounds[TOP]);
+                        c->bounds[RIGHT] = max(c->bounds[RIGHT], components[root].bounds[RIGHT]);
+                    }
+                }
+            }
+            if (label == -1) { // new component
+                label = count++;
+                c = &components[label];
+                c->parent = label;
+                c->size = 0;
+                c->bounds[LEFT] = x;
+                c->bounds[TOP] = y;
+                c->bounds[RIGHT] = x;
+                c->seedX = x;
+                c->seedY = y;
+            }
+            c = &components[label];
+            c->size++;
+            c->bounds[LEFT] = min(c->bounds[LEFT], x);
+            c->bounds[RIGHT] = max(c->bounds[RIGHT], x);
+            c->bounds[BOTTOM] = y;
+            current[x+1] = label;
+        }
+
+        // renumber the components reaching the current row into the next table
+        for (i = 0; i < count; i++) {
+            remap[i] = -1;
+        }
+        nextCount = 0;
+        for (x = 1; x <= image->width; x++) {
+            if (current[x] != -1) {
+                root = findComponent(current[x], components);
+                if (remap[root] == -1) {
+                    remap[root] = nextCount;
+                    next[nextCount] = components[root];
+                    next[nextCount].parent = nextCount;
+                    nextCount++;
+                }
+                current[x] = remap[root];
+            }
+        }
+        // all other roots are complete
+        for (i = 0; i < count; i++) {
+            if ( (components[i].parent == i) && (remap[i] == -1) ) {
+                closed(&components[i], data);
+                total++;
+            }
+        }
+        swap = components;
+        components = next;
+        next = swap;
+        count = nextCount;
+        swapLabels = labels;
+        labels = current;
+        current = swapLabels;
+    }
+    free(components);
+    free(next);
+    free(labels);
+    free(current);
+    free(remap);
+    return total;
+}
+
+
+/**
+ * Clears a complete component found by labelComponents() if it contains no
+ * more than the noisefilter's intensity pixels, see noisefilter().
+ */
+void clearNoise(struct COMPONENT* component, void* data) {
+    struct NOISE_FILTER* filter;
+    struct IMAGE* image;
+    int* stack;
+    int stackCount;
+    int x;
+    int y;
+    int xx;
+    int yy;
+
+    filter = (struct NOISE_FILTER*)data;
+    if ( (component->size > filter->intensity) || (component->bounds[TOP] < filter->first) || (component->bounds[TOP] >= filter->last) ) {
+        return;
+    }
+    // the component is small: trace its pixels again from the seed, clearing them when pushed
+    image = filter->image;
+    stack = filter->stack;
+    clearPixel(component->seedX, component->seedY, image);
+    stack[0] = component->seedX;
+    stack[1] = component->seedY;
+    stackCount = 1;
+    while (stackCount > 0) {
+        stackCount--;
+        x = stack[stackCount * 2];
+        y = stack[stackCount * 2 + 1];
+        for (yy = y - 1; yy <= y + 1; yy++) {
+            for (xx = x - 1; xx <= x + 1; xx++) {
+                if ( (stackCount < filter->intensity) && (getPixelLightness(xx, yy, image) < filter->whiteMin) ) {
+                    clearPixel(xx, yy, image);
+                    stack[stackCount * 2] = xx;
+                    stack[stackCount * 2 + 1] = yy;
+                    stackCount++;
+                }
+            }
+        }
+    }
+    filter->count++;
+}
+
+
+/**
+ * Marks a pixel as filled by a flood-fill, see floodFill().
+ */
+void markFilled(int x, int y, struct FLOOD_FILL* fill) {
+    unsigned char* row;
+
+    row = &fill->visited[y * fill->stride];
+    if (getBit(row, x) == 0) {
+        row[x >> 3] |= 128 >> (x & 7);
+        if (fill->count == 0) {
+            fill->bounds[LEFT] = fill->bounds[RIGHT] = x;
+            fill->bounds[TOP] = fill->bounds[BOTTOM] = y;
+        } else {
+            fill->bounds[LEFT] = min(fill->bounds[LEFT], x);
+            fill->bounds[TOP] = min(fill->bounds[TOP], y);
+            fill->bounds[RIGHT] = max(fill->bounds[RIGHT], x);
+            fill->bounds[BOTTOM] = max(fill->bounds[BOTTOM], y);
+        }
+        fill->count++;
+    }
+}
+
+
+/**
+ * Solidly fills a line of pixels heading towards a specified direction
+ * until color-changes in the pixels to overwrite exceed the 'intensity'
+ * parameter.
+ *
+ * @param stepX either -1 or 1, if stepY is 0, else 0
+ * @param stepY either -1 or 1, if stepX is 0, else 0
+ * @return number of pixels filled
+ */
+int fillLine(int x, int y, int stepX, int stepY, struct FLOOD_FILL* fill, struct IMAGE* image) {
+    int pixel;
+    int distance;
+    int intensityCount;
+    int w, h;
+
+    w = image->width;
+    h = image->height;
+    distance = 0;
+    intensityCount = 1; // first pixel must match, otherwise directly exit
+    while (1==1) { // !
+        x += stepX;
+        y += stepY;
+        pixel = getPixelGrayscale(x, y, image);
+        if ((pixel>=fill->maskMin) && (pixel<=fill->maskMax)) {
+            intensityCount = fill->intensity; // reset counter
+        } else {
+            intensityCount--; // allow maximum of 'intensity' pixels to be bright, until stop
+        }
+        if ((intensityCount > 0) && (x>=0) && (x<w) && (y>=0) && (y<h)) {
+            setPixel(fill->color, x, y, image);
+            markFilled(x, y, fill);
+            distance++;
+        } else {
+            return distance; // exit here
+        }
+    }
+}
+
+
+/**
+ * Fills a 'cross' of pixels (both vertical and horizontal line) around a
+ * pixel, if the pixel is to be filled, and puts the cross onto the
+ * flood-fill's stack.
+ */
+void fillCross(int x, int y, struct FLOOD_FILL* fill, struct IMAGE* image) {
+    struct FILL_CROSS* cross;
+    int pixel;
+
+    if ( (x < 0) || (x >= image->width) || (y < 0) || (y >= image->height) ) {
+        return;
+    }
+    if (getBit(&fill->visited[y * fill->stride], x) != 0) { // has already been filled
+        return;
+    }
+    pixel = getPixelGrayscale(x, y, image);
+    if ((pixel>=fill->maskMin) && (pixel<=fill->maskMax)) {
+        if (fill->stackCount == fill->stackSize) {
+            fill->stackSize = max(fill->stackSize * 2, 256);
+            fill->stack = (struct FILL_CROSS*)realloc(fill->stack, fill->stackSize * sizeof(struct FILL_CROSS));
+        }
+        cross = &fill->stack[fill->stackCount++];
+        cross->x = x;
+        cross->y = y;
+        setPixel(fill->color, x, y, image);
+        markFilled(x, y, fill);
+        cross->distance[LEFT] = fillLine(x, y, -1, 0, fill, image);
+        cross->distance[TOP] = fillLine(x, y, 0, -1, fill, image);
+        cross->distance[RIGHT] = fillLine(x, y, 1, 0, fill, image);
+        cross->distance[BOTTOM] = fillLine(x, y, 0, 1, fill, image);
+        cross->edge = LEFT;
+        cross->d = 0;
+    }
+}
+
+
+/**
+ * Flood-fill an area of pixels, starting at (x,y). Each filled line of
+ * pixels is followed by trying to fill from all pixels on both sides of the
+ * line, depth-first in the same order as a recursive implementation would.
+ * Pixels which have already been filled are not tried again.
+ * The grayscale channel of color images must be up to date, see
+ * requireChannel().
+ *
+ * @param visited bitmap marking filled pixels, one bit per pixel with
+ *                (width+7)/8 bytes per row, or NULL to use a temporary one
+ * @param filled returns the bounding box of the filled pixels, if not NULL
+ * @return number of pixels filled
+ */
+int floodFill(int x, int y, int color, int maskMin, int maskMax, int intensity, unsigned char* visited, int filled[EDGES_COUNT], struct IMAGE* image) {
+    struct FLOOD_FILL fill;
+    struct FILL_CROSS* cross;
+    int pixel;
+    int d;
+    
+    // is current pixel to be filled?
+    pixel = getPixelGrayscale(x, y, image);
+    if (!((pixel>=maskMin) && (pixel<=maskMax))) {
+        return 0;
+    }
+    fill.color = color;
+    fill.maskMin = maskMin;
+    fill.maskMax = maskMax;
+    fill.intensity = intensity;
+    fill.stride = (image->width + 7) >> 3;
+    if (visited != NULL) {
+        fill.visited = visited;
+    } else {
+        fill.visited = (unsigned char*)calloc(fill.stride * image->height, 1);
+    }
+    fill.count = 0;
+    fill.stack = NULL;
+    fill.stackSize = 0;
+    fill.stackCount = 0;
+    fillCross(x, y, &fill, image);
+    while (fill.stackCount > 0) {
+        // next pixel beside one of the lines of the topmost cross
+        cross = &fill.stack[fill.stackCount - 1];
+        while ((cross->edge < EDGES_COUNT) && (cross->d >= 2 * cross->distance[cross->edge])) {
+            cross->edge++;
+            cross->d = 0;
+        }
+        if (cross->edge == EDGES_COUNT) {
+            fill.stackCount--;
+        } else {
+            d = cross->d / 2 + 1; // position on the line, each one has two neighbours
+            x = cross->x;
+            y = cross->y;
+            if (cross->edge == LEFT) {
+                x -= d;
+            } else if (cross->edge == TOP) {
+                y -= d;
+            } else if (cross->edge == RIGHT) {
+                x += d;
+            } else {
+                y += d;
+            }
+            if ((cross->edge == LEFT) || (cross->edge == RIGHT)) {
+                y += ((cross->d & 1) == 0) ? 1 : -1;
+            } else {
+                x += ((cross->d & 1) == 0) ? 1 : -1;
+            }
+            cross->d++;
+            fillCross(x, y, &fill, image); // (may move the stack)
+        }
+    }
+    free(fill.stack);
+    if (visited == NULL) {
+        free(fill.visited);
+    }
+    if (filled != NULL) {
+        filled[LEFT] = fill.bounds[LEFT];
+        filled[TOP] = fill.bounds[TOP];
+        filled[RIGHT] = fill.bounds[RIGHT];
+        filled[BOTTOM] = fill.bounds[BOTTOM];
+    }
+    return fill.count;
+}
+
+
+
+/* --- tool function for file handling ------------------------------------ */
+
+/**
+ * Tests if a file exists.
+ */
+BOOLEAN fileExists(char* filename) {
+    struct stat info;
+
+    return (stat(filename, &info) == 0) ? TRUE : FALSE;
+}
+
+
+/**
+ * Reads the next decimal number from a pnm header, skipping whitespace and
+ * comment lines in front of it.
+ *
+ * @param pos position in data, gets advanced behind the number
+ * @return the number, or -1 if there is no valid number
+ */
+int readHeaderNumber(unsigned char* data, size_t size, size_t* pos) {
+    int number;
+    unsigned char c;
+
+    while ( *pos < size ) {
+        c = data[*pos];
+        if ( c == '#' ) { // skip comment line
+            while ( (*pos < size) && (data[*pos] != '\n') ) {
+                (*pos)++;
+            }
+        } else if ( (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n') || (c == '\v') || (c == '\f') ) {
+            (*pos)++;
+        } else {
+            break;
+        }
+    }
+    if ( (*pos >= size) || (data[*pos] < '0') || (data[*pos] > '9') ) {
+        return -1;
+    }
+    number = 0;
+    while ( (*pos < size) && (data[*pos] >= '0') && (data[*pos] <= '9') ) {
+        if ( number > 100000000 ) { // no image gets this large
+            return -1;
+        }
+        number = number * 10 + (data[*pos] - '0');
+        (*pos)++;
+    }
+    return number;
+}
+
+
+/**
+ * Parses the header of a pnm file held in memory and sets up the image's
+ * size and format. Images with a max color value above 255 get a bitdepth of
+ * 16, their raster data holds two bytes per sample.
+ *
+ * @param pos returns the offset of the raster data behind the header
+ * @param maxColorIndex returns the max color value, 1 for pbm files
+ * @return TRUE on success, FALSE on failure
+ */
+BOOLEAN parseHeader(unsigned char* data, size_t size, struct IMAGE* image, int* type, size_t* pos, int* maxColorIndex) {
+    char magic[3];
+
+    magic[0] = (size > 0) ? data[0] : 0;
+    magic[1] = (size > 1) ? data[1] : 0;
+    magic[2] = 0; // terminate
+    if (strcmp(magic, "P4")==0) {
+        *type = PBM;
+        image->bitdepth = 1;
+        image->color = FALSE;
+    } else if (strcmp(magic, "P5")==0) {
+        *type = PGM;
+        image->bitdepth = 8;
+        image->color = FALSE;
+    } else if (strcmp(magic, "P6")==0) {
+        *type = PPM;
+        image->bitdepth = 8;
+        image->color = TRUE;
+    } else {
+        printf("*** error: input file format using magic '%s' is unknown.\n", magic);
+        return FALSE;
+    }
+
+    // get image info: width, height, optionally depth
+    *pos = 2;
+    image->width = readHeaderNumber(data, size, pos);
+    image->height = readHeaderNumber(data, size, pos);
+    if ( (image->width <= 0) || (image->height <= 0) ) {
+        printf("*** error: invalid image size in header.\n");
+        return FALSE;
+    }
+    if (*type == PBM) {
+        *maxColorIndex = 1;
+        image->stride = (image->width + 7) / 8;
+    } else { // PGM or PPM
+        *maxColorIndex = readHeaderNumber(data, size, pos);
+        if ( (*maxColorIndex <= 0) || (*maxColorIndex > WHITE16) ) {
+            printf("*** error: invalid max color value in header.\n");
+            return FALSE;
+        }
+        if (*maxColorIndex > WHITE) {
+            image->bitdepth = 16;
+        }
+        image->stride = image->width;
+        if (*type == PPM) {
+            image->stride *= 3; // 3 color-components per pixel
+        }
+    }
+    (*pos)++; // skip single whitespace character in front of the raster data
+    return TRUE;
+}
+
+
+/**
+ * Returns the size of the raster data of a pnm file as set up by
+ * parseHeader().
+ */
+size_t rasterSize(struct IMAGE* image) {
+    return (size_t)image->stride * image->height * ((image->bitdepth == 16) ? 2 : 1);
+}
+
+
+/**
+ * Splits the big-endian 16-bit samples of pnm raster data into high and low
+ * bytes, scaling them to the full range of 16 bits.
+ *
+ * @param count number of samples
+ */
+void splitSamples(unsigned char* data, size_t count, int maxColorIndex, unsigned char* high, unsigned char* low) {
+    size_t i;
+    unsigned int v;
+
+    if (maxColorIndex == WHITE16) {
+        for (i = 0; i < count; i++) {
+            high[i] = data[i * 2];
+            low[i] = data[i * 2 + 1];
+        }
+    } else {
+        for (i = 0; i < count; i++) {
+            v = (data[i * 2] << 8) | data[i * 2 + 1];
+            v = (min(v, (unsigned int)maxColorIndex) * WHITE16 + maxColorIndex / 2) / maxColorIndex;
+            high[i] = v >> 8;
+            low[i] = v & 0xff;
+        }
+    }
+}
+
+
+/**
+ * Tests if a filename stands for standard input or output, which carry a
+ * stream of pnm images, one image per page.
+ */
+BOOLEAN isStandardStream(char* filename) {
+    return (strcmp(filename, "-") == 0) ? TRUE : FALSE;
+}
+
+
+/**
+ * Reads from standard input until at least count bytes are buffered behind
+ * the read position, or the input ends. Bytes consumed before get dropped
+ * from the buffer.
+ *
+ * @return the number of bytes buffered, less than count at the end of input
+ */
+size_t fillStandardInput(size_t count, struct STANDARD_INPUT* input) {
+    unsigned char* grown;
+    ssize_t length;
+
+    if (input->pos > 0) {
+        memmove(input->buffer, &input->buffer[input->pos], input->size - input->pos);
+        input->size -= input->pos;
+        input->pos = 0;
+    }
+    if (input->capacity < max(count, INPUT_BLOCK)) {
+        grown = (unsigned char*)realloc(input->buffer, max(count, INPUT_BLOCK));
+        if (grown == NULL) {
+            return input->size;
+        }
+        input->buffer = grown;
+        input->capacity = max(count, INPUT_BLOCK);
+    }
+    while ( (input->size < count) && (!input->end) ) {
+        length = read(STDIN_FILENO, &input->buffer[input->size], input->capacity - input->size);
+        if (length > 0) {
+            input->size += length;
+        } else if ( (length == 0) || (errno != EINTR) ) {
+            input->end = TRUE;
+        }
+    }
+    return input->size;
+}
+
+
+/**
+ * Consumes the next bytes of standard input. What is not buffered yet gets
+ * read directly into target.
+ *
+ * @param target receives the bytes, NULL to skip them
+ * @return the number of bytes consumed, less than length at the end of input
+ */
+size_t readStandardInput(unsigned char* target, size_t length, struct STANDARD_INPUT* input) {
+    size_t done;
+    ssize_t part;
+
+    done = min(length, input->size - input->pos);
+    if (target != NULL) {
+        memcpy(target, &input->buffer[input->pos], done);
+    }
+    input->pos += done;
+    while ( (done < length) && (!input->end) ) {
+        if (target != NULL) {
+            part = read(STDIN_FILENO, &target[done], length - done);
+        } else { // (the buffer is empty now)
+            input->pos = 0;
+            input->size = 0;
+            part = read(STDIN_FILENO, input->buffer, min(length - done, input->capacity));
+        }
+        if (part > 0) {
+            done += part;
+        } else if ( (part == 0) || (errno != EINTR) ) {
+            input->end = TRUE;
+        }
+    }
+    return done;
+}
+
+
+/**
+ * Skips the images of standard input in front of the image of the given
+ * index, and whitespace between images. Images cannot be read twice, so
+ * this fails for images consumed before.
+ *
+ * @return TRUE if the image of the given index follows, FALSE if not
+ */
+BOOLEAN seekStandardInput(int index, struct STANDARD_INPUT* input) {
+    struct IMAGE image;
+    int type;
+    int maxColorIndex;
+    size_t pos;
+    size_t inputSize;
+    unsigned char c;
+
+    while (TRUE) {
+        if (fillStandardInput(MAX_INPUT_HEADER, input) == 0) { // end of input
+            return FALSE;
+        }
+        c = input->buffer[input->pos];
+        if ( (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n') ) {
+            input->pos++;
+        } else if (input->index >= index) {
+            return (input->index == index) ? TRUE : FALSE;
+        } else {
+            if (!parseHeader(&input->buffer[input->pos], input->size - input->pos, &image, &type, &pos, &maxColorIndex)) {
+                input->end = TRUE; // nothing behind a damaged image can be found
+                return FALSE;
+            }
+            inputSize = rasterSize(&image);
+            if (readStandardInput(NULL, pos + inputSize, input) < pos + inputSize) {
+                return FALSE;
+            }
+            input->index++;
+        }
+    }
+}
+
+
+/**
+ * Loads the image of the given index from the pnm images on standard input
+ * into a buffer of its own.
+ *
+ * @return TRUE on success, FALSE on failure
+ */
+BOOLEAN loadStandardInput(int index, struct IMAGE* image, int* type, struct STANDARD_INPUT* input) {
+    size_t pos;
+    size_t inputSize;
+    size_t count;
+    unsigned char mask;
+    unsigned char* data;
+    unsigned char* low;
+    int maxColorIndex;
+    int y;
+
+    if (!seekStandardInput(index, input)) {
+        printf("*** error: standard input ends before image #%d.\n", index + 1);
+        return FALSE;
+    }
+    if (!parseHeader(&input->buffer[input->pos], input->size - input->pos, image, type, &pos, &maxColorIndex)) {
+        input->end = TRUE;
+        return FALSE;
+    }
+    inputSize = rasterSize(image);
+    data = (unsigned char*)poolAlloc(inputSize);
+    input->pos += min(pos, input->size - input->pos); // (the header is buffered completely)
+    count = readStandardInput(data, inputSize, input);
+    input->index++;
+    if (count < inputSize) {
+        printf("*** error: Only %d out of %d could be read.\n", (int)count, (int)inputSize);
+        poolFree(data);
+        image->buffer = NULL;
+        return FALSE;
+    }
+    low = NULL;
+    if (image->bitdepth == 16) { // samples are split into high and low bytes
+        image->buffer = (unsigned char*)poolAlloc(inputSize / 2);
+        low = (unsigned char*)poolAlloc(inputSize / 2);
+        splitSamples(data, inputSize / 2, maxColorIndex, image->buffer, low);
+        poolFree(data);
+    } else {
+        image->buffer = data;
+    }
+    image->packed = (*type == PBM) ? TRUE : FALSE;
+    if ((*type == PBM) && ((image->width & 7) != 0)) { // unused bits at row ends must be zero
+        mask = bitsUntil(image->width - 1);
+        for (y = 0; y < image->height; y++) {
+            image->buffer[y * image->stride + image->stride - 1] &= mask;
+        }
+    }
+    initChannels(image);
+    image->low = low;
+    return TRUE;
+}
+
+
+/**
+ * Tests if a file is a tiff file, by the extension of its name.
+ */
+BOOLEAN isTiffFilename(char* filename) {
+    char* extension;
+
+    extension = strrchr(filename, '.');
+    if (extension == NULL) {
+        return FALSE;
+    }
+    return ( (strcasecmp(extension, ".tif") == 0) || (strcasecmp(extension, ".tiff") == 0) ) ? TRUE : FALSE;
+}
+
+
+/**
+ * Tests if a filename pattern names a single tiff file whose pages are read
+ * or written as a sequence of sheets, which is the case if it contains no
+ * wildcard.
+ */
+BOOLEAN isPagedTiff(char* pattern) {
+    return ( (strchr(pattern, '%') == NULL) && isTiffFilename(pattern) ) ? TRUE : FALSE;
+}
+
+
+/**
+ * Reads an unsigned 16-bit or 32-bit number from a tiff file held in memory.
+ *
+ * @return the number, 0 if it lies beyond the end of the file
+ */
+unsigned int tiffNumber(struct TIFF* tiff, size_t pos, int bytes) {
+    unsigned int n;
+    int i;
+
+    if ( (pos > tiff->size) || (tiff->size - pos < (size_t)bytes) ) {
+        return 0;
+    }
+    n = 0;
+    for (i = 0; i < bytes; i++) {
+        n |= (unsigned int)tiff->data[pos + i] << (8 * (tiff->bigEndian ? bytes - 1 - i : i));
+    }
+    return n;
+}
+
+
+/**
+ * Sets up reading a tiff file held in memory.
+ *
+ * @return TRUE if the data starts with a tiff header, FALSE otherwise
+ */
+BOOLEAN initTiff(unsigned char* data, size_t size, struct TIFF* tiff) {
+    tiff->data = data;
+    tiff->size = size;
+    if ( (size < 8) || (data[0] != data[1]) || ((data[0] != 'I') && (data[0] != 'M')) ) {
+        return FALSE;
+    }
+    tiff->bigEndian = (data[0] == 'M');
+    return (tiffNumber(tiff, 2, 2) == 42) ? TRUE : FALSE;
+}
+
+
+/**
+ * Finds a directory (that is a page) of a tiff file.
+ *
+ * @param directory index of the directory, starting with 0
+ * @return offset of the directory in the file, 0 if there is no such directory
+ */
+size_t findTiffDirectory(int directory, struct TIFF* tiff) {
+    size_t offset;
+    int i;
+
+    offset = tiffNumber(tiff, 4, 4);
+    for (i = 0; (offset != 0) && (i < directory); i++) {
+        offset = tiffNumber(tiff, offset + 2 + 12 * tiffNumber(tiff, offset, 2), 4);
+    }
+    if ( (offset < 8) || (offset + 2 > tiff->size) ) {
+        return 0;
+    }
+    return offset;
+}
+
+
+/**
+ * Reads a value of a field of a tiff directory. Fields of type BYTE, SHORT
+ * and LONG are supported.
+ *
+ * @param index index of the value, for fields with several values
+ * @param value returns the value, unchanged if there is no such value
+ * @return the number of values of the field, 0 if the field is missing
+ */
+unsigned int tiffField(int tag, unsigned int index, unsigned int* value, size_t directory, struct TIFF* tiff) {
+    size_t entry;
+    unsigned int count;
+    unsigned int fieldType;
+    int entries;
+    int bytes;
+    int i;
+
+    entries = tiffNumber(tiff, directory, 2);
+    for (i = 0; i < entries; i++) {
+        entry = directory + 2 + 12 * i;
+        if (tiffNumber(tiff, entry, 2) == (unsigned int)tag) {
+            fieldType = tiffNumber(tiff, entry + 2, 2);
+            count = tiffNumber(tiff, entry + 4, 4);
+            bytes = (fieldType == TIFF_SHORT) ? 2 : ((fieldType == TIFF_LONG) ? 4 : 1);
+            if (index < count) {
+                if ((size_t)count * bytes > 4) { // values stored elsewhere
+                    *value = tiffNumber(tiff, tiffNumber(tiff, entry + 8, 4) + (size_t)index * bytes, bytes);
+                } else {
+                    *value = tiffNumber(tiff, entry + 8 + index * bytes, bytes);
+                }
+            }
+            return count;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Tests if a file exists. For tiff files which are read or written as a
+ * sequence of sheets, the file also needs to have the directory (page) of the
+ * given index. For standard input, the image of the given index needs to
+ * follow.
+ */
+BOOLEAN pageExists(char* filename, int directory) {
+    struct TIFF tiff;
+    struct stat info;
+    unsigned char* data;
+    BOOLEAN exists;
+    int fd;
+
+    if (isStandardStream(filename)) {
+        return seekStandardInput(directory, &standardInput);
+    }
+    if (directory == 0) {
+        return fileExists(filename);
+    }
+    exists = FALSE;
+    fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        return FALSE;
+    }
+    if ( (fstat(fd, &info) == 0) && S_ISREG(info.st_mode) && (info.st_size > 0) ) {
+        data = (unsigned char*)mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            exists = initTiff(data, info.st_size, &tiff) && (findTiffDirectory(directory, &tiff) != 0);
+            munmap(data, info.st_size);
+        }
+    }
+    close(fd);
+    return exists;
+}
+
+
+/**
+ * Decodes a strip of a tiff file compressed with PackBits.
+ *
+ * @return the number of bytes decoded
+ */
+size_t decodePackBits(unsigned char* data, size_t size, unsigned char* target, size_t capacity) {
+    size_t pos;
+    size_t out;
+    size_t count;
+    int n;
+
+    pos = 0;
+    out = 0;
+    while ( (pos < size) && (out < capacity) ) {
+        n = (signed char)data[pos++];
+        if (n >= 0) { // literal bytes
+            count = min(min((size_t)n + 1, size - pos), capacity - out);
+            memcpy(&target[out], &data[pos], count);
+            pos += n + 1;
+            out += count;
+        } else if ( (n != -128) && (pos < size) ) { // repeated byte
+            count = min((size_t)(1 - n), capacity - out);
+            memset(&target[out], data[pos++], count);
+            out += count;
+        }
+    }
+    return out;
+}
+
+
+/**
+ * Decodes a strip of a tiff file compressed with LZW.
+ *
+ * @return the number of bytes decoded
+ */
+size_t decodeLzw(unsigned char* data, size_t size, unsigned char* target, size_t capacity) {
+    unsigned short prefix[LZW_CODES];
+    unsigned short length[LZW_CODES];
+    unsigned char suffix[LZW_CODES];
+    unsigned char first[LZW_CODES];
+    unsigned long long bits;
+    int bitCount;
+    size_t pos;
+    size_t out;
+    int width;
+    int next;
+    int old;
+    int code;
+    int len;
+    int k;
+    int t;
+
+    for (code = 0; code < 256; code++) {
+        suffix[code] = code;
+        first[code] = code;
+        length[code] = 1;
+    }
+    bits = 0;
+    bitCount = 0;
+    pos = 0;
+    out = 0;
+    width = 9;
+    next = LZW_FIRST;
+    old = -1;
+    while (TRUE) {
+        while ( (bitCount < width) && (pos < size) ) {
+            bits = (bits << 8) | data[pos++];
+            bitCount += 8;
+        }
+        if (bitCount < width) { // end of data without end code
+            return out;
+        }
+        bitCount -= width;
+        code = (bits >> bitCount) & ((1 << width) - 1);
+        if (code == LZW_END) {
+            return out;
+        } else if (code == LZW_CLEAR) {
+            width = 9;
+            next = LZW_FIRST;
+            old = -1;
+            continue;
+        } else if (old == -1) { // first code after clearing
+            if ( (code > 255) || (out >= capacity) ) {
+                return out;
+            }
+            target[out++] = code;
+            old = code;
+            continue;
+        } else if ( (code > next) || (next >= LZW_CODES) ) { // invalid
+            return out;
+        }
+        // new code: previous string extended by the first byte of the current one
+        prefix[next] = old;
+        suffix[next] = (code < next) ? first[code] : first[old];
+        first[next] = first[old];
+        length[next] = length[old] + 1;
+        next++;
+        len = length[code];
+        if (out + len > capacity) {
+            return out;
+        }
+        t = code;
+        for (k = len - 1; k >= 0; k--) {
+            target[out + k] = suffix[t];
+            t = prefix[t];
+        }
+        out += len;
+        old = code;
+        if ( (next >= (1 << width) - 1) && (width < LZW_BITS) ) { // (one code early, as all tiff writers do)
+            width++;
+        }
+    }
+}
+
+
+/**
+ * Decodes a strip of a tiff file compressed with Deflate.
+ *
+ * @return the number of bytes decoded
+ */
+size_t decodeDeflate(unsigned char* data, size_t size, unsigned char* target, size_t capacity) {
+    z_stream stream;
+    size_t out;
+
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit(&stream) != Z_OK) {
+        return 0;
+    }
+    stream.next_in = data;
+    stream.avail_in = size;
+    stream.next_out = target;
+    stream.avail_out = capacity;
+    inflate(&stream, Z_FINISH);
+    out = capacity - stream.avail_out;
+    inflateEnd(&stream);
+    return out;
+}
+
+
+/**
+ * Builds the table to look up the run lengths of one color of CCITT fax
+ * codes by the next FAX_PEEK bits.
+ */
+void initFaxTable(const struct FAX_CODE codes[FAX_CODES], short runs[1 << FAX_PEEK], unsigned char lengths[1 << FAX_PEEK]) {
+    int first;
+    int i;
+    int j;
+
+    memset(lengths, 0, 1 << FAX_PEEK);
+    for (i = 0; i < FAX_CODES; i++) {
+        first = codes[i].code << (FAX_PEEK - codes[i].length);
+        for (j = first; j < first + (1 << (FAX_PEEK - codes[i].length)); j++) {
+            runs[j] = codes[i].run;
+            lengths[j] = codes[i].length;
+        }
+    }
+}
+
+
+/**
+ * Returns the next bits of compressed data without consuming them, padded
+ * with zero bits behind the end of the data.
+ */
+int peekFaxBits(int count, struct FAX_READER* reader) {
+    while (reader->bitCount < count) {
+        reader->bits = (reader->bits << 8) | ((reader->pos < reader->size) ? reader->data[reader->pos] : 0);
+        reader->pos++;
+        reader->bitCount += 8;
+    }
+    return (reader->bits >> (reader->bitCount - count)) & ((1 << count) - 1);
+}
+
+
+/**
+ * Reads a run length of CCITT fax codes, made up of any number of make-up
+ * codes and a terminating code.
+ *
+ * @return the run length, or -1 if the data is invalid
+ */
+int readFaxRun(BOOLEAN black, struct FAX_READER* reader) {
+    int total;
+    int run;
+    int bits;
+
+    total = 0;
+    do {
+        bits = peekFaxBits(FAX_PEEK, reader);
+        if (reader->lengths[black][bits] == 0) {
+            return -1;
+        }
+        run = reader->runs[black][bits];
+        reader->bitCount -= reader->lengths[black][bits];
+        total += run;
+    } while (run >= 64);
+    return total;
+}
+
+
+/**
+ * Finds the changing element b1 of the reference row in CCITT Group 4
+ * coding: the first change to the right of a0 to the opposite of the color
+ * at a0. Changes at even indices are changes to black.
+ *
+ * @param index position to start searching from, returns the position of b1
+ */
+int findFaxReference(int a0, BOOLEAN black, int* reference, int* index) {
+    int i;
+
+    i = *index;
+    while ( (i > 0) && (reference[i - 1] > a0) ) {
+        i--;
+    }
+    while (reference[i] <= a0) {
+        i++;
+    }
+    if ((i & 1) != (black ? 1 : 0)) {
+        i++;
+    }
+    *index = i;
+    return reference[i];
+}
+
+
+/**
+ * Decodes a strip of a tiff file compressed with CCITT Group 4 (T.6) into
+ * packed 1-bit rows, with set bits for black. Each strip is coded on its own,
+ * starting from a white row above it.
+ *
+ * @return the number of rows decoded
+ */
+int decodeG4(unsigned char* data, size_t size, int width, int rows, int stride, unsigned char* target) {
+    struct FAX_READER reader;
+    int* reference;
+    int* changes;
+    int* swap;
+    int count;
+    int index;
+    int a0;
+    int a1;
+    int b1;
+    int r1;
+    int r2;
+    int mode;
+    int y;
+    int i;
+    BOOLEAN black;
+    BOOLEAN valid;
+
+    reader.data = data;
+    reader.size = size;
+    reader.pos = 0;
+    reader.bits = 0;
+    reader.bitCount = 0;
+    initFaxTable(FAX_WHITE, reader.runs[0], reader.lengths[0]);
+    initFaxTable(FAX_BLACK, reader.runs[1], reader.lengths[1]);
+    reference = (int*)malloc((width + 8) * sizeof(int));
+    changes = (int*)malloc((width + 8) * sizeof(int));
+    for (i = 0; i < 4; i++) { // no changes in the white row above
+        reference[i] = width;
+    }
+    valid = TRUE;
+    for (y = 0; valid && (y < rows); y++) {
+        a0 = -1;
+        black = FALSE;
+        count = 0;
+        index = 0;
+        while ( valid && (a0 < width) ) {
+            if ( (reader.pos > size + 4) || (count > width) ) { // behind the end of the data, or no valid row
+                valid = FALSE;
+                break;
+            }
+            b1 = findFaxReference(a0, black, reference, &index);
+            mode = peekFaxBits(7, &reader);
+            if (mode >= 64) { // 1: vertical 0
+                reader.bitCount -= 1;
+                mode = 0;
+            } else if (mode >= 16) { // 011, 010: vertical +1, -1, 001: horizontal
+                reader.bitCount -= 3;
+                mode = (mode >= 48) ? 1 : ((mode >= 32) ? -1 : FAX_HORIZONTAL);
+            } else if (mode >= 8) { // 0001: pass
+                reader.bitCount -= 4;
+                mode = FAX_PASS;
+            } else if (mode >= 4) { // 000011, 000010: vertical +2, -2
+                reader.bitCount -= 6;
+                mode = (mode >= 6) ? 2 : -2;
+            } else if (mode >= 2) { // 0000011, 0000010: vertical +3, -3
+                reader.bitCount -= 7;
+                mode = (mode == 3) ? 3 : -3;
+            } else { // extensions and the end of data are not expected inside a row
+                valid = FALSE;
+                break;
+            }
+            if (mode == FAX_PASS) {
+                a0 = reference[index + 1]; // b2
+            } else if (mode == FAX_HORIZONTAL) {
+                r1 = readFaxRun(black, &reader);
+                r2 = readFaxRun(!black, &reader);
+                if ( (r1 < 0) || (r2 < 0) ) {
+                    valid = FALSE;
+                    break;
+                }
+                a1 = min(max(a0, 0) + r1, width);
+                a0 = min(a1 + r2, width);
+                changes[count++] = a1;
+                changes[count++] = a0;
+            } else { // vertical
+                a1 = b1 + mode;
+                if ( (a1 < max(a0, 0)) || (a1 > width) ) {
+                    valid = FALSE;
+                    break;
+                }
+                changes[count++] = a1;
+                a0 = a1;
+                black = !black;
+            }
+        }
+        if (valid) {
+            for (i = count; i < count + 4; i++) {
+                changes[i] = width;
+            }
+            memset(&target[y * stride], 0, stride);
+            for (i = 0; i < count; i += 2) {
+                fillBits(&target[y * stride], changes[i], changes[i + 1] - changes[i], TRUE);
+            }
+            swap = reference;
+            reference = changes;
+            changes = swap;
+        }
+    }
+    free(reference);
+    free(changes);
+    return valid ? rows : y - 1;
+}
+
+
+/**
+ * Loads a directory (that is a page) of a tiff file held in memory.
+ * Uncompressed, PackBits, LZW and Deflate compressed strips are supported,
+ * and CCITT Group 4 for black-and-white images, with 1 bit per pixel or 8 bits
+ * per sample.
+ *
+ * @param type returns the type of the loaded image: PBM, PGM or PPM
+ * @return TRUE on success, FALSE on failure
+ */
+BOOLEAN loadTiff(char* filename, int directory, struct IMAGE* image, int* type, struct TIFF* tiff) {
+    size_t ifd;
+    unsigned int width;
+    unsigned int height;
+    unsigned int bits;
+    unsigned int samples;
+    unsigned int compression;
+    unsigned int photometric;
+    unsigned int rowsPerStrip;
+    unsigned int planar;
+    unsigned int predictor;
+    unsigned int fillOrder;
+    unsigned int strips;
+    unsigned int offset;
+    unsigned int count;
+    unsigned char* data;
+    unsigned char* reversed;
+    unsigned char* strip;
+    unsigned char* row;
+    size_t expected;
+    size_t decoded;
+    unsigned int s;
+    int rows;
+    int y;
+    int x;
+    BOOLEAN success;
+
+    ifd = findTiffDirectory(directory, tiff);
+    if (ifd == 0) {
+        printf("*** error: tiff file %s has no page %d.\n", filename, directory + 1);
+        return FALSE;
+    }
+    width = height = photometric = 0;
+    bits = samples = compression = planar = predictor = fillOrder = 1;
+    tiffField(TIFF_IMAGE_WIDTH, 0, &width, ifd, tiff);
+    tiffField(TIFF_IMAGE_LENGTH, 0, &height, ifd, tiff);
+    tiffField(TIFF_BITS_PER_SAMPLE, 0, &bits, ifd, tiff);
+    tiffField(TIFF_COMPRESSION, 0, &compression, ifd, tiff);
+    tiffField(TIFF_PHOTOMETRIC, 0, &photometric, ifd, tiff);
+    tiffField(TIFF_FILL_ORDER, 0, &fillOrder, ifd, tiff);
+    tiffField(TIFF_SAMPLES_PER_PIXEL, 0, &samples, ifd, tiff);
+    rowsPerStrip = height;
+    tiffField(TIFF_ROWS_PER_STRIP, 0, &rowsPerStrip, ifd, tiff);
+    tiffField(TIFF_PLANAR_CONFIGURATION, 0, &planar, ifd, tiff);
+    tiffField(TIFF_PREDICTOR, 0, &predictor, ifd, tiff);
+    strips = tiffField(TIFF_STRIP_OFFSETS, 0, &offset, ifd, tiff);
+
+    if ( (width == 0) || (height == 0) || (width > 100000) || (height > 100000) ) {
+        printf("*** error: invalid image size in tiff file %s.\n", filename);
+        return FALSE;
+    }
+    if ( (bits == 1) && (samples == 1) && (photometric <= 1) ) {
+        *type = PBM;
+    } else if ( (bits == 8) && (samples == 1) && (photometric <= 1) ) {
+        *type = PGM;
+    } else if ( (bits == 8) && (samples == 3) && (photometric == 2) && (planar == 1) ) {
+        *type = PPM;
+    } else {
+        printf("*** error: tiff file %s: only black-and-white, 8-bit grayscale and 8-bit rgb images are supported.\n", filename);
+        return FALSE;
+    }
+    if ( (strips == 0) || (rowsPerStrip == 0) || (predictor > 2) || ((compression != TIFF_UNCOMPRESSED) && (compression != TIFF_PACKBITS) && (compression != TIFF_LZW)
+         && (compression != TIFF_DEFLATE) && (compression != TIFF_OLD_DEFLATE) && ((compression != TIFF_CCITT_G4) || (*type != PBM))) ) {
+        printf("*** error: tiff file %s: compression %u, predictor %u or a tiled layout is not supported.\n", filename, compression, predictor);
+        return FALSE;
+    }
+
+    // decode strips right into the image's rows
+    if (*type == PBM) {
+        initPackedImage(image, width, height, WHITE);
+    } else {
+        initImage(image, width, height, 8, (*type == PPM), WHITE);
+    }
+    reversed = NULL;
+    success = TRUE;
+    for (s = 0; success && (s < strips) && ((size_t)s * rowsPerStrip < height); s++) {
+        rows = min(rowsPerStrip, height - s * rowsPerStrip);
+        strip = getRow(s * rowsPerStrip, image);
+        expected = (size_t)rows * image->stride;
+        offset = count = 0;
+        tiffField(TIFF_STRIP_OFFSETS, s, &offset, ifd, tiff);
+        tiffField(TIFF_STRIP_BYTE_COUNTS, s, &count, ifd, tiff);
+        if ( (offset > tiff->size) || (count > tiff->size - offset) ) {
+            success = FALSE;
+            break;
+        }
+        data = &tiff->data[offset];
+        if (fillOrder == 2) { // least significant bit first
+            reversed = (unsigned char*)realloc(reversed, max(count, 1));
+            for (x = 0; x < (int)count; x++) {
+                reversed[x] = BIT_REVERSE[data[x]];
+            }
+            data = reversed;
+        }
+        switch (compression) {
+            case TIFF_UNCOMPRESSED:
+                decoded = min(count, expected);
+                memcpy(strip, data, decoded);
+                break;
+            case TIFF_PACKBITS:
+                decoded = decodePackBits(data, count, strip, expected);
+                break;
+            case TIFF_LZW:
+                decoded = decodeLzw(data, count, strip, expected);
+                break;
+            case TIFF_CCITT_G4:
+                decoded = (size_t)decodeG4(data, count, width, rows, image->stride, strip) * image->stride;
+                break;
+            default: // Deflate
+                decoded = decodeDeflate(data, count, strip, expected);
+        }
+        success = (decoded == expected);
+        for (y = 0; success && (y < rows); y++) {
+            row = &strip[y * image->stride];
+            if (predictor == 2) { // horizontal differencing
+                for (x = samples; x < image->stride; x++) {
+                    row[x] += row[x - samples];
+                }
+            }
+            if ( (photometric == 1) && (*type == PBM) ) { // black is 0, unlike in pbm
+                for (x = 0; x < image->stride; x++) {
+                    row[x] = ~row[x];
+                }
+            } else if ( (photometric == 0) && (*type == PGM) ) { // white is 0
+                for (x = 0; x < image->stride; x++) {
+                    row[x] = WHITE - row[x];
+                }
+            }
+            if (*type == PBM) { // unused bits at row ends must be zero
+                row[image->stride - 1] &= bitsUntil(width - 1);
+            }
+        }
+    }
+    free(reversed);
+    if (!success) {
+        printf("*** error: tiff file %s is damaged.\n", filename);
+        freeImage(image);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+/**
+ * Loads image data from a file in pnm or tiff format.
+ *
+ * A pnm file is mapped into memory copy-on-write, and the image's buffer
+ * points directly at the raster data behind the header, so that no copy is
+ * made unless the image gets modified. Files which cannot be mapped (e.g.
+ * pipes) are read into memory instead. Pages of tiff files are decoded into
+ * a buffer of their own, see loadTiff(), like the images read from standard
+ * input, see loadStandardInput().
+ *
+ * @param filename name of file to load, '-' for standard input
+ * @param directory index of the page to load from a tiff file or standard input
+ * @param image structure to hold loaded image
+ * @param type returns the type of the loaded image
+ * @return TRUE on success, FALSE on failure
+ */
+BOOLEAN loadImage(char* filename, int directory, struct IMAGE* image, int* type) {
+    int fd;
+    struct stat info;
+    struct TIFF tiff;
+    unsigned char* data;
+    unsigned char* grown;
+    size_t fileSize;
+    size_t capacity;
+    size_t pos;
+    size_t inputSize;
+    ssize_t count;
+    BOOLEAN mapped;
+    BOOLEAN success;
+    unsigned char mask;
+    unsigned char* last;
+    unsigned char* low;
+    int maxColorIndex;
+    int y;
+
+    if (verbose>=VERBOSE_MORE) {
+        printf("loading file %s.\n", filename);
+    }
+    if (isStandardStream(filename)) {
+        return loadStandardInput(directory, image, type, &standardInput);
+    }
+
+    // open input file
+    fd = open(filename, O_RDONLY);
+    if ( (fd == -1) || (fstat(fd, &info) != 0) ) {
+        printf("*** error: Unable to open file %s.\n", filename);
+        if (fd != -1) {
+            close(fd);
+        }
+        return FALSE;
+    }
+
+    // map whole file, private so that the image can be modified in place
+    fileSize = info.st_size;
+    data = MAP_FAILED;
+    if ( S_ISREG(info.st_mode) && (fileSize > 0) ) {
+        data = (unsigned char*)mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    mapped = (data != MAP_FAILED);
+    if ( ! mapped ) { // read until end of file instead
+        capacity = (fileSize > 0) ? fileSize : 1 << 16;
+        data = (unsigned char*)malloc(capacity);
+        fileSize = 0;
+        while ( (count = read(fd, &data[fileSize], capacity - fileSize)) > 0 ) {
+            fileSize += count;
+            if ( fileSize == capacity ) {
+                capacity *= 2;
+                grown = (unsigned char*)realloc(data, capacity);
+                if (grown == NULL) {
+                    break;
+                }
+                data = grown;
+            }
+        }
+    }
+    close(fd);
+
+    if (initTiff(data, fileSize, &tiff)) {
+        success = loadTiff(filename, directory, image, type, &tiff);
+        if (mapped) {
+            munmap(data, fileSize);
+        } else {
+            free(data);
+        }
+        return success;
+    }
+
+    success = parseHeader(data, fileSize, image, type, &pos, &maxColorIndex);
+    if (success) {
+        inputSize = rasterSize(image);
+        if ( (pos > fileSize) || (fileSize - pos < inputSize) ) {
+            printf("*** error: Only %d out of %d could be read.\n", (pos > fileSize) ? 0 : (int)(fileSize - pos), (int)inputSize);
+            success = FALSE;
+        }
+    }
+    if ( ! success ) {
+        if (mapped) {
+            munmap(data, fileSize);
+        } else {
+            free(data);
+        }
+        return FALSE;
+    }
+
+    low = NULL;
+    if (image->bitdepth == 16) { // samples are split into high and low bytes
+        image->buffer = (unsigned char*)poolAlloc(inputSize / 2);
+        low = (unsigned char*)poolAlloc(inputSize / 2);
+        splitSamples(&data[pos], inputSize / 2, maxColorIndex, image->buffer, low);
+        if (mapped) {
+            munmap(data, fileSize);
+            mapped = FALSE;
+        } else {
+            free(data);
+        }
+    } else if (mapped) {
+        image->buffer = &data[pos];
+    } else { // move raster data into a buffer of its own
+        image->buffer = (unsigned char*)poolAlloc(inputSize);
+        memcpy(image->buffer, &data[pos], inputSize);
+        free(data);
+    }
+    image->packed = (*type == PBM) ? TRUE : FALSE; // b&w is kept packed for processing
+    if ((*type == PBM) && ((image->width & 7) != 0)) { // unused bits at row ends must be zero
+        mask = bitsUntil(image->width - 1);
+        for (y = 0; y < image->height; y++) {
+            last = &image->buffer[y * image->stride + image->stride - 1];
+            if ( (*last & ~mask) != 0 ) { // only touch mapped pages which need it
+                *last &= mask;
+            }
+        }
+    }
+
+    initChannels(image); // grayscale, lightness and darknessInverse of color images are calculated when needed
+    image->low = low;
+    if (mapped) {
+        image->mapping = data;
+        image->mappingSize = fileSize;
+        image->mappingDevice = info.st_dev;
+        image->mappingInode = info.st_ino;
+    }
+    
+    return TRUE;
+}
+
+
+/**
+ * Writes all parts of data to a file, continuing after partial writes.
+ *
+ * @return TRUE on success, FALSE on a write error
+ */
+BOOLEAN writeParts(int fd, struct iovec* parts, int count) {
+    ssize_t written;
+
+    while (count > 0) {
+        written = writev(fd, parts, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return FALSE;
+        }
+        while ( (count > 0) && ((size_t)written >= parts->iov_len) ) {
+            written -= parts->iov_len;
+            parts++;
+            count--;
+        }
+        if (count > 0) {
+            parts->iov_base = (char*)parts->iov_base + written;
+            parts->iov_len -= written;
+        }
+    }
+    return TRUE;
+}
+
+
+/**
+ * Prepares writing to an opened file through writeOutput().
+ */
+void initOutput(int fd, struct OUTPUT_FILE* file) {
+    file->fd = fd;
+    file->buffer = (unsigned char*)poolAlloc(OUTPUT_BLOCK);
+    file->pending = 0;
+    file->offset = 0;
+    file->success = TRUE;
+}
+
+
+/**
+ * Writes data to an output file. Small pieces are collected in the file's
+ * buffer, larger ones are written in one call together with what has been
+ * collected so far. Write errors are reported by closeOutput().
+ */
+void writeOutput(unsigned char* data, int length, struct OUTPUT_FILE* file) {
+    struct iovec parts[2];
+
+    file->offset += length;
+    if (length < OUTPUT_BLOCK - file->pending) {
+        memcpy(&file->buffer[file->pending], data, length);
+        file->pending += length;
+    } else {
+        parts[0].iov_base = file->buffer;
+        parts[0].iov_len = file->pending;
+        parts[1].iov_base = data;
+        parts[1].iov_len = length;
+        if ( file->success && (!writeParts(file->fd, parts, 2)) ) {
+            file->success = FALSE;
+        }
+        file->pending = 0;
+    }
+}
+
+
+/**
+ * Overwrites data at an earlier position of an output file, after writing
+ * what has been collected so far.
+ */
+void patchOutput(size_t position, unsigned char* data, int length, struct OUTPUT_FILE* file) {
+    struct iovec part;
+
+    part.iov_base = file->buffer;
+    part.iov_len = file->pending;
+    if ( file->success && (!writeParts(file->fd, &part, 1)) ) {
+        file->success = FALSE;
+    }
+    file->pending = 0;
+    if ( file->success && (pwrite(file->fd, data, length, position) != length) ) {
+        file->success = FALSE;
+    }
+}
+
+
+/**
+ * Writes what is left of an output file and closes it. A file written under
+ * a temporary name is synced to disk and renamed to its own name now, so that
+ * it replaces an existing file at once, even after a crash, or gets removed
+ * if it could not be written.
+ *
+ * @return TRUE on success, FALSE if writing the file has failed
+ */
+BOOLEAN closeOutput(struct OUTPUT_FILE* file) {
+    struct iovec part;
+
+    part.iov_base = file->buffer;
+    part.iov_len = file->pending;
+    if ( file->success && (!writeParts(file->fd, &part, 1)) ) {
+        file->success = FALSE;
+    }
+    if ( file->success && (file->filename[0] != 0) && (fsync(file->fd) != 0) ) { // the data must be stored before the name refers to it
+        file->success = FALSE;
+    }
+    if (close(file->fd) != 0) { // network file systems may report write errors only now
+        file->success = FALSE;
+    }
+    poolFree(file->buffer);
+    if (file->filename[0] != 0) {
+        if ( file->success && (rename(file->temporaryFilename, file->filename) != 0) ) {
+            file->success = FALSE;
+        }
+        if (!file->success) {
+            unlink(file->temporaryFilename);
+        }
+    }
+    return file->success;
+}
+
+
+/**
+ * Writes the header of a pnm file.
+ *
+ * @param maxColorIndex max color value of pgm and ppm files, WHITE16 for 16-bit samples
+ */
+void writeHeader(int type, int width, int height, int maxColorIndex, struct OUTPUT_FILE* file) {
+    char header[MAX_HEADER];
+    char* outputMagic;
+    int length;
+
+    switch (type) {
+        case PBM:
+            outputMagic = "P4";
+            break;
+        case PPM:
+            outputMagic = "P6";
+            break;
+        default: // PGM
+            outputMagic = "P5";
+            break;
+    }
+    length = sprintf(header, "%s\n# generated by unpaper\n%u %u\n", outputMagic, width, height);
+    if ((type == PGM)||(type == PPM)) {
+        length += sprintf(&header[length], "%d\n", maxColorIndex); // maximum color index per color-component
+    }
+    writeOutput((unsigned char*)header, length, file);
+}
+
+
+/**
+ * Creates an output file. A regular file is written under a temporary name in
+ * the same directory and replaces the file of the given name when closed, see
+ * closeOutput(). Symbolic links are followed, the file they point to gets
+ * replaced. Other files, like devices or files with several hard links,
+ * are written in place, and so is standard output, named '-'.
+ *
+ * @param image the image to be written, if its buffer is mapped from the file
+ *              to write in place, it is copied before the file is truncated
+ * @return TRUE on success, FALSE if the file already exists or cannot be created
+ */
+BOOLEAN createOutputFile(char* filename, BOOLEAN overwrite, struct IMAGE* image, struct OUTPUT_FILE* file) {
+    struct stat info;
+    char resolved[PATH_MAX];
+    char* name;
+    BOOLEAN exists;
+    BOOLEAN replace;
+    int fd;
+    int i;
+
+    if (isStandardStream(filename)) { // images follow each other
+        file->filename[0] = 0;
+        fd = dup(standardOutput); // (closed by closeOutput())
+        if (fd == -1) {
+            printf("*** error: Cannot write to standard output.\n");
+            return FALSE;
+        }
+        initOutput(fd, file);
+        return TRUE;
+    }
+    if ( (!overwrite) && fileExists(filename) ) {
+        printf("file %s already exists (use --overwrite to replace).\n", filename);
+        return FALSE;
+    }
+    file->filename[0] = 0;
+    name = (realpath(filename, resolved) != NULL) ? resolved : filename; // (fails for files not existing yet)
+    exists = (stat(name, &info) == 0);
+    if (exists) {
+        replace = S_ISREG(info.st_mode) && (info.st_nlink == 1); // (replacing a file with several links would separate them)
+    } else {
+        replace = (lstat(filename, &info) != 0); // a dangling symbolic link is written through
+    }
+    fd = -1;
+    if ( replace && (strlen(name) + 32 < sizeof(file->temporaryFilename)) ) {
+        for (i = 0; (fd == -1) && (i < 100); i++) { // (another thread or process may use the same name)
+            sprintf(file->temporaryFilename, "%s.%d-%d.tmp", name, (int)getpid(), i);
+            fd = open(file->temporaryFilename, O_WRONLY | O_CREAT | O_EXCL, 0666);
+            if ( (fd == -1) && (errno != EEXIST) ) {
+                break;
+            }
+        }
+        if (fd != -1) {
+            strcpy(file->filename, name);
+            if (exists) { // keep the owner and permissions of the file replaced, as far as allowed
+                if (fchown(fd, info.st_uid, info.st_gid) == 0) {
+                    fchmod(fd, info.st_mode & 07777);
+                } else { // (only root may give files away) no set-id bits for another owner
+                    fchmod(fd, info.st_mode & 0777);
+                }
+            }
+        }
+    }
+    if (fd == -1) { // no temporary file possible, write in place
+        if ( (image->mapping != NULL) && (stat(filename, &info) == 0) && (info.st_dev == image->mappingDevice) && (info.st_ino == image->mappingInode) ) {
+            if (!detachMapping(image)) { // truncating the mapped input file would take away the image while it is written
+                printf("*** error: Cannot copy input file '%s' before overwriting it.\n", filename);
+                return FALSE;
+            }
+        }
+        fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+    if (fd == -1) {
+        printf("*** error: Cannot open output file '%s'.\n", filename);
+        return FALSE;
+    }
+    initOutput(fd, file);
+    return TRUE;
+}
+
+
+/**
+ * Creates a pnm file and writes its header, so that the pixel data can be
+ * written next, see createOutputFile().
+ *
+ * @return TRUE on success, FALSE if the file already exists or cannot be created
+ */
+BOOLEAN createImageFile(char* filename, int type, int width, int height, BOOLEAN overwrite, struct IMAGE* image, struct OUTPUT_FILE* file) {
+    if (!createOutputFile(filename, overwrite, image, file)) {
+        return FALSE;
+    }
+    writeHeader(type, width, height, (image->low != NULL) ? WHITE16 : WHITE, file);
+    return TRUE;
+}
+
+
+/**
+ * Stores an unsigned 16-bit or 32-bit number in the byte order of a tiff
+ * file.
+ */
+void putTiffNumber(unsigned char* target, unsigned int value, int bytes, BOOLEAN bigEndian) {
+    int i;
+
+    for (i = 0; i < bytes; i++) {
+        target[i] = value >> (8 * (bigEndian ? bytes - 1 - i : i));
+    }
+}
+
+
+/**
+ * Stores an entry of a tiff directory. Single SHORT and LONG values are
+ * stored inside the entry, for several values value is their offset.
+ */
+void putTiffField(unsigned char* entry, int tag, int fieldType, unsigned int count, unsigned int value, BOOLEAN bigEndian) {
+    putTiffNumber(entry, tag, 2, bigEndian);
+    putTiffNumber(&entry[2], fieldType, 2, bigEndian);
+    putTiffNumber(&entry[4], count, 4, bigEndian);
+    memset(&entry[8], 0, 4);
+    if ( (fieldType == TIFF_SHORT) && (count == 1) ) { // (left-justified)
+        putTiffNumber(&entry[8], value, 2, bigEndian);
+    } else {
+        putTiffNumber(&entry[8], value, 4, bigEndian);
+    }
+}
+
+
+/**
+ * Passes the compressed data collected by a tiff encoder on to the output
+ * file.
+ */
+void flushEncoder(struct TIFF_ENCODER* encoder) {
+    writeOutput(encoder->buffer, encoder->pending, encoder->file);
+    encoder->pending = 0;
+}
+
+
+/**
+ * Appends bits of compressed data, most significant bit first.
+ *
+ * @param count number of bits, at most 16
+ */
+void putBits(unsigned int value, int count, struct TIFF_ENCODER* encoder) {
+    encoder->bits = (encoder->bits << count) | value;
+    encoder->bitCount += count;
+    while (encoder->bitCount >= 8) {
+        encoder->bitCount -= 8;
+        if (encoder->pending == TIFF_BLOCK) {
+            flushEncoder(encoder);
+        }
+        encoder->buffer[encoder->pending++] = encoder->bits >> encoder->bitCount;
+    }
+}
+
+
+/**
+ * Fills up the last byte of compressed data with zero bits.
+ */
+void finishBits(struct TIFF_ENCODER* encoder) {
+    if (encoder->bitCount > 0) {
+        putBits(0, 8 - encoder->bitCount, encoder);
+    }
+}
+
+
+/**
+ * Finds the changing elements of a packed 1-bit row: the pixels which differ
+ * in color from the pixel to their left, starting with white. Whole bytes of
+ * the current color are skipped.
+ *
+ * @param changes returns the positions of the changes, followed by 4 times
+ *                the width, room for width + 4 entries
+ */
+void findChanges(unsigned char* row, int width, int* changes) {
+    BOOLEAN black;
+    int count;
+    int x;
+
+    black = FALSE;
+    count = 0;
+    x = 0;
+    while (x < width) {
+        if ( ((x & 7) == 0) && (row[x >> 3] == (black ? 0xff : 0x00)) ) {
+            x += 8;
+        } else {
+            if ((getBit(row, x) != 0) != black) {
+                changes[count++] = x;
+                black = !black;
+            }
+            x++;
+        }
+    }
+    for (x = count; x < count + 4; x++) {
+        changes[x] = width;
+    }
+}
+
+
+/**
+ * Appends the CCITT fax codes of a run length: make-up codes for multiples
+ * of 64 pixels, followed by a terminating code.
+ */
+void putFaxRun(int run, BOOLEAN black, struct TIFF_ENCODER* encoder) {
+    const struct FAX_CODE* codes;
+
+    codes = black ? FAX_BLACK : FAX_WHITE;
+    while (run >= 2560 + 64) { // longest make-up code
+        putBits(codes[FAX_CODES - 1].code, codes[FAX_CODES - 1].length, encoder);
+        run -= 2560;
+    }
+    if (run >= 64) {
+        putBits(codes[63 + run / 64].code, codes[63 + run / 64].length, encoder);
+        run &= 63;
+    }
+    putBits(codes[run].code, codes[run].length, encoder);
+}
+
+
+/**
+ * Compresses a packed 1-bit row with CCITT Group 4 (T.6), relative to the
+ * row above it.
+ */
+void encodeG4Row(unsigned char* row, struct TIFF_ENCODER* encoder) {
+    int* reference;
+    int* changes;
+    int current;
+    int index;
+    int a0;
+    int a1;
+    int a2;
+    int b1;
+    int b2;
+    BOOLEAN black;
+
+    reference = encoder->reference;
+    changes = encoder->changes;
+    findChanges(row, encoder->width, changes);
+    a0 = -1;
+    black = FALSE;
+    current = 0;
+    index = 0;
+    while (a0 < encoder->width) {
+        while (changes[current] <= a0) {
+            current++;
+        }
+        a1 = changes[current];
+        b1 = findFaxReference(a0, black, reference, &index);
+        b2 = reference[index + 1];
+        if (b2 < a1) { // pass mode
+            putBits(1, 4, encoder);
+            a0 = b2;
+        } else if (abs(a1 - b1) <= 3) { // vertical mode
+            putBits(FAX_VERTICAL[a1 - b1 + 3].code, FAX_VERTICAL[a1 - b1 + 3].length, encoder);
+            a0 = a1;
+            black = !black;
+        } else { // horizontal mode
+            a2 = changes[current + 1];
+            putBits(1, 3, encoder);
+            putFaxRun(a1 - max(a0, 0), black, encoder);
+            putFaxRun(a2 - a1, !black, encoder);
+            a0 = a2;
+        }
+    }
+    encoder->reference = changes;
+    encoder->changes = reference;
+}
+
+
+/**
+ * Empties the string table of the LZW encoder.
+ */
+void resetLzw(struct TIFF_ENCODER* encoder) {
+    memset(encoder->lzwCodes, 0xff, sizeof(encoder->lzwCodes)); // (-1)
+    encoder->lzwNext = LZW_FIRST;
+    encoder->lzwWidth = 9;
+}
+
+
+/**
+ * Counts a new entry of the LZW string table, and widens the codes or
+ * starts over with an empty table when needed, the same way as libtiff does.
+ */
+void addLzwCode(struct TIFF_ENCODER* encoder) {
+    encoder->lzwNext++;
+    if (encoder->lzwNext == LZW_CODES - 2) { // table full
+        putBits(LZW_CLEAR, encoder->lzwWidth, encoder);
+        resetLzw(encoder);
+    } else if (encoder->lzwNext >= (1 << encoder->lzwWidth)) {
+        encoder->lzwWidth++;
+    }
+}
+
+
+/**
+ * Compresses data with LZW. Strings are looked up in a hash table of the
+ * string's prefix code and last byte.
+ */
+void encodeLzw(unsigned char* data, int length, struct TIFF_ENCODER* encoder) {
+    unsigned int key;
+    int prefix;
+    int step;
+    int h;
+    int i;
+
+    prefix = encoder->lzwPrefix;
+    for (i = 0; i < length; i++) {
+        if (prefix == -1) {
+            prefix = data[i];
+            continue;
+        }
+        key = (prefix << 8) | data[i];
+        h = (data[i] << 5) ^ prefix;
+        step = (h == 0) ? 1 : LZW_HASH - h;
+        while ( (encoder->lzwCodes[h] != -1) && (encoder->lzwKeys[h] != key) ) {
+            h -= step;
+            if (h < 0) {
+                h += LZW_HASH;
+            }
+        }
+        if (encoder->lzwCodes[h] != -1) { // string known, try to extend it
+            prefix = encoder->lzwCodes[h];
+        } else {
+            putBits(prefix, encoder->lzwWidth, encoder);
+            encoder->lzwCodes[h] = encoder->lzwNext;
+            encoder->lzwKeys[h] = key;
+            addLzwCode(encoder);
+            prefix = data[i];
+        }
+    }
+    encoder->lzwPrefix = prefix;
+}
+
+
+/**
+ * Compresses data with Deflate.
+ *
+ * @param flush Z_NO_FLUSH, or Z_FINISH for the end of the data
+ */
+void encodeDeflate(unsigned char* data, int length, int flush, struct TIFF_ENCODER* encoder) {
+    int status;
+
+    encoder->stream.next_in = data;
+    encoder->stream.avail_in = length;
+    do {
+        if (encoder->pending == TIFF_BLOCK) {
+            flushEncoder(encoder);
+        }
+        encoder->stream.next_out = &encoder->buffer[encoder->pending];
+        encoder->stream.avail_out = TIFF_BLOCK - encoder->pending;
+        status = deflate(&encoder->stream, flush);
+        encoder->pending = TIFF_BLOCK - encoder->stream.avail_out;
+    } while ( (status == Z_OK) && ((encoder->stream.avail_in > 0) || (flush == Z_FINISH)) );
+}
+
+
+/**
+ * Sets up compressing the rows of a tiff page into an output file.
+ *
+ * @param compression value of the compression field of the page
+ * @param samples bytes per pixel, for the horizontal differencing predictor
+ *                of LZW and Deflate, 0 for no predictor
+ */
+void initTiffEncoder(int compression, int width, int samples, struct OUTPUT_FILE* file, struct TIFF_ENCODER* encoder) {
+    int i;
+
+    encoder->file = file;
+    encoder->compression = compression;
+    encoder->width = width;
+    encoder->samples = samples;
+    encoder->differences = (samples > 0) ? (unsigned char*)poolAlloc(width * samples) : NULL;
+    encoder->pending = 0;
+    encoder->bits = 0;
+    encoder->bitCount = 0;
+    if (compression == TIFF_CCITT_G4) {
+        encoder->reference = (int*)malloc((width + 4) * sizeof(int));
+        encoder->changes = (int*)malloc((width + 4) * sizeof(int));
+        for (i = 0; i < 4; i++) { // no changes in the white row above
+            encoder->reference[i] = width;
+        }
+    } else if (compression == TIFF_LZW) {
+        resetLzw(encoder);
+        encoder->lzwPrefix = -1;
+        putBits(LZW_CLEAR, encoder->lzwWidth, encoder);
+    } else if (compression == TIFF_DEFLATE) {
+        memset(&encoder->stream, 0, sizeof(encoder->stream));
+        deflateInit(&encoder->stream, Z_DEFAULT_COMPRESSION);
+    }
+}
+
+
+/**
+ * Compresses a row of a tiff page.
+ *
+ * @param length number of bytes of the row
+ */
+void encodeTiffRow(unsigned char* row, int length, struct TIFF_ENCODER* encoder) {
+    int x;
+
+    if (encoder->samples > 0) { // horizontal differencing
+        for (x = 0; x < encoder->samples; x++) {
+            encoder->differences[x] = row[x];
+        }
+        for (x = encoder->samples; x < length; x++) {
+            encoder->differences[x] = row[x] - row[x - encoder->samples];
+        }
+        row = encoder->differences;
+    }
+    switch (encoder->compression) {
+        case TIFF_CCITT_G4:
+            encodeG4Row(row, encoder);
+            break;
+        case TIFF_LZW:
+            encodeLzw(row, length, encoder);
+            break;
+        case TIFF_DEFLATE:
+            encodeDeflate(row, length, Z_NO_FLUSH, encoder);
+            break;
+        default: // uncompressed
+            flushEncoder(encoder);
+            writeOutput(row, length, encoder->file);
+    }
+}
+
+
+/**
+ * Completes the compressed data of a tiff page and passes it on to the
+ * output file.
+ */
+void finishTiffEncoder(struct TIFF_ENCODER* encoder) {
+    if (encoder->compression == TIFF_CCITT_G4) {
+        putBits(1, 12, encoder); // end of facsimile block: two EOL codes
+        putBits(1, 12, encoder);
+        finishBits(encoder);
+        free(encoder->reference);
+        free(encoder->changes);
+    } else if (encoder->compression == TIFF_LZW) {
+        if (encoder->lzwPrefix != -1) {
+            putBits(encoder->lzwPrefix, encoder->lzwWidth, encoder);
+            addLzwCode(encoder);
+        }
+        putBits(LZW_END, encoder->lzwWidth, encoder);
+        finishBits(encoder);
+    } else if (encoder->compression == TIFF_DEFLATE) {
+        encodeDeflate(NULL, 0, Z_FINISH, encoder);
+        deflateEnd(&encoder->stream);
+    }
+    flushEncoder(encoder);
+    if (encoder->differences != NULL) {
+        poolFree(encoder->differences);
+    }
+}
+
+
+/**
+ * Opens a tiff file to append a page, and finds the link to the page which
+ * is the last one so far.
+ *
+ * @param link returns the position of the offset of the directory following
+ *             the last one
+ * @param bigEndian returns the byte order of the file
+ * @return TRUE on success, FALSE if the file cannot be opened or is no tiff
+ *         file
+ */
+BOOLEAN openTiffFile(char* filename, size_t* link, BOOLEAN* bigEndian, struct OUTPUT_FILE* file) {
+    struct TIFF tiff;
+    struct stat info;
+    unsigned char* data;
+    size_t offset;
+    off_t end;
+    int fd;
+    int i;
+    BOOLEAN success;
+
+    fd = open(filename, O_RDWR);
+    if (fd == -1) {
+        printf("*** error: Cannot open output file '%s'.\n", filename);
+        return FALSE;
+    }
+    success = FALSE;
+    if ( (fstat(fd, &info) == 0) && S_ISREG(info.st_mode) && (info.st_size > 0) ) {
+        data = (unsigned char*)mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            if (initTiff(data, info.st_size, &tiff)) {
+                *link = 4;
+                offset = tiffNumber(&tiff, 4, 4);
+                for (i = 0; (offset != 0) && (i < 100000); i++) { // (limited, in case of a cycle)
+                    *link = offset + 2 + 12 * tiffNumber(&tiff, offset, 2);
+                    offset = tiffNumber(&tiff, *link, 4);
+                }
+                *bigEndian = tiff.bigEndian;
+                success = (offset == 0) && (*link + 4 <= tiff.size);
+            }
+            munmap(data, info.st_size);
+        }
+    }
+    end = lseek(fd, 0, SEEK_END);
+    if ( (!success) || (end == -1) ) {
+        printf("*** error: Cannot append a page to '%s', it is no tiff file.\n", filename);
+        close(fd);
+        return FALSE;
+    }
+    initOutput(fd, file);
+    file->filename[0] = 0; // written in place
+    file->offset = end;
+    return TRUE;
+}
+
+
+/**
+ * Saves image data as a page of a tiff file, in a single strip.
+ * Black-and-white pages are compressed with CCITT Group 4, grayscale and color
+ * pages with LZW or Deflate. The first page creates a new file, the following
+ * ones get appended to it.
+ *
+ * @param directory index of the page in the file
+ * @param compression TIFF_COMPRESSION_NONE, TIFF_COMPRESSION_LZW or
+ *                    TIFF_COMPRESSION_DEFLATE
+ * @return TRUE on success, FALSE on failure
+ */
+BOOLEAN saveTiff(char* filename, int directory, struct IMAGE* image, int type, int compression, BOOLEAN overwrite, float blackThreshold) {
+    struct OUTPUT_FILE output;
+    struct TIFF_ENCODER encoder;
+    unsigned char page[2 + TIFF_PAGE_FIELDS * 12 + 4 + 6];
+    unsigned char* row;
+    unsigned char* scratch;
+    size_t link;
+    size_t stripOffset;
+    size_t stripSize;
+    size_t pageOffset;
+    int fileCompression;
+    int samples;
+    int length;
+    int fields;
+    int blackThresholdAbs;
+    int x;
+    int y;
+    BOOLEAN bigEndian;
+
+    // open file
+    if ( (directory > 0) && fileExists(filename) ) { // append a page
+        if ( (!overwrite) && pageExists(filename, directory) ) {
+            printf("page %d of file %s already exists (use --overwrite to replace).\n", directory + 1, filename);
+            return FALSE;
+        }
+        if (!openTiffFile(filename, &link, &bigEndian, &output)) {
+            return FALSE;
+        }
+    } else { // new file with a little-endian header, the offset of its first directory follows
+        if (!createOutputFile(filename, overwrite, image, &output)) {
+            return FALSE;
+        }
+        link = 4;
+        bigEndian = FALSE;
+        writeOutput((unsigned char*)"II*\0\0\0\0\0", 8, &output);
+    }
+    if ((output.offset & 1) != 0) { // data starts at a word boundary
+        writeOutput((unsigned char*)"", 1, &output);
+    }
+
+    // compress pixel data
+    samples = (type == PPM) ? 3 : 1;
+    if (type == PBM) {
+        fileCompression = (compression == TIFF_COMPRESSION_NONE) ? TIFF_UNCOMPRESSED : TIFF_CCITT_G4;
+        length = (image->width + 7) >> 3;
+    } else {
+        fileCompression = (compression == TIFF_COMPRESSION_LZW) ? TIFF_LZW : ((compression == TIFF_COMPRESSION_DEFLATE) ? TIFF_DEFLATE : TIFF_UNCOMPRESSED);
+        length = image->width * samples;
+    }
+    stripOffset = output.offset;
+    initTiffEncoder(fileCompression, image->width, ((fileCompression == TIFF_LZW) || (fileCompression == TIFF_DEFLATE)) ? samples : 0, &output, &encoder);
+    blackThresholdAbs = WHITE * (1.0 - blackThreshold);
+    scratch = (unsigned char*)poolAlloc(image->width * 3);
+    for (y = 0; y < image->height; y++) {
+        if ( ((type == PPM) && image->color) || ((type == PBM) && image->packed && (blackThresholdAbs > BLACK)) ) { // written as stored
+            row = getRow(y, image);
+        } else {
+            if (image->packed) { // expand bits to bytes
+                unpackBits(getRow(y, image), 0, image->width, scratch);
+                row = scratch;
+            } else {
+                row = getRowGrayscale(y, image);
+            }
+            if (type == PBM) {
+                packBits(row, image->width, blackThresholdAbs, scratch); // dark pixels become black
+                row = scratch;
+            } else if (type == PPM) { // convert to color, from the end so that the gray pixels may be in scratch
+                for (x = image->width - 1; x >= 0; x--) {
+                    scratch[x * 3] = scratch[x * 3 + 1] = scratch[x * 3 + 2] = row[x];
+                }
+                row = scratch;
+            }
+        }
+        encodeTiffRow(row, length, &encoder);
+    }
+    poolFree(scratch);
+    finishTiffEncoder(&encoder);
+    stripSize = output.offset - stripOffset;
+    if ((output.offset & 1) != 0) {
+        writeOutput((unsigned char*)"", 1, &output);
+    }
+
+    // write directory of the page, with fields in ascending order of tags
+    pageOffset = output.offset;
+    fields = 0;
+    putTiffField(&page[2 + 12 * fields++], TIFF_IMAGE_WIDTH, TIFF_LONG, 1, image->width, bigEndian);
+    putTiffField(&page[2 + 12 * fields++], TIFF_IMAGE_LENGTH, TIFF_LONG, 1, image->height, bigEndian);
+    if (samples == 1) {
+        putTiffField(&page[2 + 12 * fields++], TIFF_BITS_PER_SAMPLE, TIFF_SHORT, 1, (type == PBM) ? 1 : 8, bigEndian);
+    } else { // values behind the directory
+        putTiffField(&page[2 + 12 * fields++], TIFF_BITS_PER_SAMPLE, TIFF_SHORT, 3, 0, bigEndian);
+    }
+    putTiffField(&page[2 + 12 * fields++], TIFF_COMPRESSION, TIFF_SHORT, 1, fileCompression, bigEndian);
+    putTiffField(&page[2 + 12 * fields++], TIFF_PHOTOMETRIC, TIFF_SHORT, 1, (type == PBM) ? 0 : ((type == PGM) ? 1 : 2), bigEndian); // white is zero, black is zero, rgb
+    putTiffField(&page[2 + 12 * fields++], TIFF_STRIP_OFFSETS, TIFF_LONG, 1, stripOffset, bigEndian);
+    putTiffField(&page[2 + 12 * fields++], TIFF_SAMPLES_PER_PIXEL, TIFF_SHORT, 1, samples, bigEndian);
+    putTiffField(&page[2 + 12 * fields++], TIFF_ROWS_PER_STRIP, TIFF_LONG, 1, image->height, bigEndian);
+    putTiffField(&page[2 + 12 * fields++], TIFF_STRIP_BYTE_COUNTS, TIFF_LONG, 1, stripSize, bigEndian);
+    putTiffField(&page[2 + 12 * fields++], TIFF_PLANAR_CONFIGURATION, TIFF_SHORT, 1, 1, bigEndian);
+    if (encoder.samples > 0) {
+        putTiffField(&page[2 + 12 * fields++], TIFF_PREDICTOR, TIFF_SHORT, 1, 2, bigEndian); // horizontal differencing
+    }
+    putTiffNumber(page, fields, 2, bigEndian);
+    putTiffNumber(&page[2 + 12 * fields], 0, 4, bigEndian); // no next directory yet
+    length = 2 + 12 * fields + 4;
+    if (samples > 1) {
+        putTiffNumber(&page[2 + 12 * 2 + 8], pageOffset + length, 4, bigEndian); // bits per sample of each component
+        for (x = 0; x < samples; x++) {
+            putTiffNumber(&page[length], 8, 2, bigEndian);
+            length += 2;
+        }
+    }
+    if (pageOffset + length > 0xffffffffUL) { // offsets have 32 bits
+        printf("*** error: tiff file %s would exceed 4 GB.\n", filename);
+        output.success = FALSE;
+    } else {
+        writeOutput(page, length, &output);
+        // link the page in as the last one
+        putTiffNumber(page, pageOffset, 4, bigEndian);
+        patchOutput(link, page, 4, &output);
+    }
+    return closeOutput(&output);
+}
+
+
+/**
+ * Saves a 16-bit image to a pgm or ppm file. The samples are written
+ * big-endian, a block at a time.
+ *
+ * @return TRUE on success, FALSE on failure
+ */
+BOOLEAN saveImage16(char* filename, struct IMAGE* image, int type, BOOLEAN overwrite) {
+    struct OUTPUT_FILE output;
+    unsigned char* buf;
+    unsigned char* t;
+    int pixels;
+    int offset;
+    int length;
+    int i;
+    long pos;
+    unsigned int v;
+
+    if (!createImageFile(filename, type, image->width, image->height, overwrite, image, &output)) {
+        return FALSE;
+    }
+    buf = (unsigned char*)poolAlloc(OUTPUT_BLOCK);
+    pixels = image->width * image->height;
+    for (offset = 0; offset < pixels; offset += length) {
+        length = min(pixels - offset, OUTPUT_BLOCK / 6);
+        t = buf;
+        if ( image->color && (type == PGM) ) { // convert to gray
+            for (i = 0; i < length; i++) {
+                pos = (long)(offset + i) * 3;
+                v = (sample16(image, pos) + sample16(image, pos + 1) + sample16(image, pos + 2)) / 3;
+                *t++ = v >> 8;
+                *t++ = v & 0xff;
+            }
+        } else if ( (!image->color) && (type == PPM) ) { // convert to color
+            for (i = 0; i < length; i++) {
+                pos = offset + i;
+                t[0] = t[2] = t[4] = image->buffer[pos];
+                t[1] = t[3] = t[5] = image->low[pos];
+                t += 6;
+            }
+        } else {
+            pos = (long)offset * (image->color ? 3 : 1);
+            for (i = 0; i < length * (image->color ? 3 : 1); i++) {
+                *t++ = image->buffer[pos + i];
+                *t++ = image->low[pos + i];
+            }
+        }
+        writeOutput(buf, t - buf, &output);
+    }
+    poolFree(buf);
+    return closeOutput(&output);
+}
+
+
+/**
+ * Saves image data to a file in pgm or pbm format, or as a page of a tiff
+ * file, see saveTiff().
+ *
+ * @param filename name of file to save
+ * @param directory index of the page in a tiff file
+ * @param image image to save
+ * @param type filetype of the image to save
+ * @param compression compression of tiff files, see saveTiff()
+ * @param overwrite allow overwriting existing files
+ * @param blackThreshold threshold for grayscale-to-black&white conversion
+ * @return TRUE on success, FALSE on failure
+ */
+BOOLEAN saveImage(char* filename, int directory, struct IMAGE* image, int type, int compression, BOOLEAN overwrite, float blackThreshold) {
+    unsigned char* buf;
+    unsigned char* row;
+    int bytesPerLine;
+    int inputSize;
+    int outputSize;
+    int offsetInput;
+    int length;
+    int i;
+    int y;
+    int pixel;
+    struct OUTPUT_FILE output;
+    int blackThresholdAbs;
+    BOOLEAN result;
+    unsigned char* gray;
+
+    if (verbose>=VERBOSE_MORE) {
+        printf("saving file %s.\n", filename);
+    }
+    if (isTiffFilename(filename)) {
+        return saveTiff(filename, directory, image, type, compression, overwrite, blackThreshold);
+    }
+    if ( (image->low != NULL) && (type != PBM) ) {
+        return saveImage16(filename, image, type, overwrite);
+    }
+
+    result = TRUE;
+    gray = image->buffer;
+    blackThresholdAbs = WHITE * (1.0 - blackThreshold);
+    if ( image->packed && ((type != PBM) || (blackThresholdAbs <= BLACK)) ) { // expand bits to bytes
+        gray = (unsigned char*)poolAlloc(image->width * image->height);
+        for (y = 0; y < image->height; y++) {
+            unpackBits(getRow(y, image), 0, image->width, &gray[y * image->width]);
+        }
+    }
+    if ( (type == PBM) && image->packed && (blackThresholdAbs > BLACK) ) { // black stays black, white stays white
+        outputSize = image->stride * image->height;
+        buf = image->buffer;
+    } else if (type == PBM) { // convert to pbm
+        bytesPerLine = (image->width + 7) >> 3; // / 8;
+        outputSize = bytesPerLine * image->height;
+        buf = (unsigned char*)poolAlloc(outputSize);
+        for (y = 0; y < image->height; y++) {
+            if ( image->packed ) {
+                row = &gray[y * image->width]; // (expanded above)
+            } else {
+                row = getRowGrayscale(y, image);
+            }
+            packBits(row, image->width, blackThresholdAbs, &buf[y * bytesPerLine]); // dark pixels become black
+        }
+    } else if (type == PPM) { // maybe convert to color
+        outputSize = image->width * image->height * 3;
+        if (image->color) { // color already
+            buf = image->buffer;
+        } else { // converted to color below, a block at a time
+            buf = (unsigned char*)poolAlloc(OUTPUT_BLOCK / 2 * 3);
+        }
+    } else { // PGM
+        outputSize = image->width * image->height;
+        buf = gray;
+    }
+    
+    // write to file
+    result = createImageFile(filename, type, image->width, image->height, overwrite, image, &output);
+    if (result) {
+        if ( (type == PPM) && (!image->color) ) {
+            inputSize = image->width * image->height;
+            for (offsetInput = 0; offsetInput < inputSize; offsetInput += length) {
+                length = min(inputSize - offsetInput, OUTPUT_BLOCK / 2); // (large enough to be written without being collected)
+                for (i = 0; i < length; i++) {
+                    pixel = gray[offsetInput + i];
+                    buf[i * 3] = pixel;
+                    buf[i * 3 + 1] = pixel;
+                    buf[i * 3 + 2] = pixel;
+                }
+                writeOutput(buf, length * 3, &output);
+            }
+        } else {
+            writeOutput(buf, outputSize, &output);
+        }
+        result = closeOutput(&output);
+    }
+    if ((buf != image->buffer) && (buf != gray)) {
+        poolFree(buf);
+    }
+    if (gray != image->buffer) {
+        poolFree(gray);
+    }
+    return result;
+}    
+
+
+/**
+ * Saves the image if full debugging mode is enabled.
+ */
+void saveDebug(char* filename, struct IMAGE* image) {
+    int type;
+    
+    if (verbose >= VERBOSE_DEBUG_SAVE) {
+        if (image->color) {
+            type = PPM;
+        } else if (image->bitdepth == 1) {
+            type = PBM;
+        } else {
+            type = PGM;
+        }
+        saveImage(filename, 0, image, type, TIFF_COMPRESSION_LZW, TRUE, 0.5); // 0.5 is a dummy, not used because PGM depth
+    }
+}
+
+
+/**
+ * Resolves the input filenames of one sheet from the input file sequence and
+ * advances the position in the sequence. Pages inserted by --insert-blank or
+ * --replace-blank get NULL as filename.
+ *
+ * @param pos index into the sequence, without inserted blank pages
+ * @param posTotal index into the sequence, with inserted blank pages
+ * @param nr number filled into the filename patterns of the sequence
+ * @param directories returns the index of the page to read from each file,
+ *                    nr - 1 for multi-page tiff files, see isPagedTiff(), and
+ *                    for standard input
+ * @param anyWildcards set to TRUE if a filename pattern contains a wildcard,
+ *                     or names a multi-page tiff file or standard input
+ * @return the number of blank pages
+ */
+int resolveInputFilenames(int count, char* sequence[], int sequenceCount, int* pos, int* posTotal, int* nr, int insertBlank[], int insertBlankCount, int replaceBlank[], int replaceBlankCount, char buffer[][255], char* filenames[], int directories[], BOOLEAN* anyWildcards) {
+    BOOLEAN ins;
+    BOOLEAN repl;
+    int blankCount;
+    int j;
+
+    blankCount = 0;
+    for (j = 0; j < count; j++) {
+        if ( (!(*anyWildcards)) && ((strchr(sequence[*pos], '%') != 0) || isPagedTiff(sequence[*pos]) || isStandardStream(sequence[*pos])) ) {
+            *anyWildcards = TRUE;
+        }
+        ins = isInMultiIndex(*posTotal + 1, insertBlank, insertBlankCount);
+        repl = isInMultiIndex(*posTotal + 1, replaceBlank, replaceBlankCount);
+        directories[j] = 0;
+        if (!(ins || repl)) {
+            if ( isPagedTiff(sequence[*pos]) || isStandardStream(sequence[*pos]) ) {
+                directories[j] = *nr - 1;
+            }
+            sprintf(buffer[j], sequence[(*pos)++], *nr);
+            filenames[j] = buffer[j];
+        } else { // use blank input
+            filenames[j] = NULL;
+            blankCount++;
+            if (repl) { // but skip input file sequence pos if replace-mode
+                (*pos)++;
+            }
+        }
+        if ( *pos >= sequenceCount ) { // next 'loop' in input-file-seq
+            *pos = 0;
+            (*nr)++;
+        }
+        (*posTotal)++;
+    }
+    return blankCount;
+}
+
+
+/**
+ * Saves a sheet to one file per page, splitting it into pages of equal
+ * width if there is more than one.
+ *
+ * @param directories index of each page in its file, for tiff files
+ * @return TRUE on success, FALSE if a page could not be saved
+ */
+BOOLEAN saveSheet(struct IMAGE* sheet, int count, char* filenames[], int directories[], int type, int compression, BOOLEAN overwrite, float blackThreshold) {
+    struct IMAGE page;
+    BOOLEAN success;
+    int j;
+
+    success = TRUE;
+    for ( j = 0; success && (j < count); j++) {
+        // get pagebuffer
+        if ( count == 1 ) {
+            page = *sheet; // copy whole struct, page shares the sheet's buffers
+        } else { // generic case: copy page-part of sheet into own buffer
+            initSheetImage(&page, sheet->width / count, sheet->height, sheet->bitdepth, sheet->color, WHITE);
+            copyImageArea(page.width * j, 0, page.width, page.height, sheet, 0, 0, &page);
+        }
+
+        success = saveImage(filenames[j], directories[j], &page, type, compression, overwrite, blackThreshold);
+
+        if ( count > 1 ) {
+            freeImage(&page);
+        } else {
+            *sheet = page; // (channels may have been calculated while saving)
+        }
+        if (success == FALSE) {
+            printf("*** error: Could not save image data to file %s.\n", filenames[j]);
+        }
+    }
+    return success;
+}
+
+
+/* --- tool functions for profiling --------------------------------------- */
+
+/**
+ * Returns the seconds passed on a clock since the given time.
+ */
+double secondsSince(clockid_t clock, struct timespec* start) {
+    struct timespec now;
+
+    clock_gettime(clock, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+/**
+ * Starts measuring the processing of a sheet, if requested by --profile.
+ */
+void startProfile(BOOLEAN enabled) {
+    profile.enabled = enabled;
+    if (enabled) {
+        memset(&profile.sheet, 0, sizeof(struct STAGE_TIMES));
+        clock_gettime(CLOCK_MONOTONIC, &profile.sheetWall);
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &profile.sheetCpu);
+    }
+}
+
+
+/**
+ * Starts measuring a stage of processing, which ends with endStage(). Stages
+ * do not nest.
+ */
+void beginStage() {
+    if (profile.enabled) {
+        clock_gettime(CLOCK_MONOTONIC, &profile.stageWall);
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &profile.stageCpu);
+    }
+}
+
+
+/**
+ * Adds the time since beginStage() to a stage, and the pixels of the image
+ * the stage has processed.
+ */
+void endStage(int stage, struct IMAGE* image) {
+    if (profile.enabled) {
+        profile.sheet.wall[stage] += secondsSince(CLOCK_MONOTONIC, &profile.stageWall);
+        profile.sheet.cpu[stage] += secondsSince(CLOCK_PROCESS_CPUTIME_ID, &profile.stageCpu);
+        profile.sheet.pixels[stage] += (unsigned long long)image->width * image->height;
+    }
+}
+
+
+/**
+ * Adds the measurements of a sheet to the summary of printProfileSummary().
+ */
+void recordProfile(struct STAGE_TIMES* stages) {
+    profile.sheets = (struct STAGE_TIMES*)realloc(profile.sheets, (profile.count + 1) * sizeof(struct STAGE_TIMES));
+    profile.sheets[profile.count++] = *stages;
+}
+
+
+/**
+ * Finishes measuring the processing of a sheet, prints the time spent in each
+ * stage used and records it for the summary.
+ */
+void finishProfile(int nr) {
+    int i;
+
+    if (!profile.enabled) {
+        return;
+    }
+    profile.sheet.totalWall = secondsSince(CLOCK_MONOTONIC, &profile.sheetWall);
+    profile.sheet.totalCpu = secondsSince(CLOCK_PROCESS_CPUTIME_ID, &profile.sheetCpu);
+    printf("profile of sheet %d:\n", nr);
+    printf("  %-12s %9s %9s %9s\n", "stage", "wall s", "cpu s", "Mpixels");
+    for (i = 0; i < STAGES_COUNT; i++) {
+        if (profile.sheet.pixels[i] > 0) {
+            printf("  %-12s %9.3f %9.3f %9.2f\n", STAGE_NAMES[i], profile.sheet.wall[i], profile.sheet.cpu[i], profile.sheet.pixels[i] / 1e6);
+        }
+    }
+    printf("  %-12s %9.3f %9.3f\n", "total", profile.sheet.totalWall, profile.sheet.totalCpu);
+    recordProfile(&profile.sheet);
+}
+
+
+/**
+ * Compares two numbers of seconds for qsort().
+ */
+int compareSeconds(const void* a, const void* b) {
+    double d;
+
+    d = *(const double*)a - *(const double*)b;
+    return (d < 0) ? -1 : ((d > 0) ? 1 : 0);
+}
+
+
+/**
+ * Prints mean, median, 95th percentile and maximum of the wall-clock time
+ * per sheet of each stage over all sheets measured, with the total cpu time
+ * and the throughput of the stage.
+ */
+void printProfileSummary() {
+    struct timespec resolution;
+    double* wall;
+    double sum;
+    double cpu;
+    unsigned long long pixels;
+    int stage;
+    int i;
+    int n;
+
+    n = profile.count;
+    if (n == 0) {
+        return;
+    }
+    wall = (double*)malloc(n * sizeof(double));
+    clock_getres(CLOCK_MONOTONIC, &resolution);
+    printf("profile of %d sheet%s:\n", n, pluralS(n));
+    printf("  %-12s %9s %9s %9s %9s %9s %9s\n", "stage", "mean s", "p50 s", "p95 s", "max s", "cpu s", "Mpixel/s");
+    for (stage = 0; stage <= STAGES_COUNT; stage++) { // (STAGES_COUNT: whole sheets)
+        sum = 0.0;
+        cpu = 0.0;
+        pixels = 0;
+        for (i = 0; i < n; i++) {
+            if (stage < STAGES_COUNT) {
+                wall[i] = profile.sheets[i].wall[stage];
+                cpu += profile.sheets[i].cpu[stage];
+                pixels += profile.sheets[i].pixels[stage];
+            } else {
+                wall[i] = profile.sheets[i].totalWall;
+                cpu += profile.sheets[i].totalCpu;
+            }
+            sum += wall[i];
+        }
+        if ( (stage < STAGES_COUNT) && (pixels == 0) ) { // stage not used
+            continue;
+        }
+        qsort(wall, n, sizeof(double), compareSeconds);
+        printf("  %-12s %9.3f %9.3f %9.3f %9.3f %9.3f", (stage < STAGES_COUNT) ? STAGE_NAMES[stage] : "total", sum / n, wall[(n + 1) / 2 - 1], wall[(n * 95 + 99) / 100 - 1], wall[n - 1], cpu);
+        if (stage < STAGES_COUNT) {
+            if ( sum > resolution.tv_sec + resolution.tv_nsec / 1e9 ) {
+                printf(" %9.2f", pixels / 1e6 / sum);
+            } else { // too fast to be measured
+                printf(" %9s", "-");
+            }
+        }
+        printf("\n");
+    }
+    free(wall);
+}
+
+
+
+/* --- tool functions for parallel sheet processing ----------------------- */
+
+/**
+ * Starts a worker process to process one sheet. The worker's standard output
+ * is redirected to a temporary file, so that the messages of all sheets can
+ * later be replayed in the original order. The workers are chained by pipes,
+ * over which each one tells the next whether all sheets up to its own have
+ * succeeded, see awaitPreviousSheets().
+ *
+ * @param worker returns the worker information, inside the worker process
+ *               worker->result is the write end of the result pipe
+ * @param chain read end of the pipe from the worker started last, -1 if
+ *              none; returns the one from this worker
+ * @return 0 inside the worker process, the process id of the worker inside
+ *         the main process, or -1 if no worker could be started
+ */
+pid_t startSheetWorker(struct SHEET_WORKER* worker, int* chain) {
+    int fd[2];
+    int link[2];
+
+    fflush(stdout); // don't let the worker inherit pending output
+    worker->log = tmpfile();
+    if (worker->log == NULL) {
+        return -1;
+    }
+    if (pipe(fd) != 0) {
+        fclose(worker->log);
+        return -1;
+    }
+    if (pipe(link) != 0) {
+        close(fd[0]);
+        close(fd[1]);
+        fclose(worker->log);
+        return -1;
+    }
+    worker->pid = fork();
+    if (worker->pid == 0) { // worker process
+        close(fd[0]);
+        close(link[0]);
+        dup2(fileno(worker->log), STDOUT_FILENO);
+        worker->result = fd[1];
+        worker->previous = *chain;
+        worker->next = link[1];
+        worker->previousSucceeded = TRUE;
+    } else if (worker->pid > 0) { // main process
+        close(fd[1]);
+        close(link[1]); // (only the worker may write, so that the pipe ends if it stops)
+        worker->result = fd[0];
+        if (*chain != -1) {
+            close(*chain);
+        }
+        *chain = link[0];
+    } else {
+        close(fd[0]);
+        close(fd[1]);
+        close(link[0]);
+        close(link[1]);
+        fclose(worker->log);
+    }
+    return worker->pid;
+}
+
+
+/**
+ * Waits inside a worker process until the worker of the previous sheet is
+ * done. Output files must only be written if this succeeds, as sequential
+ * processing stops after the first sheet which fails.
+ *
+ * @return TRUE if all sheets before have succeeded
+ */
+BOOLEAN awaitPreviousSheets(struct SHEET_WORKER* worker) {
+    char status;
+    ssize_t n;
+
+    if (worker->previous != -1) {
+        while (((n = read(worker->previous, &status, 1)) == -1) && (errno == EINTR)) {
+            // retry
+        }
+        worker->previousSucceeded = (n == 1) && (status != 0); // (nothing to read if the previous worker has stopped)
+        close(worker->previous);
+        worker->previous = -1;
+    }
+    return worker->previousSucceeded;
+}
+
+
+/**
+ * Ends a worker process after its sheet has been processed.
+ */
+void finishSheetWorker(struct SHEET_WORKER* worker, struct SHEET_RESULT* result) {
+    char status;
+
+    status = awaitPreviousSheets(worker) && (result->exitCode == 0);
+    if (write(worker->next, &status, 1) != 1) {
+        _exit(2);
+    }
+    fflush(stdout);
+    if (write(worker->result, result, sizeof(struct SHEET_RESULT)) != sizeof(struct SHEET_RESULT)) {
+        _exit(2);
+    }
+    _exit(0);
+}
+
+
+/**
+ * Waits for a worker process to end and copies its messages to the standard
+ * output.
+ *
+ * @param replay FALSE to discard the worker's messages
+ * @param result returns the state of the main program after the sheet, or
+ *               only the exit code if the worker stopped without reporting
+ * @return TRUE if the worker reported a result, FALSE if the program has to
+ *         be terminated because the worker stopped with an error
+ */
+BOOLEAN collectSheetWorker(struct SHEET_WORKER* worker, BOOLEAN replay, struct SHEET_RESULT* result) {
+    int status;
+    BOOLEAN reported;
+    char buffer[4096];
+    size_t n;
+
+    while ((waitpid(worker->pid, &status, 0) == -1) && (errno == EINTR)) {
+        // retry
+    }
+    reported = (read(worker->result, result, sizeof(struct SHEET_RESULT)) == sizeof(struct SHEET_RESULT));
+    close(worker->result);
+    if (!reported) {
+        result->exitCode = (WIFEXITED(status) && (WEXITSTATUS(status) != 0)) ? WEXITSTATUS(status) : 2;
+    }
+    if (replay) {
+        rewind(worker->log);
+        while ((n = fread(buffer, 1, sizeof(buffer), worker->log)) > 0) {
+            fwrite(buffer, 1, n, stdout);
+        }
+    }
+    fclose(worker->log);
+    return reported;
+}
+
+
+/**
+ * Collects finished sheets in their original order until no more than limit
+ * worker processes are left running, and applies their results to the state
+ * of the main program.
+ *
+ * @return FALSE if a sheet has failed, in this case all other workers have
+ *         been waited for and the program has to be terminated
+ */
+BOOLEAN waitSheetWorkers(int limit, struct SHEET_WORKER workers[], int jobs, int* first, int* count, int* exitCode, int* previousWidth, int* previousHeight, int* previousBitdepth, BOOLEAN* previousColor, unsigned long int* totalTime, int* totalCount) {
+    struct SHEET_RESULT result;
+    BOOLEAN reported;
+
+    while (*count > limit) {
+        reported = collectSheetWorker(&workers[*first], TRUE, &result);
+        *first = (*first + 1) % jobs;
+        (*count)--;
+        if (result.exitCode != 0) {
+            *exitCode = result.exitCode;
+        }
+        if ( (!reported) || (result.exitCode != 0) ) { // sequential processing would have stopped here, drop all following sheets' messages (they have not saved anything)
+            while (*count > 0) {
+                collectSheetWorker(&workers[*first], FALSE, &result);
+                *first = (*first + 1) % jobs;
+                (*count)--;
+            }
+            return FALSE;
+        }
+        *previousWidth = result.previousWidth;
+        *previousHeight = result.previousHeight;
+        *previousBitdepth = result.previousBitdepth;
+        *previousColor = result.previousColor;
+        *totalTime += result.totalTime;
+        *totalCount += result.totalCount;
+        if (result.profiled) {
+            recordProfile(&result.stages);
+        }
+    }
+    return TRUE;
+}
+
+
+
+/* --- tool functions for multi-threading --------------------------------- */
+
+/**
+ * Thread function of runTasks(), processes tasks until none are left.
+ */
+void* runTasksThread(void* arg) {
+    struct TASKS* tasks = arg;
+    int index;
+
+    while (TRUE) {
+        pthread_mutex_lock(&tasks->mutex);
+        index = tasks->next++;
+        pthread_mutex_unlock(&tasks->mutex);
+        if (index >= tasks->count) {
+            return NULL;
+        }
+        tasks->task(index, tasks->data);
+    }
+}
+
+
+/**
+ * Calls task(index, data) for all indices from 0 to count-1, using up to the
+ * number of threads set by --threads. Tasks are started in the order of their
+ * indices, so a task may wait for a lower-indexed task to make progress.
+ */
+void runTasks(int count, void (*task)(int index, void* data), void* data) {
+    struct TASKS tasks;
+    pthread_t thread[MAX_THREADS];
+    int started;
+    int i;
+
+    if ((threads <= 1) || (count <= 1)) {
+        for (i = 0; i < count; i++) {
+            task(i, data);
+        }
+        return;
+    }
+    tasks.task = task;
+    tasks.data = data;
+    tasks.count = count;
+    tasks.next = 0;
+    pthread_mutex_init(&tasks.mutex, NULL);
+    started = 0;
+    for (i = 1; (i < threads) && (i < count); i++) { // the calling thread is the first one
+        if (pthread_create(&thread[started], NULL, runTasksThread, &tasks) == 0) {
+            started++;
+        }
+    }
+    runTasksThread(&tasks);
+    for (i = 0; i < started; i++) {
+        pthread_join(thread[i], NULL);
+    }
+    pthread_mutex_destroy(&tasks.mutex);
+}
+
+
+/**
+ * Returns the number of windows needed to scan over a length, until the last
+ * window reaches or exceeds the end.
+ */
+int scanCount(int length, int size, int step) {
+    if (length <= size - 1) {
+        return 1;
+    } else {
+        return (length - size + step) / step + 1;
+    }
+}
+
+
+/**
+ * Processes one row of windows of a scan, see scanWindows().
+ */
+void scanWindowRow(int row, void* data) {
+    struct WINDOW_SCAN* scan = data;
+    int column;
+    int left;
+    int top;
+
+    top = scan->offset + row * scan->step[VERTICAL];
+    scan->result[row] = 0;
+    for (column = 0; column < scan->columns; column++) {
+        if (row > 0) {
+            pthread_mutex_lock(&scan->mutex);
+            while (scan->done[row-1] < min(column + scan->lag + 1, scan->columns)) {
+                pthread_cond_wait(&scan->progress, &scan->mutex);
+            }
+            pthread_mutex_unlock(&scan->mutex);
+        }
+        left = column * scan->step[HORIZONTAL];
+        scan->result[row] += scan->filterWindow(left, top, left + scan->size[HORIZONTAL] - 1, top + scan->size[VERTICAL] - 1, scan);
+        pthread_mutex_lock(&scan->mutex);
+        scan->done[row] = column + 1;
+        pthread_cond_broadcast(&scan->progress);
+        pthread_mutex_unlock(&scan->mutex);
+    }
+}
+
+
+/**
+ * Applies scan->filterWindow to a grid of overlapping windows, with the same
+ * results as processing them one after another, row by row. The rows of
+ * windows are processed in parallel, each row staying far enough behind the
+ * row above to not touch any pixel which a window still to be processed
+ * above would read or change.
+ *
+ * @param margin distance around a window in which a window's filter reads pixels
+ * @return sum of the results of all windows
+ */
+int scanWindows(struct WINDOW_SCAN* scan, int margin[DIRECTIONS_COUNT]) {
+    int reach;
+    int result;
+    int i;
+
+    reach = scan->size[HORIZONTAL] + margin[HORIZONTAL];
+    if (scan->image->packed) { // windows must not share bytes of packed rows
+        reach += 8;
+    }
+    if (scan->image->integrals != NULL) { // windows must not share tiles of summed-area tables, neither for reading nor for writing
+        reach += margin[HORIZONTAL] + INTEGRAL_TILE;
+    }
+    scan->lag = (reach + scan->step[HORIZONTAL] - 1) / scan->step[HORIZONTAL] - 1;
+    scan->done = (int*)malloc(scan->rows * sizeof(int));
+    scan->result = (int*)malloc(scan->rows * sizeof(int));
+    for (i = 0; i < scan->rows; i++) {
+        scan->done[i] = 0;
+    }
+    pthread_mutex_init(&scan->mutex, NULL);
+    pthread_cond_init(&scan->progress, NULL);
+    runTasks(scan->rows, scanWindowRow, scan);
+    pthread_cond_destroy(&scan->progress);
+    pthread_mutex_destroy(&scan->mutex);
+    result = 0;
+    for (i = 0; i < scan->rows; i++) {
+        result += scan->result[i];
+    }
+    free(scan->done);
+    free(scan->result);
+    return result;
+}
+
+
+
+/* --- tool functions for pipelined input and output --------------------- */
+
+/**
+ * Thread function of startPrefetch(), reads the files through once, so that
+ * loading them finds their data in the page cache instead of waiting for the
+ * storage.
+ */
+void* prefetchThread(void* arg) {
+    struct PREFETCH* prefetch = arg;
+    unsigned char* buffer;
+    int fd;
+    int i;
+
+    buffer = (unsigned char*)malloc(PREFETCH_BLOCK);
+    for (i = 0; (buffer != NULL) && (i < prefetch->count); i++) {
+        fd = open(prefetch->filenames[i], O_RDONLY);
+        if (fd != -1) { // missing files are reported when the sheet gets loaded
+            while (read(fd, buffer, PREFETCH_BLOCK) > 0) {
+            }
+            close(fd);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+
+/**
+ * Starts reading ahead the input files of the next sheet while the current
+ * one is processed. Entries which are NULL (blank pages) are skipped.
+ */
+void startPrefetch(int count, char* filenames[], struct PREFETCH* prefetch) {
+    int i;
+
+    prefetch->count = 0;
+    for (i = 0; i < count; i++) {
+        if (filenames[i] != NULL) {
+            strcpy(prefetch->filenames[prefetch->count++], filenames[i]);
+        }
+    }
+    prefetch->running = (prefetch->count > 0) && (pthread_create(&prefetch->thread, NULL, prefetchThread, prefetch) == 0);
+}
+
+
+/**
+ * Waits until the files started by startPrefetch() have been read.
+ */
+void finishPrefetch(struct PREFETCH* prefetch) {
+    if (prefetch->running) {
+        pthread_join(prefetch->thread, NULL);
+        prefetch->running = FALSE;
+    }
+}
+
+
+/**
+ * Thread function of startWriter(), saves the sheet and frees it.
+ */
+void* writerThread(void* arg) {
+    struct WRITER* writer = arg;
+
+    writer->success = saveSheet(&writer->sheet, writer->count, writer->filenames, writer->directories, writer->type, writer->compression, writer->overwrite, writer->blackThreshold);
+    freeImage(&writer->sheet);
+    return NULL;
+}
+
+
+/**
+ * Waits until the sheet handed to startWriter() has been saved. A failure is
+ * reported only once, by the first call after it.
+ *
+ * @return FALSE if saving a sheet has failed since the last call
+ */
+BOOLEAN finishWriter(struct WRITER* writer) {
+    BOOLEAN success;
+
+    if (writer->running) {
+        pthread_join(writer->thread, NULL);
+        writer->running = FALSE;
+    }
+    success = writer->success;
+    writer->success = TRUE;
+    return success;
+}
+
+
+/**
+ * Hands a sheet over to be saved while the next sheet is processed. The
+ * writer takes over the sheet's buffers and frees them when done. Only one
+ * sheet is queued at a time, so this waits for the previous one first.
+ * A sheet which would overwrite existing files without --overwrite is saved
+ * right away, so that the error is reported before the next sheet starts.
+ * The caller normally collects the previous sheet's status with
+ * finishWriter() before printing the next sheet's header.
+ *
+ * @return FALSE if saving the previous sheet or this one has failed
+ */
+BOOLEAN startWriter(struct IMAGE* sheet, int count, char* filenames[], int directories[], int type, int compression, BOOLEAN overwrite, float blackThreshold, struct WRITER* writer) {
+    BOOLEAN success;
+    BOOLEAN exists;
+    int j;
+
+    success = finishWriter(writer);
+    writer->sheet = *sheet;
+    writer->count = count;
+    exists = FALSE;
+    for (j = 0; j < count; j++) {
+        strcpy(writer->filenamesBuffer[j], filenames[j]);
+        writer->filenames[j] = writer->filenamesBuffer[j];
+        writer->directories[j] = directories[j];
+        if ( (!overwrite) && (!isStandardStream(filenames[j])) && pageExists(filenames[j], directories[j]) ) {
+            exists = TRUE;
+        }
+    }
+    writer->type = type;
+    writer->compression = compression;
+    writer->overwrite = overwrite;
+    writer->blackThreshold = blackThreshold;
+    writer->running = (!exists) && (pthread_create(&writer->thread, NULL, writerThread, writer) == 0);
+    if (!writer->running) { // save right away instead
+        writerThread(writer);
+        if (!finishWriter(writer)) {
+            success = FALSE;
+        }
+    }
+    return success;
+}
+
+
+/**
+ * Tests if a file is still to be written by the writer.
+ */
+BOOLEAN isWriting(char* filename, struct WRITER* writer) {
+    int j;
+
+    if ( writer->running && (!isStandardStream(filename)) ) { // (standard input is not standard output)
+        for (j = 0; j < writer->count; j++) {
+            if (strcmp(filename, writer->filenames[j]) == 0) {
+                return TRUE;
+            }
+        }
+    }
+    return FALSE;
+}
+
+
+
+/****************************************************************************
+ * image processing functions                                               *
+ ****************************************************************************/
+
+
+/* --- deskewing ---------------------------------------------------------- */
+
+/**
+ * Returns the maximum peak value that occurs when shifting a rotated virtual line above the image,
+ * starting from one edge of an area and moving towards the middle point of the area.
+ * The peak value is calulated by the absolute difference in the average blackness of pixels that occurs between two single shifting steps.
+ *
+ * @param m ascending slope of the virtually shifted (m=tan(angle)). Mind that this is negative for negative radians.
+ */
+int detectEdgeRotationPeak(double m, int deskewScanSize, float deskewScanDepth, int shiftX, int shiftY, int left, int top, int right, int bottom, struct IMAGE* image) {
+    int width;
+    int height;
+    int mid;
     int half;
     int sideOffset;
     int outerOffset;
@@ -2201,1304 +7030,2819 @@ int detectEdgeRotationPeak(double m, int deskewScanSize, float deskewScanDepth,
     int y[MAX_ROTATION_SCAN_SIZE];
     int xx;
     int yy;
-    int lineStep;
-    int dep;
-    int pixel;
+    int lineStep;
+    int dep;
+    int pixel;
+    int blackness;
+    int lastBlackness;
+    int diff;
+    int maxDiff;
+    int maxBlacknessAbs;
+    int maxDepth;
+    int accumulatedBlackness;
+        
+    width = right-left+1;
+    height = bottom-top+1;    
+    maxBlacknessAbs = (int) 255 * deskewScanSize * deskewScanDepth;
+    
+    if (shiftY==0) { // horizontal detection
+        if (deskewScanSize == -1) {
+            deskewScanSize = height;
+        }
+        limit(&deskewScanSize, MAX_ROTATION_SCAN_SIZE);
+        limit(&deskewScanSize, height);
+
+        maxDepth = width/2;
+        half = deskewScanSize/2;
+        outerOffset = (int)(abs(m) * half);
+        mid = height/2;
+        sideOffset = shiftX > 0 ? left-outerOffset : right+outerOffset;
+        X = sideOffset + half * m;
+        Y = top + mid - half;
+        stepX = -m;
+        stepY = 1.0;
+    } else { // vertical detection
+        if (deskewScanSize == -1) {
+            deskewScanSize = width;
+        }
+        limit(&deskewScanSize, MAX_ROTATION_SCAN_SIZE);
+        limit(&deskewScanSize, width);
+        maxDepth = height/2;
+        half = deskewScanSize/2;
+        outerOffset = (int)(abs(m) * half);
+        mid = width/2;
+        sideOffset = shiftY > 0 ? top-outerOffset : bottom+outerOffset;
+        X = left + mid - half;
+        Y = sideOffset - (half * m);
+        stepX = 1.0;
+        stepY = -m; // (line goes upwards for negative degrees)
+    }
+    
+    // fill buffer with coordinates for rotated line in first unshifted position
+    for (lineStep = 0; lineStep < deskewScanSize; lineStep++) {
+        x[lineStep] = (int)X;
+        y[lineStep] = (int)Y;
+        X += stepX;
+        Y += stepY;
+    }
+    
+    // now scan for edge, modify coordinates in buffer to shift line into search direction (towards the middle point of the area)
+    // stop either when detectMaxDepth steps are shifted, or when diff falls back to less than detectThreshold*maxDiff
+    lastBlackness = 0;
+    diff = 0;
+    maxDiff = 0;
+    accumulatedBlackness = 0;
+    for (dep = 0; (accumulatedBlackness < maxBlacknessAbs) && (dep < maxDepth) ; dep++) {
+        // calculate blackness of virtual line
+        blackness = 0;
+        for (lineStep = 0; lineStep < deskewScanSize; lineStep++) {
+            xx = x[lineStep];
+            x[lineStep] += shiftX;
+            yy = y[lineStep];
+            y[lineStep] += shiftY;
+            if ((xx >= left) && (xx <= right) && (yy >= top) && (yy <= bottom)) {
+                pixel = getPixelDarknessInverse(xx, yy, image);
+                blackness += (255 - pixel);
+            }
+        }
+        diff = blackness - lastBlackness;
+        lastBlackness = blackness;
+        if (diff >= maxDiff) {
+            maxDiff = diff;
+        }
+        accumulatedBlackness += blackness;
+    }
+    if (dep < maxDepth) { // has not terminated only because middle was reached
+        return maxDiff;
+    } else {
+        return 0;
+    }
+}
+
+
+/**
+ * Detects rotation at one edge of the area specified by left, top, right, bottom.
+ * Which of the four edges to take depends on whether shiftX or shiftY is non-zero,
+ * and what sign this shifting value has.
+ *
+ * @param deskewScanSearch DESKEW_SEARCH_ALL to test every step in the range,
+ *                         DESKEW_SEARCH_REFINE to test a grid of at most
+ *                         REFINE_STRIDE steps first, then halve the distance
+ *                         around each of the REFINE_CANDIDATES best angles
+ */
+double detectEdgeRotation(float deskewScanRange, float deskewScanStep, int deskewScanSearch, int deskewScanSize, float deskewScanDepth, int shiftX, int shiftY, int left, int top, int right, int bottom, struct IMAGE* image) {
+    // either shiftX or shiftY is 0, the other value is -i|+i
+    // depending on shiftX/shiftY the start edge for shifting is determined
+    double rangeRad;
+    double stepRad;
+    double rotation;
+    int peak;
+    int maxPeak;
+    double detectedRotation;
+    double m;
+    int steps;
+    int stride;
+    int distance;
+    int candidate[REFINE_CANDIDATES]; // best angles of the coarse search in steps, in order of their peaks
+    int candidatePeak[REFINE_CANDIDATES];
+    int count;
+    int localPeak;
+    int best;
+    int index;
+    int middle;
+    int i;
+    int j;
+
+    rangeRad = degreesToRadians((double)deskewScanRange);
+    stepRad = degreesToRadians((double)deskewScanStep);
+    detectedRotation = 0.0;
+    maxPeak = 0;    
+    if (deskewScanSearch == DESKEW_SEARCH_REFINE) {
+        // angles are multiples of the step between -steps and +steps, as with a full search
+        steps = (int)(deskewScanRange / deskewScanStep + 0.000001);
+        for (stride = 1; (stride * 2 <= steps / 4) && (stride < REFINE_STRIDE); stride *= 2) {
+            ;
+        }
+        // coarse search, alternating between +/- sign while increasing absolute value, keeping the best angles in order
+        count = 0;
+        candidate[0] = 0;
+        candidatePeak[0] = 0;
+        for (i = 0; i <= steps; i = (i >= 0) ? -(i + stride) : -i) {
+            if (i >= -steps) {
+                peak = detectEdgeRotationPeak(tan(i * stepRad), deskewScanSize, deskewScanDepth, shiftX, shiftY, left, top, right, bottom, image);
+                for (j = count; (j > 0) && (peak > candidatePeak[j - 1]); j--) {
+                    if (j < REFINE_CANDIDATES) {
+                        candidate[j] = candidate[j - 1];
+                        candidatePeak[j] = candidatePeak[j - 1];
+                    }
+                }
+                if (j < REFINE_CANDIDATES) {
+                    candidate[j] = i;
+                    candidatePeak[j] = peak;
+                    count = min(count + 1, REFINE_CANDIDATES);
+                }
+            }
+        }
+        // refine around each of the best angles with successively halved distances
+        best = candidate[0];
+        maxPeak = candidatePeak[0];
+        for (j = 0; j < count; j++) {
+            index = candidate[j];
+            peak = candidatePeak[j];
+            for (distance = stride / 2; distance >= 1; distance /= 2) {
+                middle = index;
+                for (i = middle - distance; i <= middle + distance; i += 2 * distance) {
+                    if ( (i >= -steps) && (i <= steps) ) {
+                        localPeak = detectEdgeRotationPeak(tan(i * stepRad), deskewScanSize, deskewScanDepth, shiftX, shiftY, left, top, right, bottom, image);
+                        if (localPeak > peak) {
+                            index = i;
+                            peak = localPeak;
+                        }
+                    }
+                }
+            }
+            if ( (peak > maxPeak) || ((peak == maxPeak) && ((abs(index) < abs(best)) || ((abs(index) == abs(best)) && (index < best)))) ) { // as the full search among equal peaks
+                best = index;
+                maxPeak = peak;
+            }
+        }
+        return radiansToDegrees(best * stepRad);
+    }
+    // iteratively increase test angle,  alterating between +/- sign while increasing absolute value
+    for (rotation = 0.0; rotation <= rangeRad; rotation = (rotation>=0.0) ? -(rotation + stepRad) : -rotation ) {    
+        m = tan(rotation);
+        peak = detectEdgeRotationPeak(m, deskewScanSize, deskewScanDepth, shiftX, shiftY, left, top, right, bottom, image);
+        if (peak > maxPeak) {
+            detectedRotation = rotation;
+            maxPeak = peak;
+        }
+    }
+    return radiansToDegrees(detectedRotation);
+}
+
+
+/**
+ * Marks the upper edges of dark areas in a span of a row with 1, i.e. dark
+ * pixels whose upper neighbour is light, all others with 0. Solid dark areas
+ * like borders and pictures thus only count with their outline, while text
+ * keeps most of its weight.
+ *
+ * @param dark receives the dark pixels of the row, must contain the dark
+ *             pixels of the previous row (or zeros for the first row)
+ */
+void markDarkEdges(int x, int y, int count, unsigned char* dark, unsigned char* edge, struct IMAGE* image) {
+    unsigned char* row;
+    unsigned char d;
+    int i;
+
+    row = getRow(y, image);
+    if ( (! image->packed) && image->color ) {
+        row = getRowDarknessInverse(y, image);
+    }
+    for (i = 0; i < count; i++) {
+        if ( image->packed ) {
+            d = (getBit(row, x + i) != 0) ? 1 : 0;
+        } else {
+            d = (row[x + i] < GRAY) ? 1 : 0;
+        }
+        edge[i] = d & (dark[i] ^ 1);
+        dark[i] = d;
+    }
+}
+
+
+/**
+ * Adds the weights of a row to the projection profiles of several angles.
+ * The weight of pixel x gets added to bin y + offset[k][x] of profile k.
+ */
+void projectRow(unsigned char* weight, int width, int y, int count, int** offset, unsigned int** bins) {
+    int x;
+    int k;
+
+    for (x = 0; x < width; x++) {
+        if (weight[x] != 0) {
+            for (k = 0; k < count; k++) {
+                bins[k][y + offset[k][x]] += weight[x];
+            }
+        }
+    }
+}
+
+
+/**
+ * Prepares the projection profiles of count angles (in radians) for an area
+ * of the given size: offset[k][x] is the number of rows the profile of angle
+ * k is shifted at column x, plus a margin keeping all bins positive.
+ *
+ * @return number of bins in each profile
+ */
+int initProjections(double* angle, int count, int width, int height, int** offset, unsigned int** bins) {
+    int margin;
+    int size;
+    int x;
+    int k;
+
+    margin = (int)(width * fabs(tan(angle[0]))) + 1;
+    for (k = 1; k < count; k++) {
+        margin = max(margin, (int)(width * fabs(tan(angle[k]))) + 1);
+    }
+    size = height + 2 * margin;
+    for (k = 0; k < count; k++) {
+        offset[k] = (int*)malloc(width * sizeof(int));
+        bins[k] = (unsigned int*)calloc(size, sizeof(unsigned int));
+        for (x = 0; x < width; x++) {
+            offset[k][x] = margin - (int)floor(x * tan(angle[k]) + 0.5);
+        }
+    }
+    return size;
+}
+
+
+/**
+ * Returns the index of the projection profile with the highest sum of squared
+ * bins, i.e. the one in which text lines pile up in the fewest rows, and
+ * frees all profiles. On equal sums, the lower index wins.
+ */
+int bestProjection(int count, int size, int** offset, unsigned int** bins) {
+    double score;
+    double maxScore;
+    int best;
+    int k;
+    int i;
+
+    best = 0;
+    maxScore = -1.0;
+    for (k = 0; k < count; k++) {
+        score = 0.0;
+        for (i = 0; i < size; i++) {
+            score += (double)bins[k][i] * bins[k][i];
+        }
+        if (score > maxScore) {
+            maxScore = score;
+            best = k;
+        }
+        free(offset[k]);
+        free(bins[k]);
+    }
+    return best;
+}
+
+
+/**
+ * Detects rotation of a whole area by analyzing the projection profiles of the
+ * upper edges of its dark areas (see markDarkEdges()): when projected along
+ * the direction of the text lines, the profile shows sharp peaks and gaps.
+ * Angles between -deskewScanRange and +deskewScanRange are first tested on a
+ * copy of the area downsampled by 4 or 8 (counting the edge pixels of each
+ * block), in steps of deskewScanStep times the factor. The best angle is then
+ * refined in steps of deskewScanStep at full resolution.
+ * The result is in the sense of detectRotation().
+ */
+double detectProjectionRotation(float deskewScanRange, float deskewScanStep, int left, int top, int right, int bottom, struct IMAGE* image) {
+    double angle[MAX_ROTATION_STEPS];
+    int* offset[MAX_ROTATION_STEPS];
+    unsigned int* bins[MAX_ROTATION_STEPS];
+    unsigned char* small;
+    unsigned char* dark;
+    unsigned char* edge;
+    unsigned char* s;
+    double stepRad;
+    double coarseRad;
+    double best;
+    int factor;
+    int width;
+    int height;
+    int smallWidth;
+    int smallHeight;
+    int steps;
+    int count;
+    int size;
+    int x;
+    int y;
+    int i;
+
+    left = max(left, 0);
+    top = max(top, 0);
+    right = min(right, image->width - 1);
+    bottom = min(bottom, image->height - 1);
+    width = right - left + 1;
+    height = bottom - top + 1;
+    if ( (width <= 0) || (height <= 0) || (deskewScanStep <= 0.0) ) {
+        return 0.0;
+    }
+    factor = ( (width >= 2400) && (height >= 2400) ) ? 8 : 4;
+    stepRad = degreesToRadians((double)deskewScanStep);
+    coarseRad = stepRad * factor;
+
+    // downsampled copy: number of dark pixels in each block
+    smallWidth = (width + factor - 1) / factor;
+    smallHeight = (height + factor - 1) / factor;
+    small = (unsigned char*)calloc(smallWidth * smallHeight, 1);
+    dark = (unsigned char*)calloc(width, 1);
+    edge = (unsigned char*)malloc(width);
+    for (y = 0; y < height; y++) {
+        markDarkEdges(left, top + y, width, dark, edge, image);
+        s = &small[(y / factor) * smallWidth];
+        for (x = 0; x < width; x++) {
+            s[x / factor] += edge[x];
+        }
+    }
+
+    // coarse angles, alternating between +/- sign while increasing absolute value
+    steps = min((int)(deskewScanRange / deskewScanStep / factor + 0.000001), (MAX_ROTATION_STEPS - 1) / 2);
+    count = 0;
+    for (i = 0; i <= steps; i = (i >= 0) ? -(i + 1) : -i) {
+        if (i >= -steps) {
+            angle[count++] = i * coarseRad;
+        }
+    }
+    size = initProjections(angle, count, smallWidth, smallHeight, offset, bins);
+    for (y = 0; y < smallHeight; y++) {
+        projectRow(&small[y * smallWidth], smallWidth, y, count, offset, bins);
+    }
+    best = angle[bestProjection(count, size, offset, bins)];
+    free(small);
+
+    // refine around the coarse angle at full resolution
+    count = 0;
+    for (i = 0; i <= factor; i = (i >= 0) ? -(i + 1) : -i) {
+        if ( (i >= -factor) && (fabs(best + i * stepRad) <= degreesToRadians((double)deskewScanRange) + stepRad / 2) ) {
+            angle[count++] = best + i * stepRad;
+        }
+    }
+    size = initProjections(angle, count, width, height, offset, bins);
+    memset(dark, 0, width);
+    for (y = 0; y < height; y++) {
+        markDarkEdges(left, top + y, width, dark, edge, image);
+        projectRow(edge, width, y, count, offset, bins);
+    }
+    best = angle[bestProjection(count, size, offset, bins)];
+    free(dark);
+    free(edge);
+    return radiansToDegrees(best);
+}
+
+
+/**
+ * Reports the rotation detected for a mask by detectRotations() and returns
+ * it. With DESKEW_METHOD_EDGES, the rotations detected at the edges get
+ * averaged. The average is only accepted if the statistical deviation among
+ * the edges stays below deskewScanDeviation.
+ */
+double maskRotation(int deskewMethod, int deskewScanEdges, double edgeRotation[EDGES_COUNT], float deskewScanDeviation, int left, int top, int right, int bottom) {
+    const char* names[EDGES_COUNT] = { "left", "top", "right", "bottom" };
+    double rotation[EDGES_COUNT];
+    int count;
+    double total;
+    double average;
+    double deviation;
+    int edge;
+    int i;
+    
+    if (deskewMethod == DESKEW_METHOD_PROJECTION) {
+        if (verbose >= VERBOSE_NORMAL) {
+            printf("detected rotation by projection: [%d,%d,%d,%d]: %f\n", left,top,right,bottom, edgeRotation[LEFT]);
+        }
+        return edgeRotation[LEFT];
+    }
+    count = 0;
+    for (edge = LEFT; edge < EDGES_COUNT; edge++) {
+        if ((deskewScanEdges & 1<<edge) != 0) {
+            rotation[count] = edgeRotation[edge];
+            if (verbose >= VERBOSE_NORMAL) {
+                printf("detected rotation %s: [%d,%d,%d,%d]: %f\n", names[edge], left,top,right,bottom, rotation[count]);
+            }
+            count++;
+        }
+    }
+    
+    total = 0.0;
+    for (i = 0; i < count; i++) {
+        total += rotation[i];
+    }
+    average = total / count;
+    total = 0.0;
+    for (i = 0; i < count; i++) {
+        total += sqr(rotation[i]-average);
+    }
+    deviation = sqrt(total);
+    if (verbose >= VERBOSE_NORMAL) {
+        printf("rotation average: %f  deviation: %f  rotation-scan-deviation (maximum): %f  [%d,%d,%d,%d]\n", average, deviation, deskewScanDeviation, left,top,right,bottom);
+    }
+    if (deviation <= deskewScanDeviation) {
+        return average;
+    } else {
+        if (verbose >= VERBOSE_NONE) {
+            printf("out of deviation range - NO ROTATING\n");
+        }
+        return 0.0;
+    }
+}
+
+
+/**
+ * Runs a single edge scan (or projection analysis) of detectRotations().
+ * Task index / EDGES_COUNT is the mask, index % EDGES_COUNT the edge.
+ */
+void detectRotationTask(int index, void* data) {
+    struct ROTATION_SCAN* scan = data;
+    int* m;
+    int edge;
+
+    m = scan->mask[index / EDGES_COUNT];
+    edge = index % EDGES_COUNT;
+    if (scan->method == DESKEW_METHOD_PROJECTION) {
+        if (edge == LEFT) { // one analysis per mask
+            scan->rotation[index / EDGES_COUNT][LEFT] = detectProjectionRotation(scan->range, scan->step, m[LEFT], m[TOP], m[RIGHT], m[BOTTOM], scan->image);
+        }
+    } else if ((scan->edges & 1<<edge) != 0) {
+        if (edge == LEFT) {
+            scan->rotation[index / EDGES_COUNT][edge] = detectEdgeRotation(scan->range, scan->step, scan->search, scan->size, scan->depth, 1, 0, m[LEFT], m[TOP], m[RIGHT], m[BOTTOM], scan->image);
+        } else if (edge == TOP) {
+            scan->rotation[index / EDGES_COUNT][edge] = - detectEdgeRotation(scan->range, scan->step, scan->search, scan->size, scan->depth, 0, 1, m[LEFT], m[TOP], m[RIGHT], m[BOTTOM], scan->image);
+        } else if (edge == RIGHT) {
+            scan->rotation[index / EDGES_COUNT][edge] = detectEdgeRotation(scan->range, scan->step, scan->search, scan->size, scan->depth, -1, 0, m[LEFT], m[TOP], m[RIGHT], m[BOTTOM], scan->image);
+        } else { // BOTTOM
+            scan->rotation[index / EDGES_COUNT][edge] = - detectEdgeRotation(scan->range, scan->step, scan->search, scan->size, scan->depth, 0, -1, m[LEFT], m[TOP], m[RIGHT], m[BOTTOM], scan->image);
+        }
+    }
+}
+
+
+/**
+ * Detects the rotation of several masks. 
+ * With DESKEW_METHOD_EDGES, angles between -deskewScanRange and
+ * +deskewScanRange are scanned at the horizontal or vertical edges of each
+ * mask selected by deskewScanEdges. With DESKEW_METHOD_PROJECTION,
+ * detectProjectionRotation() is used for each mask.
+ * All scans run in parallel and print nothing, maskRotation() reports and
+ * combines the results of each mask afterwards.
+ *
+ * @param rotation receives the results of the edges of each mask
+ */
+void detectRotations(int deskewMethod, int deskewScanEdges, int deskewScanRange, float deskewScanStep, int deskewScanSearch, int deskewScanSize, float deskewScanDepth, int mask[MAX_MASKS][EDGES_COUNT], int maskCount, double rotation[MAX_MASKS][EDGES_COUNT], struct IMAGE* image) {
+    struct ROTATION_SCAN scan;
+
+    if ( image->color && (! image->packed) ) {
+        requireChannel(DARKNESS_INVERSE, image); // before threads start reading it
+    }
+    scan.method = deskewMethod;
+    scan.edges = deskewScanEdges;
+    scan.range = deskewScanRange;
+    scan.step = deskewScanStep;
+    scan.search = deskewScanSearch;
+    scan.size = deskewScanSize;
+    scan.depth = deskewScanDepth;
+    scan.mask = mask;
+    scan.rotation = rotation;
+    scan.image = image;
+    runTasks(maskCount * EDGES_COUNT, detectRotationTask, &scan);
+}
+
+
+/**
+ * Reads a sample of the pixel at (x,y) of the rotated area, pixels outside
+ * the area are white. Only used near the edges of the area, where the
+ * neighbours of a pixel may lie outside.
+ */
+unsigned int rotateSample(int x, int y, int c, struct ROTATION* rotation) {
+    long pos;
+
+    if ( (x < 0) || (x >= rotation->width) || (y < 0) || (y >= rotation->height) ) {
+        return (rotation->source->low != NULL) ? WHITE16 : WHITE;
+    }
+    pos = rotation->sourceOffset + (long)y * rotation->source->stride + x * (rotation->source->color ? 3 : 1) + c;
+    return (rotation->source->low != NULL) ? sample16(rotation->source, pos) : rotation->source->buffer[pos];
+}
+
+
+/**
+ * Writes the components v0, v1, v2 of a pixel of bytesPerPixel samples at
+ * offset t of the target of a kernel, and advances t to the next pixel
+ * (components written one by one, as loops over them are not unrolled).
+ */
+#define putPixel(put, bytesPerPixel, t, v0, v1, v2) \
+    do { \
+        put(targetHigh, targetLow, (t), (v0)); \
+        if ((bytesPerPixel) == 3) { \
+            put(targetHigh, targetLow, (t) + 1, (v1)); \
+            put(targetHigh, targetLow, (t) + 2, (v2)); \
+        } \
+        (t) += (bytesPerPixel); \
+    } while (0)
+
+
+/**
+ * Defines a function processing a band of rows of rotate(), for pixels of
+ * bytesPerPixel samples read by get(high, low, offset) and written by
+ * put(high, low, offset, value). With bilinear interpolation, each target
+ * row is walked with fixed-point steps along the rotated row in the source
+ * image. Nearest-neighbour sampling takes the offsets of a pixel from the
+ * middle pixels, truncated in single precision, which gives the same pixels
+ * as former versions. Supersampling samples the same way on a grid of
+ * supersample times as many pixels in each direction, so that a supersample
+ * of 2 gives the same result as rotating qpixels.
+ */
+#define DEFINE_ROTATE_BAND(name, bytesPerPixel, get, put, white) \
+void name(int band, void* data) { \
+    struct ROTATION* rotation = data; \
+    struct IMAGE* source; \
+    struct IMAGE* target; \
+    long long fx; /* source position, 32.32 fixed point */ \
+    long long fy; \
+    long long stepX; \
+    long long stepY; \
+    double dx; \
+    double dy; \
+    float cosval; /* (in single precision with nearest-neighbour sampling) */ \
+    float sinval; \
+    float rowCos[MAX_SUPERSAMPLE][4]; /* offsets of the sampled rows from the middle rows, multiplied by cos and sin */ \
+    float rowSin[MAX_SUPERSAMPLE][4]; \
+    float* columnOffsets; /* offsets of the sampled columns from the middle multiplied by cos and sin, NULL to calculate them */ \
+    float columnCos; \
+    float columnSin; \
+    unsigned int sum[3]; \
+    unsigned int wx; \
+    unsigned int wy; \
+    unsigned int v; \
+    long offset; \
+    long s00; \
+    long t; \
+    long stride; \
+    unsigned char* sourceHigh; /* (in local variables, as stores of bytes could change the image structures) */ \
+    unsigned char* sourceLow; \
+    unsigned char* targetHigh; \
+    unsigned char* targetLow; \
+    int x; \
+    int y; \
+    int sx; \
+    int sy; \
+    int c; \
+    int i; \
+    int j; \
+    int k; \
+    int p; \
+    int gridX; \
+    int gridY; \
+    int scale; /* sampled pixels per pixel in each direction */ \
+    int samples; \
+    int w, h; \
+    int halfX, halfY; /* middle pixels of the sampled grid */ \
+    int midX, midY; \
+    int part[5]; /* first columns of the parts of a sampled row measured from different middle pixels */ \
+    int origin[MAX_SUPERSAMPLE][4]; /* their middle rows */ \
+    int first; \
+\
+    source = rotation->source; \
+    target = rotation->target; \
+    w = rotation->width; \
+    h = rotation->height; \
+    offset = rotation->sourceOffset; /* may lie outside the buffer, but pixels inside the area do not */ \
+    stride = source->stride; \
+    sourceHigh = source->buffer; \
+    sourceLow = source->low; \
+    targetHigh = target->buffer; \
+    targetLow = target->low; \
+    scale = (rotation->interpolation == INTERPOLATION_SUPERSAMPLE) ? rotation->supersample : 1; \
+    samples = scale * scale; \
+    halfX = (w * scale - 1) / 2; \
+    halfY = (h * scale - 1) / 2; \
+    midX = w * scale / 2; \
+    midY = h * scale / 2; \
+    cosval = rotation->cosval; \
+    sinval = rotation->sinval; \
+    part[0] = 0; \
+    part[1] = max(0, halfX - 1); \
+    part[2] = min(w * scale, halfX + 1); \
+    part[3] = min(w * scale, midX + 2); \
+    part[4] = w * scale; \
+    columnOffsets = NULL; \
+    if (rotation->interpolation != INTERPOLATION_BILINEAR) { \
+        columnOffsets = (float*)malloc(2 * w * scale * sizeof(float)); \
+        for (x = 0; (columnOffsets != NULL) && (x < w * scale); x++) { \
+            i = (x <= halfX) ? halfX : midX; \
+            columnOffsets[2 * x] = (float)(x - i) * cosval; \
+            columnOffsets[2 * x + 1] = (float)(x - i) * sinval; \
+        } \
+    } \
+    stepX = (long long)(rotation->cosval * 4294967296.0); \
+    stepY = (long long)(-rotation->sinval * 4294967296.0); \
+    first = rotation->first + band * rotation->rows; \
+    for (y = first; (y < first + rotation->rows) && (y < rotation->last); y++) { \
+        t = rotation->targetOffset + (long)y * target->stride; \
+        if (rotation->interpolation != INTERPOLATION_BILINEAR) { \
+            for (k = 0; k < scale; k++) { /* the sampled rows of the target row */ \
+                gridY = y * scale + k; \
+                if ( (halfY == midY) || (gridY < halfY) || (gridY > midY) ) { /* the two middle rows of an even height were taken from either side */ \
+                    origin[k][0] = origin[k][1] = origin[k][2] = origin[k][3] = (gridY < halfY) ? midY : halfY; \
+                } else if (gridY == halfY) { \
+                    origin[k][0] = origin[k][1] = origin[k][2] = midY; \
+                    origin[k][3] = halfY; \
+                } else { \
+                    origin[k][0] = midY; \
+                    origin[k][1] = origin[k][2] = origin[k][3] = halfY; \
+                } \
+                for (j = 0; j < 4; j++) { \
+                    rowCos[k][j] = (float)(gridY - origin[k][j]) * cosval; \
+                    rowSin[k][j] = (float)(gridY - origin[k][j]) * sinval; \
+                } \
+            } \
+        } \
+        if (rotation->interpolation == INTERPOLATION_NEAREST) { \
+            for (j = 0; j < 4; j++) { /* parts of the row left of the middle, next to it on either side, right of it */ \
+                i = (j < 2) ? halfX : midX; \
+                for (x = part[j]; x < part[j + 1]; x++) { \
+                    if (columnOffsets != NULL) { \
+                        columnCos = columnOffsets[2 * x]; \
+                        columnSin = columnOffsets[2 * x + 1]; \
+                    } else { \
+                        columnCos = (float)(x - i) * cosval; \
+                        columnSin = (float)(x - i) * sinval; \
+                    } \
+                    sx = i + (int)(columnCos + rowSin[0][j]); \
+                    sy = origin[0][j] + (int)(rowCos[0][j] - columnSin); \
+                    if ( ((unsigned)sx < (unsigned)w) && ((unsigned)sy < (unsigned)h) ) { \
+                        s00 = offset + (long)sy * stride + sx * bytesPerPixel; \
+                        putPixel(put, bytesPerPixel, t, get(sourceHigh, sourceLow, s00), get(sourceHigh, sourceLow, s00 + 1), get(sourceHigh, sourceLow, s00 + 2)); \
+                    } else { \
+                        putPixel(put, bytesPerPixel, t, white, white, white); \
+                    } \
+                } \
+            } \
+        } else if (rotation->interpolation == INTERPOLATION_SUPERSAMPLE) { /* average of the pixels sampled for each target pixel */ \
+            for (x = 0; x < w; x++) { \
+                sum[0] = sum[1] = sum[2] = 0; \
+                for (gridX = x * scale; gridX < (x + 1) * scale; gridX++) { \
+                    p = (gridX < part[2]) ? ((gridX < part[1]) ? 0 : 1) : ((gridX < part[3]) ? 2 : 3); \
+                    i = (p < 2) ? halfX : midX; \
+                    if (columnOffsets != NULL) { \
+                        columnCos = columnOffsets[2 * gridX]; \
+                        columnSin = columnOffsets[2 * gridX + 1]; \
+                    } else { \
+                        columnCos = (float)(gridX - i) * cosval; \
+                        columnSin = (float)(gridX - i) * sinval; \
+                    } \
+                    for (k = 0; k < scale; k++) { \
+                        sx = i + (int)(columnCos + rowSin[k][p]); \
+                        sy = origin[k][p] + (int)(rowCos[k][p] - columnSin); \
+                        if ( ((unsigned)sx < (unsigned)(w * scale)) && ((unsigned)sy < (unsigned)(h * scale)) ) { \
+                            s00 = offset + (long)(sy / scale) * stride + (sx / scale) * bytesPerPixel; \
+                            for (c = 0; c < bytesPerPixel; c++) { \
+                                sum[c] += get(sourceHigh, sourceLow, s00 + c); \
+                            } \
+                        } else { \
+                            for (c = 0; c < bytesPerPixel; c++) { \
+                                sum[c] += white; \
+                            } \
+                        } \
+                    } \
+                } \
+                for (c = 0; c < bytesPerPixel; c++) { \
+                    v = sum[c] / samples; \
+                    put(targetHigh, targetLow, t + c, v); \
+                } \
+                t += bytesPerPixel; \
+            } \
+        } else { /* INTERPOLATION_BILINEAR, with 8 bit weights the sums of 16-bit samples still fit into 32 bits */ \
+            /* source position of the first pixel in the row */ \
+            dx = - rotation->centerX; \
+            dy = y - rotation->centerY; \
+            fx = (long long)((rotation->centerX + dx * rotation->cosval + dy * rotation->sinval) * 4294967296.0); \
+            fy = (long long)((rotation->centerY - dx * rotation->sinval + dy * rotation->cosval) * 4294967296.0); \
+            for (x = 0; x < w; x++) { \
+                sx = (int)(fx >> 32); \
+                sy = (int)(fy >> 32); \
+                wx = (unsigned int)((fx >> 24) & 0xff); /* 8 bit weights of the right and lower neighbours */ \
+                wy = (unsigned int)((fy >> 24) & 0xff); \
+                if ( ((unsigned)sx < (unsigned)(w - 1)) && ((unsigned)sy < (unsigned)(h - 1)) ) { \
+                    s00 = offset + (long)sy * stride + sx * bytesPerPixel; \
+                    for (c = 0; c < bytesPerPixel; c++) { \
+                        v = ( (get(sourceHigh, sourceLow, s00 + c) * (256 - wx) + get(sourceHigh, sourceLow, s00 + bytesPerPixel + c) * wx) * (256 - wy) \
+                            + (get(sourceHigh, sourceLow, s00 + stride + c) * (256 - wx) + get(sourceHigh, sourceLow, s00 + stride + bytesPerPixel + c) * wx) * wy + 32768 ) >> 16; \
+                        put(targetHigh, targetLow, t + c, v); \
+                    } \
+                } else { \
+                    for (c = 0; c < bytesPerPixel; c++) { \
+                        v = ( (rotateSample(sx, sy, c, rotation) * (256 - wx) + rotateSample(sx + 1, sy, c, rotation) * wx) * (256 - wy) \
+                            + (rotateSample(sx, sy + 1, c, rotation) * (256 - wx) + rotateSample(sx + 1, sy + 1, c, rotation) * wx) * wy + 32768 ) >> 16; \
+                        put(targetHigh, targetLow, t + c, v); \
+                    } \
+                } \
+                t += bytesPerPixel; \
+                fx += stepX; \
+                fy += stepY; \
+            } \
+        } \
+    } \
+    free(columnOffsets); \
+}
+
+DEFINE_ROTATE_BAND(rotateBandGray, 1, getSample8, putSample8, WHITE)
+DEFINE_ROTATE_BAND(rotateBandColor, 3, getSample8, putSample8, WHITE)
+DEFINE_ROTATE_BAND(rotateBandGray16, 1, getSample16, putSample16, WHITE16)
+DEFINE_ROTATE_BAND(rotateBandColor16, 3, getSample16, putSample16, WHITE16)
+
+
+/**
+ * Rotates a whole image buffer by the specified radians, around its middle-point.
+ * With nearest-neighbour interpolation, the buffer should usually have been
+ * converted to a qpixels-representation before, to increase quality.
+ * (To rotate parts of an image, extract the part with copyBuffer, rotate, and re-paste with copyBuffer.)
+ * Source and target must be of equal size, color mode and bitdepth.
+ *
+ * @param interpolation INTERPOLATION_NEAREST, INTERPOLATION_BILINEAR or INTERPOLATION_SUPERSAMPLE
+ * @param supersample number of samples per pixel in each direction with INTERPOLATION_SUPERSAMPLE
+ */
+void rotate(double radians, int interpolation, int supersample, struct IMAGE* source, struct IMAGE* target) {
+    struct ROTATION rotation;
+    
+    unpackImage(source);
+    unpackImage(target);
+    // target pixel (x,y) is taken from source pixel (cx + (x-cx)*cos + (y-cy)*sin, cy - (x-cx)*sin + (y-cy)*cos)
+    rotation.cosval = cos(radians);
+    rotation.sinval = sin(radians);
+    rotation.centerX = (source->width - 1) / 2.0;
+    rotation.centerY = (source->height - 1) / 2.0;
+    rotation.interpolation = interpolation;
+    rotation.supersample = max(1, min(supersample, MAX_SUPERSAMPLE));
+    rotation.width = source->width;
+    rotation.height = source->height;
+    rotation.first = 0;
+    rotation.last = target->height;
+    rotation.rows = 64;
+    rotation.sourceOffset = 0;
+    rotation.targetOffset = 0;
+    rotation.source = source;
+    rotation.target = target;
+    if (target->low != NULL) {
+        runTasks((target->height + rotation.rows - 1) / rotation.rows, target->color ? rotateBandColor16 : rotateBandGray16, &rotation);
+    } else {
+        runTasks((target->height + rotation.rows - 1) / rotation.rows, target->color ? rotateBandColor : rotateBandGray, &rotation);
+    }
+    invalidateChannels(target);
+}
+
+
+/**
+ * Converts an image buffer to a qpixel-representation, i.e. enlarge the whole
+ * whole image both horizontally and vertically by factor 2 (leading to a
+ * factor 4 increase in total).
+ * qpixelBuf must have been allocated before with 4-times amount of memory as
+ * buf.
+ */
+void convertToQPixels(struct IMAGE* image, struct IMAGE* qpixelImage) {
+    int x;
+    int y;
+    int bytesPerPixel;
+    int bytes;
+    unsigned char* s;
+    unsigned char* t;
+    unsigned char* row;
+    struct IMAGE plane;
+    struct IMAGE qpixelPlane;
+    
+    unpackImage(qpixelImage);
+    bytesPerPixel = image->color ? 3 : 1;
+    bytes = image->width * 2 * bytesPerPixel;
+    row = NULL;
+    if ( image->packed ) { // read bits into a temporary row, the image itself is not modified
+        row = (unsigned char*)malloc(image->width);
+    }
+    for (y = 0; y < image->height; y++) {
+        s = getRow(y, image);
+        if ( image->packed ) {
+            unpackBits(s, 0, image->width, row);
+            s = row;
+        }
+        t = getRow(y * 2, qpixelImage);
+        if ( ! image->color ) {
+            for (x = 0; x < image->width; x++) {
+                t[0] = t[1] = *s++;
+                t += 2;
+            }
+        } else { // color
+            for (x = 0; x < image->width; x++) {
+                t[0] = t[3] = s[0];
+                t[1] = t[4] = s[1];
+                t[2] = t[5] = s[2];
+                s += 3;
+                t += 6;
+            }
+        }
+        memcpy(getRow(y * 2 + 1, qpixelImage), getRow(y * 2, qpixelImage), bytes);
+    }
+    free(row);
+    if (lowPlane(image, &plane) && lowPlane(qpixelImage, &qpixelPlane)) {
+        convertToQPixels(&plane, &qpixelPlane);
+    }
+    invalidateChannels(qpixelImage);
+}
+
+
+/**
+ * Converts an image buffer back from a qpixel-representation to normal, i.e.
+ * shrinks the whole image both horizontally and vertically by factor 2
+ * (leading to a factor 4 decrease in total).
+ * buf must have been allocated before with 1/4-times amount of memory as
+ * qpixelBuf.
+ */
+void convertFromQPixels(struct IMAGE* qpixelImage, struct IMAGE* image) {
+    int x;
+    int y;
+    int i;
+    int bytesPerPixel;
+    unsigned char* a;
+    unsigned char* c;
+    unsigned char* t;
+    long pos;
+    int samples;
+    unsigned int v;
+    
+    unpackImage(image); // averaging creates gray values
+    bytesPerPixel = image->color ? 3 : 1;
+    if (image->low != NULL) { // average of 16-bit samples
+        samples = image->width * bytesPerPixel;
+        for (y = 0; y < image->height; y++) {
+            pos = (long)y * 2 * qpixelImage->stride;
+            t = getRow(y, image);
+            for (x = 0; x < samples; x++) {
+                i = (x / bytesPerPixel) * bytesPerPixel + x; // offset of the sample in the upper left pixel of the 4
+                v = (sample16(qpixelImage, pos + i) + sample16(qpixelImage, pos + i + bytesPerPixel)
+                    + sample16(qpixelImage, pos + qpixelImage->stride + i) + sample16(qpixelImage, pos + qpixelImage->stride + i + bytesPerPixel)) / 4;
+                t[x] = v >> 8;
+                image->low[y * image->stride + x] = v & 0xff;
+            }
+        }
+        invalidateChannels(image);
+        return;
+    }
+    for (y = 0; y < image->height; y++) {
+        a = getRow(y * 2, qpixelImage); // upper row
+        c = getRow(y * 2 + 1, qpixelImage); // lower row
+        t = getRow(y, image);
+        for (x = 0; x < image->width; x++) {
+            for (i = 0; i < bytesPerPixel; i++) { // average of each color component
+                *t++ = (a[i] + a[bytesPerPixel + i] + c[i] + c[bytesPerPixel + i]) / 4;
+            }
+            a += bytesPerPixel * 2;
+            c += bytesPerPixel * 2;
+        }
+    }
+    invalidateChannels(image);
+}
+
+
+/* --- stretching / resizing / shifting ------------------------------------ */
+
+/**
+ * Returns the weight of a source pixel at distance d from the center of a
+ * target pixel, in units of source pixels (or target pixels when shrinking).
+ */
+double resampleKernel(int filter, double d) {
+    d = fabs(d);
+    if (filter == STRETCH_BILINEAR) {
+        return (d < 1.0) ? 1.0 - d : 0.0;
+    } else { // STRETCH_LANCZOS, 3 lobes
+        if (d < 1e-8) {
+            return 1.0;
+        } else if (d < 3.0) {
+            return 3.0 * sin(M_PI * d) * sin(M_PI * d / 3.0) / (M_PI * M_PI * d * d);
+        } else {
+            return 0.0;
+        }
+    }
+}
+
+
+/**
+ * Calculates which source pixels make up each target pixel along one axis.
+ * STRETCH_BOX averages blocks of source pixels when shrinking, some of them
+ * one pixel larger to use up the remainder, and copies the nearest source
+ * pixel when enlarging. The other filters weight the source pixels around
+ * the target pixel's center, with the kernel widened when shrinking.
+ */
+void initResample(int filter, int sourceSize, int targetSize, struct RESAMPLE* resample) {
+    double scale;
+    double support;
+    double center;
+    double weights[1024];
+    double total;
+    int block;
+    int rest;
+    int fillIndex;
+    int position;
+    int last;
+    int largest;
+    int sum;
+    int i;
+    int j;
+
+    resample->start = (int*)malloc(targetSize * sizeof(int));
+    resample->count = (int*)malloc(targetSize * sizeof(int));
+    resample->weight = NULL;
+    resample->taps = 1;
+    if (filter == STRETCH_BOX) {
+        block = sourceSize / targetSize; // (0 if enlarging)
+        rest = (targetSize <= sourceSize) ? sourceSize % targetSize : targetSize;
+        fillIndex = 0;
+        position = 0;
+        for (i = 0; i < targetSize; i++) {
+            resample->count[i] = block;
+            if ( (((long long)i * rest) / targetSize) == fillIndex ) { // next fill index?
+                fillIndex++;
+                resample->count[i]++;
+            }
+            if (block == 0) { // enlarging, map coordinates directly
+                position = (int)(((long long)i * sourceSize) / targetSize);
+            }
+            resample->start[i] = position;
+            if (block > 0) { // shrinking
+                position += resample->count[i];
+            }
+            resample->taps = max(resample->taps, resample->count[i]);
+        }
+        return;
+    }
+    scale = (double)sourceSize / targetSize;
+    support = ((filter == STRETCH_BILINEAR) ? 1.0 : 3.0) * ((scale > 1.0) ? scale : 1.0);
+    resample->taps = min((int)ceil(support) * 2 + 1, 1024);
+    resample->weight = (int*)malloc(targetSize * resample->taps * sizeof(int));
+    for (i = 0; i < targetSize; i++) {
+        center = (i + 0.5) * scale;
+        resample->start[i] = max(0, (int)floor(center - support));
+        last = min(sourceSize, (int)ceil(center + support)); // exclusive
+        last = min(last, resample->start[i] + resample->taps);
+        total = 0.0;
+        for (j = resample->start[i]; j < last; j++) {
+            weights[j - resample->start[i]] = resampleKernel(filter, (j + 0.5 - center) / ((scale > 1.0) ? scale : 1.0));
+            total += weights[j - resample->start[i]];
+        }
+        resample->count[i] = last - resample->start[i];
+        sum = 0;
+        largest = 0;
+        for (j = 0; j < resample->count[i]; j++) { // normalized, pixels beyond the edges are left out
+            resample->weight[i * resample->taps + j] = (int)floor(weights[j] / total * (1<<RESAMPLE_BITS) + 0.5);
+            sum += resample->weight[i * resample->taps + j];
+            if (weights[j] > weights[largest]) {
+                largest = j;
+            }
+        }
+        resample->weight[i * resample->taps + largest] += (1<<RESAMPLE_BITS) - sum; // (rounding)
+    }
+}
+
+
+/**
+ * Frees the tables calculated by initResample().
+ */
+void freeResample(struct RESAMPLE* resample) {
+    free(resample->start);
+    free(resample->count);
+    free(resample->weight);
+}
+
+
+#define clampSum(sum, white) ( max(BLACK, min((white), (sum) >> (RESAMPLE_BITS + 6))) ) // sample of a weighted sum of the second pass of stretch kernels
+
+
+/**
+ * Defines a function calculating a band of rows of a stretched image, see
+ * stretch(), for pixels of bytesPerPixel samples read by get(high, low,
+ * offset) and written by put(high, low, offset, value), summed up in
+ * variables of type sumType. Each
+ * target row is calculated in two passes over whole rows: first the source
+ * rows it is made of are summed up, then the sums are combined along the row.
+ */
+#define DEFINE_STRETCH_BAND(name, bytesPerPixel, sumType, get, put, white) \
+void name(int band, void* data) { \
+    struct STRETCH_BAND* stretch = data; \
+    struct IMAGE* source; \
+    struct IMAGE* target; \
+    struct RESAMPLE* columns; \
+    struct RESAMPLE* rows; \
+    sumType* sums; \
+    sumType sum[3]; \
+    sumType outside; \
+    int* w; \
+    long pos; \
+    long p; \
+    long t; \
+    unsigned char* sourceHigh; /* (in local variables, as stores of bytes could change the image structures) */ \
+    unsigned char* sourceLow; \
+    unsigned char* targetHigh; \
+    unsigned char* targetLow; \
+    int stride; \
+    int first; \
+    int last; \
+    int inside; \
+    int start; \
+    int count; \
+    int x; \
+    int y; \
+    int i; \
+    int k; \
+\
+    source = stretch->source; \
+    target = stretch->target; \
+    columns = stretch->columns; \
+    rows = stretch->rows; \
+    sourceHigh = source->buffer; \
+    sourceLow = source->low; \
+    targetHigh = target->buffer; \
+    targetLow = target->low; \
+    stride = source->width * bytesPerPixel; \
+    sums = (sumType*)malloc(stride * sizeof(sumType)); \
+    first = band * stretch->height; \
+    last = min(first + stretch->height, target->height); \
+    for (y = first; y < last; y++) { \
+        t = (long)y * target->stride; \
+        if ( (stretch->filter == STRETCH_BOX) && (y > first) && (rows->start[y] == rows->start[y - 1]) && (rows->count[y] == rows->count[y - 1]) ) { /* enlarging: same as the row before */ \
+            memcpy(&target->buffer[t], &target->buffer[t - target->stride], target->stride); \
+            if (target->low != NULL) { \
+                memcpy(&target->low[t], &target->low[t - target->stride], target->stride); \
+            } \
+        } else if ( (stretch->filter == STRETCH_BOX) && (rows->count[y] == 1) && (rows->start[y] < source->height) ) { /* average along a single source row */ \
+            pos = (long)rows->start[y] * source->stride; \
+            for (x = 0; x < target->width; x++) { \
+                start = columns->start[x]; \
+                inside = min(columns->count[x], source->width - start); \
+                sum[0] = sum[1] = sum[2] = (sumType)white * (columns->count[x] - inside); \
+                for (k = 0; k < inside; k++) { \
+                    p = pos + (start + k) * bytesPerPixel; \
+                    sum[0] += get(sourceHigh, sourceLow, p); \
+                    if (bytesPerPixel == 3) { \
+                        sum[1] += get(sourceHigh, sourceLow, p + 1); \
+                        sum[2] += get(sourceHigh, sourceLow, p + 2); \
+                    } \
+                } \
+                count = columns->count[x]; \
+                putPixel(put, bytesPerPixel, t, sum[0] / count, sum[1] / count, sum[2] / count); \
+            } \
+        } else if (stretch->filter == STRETCH_BOX) { /* integer average, pixels beyond the source count as white */ \
+            inside = max(0, min(rows->count[y], source->height - rows->start[y])); \
+            outside = (sumType)white * (rows->count[y] - inside); \
+            for (i = 0; i < stride; i++) { \
+                sums[i] = outside; \
+            } \
+            for (k = 0; k < inside; k++) { \
+                pos = (long)(rows->start[y] + k) * source->stride; \
+                for (i = 0; i < stride; i++) { \
+                    sums[i] += get(sourceHigh, sourceLow, pos + i); \
+                } \
+            } \
+            for (x = 0; x < target->width; x++) { \
+                start = columns->start[x]; \
+                inside = min(columns->count[x], source->width - start); \
+                outside = (sumType)white * rows->count[y] * (columns->count[x] - inside); \
+                count = columns->count[x] * rows->count[y]; \
+                sum[0] = sum[1] = sum[2] = outside; \
+                for (k = 0; k < inside; k++) { \
+                    p = (start + k) * bytesPerPixel; \
+                    sum[0] += sums[p]; \
+                    if (bytesPerPixel == 3) { \
+                        sum[1] += sums[p + 1]; \
+                        sum[2] += sums[p + 2]; \
+                    } \
+                } \
+                putPixel(put, bytesPerPixel, t, sum[0] / count, sum[1] / count, sum[2] / count); \
+            } \
+        } else { /* weighted, in fixed point */ \
+            memset(sums, 0, stride * sizeof(sumType)); \
+            w = &rows->weight[y * rows->taps]; \
+            for (k = 0; k < rows->count[y]; k++) { \
+                pos = (long)(rows->start[y] + k) * source->stride; \
+                for (i = 0; i < stride; i++) { \
+                    sums[i] += (sumType)w[k] * get(sourceHigh, sourceLow, pos + i); \
+                } \
+            } \
+            for (i = 0; i < stride; i++) { /* keep 6 bits of precision for the second pass */ \
+                sums[i] = (sums[i] + (1 << (RESAMPLE_BITS - 7))) >> (RESAMPLE_BITS - 6); \
+            } \
+            for (x = 0; x < target->width; x++) { \
+                start = columns->start[x]; \
+                w = &columns->weight[x * columns->taps]; \
+                sum[0] = sum[1] = sum[2] = 1 << (RESAMPLE_BITS + 5); /* (rounding) */ \
+                for (k = 0; k < columns->count[x]; k++) { \
+                    p = (start + k) * bytesPerPixel; \
+                    sum[0] += w[k] * sums[p]; \
+                    if (bytesPerPixel == 3) { \
+                        sum[1] += w[k] * sums[p + 1]; \
+                        sum[2] += w[k] * sums[p + 2]; \
+                    } \
+                } \
+                putPixel(put, bytesPerPixel, t, clampSum(sum[0], white), clampSum(sum[1], white), clampSum(sum[2], white)); \
+            } \
+        } \
+    } \
+    free(sums); \
+}
+
+DEFINE_STRETCH_BAND(stretchBandGray, 1, int, getSample8, putSample8, WHITE)
+DEFINE_STRETCH_BAND(stretchBandColor, 3, int, getSample8, putSample8, WHITE)
+DEFINE_STRETCH_BAND(stretchBandGray16, 1, long long, getSample16, putSample16, WHITE16)
+DEFINE_STRETCH_BAND(stretchBandColor16, 3, long long, getSample16, putSample16, WHITE16)
+
+
+/**
+ * Stretches the image so that the resulting image has a new size. The
+ * weights of the source pixels are calculated once per row and column, and
+ * rows are resampled in two separable passes.
+ *
+ * @param w the new width to stretch to
+ * @param h the new height to stretch to
+ * @param filter STRETCH_BOX, STRETCH_BILINEAR or STRETCH_LANCZOS
+ */
+void stretch(int w, int h, int filter, struct IMAGE* image) {
+    struct IMAGE newimage;
+    struct RESAMPLE columns;
+    struct RESAMPLE rows;
+    struct STRETCH_BAND band;
+
+    if (verbose >= VERBOSE_MORE) {
+        printf("stretching %dx%d -> %dx%d\n", image->width, image->height, w, h);
+    }
+
+    unpackImage(image); // averaging creates gray values
+    initImage(&newimage, w, h, image->bitdepth, image->color, WHITE);
+    initResample(filter, image->width, w, &columns);
+    initResample(filter, image->height, h, &rows);
+    band.filter = filter;
+    band.columns = &columns;
+    band.rows = &rows;
+    band.height = 64;
+    band.source = image;
+    band.target = &newimage;
+    if (image->low != NULL) {
+        runTasks((h + band.height - 1) / band.height, image->color ? stretchBandColor16 : stretchBandGray16, &band);
+    } else {
+        runTasks((h + band.height - 1) / band.height, image->color ? stretchBandColor : stretchBandGray, &band);
+    }
+    freeResample(&columns);
+    freeResample(&rows);
+    // pixels may have resulted in gray values, which will be converted to 1-bit
+    // when the file gets saved, if .pbm format requested. black-threshold will apply.
+    invalidateChannels(&newimage);
+    replaceImage(image, &newimage);
+}
+
+/**
+ * Resizes the image so that the resulting sheet has a new size and the image
+ * content is zoomed to fit best into the sheet, while keeping it's aspect ration.
+ *
+ * @param w the new width to resize to
+ * @param h the new height to resize to
+ * @param filter see stretch()
+ */
+void resize(int w, int h, int filter, struct IMAGE* image) {
+    struct IMAGE newimage;
+    int ww;
+    int hh;
+    float wRat;
+    float hRat;
+    
+    if (verbose >= VERBOSE_NORMAL) {
+        printf("resizing %dx%d -> %dx%d\n", image->width, image->height, w, h);
+    }
+
+    wRat = (float)w / image->width;
+    hRat = (float)h / image->height;
+    if (wRat < hRat) { // horizontally more shrinking/less enlarging is needed: fill width fully, adjust height
+        ww = w;
+        hh = image->height * w / image->width;
+    } else if (hRat < wRat) {
+        ww = image->width * h / image->height;
+        hh = h;
+    } else { // wRat == hRat
+        ww = w;
+        hh = h;
+    }
+    stretch(ww, hh, filter, image);
+    initImage(&newimage, w, h, image->bitdepth, image->color, image->background);
+    centerImage(image, 0, 0, w, h, &newimage);
+    replaceImage(image, &newimage);
+}
+
+
+/**
+ * Shifts the image.
+ *
+ * @param shiftX horizontal shifting
+ * @param shiftY vertical shifting
+ */
+void shift(int shiftX, int shiftY, struct IMAGE* image) {
+    unsigned char* row;
+    unsigned char* target;
+    int y;
+    int yy;
+    int first;
+    int last;
+    int left;
+    int right;
+    int bytesPerPixel;
+    struct IMAGE plane;
+
+    if ( !(image->packed && isBlackOrWhite(image->background)) ) {
+        unpackImage(image);
+    }
+    bytesPerPixel = image->color ? 3 : 1;
+    left = max(0, -shiftX);
+    right = min(image->width, image->width - shiftX); // exclusive
+    row = image->packed ? (unsigned char*)malloc(image->stride) : NULL;
+    // rows are moved within the buffer, starting with the ones whose new place has already been read
+    first = (shiftY > 0) ? image->height - 1 : 0;
+    last = (shiftY > 0) ? -1 : image->height;
+    for (y = first; y != last; y += (shiftY > 0) ? -1 : 1) {
+        yy = y - shiftY; // source row
+        target = getRow(y, image);
+        if ( (yy < 0) || (yy >= image->height) || (left >= right) ) { // nothing moved here
+            if ( image->packed ) {
+                memset(target, 0, image->stride);
+                if (image->background == BLACK) {
+                    fillBits(target, 0, image->width, TRUE);
+                }
+            } else {
+                memset(target, image->background, image->stride);
+            }
+        } else if ( image->packed ) {
+            memcpy(row, getRow(yy, image), image->stride);
+            memset(target, 0, image->stride);
+            if (image->background == BLACK) {
+                fillBits(target, 0, image->width, TRUE);
+            }
+            copyBits(row, left, target, left + shiftX, right - left);
+        } else {
+            memmove(&target[(left + shiftX) * bytesPerPixel], &getRow(yy, image)[left * bytesPerPixel], (right - left) * bytesPerPixel);
+            memset(target, image->background, (left + shiftX) * bytesPerPixel);
+            memset(&target[(right + shiftX) * bytesPerPixel], image->background, (image->width - right - shiftX) * bytesPerPixel);
+        }
+    }
+    free(row);
+    if (lowPlane(image, &plane)) {
+        shift(shiftX, shiftY, &plane);
+    }
+    invalidateChannels(image);
+}
+
+
+/* --- mask-detection ----------------------------------------------------- */
+
+/**
+ * Finds one edge of non-black pixels headig from one starting point towards edge direction.
+ *
+ * @return number of shift-steps until blank edge found
+ */
+int detectEdge(int startX, int startY, int shiftX, int shiftY, int maskScanSize, int maskScanDepth, float maskScanThreshold, struct IMAGE* image) {
+    // either shiftX or shiftY is 0, the other value is -i|+i
+    int left;
+    int top;
+    int right;
+    int bottom;
+    int half;
+    int halfDepth;
     int blackness;
-    int lastBlackness;
-    int diff;
-    int maxDiff;
-    int maxBlacknessAbs;
-    int maxDepth;
-    int accumulatedBlackness;
-        
-    width = right-left+1;
-    height = bottom-top+1;    
-    maxBlacknessAbs = (int) 255 * deskewScanSize * deskewScanDepth;
+    int total;
+    int count;
     
-    if (shiftY==0) { // horizontal detection
-        if (deskewScanSize == -1) {
-            deskewScanSize = height;
+    half = maskScanSize / 2;
+    total = 0;
+    count = 0;
+    if (shiftY==0) { // vertical border is to be detected, horizontal shifting of scan-bar
+        if (maskScanDepth == -1) {
+            maskScanDepth = image->height;
+        }
+        halfDepth = maskScanDepth / 2;
+        left = startX - half;
+        top = startY - halfDepth;
+        right = startX + half;
+        bottom = startY + halfDepth;
+    } else { // horizontal border is to be detected, vertical shifting of scan-bar
+        if (maskScanDepth == -1) {
+            maskScanDepth = image->width;
+        }
+        halfDepth = maskScanDepth / 2;
+        left = startX - halfDepth;
+        top = startY - half;
+        right = startX + halfDepth;
+        bottom = startY + half;
+    }
+    
+    while (TRUE) { // !
+        blackness = 255 - brightnessRect(left, top, right, bottom, image);
+        total += blackness;
+        count++;
+        // is blackness below threshold*average?
+        if ((blackness < ((maskScanThreshold*total)/count))||(blackness==0)) { // this will surely become true when pos reaches the outside of the actual image area and blacknessRect() will deliver 0 because all pixels outside are considered white
+            return count; // ! return here, return absolute value of shifting difference
+        }
+        left += shiftX;
+        right += shiftX;
+        top += shiftY;
+        bottom += shiftY;
+    }
+}
+
+
+/**
+ * Detects a mask of white borders around a starting point.
+ * The result is returned via call-by-reference parameters left, top, right, bottom.
+ *
+ * @return the detected mask in left, top, right, bottom; or -1, -1, -1, -1 if no mask could be detected
+ */
+BOOLEAN detectMask(int startX, int startY, int maskScanDirections, int maskScanSize[DIRECTIONS_COUNT], int maskScanDepth[DIRECTIONS_COUNT], int maskScanStep[DIRECTIONS_COUNT], float maskScanThreshold[DIRECTIONS_COUNT], int maskScanMinimum[DIMENSIONS_COUNT], int maskScanMaximum[DIMENSIONS_COUNT], int* left, int* top, int* right, int* bottom, struct IMAGE* image) {
+    int width;
+    int height;
+    int half[DIRECTIONS_COUNT];
+    BOOLEAN success;
+    
+    half[HORIZONTAL] = maskScanSize[HORIZONTAL] / 2;
+    half[VERTICAL] = maskScanSize[VERTICAL] / 2;
+    if ((maskScanDirections & 1<<HORIZONTAL) != 0) {
+        *left = startX - maskScanStep[HORIZONTAL] * detectEdge(startX, startY, -maskScanStep[HORIZONTAL], 0, maskScanSize[HORIZONTAL], maskScanDepth[HORIZONTAL], maskScanThreshold[HORIZONTAL], image) - half[HORIZONTAL];
+        *right = startX + maskScanStep[HORIZONTAL] * detectEdge(startX, startY, maskScanStep[HORIZONTAL], 0, maskScanSize[HORIZONTAL], maskScanDepth[HORIZONTAL], maskScanThreshold[HORIZONTAL], image) + half[HORIZONTAL];
+    } else { // full range of sheet
+        *left = 0;
+        *right = image->width - 1;
+    }
+    if ((maskScanDirections & 1<<VERTICAL) != 0) {
+        *top = startY - maskScanStep[VERTICAL] * detectEdge(startX, startY, 0, -maskScanStep[VERTICAL], maskScanSize[VERTICAL], maskScanDepth[VERTICAL], maskScanThreshold[VERTICAL], image) - half[VERTICAL];
+        *bottom = startY + maskScanStep[VERTICAL] * detectEdge(startX, startY, 0, maskScanStep[VERTICAL], maskScanSize[VERTICAL], maskScanDepth[VERTICAL], maskScanThreshold[VERTICAL], image) + half[VERTICAL];
+    } else { // full range of sheet
+        *top = 0;
+        *bottom = image->height - 1;
+    }
+    
+    // if below minimum or above maximum, set to maximum
+    width = *right - *left;
+    height = *bottom - *top;
+    success = TRUE;
+    if ( ((maskScanMinimum[WIDTH] != -1) && (width < maskScanMinimum[WIDTH])) || ((maskScanMaximum[WIDTH] != -1) && (width > maskScanMaximum[WIDTH])) ) {
+        width = maskScanMaximum[WIDTH] / 2;
+        *left = startX - width;
+        *right = startX + width;
+        success = FALSE;;
+    }
+    if ( ((maskScanMinimum[HEIGHT] != -1) && (height < maskScanMinimum[HEIGHT])) || ((maskScanMaximum[HEIGHT] != -1) && (height > maskScanMaximum[HEIGHT])) ) {
+        height = maskScanMaximum[HEIGHT] / 2;
+        *top = startY - height;
+        *bottom = startY + height;
+        success = FALSE;
+    }
+    return success;
+}
+
+
+/**
+ * Detects masks around the points specified in point[].
+ *
+ * @param mask point to array into which detected masks will be stored
+ * @return number of masks stored in mask[][]
+ */
+int detectMasks(int mask[MAX_MASKS][EDGES_COUNT], BOOLEAN maskValid[MAX_MASKS], int point[MAX_POINTS][COORDINATES_COUNT], int pointCount, int maskScanDirections, int maskScanSize[DIRECTIONS_COUNT], int maskScanDepth[DIRECTIONS_COUNT], int maskScanStep[DIRECTIONS_COUNT], float maskScanThreshold[DIRECTIONS_COUNT], int maskScanMinimum[DIMENSIONS_COUNT], int maskScanMaximum[DIMENSIONS_COUNT],  struct IMAGE* image) {
+    int left;
+    int top;
+    int right;
+    int bottom;
+    int i;
+    int maskCount;
+    
+    maskCount = 0;
+    if (maskScanDirections != 0) {
+         requireIntegral(GRAYSCALE, -1, -1, image); // for brightnessRect()
+         for (i = 0; i < pointCount; i++) {
+             maskValid[i] = detectMask(point[i][X], point[i][Y], maskScanDirections, maskScanSize, maskScanDepth, maskScanStep, maskScanThreshold, maskScanMinimum, maskScanMaximum, &left, &top, &right, &bottom, image);
+             if (!(left==-1 || top==-1 || right==-1 || bottom==-1)) {
+                 mask[maskCount][LEFT] = left;
+                 mask[maskCount][TOP] = top;
+                 mask[maskCount][RIGHT] = right;
+                 mask[maskCount][BOTTOM] = bottom;
+                 maskCount++;
+                 if (verbose>=VERBOSE_NORMAL) {
+                     printf("auto-masking (%d,%d): %d,%d,%d,%d", point[i][X], point[i][Y], left, top, right, bottom);
+                     if (maskValid[i] == FALSE) { // (mask had been auto-set to full page size)
+                         printf(" (invalid detection, using full page size)");
+                     }
+                     printf("\n");
+                 }
+             } else {
+                 if (verbose>=VERBOSE_NORMAL) {
+                     printf("auto-masking (%d,%d): NO MASK FOUND\n", point[i][X], point[i][Y]);
+                 }
+             }
+             //if (maskValid[i] == FALSE) { // (mask had been auto-set to full page size)
+             //    if (verbose>=VERBOSE_NORMAL) {
+             //        printf("auto-masking (%d,%d): NO MASK DETECTED\n", point[i][X], point[i][Y]);
+             //    }
+             //}
+         }
+         freeIntegrals(image);
+    }
+    return maskCount;
+}
+
+
+/**
+ * Applies image masks to one band of rows, see applyMasks().
+ */
+void applyMasksBand(int band, void* data) {
+    struct MASKS_BAND* masks = data;
+    struct IMAGE* image;
+    int x;
+    int y;
+    int i;
+    int j;
+    int count;
+    int left[MAX_MASKS];
+    int right[MAX_MASKS];
+    int l, r;
+
+    image = masks->image;
+    for (y = band * masks->height; (y < (band + 1) * masks->height) && (y < image->height); y++) {
+        // collect the spans of all masks covering this row, sorted by left edge
+        count = 0;
+        for (i=0; i<masks->maskCount; i++) {
+            if (y>=masks->mask[i][TOP] && y<=masks->mask[i][BOTTOM]) {
+                l = max(masks->mask[i][LEFT], 0);
+                r = min(masks->mask[i][RIGHT], image->width - 1);
+                if (l <= r) {
+                    for (j = count; (j > 0) && (left[j-1] > l); j--) {
+                        left[j] = left[j-1];
+                        right[j] = right[j-1];
+                    }
+                    left[j] = l;
+                    right[j] = r;
+                    count++;
+                }
+            }
+        }
+        // delete everything outside the spans: set to white
+        x = 0;
+        for (i=0; i<count; i++) {
+            if (left[i] > x) {
+                fillRowSpan(masks->maskColor, x, y, left[i] - x, image);
+            }
+            x = max(x, right[i] + 1);
+        }
+        if (x < image->width) {
+            fillRowSpan(masks->maskColor, x, y, image->width - x, image);
+        }
+    }
+}
+
+
+/**
+ * Permanently applies image masks. Each pixel which is not covered by at least
+ * one mask is set to maskColor.
+ */
+void applyMasks(int mask[MAX_MASKS][EDGES_COUNT], int maskCount, int maskColor, struct IMAGE* image) {
+    struct MASKS_BAND masks;
+
+    if (maskCount<=0) {
+        return;
+    }
+    if ( image->packed && (!isBlackOrWhite(pixelGrayscale(red(maskColor), green(maskColor), blue(maskColor)))) ) {
+        unpackImage(image); // before threads start writing gray values
+    }
+    masks.mask = mask;
+    masks.maskCount = maskCount;
+    masks.maskColor = maskColor;
+    masks.height = 64;
+    masks.image = image;
+    runTasks((image->height + masks.height - 1) / masks.height, applyMasksBand, &masks);
+}
+
+
+/* --- wiping ------------------------------------------------------------- */
+
+/**
+ * Permanently wipes out areas of an images. Each pixel covered by a wipe-area
+ * is set to wipeColor.
+ */
+void applyWipes(int area[MAX_MASKS][EDGES_COUNT], int areaCount, int wipeColor, struct IMAGE* image) {
+    int y;
+    int i;
+    int count;
+    int left;
+    int right;
+
+    for (i = 0; i < areaCount; i++) {
+        count = 0;
+        left = max(area[i][LEFT], 0);
+        right = min(area[i][RIGHT], image->width - 1);
+        if (left <= right) {
+            for (y = max(area[i][TOP], 0); y <= min(area[i][BOTTOM], image->height - 1); y++) {
+                count += fillRowSpan(wipeColor, left, y, right - left + 1, image);
+            }
         }
-        limit(&deskewScanSize, MAX_ROTATION_SCAN_SIZE);
-        limit(&deskewScanSize, height);
+        if (verbose >= VERBOSE_MORE) {
+            printf("wipe [%d,%d,%d,%d]: %d pixels\n", area[i][LEFT], area[i][TOP], area[i][RIGHT], area[i][BOTTOM], count);
+        }
+    }
+}
 
-        maxDepth = width/2;
-        half = deskewScanSize/2;
-        outerOffset = (int)(abs(m) * half);
-        mid = height/2;
-        sideOffset = shiftX > 0 ? left-outerOffset : right+outerOffset;
-        X = sideOffset + half * m;
-        Y = top + mid - half;
-        stepX = -m;
-        stepY = 1.0;
-    } else { // vertical detection
-        if (deskewScanSize == -1) {
-            deskewScanSize = width;
+
+/* --- mirroring ---------------------------------------------------------- */
+
+/**
+ * Reverses the order of the bytes in an 8-byte word.
+ */
+unsigned long long swapBytes(unsigned long long v) {
+    v = ((v & 0x00FF00FF00FF00FFULL) << 8) | ((v >> 8) & 0x00FF00FF00FF00FFULL);
+    v = ((v & 0x0000FFFF0000FFFFULL) << 16) | ((v >> 16) & 0x0000FFFF0000FFFFULL);
+    return (v << 32) | (v >> 32);
+}
+
+
+/**
+ * Reverses the order of the pixels of an unpacked row in place. Grayscale
+ * rows are reversed 8 bytes at a time from both ends.
+ */
+void reverseRow(unsigned char* row, int width, BOOLEAN color) {
+    unsigned long long a;
+    unsigned long long b;
+    unsigned char* p;
+    unsigned char* q;
+    unsigned char c;
+
+    p = row;
+    if (color) {
+        q = &row[(width - 1) * 3];
+        while (p < q) {
+            c = p[0]; p[0] = q[0]; q[0] = c;
+            c = p[1]; p[1] = q[1]; q[1] = c;
+            c = p[2]; p[2] = q[2]; q[2] = c;
+            p += 3;
+            q -= 3;
+        }
+    } else {
+        q = &row[width];
+        while (q - p >= 16) {
+            q -= 8;
+            memcpy(&a, p, 8);
+            memcpy(&b, q, 8);
+            a = swapBytes(a);
+            b = swapBytes(b);
+            memcpy(p, &b, 8);
+            memcpy(q, &a, 8);
+            p += 8;
+        }
+        while (q - p >= 2) {
+            q--;
+            c = *p; *p = *q; *q = c;
+            p++;
         }
-        limit(&deskewScanSize, MAX_ROTATION_SCAN_SIZE);
-        limit(&deskewScanSize, width);
-        maxDepth = height/2;
-        half = deskewScanSize/2;
-        outerOffset = (int)(abs(m) * half);
-        mid = width/2;
-        sideOffset = shiftY > 0 ? top-outerOffset : bottom+outerOffset;
-        X = left + mid - half;
-        Y = sideOffset - (half * m);
-        stepX = 1.0;
-        stepY = -m; // (line goes upwards for negative degrees)
     }
+}
+
+
+/**
+ * Mirrors an image either horizontally, vertically, or both, in place.
+ */
+void mirror(int directions, struct IMAGE* image) {
+    int y;
+    int yy;
+    BOOLEAN horizontal;
+    BOOLEAN vertical;
+    unsigned char* row;
+    struct IMAGE plane;
     
-    // fill buffer with coordinates for rotated line in first unshifted position
-    for (lineStep = 0; lineStep < deskewScanSize; lineStep++) {
-        x[lineStep] = (int)X;
-        y[lineStep] = (int)Y;
-        X += stepX;
-        Y += stepY;
+    horizontal = ((directions & 1<<HORIZONTAL) != 0) ? TRUE : FALSE;
+    vertical = ((directions & 1<<VERTICAL) != 0) ? TRUE : FALSE;
+    row = (unsigned char*)malloc(image->stride);
+    for (y = 0; y < image->height; y++) {
+        yy = (vertical==TRUE) ? (image->height - y - 1) : y;
+        if (yy < y) { // already exchanged
+            break;
+        }
+        if (horizontal==TRUE) {
+            if (image->packed) {
+                reverseBits(getRow(y, image), image->width, row);
+                memcpy(getRow(y, image), row, image->stride);
+                if (yy != y) {
+                    reverseBits(getRow(yy, image), image->width, row);
+                    memcpy(getRow(yy, image), row, image->stride);
+                }
+            } else {
+                reverseRow(getRow(y, image), image->width, image->color);
+                if (yy != y) {
+                    reverseRow(getRow(yy, image), image->width, image->color);
+                }
+            }
+        }
+        if (yy != y) { // exchange rows
+            memcpy(row, getRow(y, image), image->stride);
+            memcpy(getRow(y, image), getRow(yy, image), image->stride);
+            memcpy(getRow(yy, image), row, image->stride);
+        }
     }
+    free(row);
+    if (lowPlane(image, &plane)) {
+        mirror(directions, &plane);
+    }
+    invalidateChannels(image);
+}
+
+
+/* --- flip-rotating ------------------------------------------------------ */
+
+/**
+ * Transposes the pixels of an image into a blank image with exchanged width
+ * and height, in tiles of FLIP_TILE x FLIP_TILE pixels, so that both the rows
+ * read and the rows written stay in the cache while a tile is processed.
+ *
+ * @param direction either -1 (rotate anti-clockwise) or 1 (rotate clockwise)
+ */
+void flipRotatePixels(int direction, struct IMAGE* image, struct IMAGE* newimage) {
+    int x;
+    int y;
+    int xx;
+    int yy;
+    int tileX;
+    int tileY;
+    int right;
+    int bottom;
+    int bytesPerPixel;
+    unsigned char* p;
+    unsigned char* t;
     
-    // now scan for edge, modify coordinates in buffer to shift line into search direction (towards the middle point of the area)
-    // stop either when detectMaxDepth steps are shifted, or when diff falls back to less than detectThreshold*maxDiff
-    lastBlackness = 0;
-    diff = 0;
-    maxDiff = 0;
-    accumulatedBlackness = 0;
-    for (dep = 0; (accumulatedBlackness < maxBlacknessAbs) && (dep < maxDepth) ; dep++) {
-        // calculate blackness of virtual line
-        blackness = 0;
-        for (lineStep = 0; lineStep < deskewScanSize; lineStep++) {
-            xx = x[lineStep];
-            x[lineStep] += shiftX;
-            yy = y[lineStep];
-            y[lineStep] += shiftY;
-            if ((xx >= left) && (xx <= right) && (yy >= top) && (yy <= bottom)) {
-                pixel = getPixelDarknessInverse(xx, yy, image);
-                blackness += (255 - pixel);
+    bytesPerPixel = image->color ? 3 : 1;
+    for (tileY = 0; tileY < image->height; tileY += FLIP_TILE) {
+        bottom = min(tileY + FLIP_TILE, image->height);
+        for (tileX = 0; tileX < image->width; tileX += FLIP_TILE) {
+            right = min(tileX + FLIP_TILE, image->width);
+            for (y = tileY; y < bottom; y++) {
+                xx = ((direction > 0) ? image->height - 1 : 0) - y * direction;
+                p = getRow(y, image);
+                if ( image->packed ) {
+                    for (x = tileX; x < right; x++) {
+                        if ( ((x & 7) == 0) && (x + 8 <= right) && (p[x >> 3] == 0) ) { // skip 8 white pixels at once
+                            x += 7;
+                        } else if (getBit(p, x) != 0) {
+                            yy = ((direction < 0) ? image->width - 1 : 0) + x*direction;
+                            getRow(yy, newimage)[xx >> 3] |= 128 >> (xx & 7);
+                        }
+                    }
+                } else {
+                    p = &p[tileX * bytesPerPixel];
+                    for (x = tileX; x < right; x++) {
+                        yy = ((direction < 0) ? image->width - 1 : 0) + x*direction;
+                        t = &getRow(yy, newimage)[xx * bytesPerPixel];
+                        t[0] = *p++;
+                        if (image->color) {
+                            t[1] = *p++;
+                            t[2] = *p++;
+                        }
+                    }
+                }
             }
         }
-        diff = blackness - lastBlackness;
-        lastBlackness = blackness;
-        if (diff >= maxDiff) {
-            maxDiff = diff;
-        }
-        accumulatedBlackness += blackness;
     }
-    if (dep < maxDepth) { // has not terminated only because middle was reached
-        return maxDiff;
+}
+
+
+/**
+ * Rotates an image clockwise or anti-clockwise in 90-degrees.
+ *
+ * @param direction either -1 (rotate anti-clockwise) or 1 (rotate clockwise)
+ */
+void flipRotate(int direction, struct IMAGE* image) {
+    struct IMAGE newimage;
+    struct IMAGE plane;
+    struct IMAGE newplane;
+
+    if ( image->packed ) {
+        initPackedImage(&newimage, image->height, image->width, WHITE); // exchanged width and height
     } else {
-        return 0;
+        initImage(&newimage, image->height, image->width, image->bitdepth, image->color, WHITE); // exchanged width and height
     }
+    flipRotatePixels(direction, image, &newimage);
+    if (lowPlane(image, &plane) && lowPlane(&newimage, &newplane)) {
+        flipRotatePixels(direction, &plane, &newplane);
+    }
+    invalidateChannels(&newimage);
+    replaceImage(image, &newimage);
 }
 
 
+/* --- blackfilter -------------------------------------------------------- */
+
 /**
- * Detects rotation at one edge of the area specified by left, top, right, bottom.
- * Which of the four edges to take depends on whether shiftX or shiftY is non-zero,
- * and what sign this shifting value has.
+ * Filters out solidly black areas scanning to one direction.
+ *
+ * @param stepX is 0 if stepY!=0
+ * @param stepY is 0 if stepX!=0
+ * @see blackfilter()
  */
-double detectEdgeRotation(float deskewScanRange, float deskewScanStep, int deskewScanSize, float deskewScanDepth, int shiftX, int shiftY, int left, int top, int right, int bottom, struct IMAGE* image) {
-    // either shiftX or shiftY is 0, the other value is -i|+i
-    // depending on shiftX/shiftY the start edge for shifting is determined
-    double rangeRad;
-    double stepRad;
-    double rotation;
-    int peak;
-    int maxPeak;
-    double detectedRotation;
-    double m;
+void blackfilterScan(int stepX, int stepY, int size, int dep, float threshold, int exclude[MAX_MASKS][EDGES_COUNT], int excludeCount, int intensity, float blackThreshold, struct IMAGE* image) {
+    int left;
+    int top;
+    int right;
+    int bottom;
+    int blackness;
+    int thresholdBlack;
+    int x;
+    int y;
+    int shiftX;
+    int shiftY;
+    int l, t, r, b;
+    int total;
+    int diffX;
+    int diffY;
+    int mask[EDGES_COUNT];
+    BOOLEAN alreadyExcludedMessage;
+    unsigned char* filled;
+    int stride;
 
-    rangeRad = degreesToRadians((double)deskewScanRange);
-    stepRad = degreesToRadians((double)deskewScanStep);
-    detectedRotation = 0.0;
-    maxPeak = 0;    
-    // iteratively increase test angle,  alterating between +/- sign while increasing absolute value
-    for (rotation = 0.0; rotation <= rangeRad; rotation = (rotation>=0.0) ? -(rotation + stepRad) : -rotation ) {    
-        m = tan(rotation);
-        peak = detectEdgeRotationPeak(m, deskewScanSize, deskewScanDepth, shiftX, shiftY, left, top, right, bottom, image);
-        if (peak > maxPeak) {
-            detectedRotation = rotation;
-            maxPeak = peak;
+    thresholdBlack = (int)(WHITE * (1.0-blackThreshold));
+    stride = (image->width + 7) >> 3;
+    filled = (unsigned char*)calloc(stride * image->height, 1); // pixels already flood-filled
+    total = size * dep;
+    if (stepX != 0) { // horizontal scanning
+        left = 0;
+        top = 0;
+        right = size -1;
+        bottom = dep - 1;
+        shiftX = 0;
+        shiftY = dep;
+    } else { // vertical scanning
+        left = 0;
+        top = 0;
+        right = dep -1;
+        bottom = size - 1;
+        shiftX = dep;
+        shiftY = 0;
+    }
+    while ((left < image->width) && (top < image->height)) { // individual scanning "stripes" over the whole sheet
+        l = left;
+        t = top;
+        r = right;
+        b = bottom;
+        // make sure last stripe does not reach outside sheet, shift back inside (next +=shift will exit while-loop)
+        if (r >= image->width || b >= image->height) {
+            diffX = r-image->width+1;
+            diffY = b-image->height+1;
+            l -= diffX;
+            t -= diffY;
+            r -= diffX;
+            b -= diffY;
+        }
+        alreadyExcludedMessage = FALSE;
+        while ((l < image->width) && (t < image->height)) { // single scanning "stripe"
+            blackness = 255 - darknessInverseRect(l, t, r, b, image);
+            if (blackness >= 255*threshold) { // found a solidly black area
+                mask[LEFT] = l;
+                mask[TOP] = t;
+                mask[RIGHT] = r;
+                mask[BOTTOM] = b;
+                if (! masksOverlapAny(mask, exclude, excludeCount) ) {
+                    if (verbose >= VERBOSE_NORMAL) {
+                        printf("black-area flood-fill: [%d,%d,%d,%d]\n", l, t, r, b);
+                        alreadyExcludedMessage = FALSE;
+                    }
+                    // start flood-fill in this area (on each pixel to make sure we get everything, in most cases first flood-fill from first pixel will delete all other black pixels in the area already)
+                    for (y = max(t, 0); y <= min(b, image->height - 1); y++) {
+                        for (x = max(l, 0); x <= min(r, image->width - 1); x++) {
+                            if (getBit(&filled[y * stride], x) == 0) {
+                                floodFill(x, y, pixelValue(WHITE, WHITE, WHITE), 0, thresholdBlack, intensity, filled, NULL, image);
+                            }
+                        }
+                    }
+                } else {
+                    if ((verbose >= VERBOSE_NORMAL) && (!alreadyExcludedMessage)) {
+                        printf("black-area EXCLUDED: [%d,%d,%d,%d]\n", l, t, r, b);
+                        alreadyExcludedMessage = TRUE; // do this only once per scan-stripe, otherwise too many mesages
+                    }
+                }
+            }
+            l += stepX;
+            t += stepY;
+            r += stepX;
+            b += stepY;
         }
+        left += shiftX;
+        top += shiftY;
+        right += shiftX;
+        bottom += shiftY;
     }
-    return radiansToDegrees(detectedRotation);
+    free(filled);
 }
 
 
 /**
- * Detect rotation of a whole area. 
- * Angles between -deskewScanRange and +deskewScanRange are scanned, at either the
- * horizontal or vertical edges of the area specified by left, top, right, bottom.
+ * Filters out solidly black areas, as appearing on bad photocopies.
+ * A virtual bar of width 'size' and height 'depth' is horizontally moved 
+ * above the middle of the sheet (or the full sheet, if depth ==-1).
  */
-double detectRotation(int deskewScanEdges, int deskewScanRange, float deskewScanStep, int deskewScanSize, float deskewScanDepth, float deskewScanDeviation, int left, int top, int right, int bottom, struct IMAGE* image) {
-    double rotation[4];
-    int count;
-    double total;
-    double average;
-    double deviation;
-    int i;
-    
-    count = 0;
-    
-    if ((deskewScanEdges & 1<<LEFT) != 0) {
-        // left
-        rotation[count] = detectEdgeRotation(deskewScanRange, deskewScanStep, deskewScanSize, deskewScanDepth, 1, 0, left, top, right, bottom, image);
-        if (verbose >= VERBOSE_NORMAL) {
-            printf("detected rotation left: [%d,%d,%d,%d]: %f\n", left,top,right,bottom, rotation[count]);
-        }
-        count++;
-    }
-    if ((deskewScanEdges & 1<<TOP) != 0) {
-        // top
-        rotation[count] = - detectEdgeRotation(deskewScanRange, deskewScanStep, deskewScanSize, deskewScanDepth, 0, 1, left, top, right, bottom, image);
-        if (verbose >= VERBOSE_NORMAL) {
-            printf("detected rotation top: [%d,%d,%d,%d]: %f\n", left,top,right,bottom, rotation[count]);
-        }
-        count++;
-    }
-    if ((deskewScanEdges & 1<<RIGHT) != 0) {
-        // right
-        rotation[count] = detectEdgeRotation(deskewScanRange, deskewScanStep, deskewScanSize, deskewScanDepth, -1, 0, left, top, right, bottom, image);
-        if (verbose >= VERBOSE_NORMAL) {
-            printf("detected rotation right: [%d,%d,%d,%d]: %f\n", left,top,right,bottom, rotation[count]);
-        }
-        count++;
-    }
-    if ((deskewScanEdges & 1<<BOTTOM) != 0) {
-        // bottom
-        rotation[count] = - detectEdgeRotation(deskewScanRange, deskewScanStep, deskewScanSize, deskewScanDepth, 0, -1, left, top, right, bottom, image);
-        if (verbose >= VERBOSE_NORMAL) {
-            printf("detected rotation bottom: [%d,%d,%d,%d]: %f\n", left,top,right,bottom, rotation[count]);
-        }
-        count++;
-    }
-    
-    total = 0.0;
-    for (i = 0; i < count; i++) {
-        total += rotation[i];
-    }
-    average = total / count;
-    total = 0.0;
-    for (i = 0; i < count; i++) {
-        total += sqr(rotation[i]-average);
+void blackfilter(int blackfilterScanDirections, int blackfilterScanSize[DIRECTIONS_COUNT], int blackfilterScanDepth[DIRECTIONS_COUNT], int blackfilterScanStep[DIRECTIONS_COUNT], float blackfilterScanThreshold, int blackfilterExclude[MAX_MASKS][EDGES_COUNT], int blackfilterExcludeCount, int blackfilterIntensity, float blackThreshold, struct IMAGE* image) {
+    requireIntegral(DARKNESS_INVERSE, -1, -1, image); // for darknessInverseRect()
+    if ( image->color && (! image->packed) ) {
+        requireChannel(GRAYSCALE, image); // for floodFill()
     }
-    deviation = sqrt(total);
-    if (verbose >= VERBOSE_NORMAL) {
-        printf("rotation average: %f  deviation: %f  rotation-scan-deviation (maximum): %f  [%d,%d,%d,%d]\n", average, deviation, deskewScanDeviation, left,top,right,bottom);
+    if ((blackfilterScanDirections & 1<<HORIZONTAL) != 0) { // left-to-right scan
+        blackfilterScan(blackfilterScanStep[HORIZONTAL], 0, blackfilterScanSize[HORIZONTAL], blackfilterScanDepth[HORIZONTAL], blackfilterScanThreshold, blackfilterExclude, blackfilterExcludeCount, blackfilterIntensity, blackThreshold, image);
     }
-    if (deviation <= deskewScanDeviation) {
-        return average;
-    } else {
-        if (verbose >= VERBOSE_NONE) {
-            printf("out of deviation range - NO ROTATING\n");
-        }
-        return 0.0;
+    if ((blackfilterScanDirections & 1<<VERTICAL) != 0) { // top-to-bottom scan
+        blackfilterScan(0, blackfilterScanStep[VERTICAL], blackfilterScanSize[VERTICAL], blackfilterScanDepth[VERTICAL], blackfilterScanThreshold, blackfilterExclude, blackfilterExcludeCount, blackfilterIntensity, blackThreshold, image);
     }
+    freeIntegrals(image);
 }
 
 
+/* --- noisefilter -------------------------------------------------------- */
+
 /**
- * Rotates a whole image buffer by the specified radians, around its middle-point.
- * Usually, the buffer should have been converted to a qpixels-representation before, to increase quality.
- * (To rotate parts of an image, extract the part with copyBuffer, rotate, and re-paste with copyBuffer.)
+ * Applies a simple noise filter to the image.
+ *
+ * @param intensity maximum cluster size to delete
+ * @param method NOISEFILTER_COMPONENTS to delete connected clusters of up to
+ *               intensity pixels, NOISEFILTER_RINGS to delete clusters found by
+ *               counting dark pixels in growing square rings around each dark
+ *               pixel (behaviour of previous versions)
+ * @param first only clusters starting in the rows first..last-1 are deleted,
+ *              the rows of the image further away than intensity+1 rows from
+ *              these are not touched
  */
-//void rotate(double radians, struct IMAGE* source, struct IMAGE* target, double* trigonometryCache, int trigonometryCacheBaseSize) {
-void rotate(double radians, struct IMAGE* source, struct IMAGE* target) {
+int noisefilterRows(int intensity, int method, float whiteThreshold, int first, int last, struct IMAGE* image) {
+    struct NOISE_FILTER filter;
     int x;
     int y;
-    int midX;
-    int midY;
-    int midMax;
-    int halfX;
-    int halfY;
-    int dX;
-    int dY;
-    float m11;
-    float m12;
-    float m21;
-    float m22;
-    int diffX;
-    int diffY;
-    int oldX;
-    int oldY;
+    int whiteMin;
+    int count;
     int pixel;
-    float sinval;
-    float cosval;
-    int w, h;
+    int neighbors;
     
-    w = source->width;
-    h = source->height;
-    halfX = (w-1)/2;
-    halfY = (h-1)/2;    
-    midX = w/2;
-    midY = h/2;    
-    midMax = max(midX, midY);
-
-    // create 2D rotation matrix
-    sinval = sin(radians); // no use of sincos()-function for compatibility, no performace bottleneck anymore anyway
-    cosval = cos(radians);
-    m11 = cosval;
-    m12 = sinval;
-    m21 = -sinval;
-    m22 = cosval;
-
-    // step through all pixels of the target image, 
-    // symmetrically in all four quadrants to reduce trigonometric calculations
-
-    for (dY = 0; dY <= midMax; dY++) {
-
-        for (dX = 0; dX <= midMax; dX++) {
-        
-            // matrix multiplication to get rotated pixel pos (as in quadrant I)
-            diffX = dX * m11 + dY * m21;
-            diffY = dX * m12 + dY * m22;
-
-            // quadrant I
-            x = midX + dX;
-            y = midY - dY;
-            if ((x < w) && (y >= 0)) {
-                oldX = midX + diffX;
-                oldY = midY - diffY;
-                pixel = getPixel(oldX, oldY, source);
-                setPixel(pixel, x, y, target);
-            }
-            
-            // quadrant II
-            x = halfX - dY;
-            y = midY - dX;
-            if ((x >=0) && (y >= 0)) {
-                oldX = halfX - diffY;
-                oldY = midY - diffX;
-                pixel = getPixel(oldX, oldY, source);
-                setPixel(pixel, x, y, target);
-            }
-            
-            // quadrant III
-            x = halfX - dX;
-            y = halfY + dY;
-            if ((x >=0) && (y < h)) {
-                oldX = halfX - diffX;
-                oldY = halfY + diffY;
-                pixel = getPixel(oldX, oldY, source);
-                setPixel(pixel, x, y, target);
+    whiteMin = (int)(WHITE * whiteThreshold);
+    if ( image->color && (! image->packed) ) { // for getPixelLightness() and getPixelDarknessInverse()
+        requireChannel(LIGHTNESS, image);
+        if (method != NOISEFILTER_COMPONENTS) {
+            requireChannel(DARKNESS_INVERSE, image);
+        }
+    }
+    if (method == NOISEFILTER_COMPONENTS) {
+        if (intensity <= 0) {
+            return 0;
+        }
+        filter.intensity = intensity;
+        filter.whiteMin = whiteMin;
+        filter.first = first;
+        filter.last = last;
+        filter.count = 0;
+        filter.stack = (int*)malloc(intensity * 2 * sizeof(int));
+        filter.image = image;
+        labelComponents(whiteMin, clearNoise, &filter, image);
+        free(filter.stack);
+        return filter.count;
+    }
+    count = 0;
+    for (y = first; y < last; y++) {
+        for (x = 0; x < image->width; x++) {
+            if ( image->packed && ((x & 7) == 0) && (getRow(y, image)[x >> 3] == 0) ) { // skip 8 white pixels at once
+                x += 7;
+                continue;
             }
-            
-            // quadrant IV
-            x = midX + dY;
-            y = halfY + dX;
-            if ((x < w) && (y < h)) {
-                oldX = midX + diffY;
-                oldY = halfY + diffX;
-                pixel = getPixel(oldX, oldY, source);
-                setPixel(pixel, x, y, target);
+            pixel = getPixelDarknessInverse(x, y, image);
+            if (pixel < whiteMin) { // one dark pixel found
+                neighbors = countPixelNeighbors(x, y, intensity, whiteMin, image); // get number of non-light pixels in neighborhood
+                if (neighbors <= intensity) { // ...not more than 'intensity'?
+                    clearPixelNeighbors(x, y, whiteMin, image); // delete area
+                    count++;
+                }
             }
         }
     }
+    return count;
 }
 
 
 /**
- * Converts an image buffer to a qpixel-representation, i.e. enlarge the whole
- * whole image both horizontally and vertically by factor 2 (leading to a
- * factor 4 increase in total).
- * qpixelBuf must have been allocated before with 4-times amount of memory as
- * buf.
+ * Applies a simple noise filter to the whole image, see noisefilterRows().
  */
-void convertToQPixels(struct IMAGE* image, struct IMAGE* qpixelImage) {
-    int x;
-    int y;
-    int xx;
-    int yy;
-    int pixel;
-    
-    yy = 0;
-    for (y = 0; y < image->height; y++) {
-        xx = 0;
-        for (x = 0; x < image->width; x++) {
-            pixel = getPixel(x, y, image);
-            setPixel(pixel, xx, yy, qpixelImage);
-            setPixel(pixel, xx+1, yy, qpixelImage);
-            setPixel(pixel, xx, yy+1, qpixelImage);
-            setPixel(pixel, xx+1, yy+1, qpixelImage);
-            xx += 2;
-        }
-        yy += 2;
-    }
+int noisefilter(int intensity, int method, float whiteThreshold, struct IMAGE* image) {
+    return noisefilterRows(intensity, method, whiteThreshold, 0, image->height, image);
 }
 
 
+/* --- blurfilter --------------------------------------------------------- */
+
 /**
- * Converts an image buffer back from a qpixel-representation to normal, i.e.
- * shrinks the whole image both horizontally and vertically by factor 2
- * (leading to a factor 4 decrease in total).
- * buf must have been allocated before with 1/4-times amount of memory as
- * qpixelBuf.
+ * Processes a single window of the blurfilter, see blurfilter().
  */
-void convertFromQPixels(struct IMAGE* qpixelImage, struct IMAGE* image) {
-    int x;
-    int y;
-    int xx;
-    int yy;
-    int pixel;
-    int a,b,c,d;
-    int r, g, bl;
-    
-    yy = 0;
-    for (y = 0; y < image->height; y++) {
-        xx = 0;
-        for (x = 0; x < image->width; x++) {
-            a = getPixel(xx, yy, qpixelImage);
-            b = getPixel(xx+1, yy, qpixelImage);
-            c = getPixel(xx, yy+1, qpixelImage);
-            d = getPixel(xx+1, yy+1, qpixelImage);
-            r = (red(a) + red(b) + red(c) + red(d)) / 4;
-            g = (green(a) + green(b) + green(c) + green(d)) / 4;
-            bl = (blue(a) + blue(b) + blue(c) + blue(d)) / 4;
-            pixel = pixelValue(r, g, bl);
-            setPixel(pixel, x, y, image);
-            xx += 2;
-        }
-        yy += 2;
+int blurfilterWindow(int left, int top, int right, int bottom, struct WINDOW_SCAN* scan) {
+    int* step;
+    int count;
+    int max;
+    int total;
+
+    step = scan->step;
+    total = scan->size[HORIZONTAL] * scan->size[VERTICAL];
+    max = 0;
+    count = countPixelsRect(left, top, right, bottom, 0, scan->brightness, FALSE, scan->image);
+    if (count > max) {
+        max = count;
+    }
+    count = countPixelsRect(left-step[HORIZONTAL], top-step[VERTICAL], right-step[HORIZONTAL], bottom-step[VERTICAL], 0, scan->brightness, FALSE, scan->image);
+    if (count > max) {
+        max = count;
     }
+    count = countPixelsRect(left+step[HORIZONTAL], top-step[VERTICAL], right+step[HORIZONTAL], bottom-step[VERTICAL], 0, scan->brightness, FALSE, scan->image);
+    if (count > max) {
+        max = count;
+    }
+    count = countPixelsRect(left-step[HORIZONTAL], top+step[VERTICAL], right-step[HORIZONTAL], bottom+step[VERTICAL], 0, scan->brightness, FALSE, scan->image);
+    if (count > max) {
+        max = count;
+    }
+    count = countPixelsRect(left+step[HORIZONTAL], top+step[VERTICAL], right+step[HORIZONTAL], bottom+step[VERTICAL], 0, scan->brightness, FALSE, scan->image);
+    if (count > max) {
+        max = count;
+    }
+    if ((((float)max)/total) <= scan->intensity) {
+        return countPixelsRect(left, top, right, bottom, 0, scan->brightness, TRUE, scan->image); // also clear
+    }
+    return 0;
 }
 
 
-/* --- stretching / resizing / shifting ------------------------------------ */
+/**
+ * Applies the blurfilter to some rows of windows, the first one starting at
+ * image row offset, see blurfilter(). The windows read one step above and
+ * below themselves.
+ */
+int blurfilterWindows(int blurfilterScanSize[DIRECTIONS_COUNT], int blurfilterScanStep[DIRECTIONS_COUNT], float blurfilterIntensity, float whiteThreshold, int offset, int rows, struct IMAGE* image) {
+    struct WINDOW_SCAN scan;
+    int result;
+
+    scan.filterWindow = blurfilterWindow;
+    scan.image = image;
+    scan.size[HORIZONTAL] = blurfilterScanSize[HORIZONTAL];
+    scan.size[VERTICAL] = blurfilterScanSize[VERTICAL];
+    scan.step[HORIZONTAL] = blurfilterScanStep[HORIZONTAL];
+    scan.step[VERTICAL] = blurfilterScanStep[VERTICAL];
+    scan.brightness = (int)(WHITE * whiteThreshold);
+    scan.intensity = blurfilterIntensity;
+    scan.columns = scanCount(image->width, scan.size[HORIZONTAL], scan.step[HORIZONTAL]);
+    scan.rows = rows;
+    scan.offset = offset;
+    requireIntegral(GRAYSCALE, 0, scan.brightness, image); // for countPixelsRect(), also builds the channel before threads start reading it
+    result = scanWindows(&scan, scan.step); // neighbouring windows are read one step around
+    freeIntegrals(image);
+    return result;
+}
+
 
 /**
- * Stretches the image so that the resulting image has a new size.
- *
- * @param w the new width to stretch to
- * @param h the new height to stretch to
+ * Removes noise using a kind of blurfilter, as alternative to the noise
+ * filter. This algoithm counts pixels while 'shaking' the area to detect,
+ * and clears the area if the amount of white pixels exceeds whiteTreshold.
  */
-void stretch(int w, int h, struct IMAGE* image) {
-    struct IMAGE newimage;
-    int x;
-    int y;
-    int matrixX;
-    int matrixY;
-    int matrixWidth;
-    int matrixHeight;
-    int blockWidth;
-    int blockHeight;
-    int blockWidthRest;
-    int blockHeightRest;
-    int fillIndexWidth;
-    int fillIndexHeight;
-    int fill;
-    int xx;
-    int yy;
-    int sum;
-    int sumR;
-    int sumG;
-    int sumB;
-    int sumCount;
-    int pixel;
+int blurfilter(int blurfilterScanSize[DIRECTIONS_COUNT], int blurfilterScanStep[DIRECTIONS_COUNT], float blurfilterIntensity, float whiteThreshold, struct IMAGE* image) {
+    // scan until the right/bottom edge of a window reaches the end of the image
+    return blurfilterWindows(blurfilterScanSize, blurfilterScanStep, blurfilterIntensity, whiteThreshold, 0, scanCount(image->height, blurfilterScanSize[VERTICAL], blurfilterScanStep[VERTICAL]), image);
+}
 
-    if (verbose >= VERBOSE_MORE) {
-        printf("stretching %dx%d -> %dx%d\n", image->width, image->height, w, h);
-    }
 
-    // allocate new buffer's memory
-    initImage(&newimage, w, h, image->bitdepth, image->color, WHITE);
-    
-    blockWidth = image->width / w; // (0 if enlarging, i.e. w > image->width)
-    blockHeight = image->height / h;
+/* --- grayfilter --------------------------------------------------------- */
 
-    if (w <= image->width) {
-        blockWidthRest = (image->width) % w;
-    } else { // modulo-operator doesn't work as expected: (3680 % 7360)==3680 ! (not 7360 as expected)
-             // shouldn't always be a % b = b if a < b ?
-        blockWidthRest = w;
-    }
+/**
+ * Processes a single window of the grayfilter, see grayfilter().
+ */
+int grayfilterWindow(int left, int top, int right, int bottom, struct WINDOW_SCAN* scan) {
+    int count;
+    int lightness;
 
-    if (h <= image->height) {
-        blockHeightRest = (image->height) % h;
-    } else {
-        blockHeightRest = h;
-    }
-
-    // for each new pixel, get a matrix of pixels from which the new pixel should be derived
-    // (when enlarging, this matrix is always of size 1x1)
-    matrixY = 0;
-    fillIndexHeight = 0;
-    for (y = 0; y < h; y++) {
-        fillIndexWidth = 0;
-        matrixX = 0;
-        if ( ( (y * blockHeightRest) / h ) == fillIndexHeight ) { // next fill index?
-            // (If our optimizer is cool, the above "* blockHeightRest / h" will disappear
-            // when images are enlarged, because in that case blockHeightRest = h has been set before,
-            // thus we're in a Kripke-branch where blockHeightRest and h are the same variable.
-            // No idea if gcc's optimizer does this...) (See again below.)
-            fillIndexHeight++;
-            fill = 1;
-        } else {
-            fill = 0;
-        }
-        matrixHeight = blockHeight + fill;
-        for (x = 0; x < w; x++) {
-            if ( ( (x * blockWidthRest) / w ) == fillIndexWidth ) { // next fill index?
-                fillIndexWidth++;
-                fill = 1;
-            } else {
-                fill = 0;
-            }
-            matrixWidth = blockWidth + fill;
-            // if enlarging, map corrdinates directly
-            if (blockWidth == 0) { // enlarging
-                matrixX = (x * image->width) / w;
-            }
-            if (blockHeight == 0) { // enlarging
-                matrixY = (y * image->height) / h;
-            }
-            
-            // calculate average pixel value in source matrix
-            if ((matrixWidth == 1) && (matrixHeight == 1)) { // optimization: quick version
-                pixel = getPixel(matrixX, matrixY, image);
-            } else {
-                sumCount = 0;
-                if (!image->color) {
-                    sum = 0;
-                    for (yy = 0; yy < matrixHeight; yy++) {
-                        for (xx = 0; xx < matrixWidth; xx++) {
-                            sum += getPixelGrayscale(matrixX + xx, matrixY + yy, image);
-                            sumCount++;
-                        }
-                    }
-                    sum = sum / sumCount;
-                    pixel = pixelGrayscaleValue(sum);
-                } else { // color
-                    sumR = 0;
-                    sumG = 0;
-                    sumB = 0;
-                    for (yy = 0; yy < matrixHeight; yy++) {
-                        for (xx = 0; xx < matrixWidth; xx++) {
-                            pixel = getPixel(matrixX + xx, matrixY + yy, image);
-                            sumR += (pixel >> 16) & 0xff;
-                            sumG += (pixel >> 8) & 0xff;
-                            sumB += pixel & 0xff;
-                            //sumR += getPixelComponent(matrixX + xx, matrixY + yy, RED, image);
-                            //sumG += getPixelComponent(matrixX + xx, matrixY + yy, GREEN, image);
-                            //sumB += getPixelComponent(matrixX + xx, matrixY + yy, BLUE, image);
-                            sumCount++;
-                        }
-                    }
-                    pixel = pixelValue( sumR/sumCount, sumG/sumCount, sumB/sumCount );
-                }
-            }
-            setPixel(pixel, x, y, &newimage);
-            
-            // pixel may have resulted in a gray value, which will be converted to 1-bit
-            // when the file gets saved, if .pbm format requested. black-threshold will apply.
-            
-            if (blockWidth > 0) { // shrinking
-                matrixX += matrixWidth;
-            }
-        }
-        if (blockHeight > 0) { // shrinking
-            matrixY += matrixHeight;
+    count = countPixelsRect(left, top, right, bottom, 0, scan->brightness, FALSE, scan->image);
+    if (count == 0) {
+        lightness = lightnessRect(left, top, right, bottom, scan->image);
+        if ((WHITE - lightness) < scan->threshold) { // (lower threshold->more deletion)
+            return clearRect(left, top, right, bottom, scan->image, WHITE);
         }
     }
-    replaceImage(image, &newimage);
+    return 0;
 }
 
+
 /**
- * Resizes the image so that the resulting sheet has a new size and the image
- * content is zoomed to fit best into the sheet, while keeping it's aspect ration.
- *
- * @param w the new width to resize to
- * @param h the new height to resize to
+ * Applies the grayfilter to some rows of windows, the first one starting at
+ * image row offset, see grayfilter().
  */
-void resize(int w, int h, struct IMAGE* image) {
+int grayfilterWindows(int grayfilterScanSize[DIRECTIONS_COUNT], int grayfilterScanStep[DIRECTIONS_COUNT], float grayfilterThreshold, float blackThreshold, int offset, int rows, struct IMAGE* image) {
+    struct WINDOW_SCAN scan;
+    int margin[DIRECTIONS_COUNT];
+    int result;
+
+    scan.filterWindow = grayfilterWindow;
+    scan.image = image;
+    scan.size[HORIZONTAL] = grayfilterScanSize[HORIZONTAL];
+    scan.size[VERTICAL] = grayfilterScanSize[VERTICAL];
+    scan.step[HORIZONTAL] = grayfilterScanStep[HORIZONTAL];
+    scan.step[VERTICAL] = grayfilterScanStep[VERTICAL];
+    scan.brightness = (int)(WHITE * (1.0-blackThreshold));
+    scan.threshold = (int)(WHITE * grayfilterThreshold);
+    // scan until the left edge of a window passes the end of a row
+    scan.columns = scanCount(image->width, 1, scan.step[HORIZONTAL]);
+    scan.rows = rows;
+    scan.offset = offset;
+    margin[HORIZONTAL] = margin[VERTICAL] = 0;
+    // tables for countPixelsRect() and lightnessRect(), also build the channels before threads start reading them
+    requireIntegral(GRAYSCALE, 0, scan.brightness, image);
+    requireIntegral(LIGHTNESS, -1, -1, image);
+    result = scanWindows(&scan, margin);
+    freeIntegrals(image);
+    return result;
+}
+
+
+/**
+ * Clears areas which do not contain any black pixels, but some "gray shade" only.
+ * Two conditions have to apply before an area gets deleted: first, not a single black pixel may be contained,
+ * second, a minimum threshold of blackness must not be exceeded.
+ */
+int grayfilter(int grayfilterScanSize[DIRECTIONS_COUNT], int grayfilterScanStep[DIRECTIONS_COUNT], float grayfilterThreshold, float blackThreshold, struct IMAGE* image) {
+    // scan until the bottom edge of a window reaches the end of the image
+    return grayfilterWindows(grayfilterScanSize, grayfilterScanStep, grayfilterThreshold, blackThreshold, 0, scanCount(image->height, grayfilterScanSize[VERTICAL], grayfilterScanStep[VERTICAL]), image);
+}
+
+
+/* --- border-detection --------------------------------------------------- */
+
+/**
+ * Moves a rectangular area of pixels to be centered above the centerX, centerY coordinates.
+ */
+void centerMask(int centerX, int centerY, int left, int top, int right, int bottom, struct IMAGE* image) {
     struct IMAGE newimage;
-    int ww;
-    int hh;
-    float wRat;
-    float hRat;
+    int width;
+    int height;
+    int targetX;
+    int targetY;
     
-    if (verbose >= VERBOSE_NORMAL) {
-        printf("resizing %dx%d -> %dx%d\n", image->width, image->height, w, h);
-    }
-
-    wRat = (float)w / image->width;
-    hRat = (float)h / image->height;
-    if (wRat < hRat) { // horizontally more shrinking/less enlarging is needed: fill width fully, adjust height
-        ww = w;
-        hh = image->height * w / image->width;
-    } else if (hRat < wRat) {
-        ww = image->width * h / image->height;
-        hh = h;
-    } else { // wRat == hRat
-        ww = w;
-        hh = h;
+    width = right - left + 1;
+    height = bottom - top + 1;
+    targetX = centerX - width/2;
+    targetY = centerY - height/2; 
+    if ((targetX >= 0) && (targetY >= 0) && ((targetX+width) <= image->width) && ((targetY+height) <= image->height)) {
+        if (verbose >= VERBOSE_NORMAL) {
+            printf("centering mask [%d,%d,%d,%d] (%d,%d): %d, %d\n", left, top, right, bottom, centerX, centerY, targetX-left, targetY-top);
+        }
+        initImage(&newimage, width, height, image->bitdepth, image->color, image->background);
+        copyImageArea(left, top, width, height, image, 0, 0, &newimage);
+        clearRect(left, top, right, bottom, image, image->background);
+        copyImageArea(0, 0, width, height, &newimage, targetX, targetY, image);
+        freeImage(&newimage);
+    } else {
+        if (verbose >= VERBOSE_NORMAL) {
+            printf("centering mask [%d,%d,%d,%d] (%d,%d): %d, %d - NO CENTERING (would shift area outside visible image)\n", left, top, right, bottom, centerX, centerY, targetX-left, targetY-top);
+        }
     }
-    stretch(ww, hh, image);
-    initImage(&newimage, w, h, image->bitdepth, image->color, image->background);
-    centerImage(image, 0, 0, w, h, &newimage);
-    replaceImage(image, &newimage);
 }
 
 
 /**
- * Shifts the image.
- *
- * @param shiftX horizontal shifting
- * @param shiftY vertical shifting
+ * Moves a rectangular area of pixels to be centered inside a specified area coordinates.
  */
-void shift(int shiftX, int shiftY, struct IMAGE* image) {
+void alignMask(int mask[EDGES_COUNT], int outside[EDGES_COUNT], int direction, int margin[DIRECTIONS_COUNT], struct IMAGE* image) {
     struct IMAGE newimage;
-    int x;
-    int y;
-    int pixel;
-
-    // allocate new buffer's memory
-    initImage(&newimage, image->width, image->height, image->bitdepth, image->color, image->background);
+    int width;
+    int height;
+    int targetX;
+    int targetY;
     
-    for (y = 0; y < image->height; y++) {
-        for (x = 0; x < image->width; x++) {
-            pixel = getPixel(x, y, image);
-            setPixel(pixel, x + shiftX, y + shiftY, &newimage);
-        }
+    width = mask[RIGHT] - mask[LEFT] + 1;
+    height = mask[BOTTOM] - mask[TOP] + 1;
+    if (direction & 1<<LEFT) {
+        targetX = outside[LEFT] + margin[HORIZONTAL];
+    } else if (direction & 1<<RIGHT) {
+        targetX = outside[RIGHT] - width - margin[HORIZONTAL];
+    } else {
+        targetX = (outside[LEFT] + outside[RIGHT] - width) / 2;
     }
-    replaceImage(image, &newimage);
+    if (direction & 1<<TOP) {
+        targetY = outside[TOP] + margin[VERTICAL];
+    } else if (direction & 1<<BOTTOM) {
+        targetY = outside[BOTTOM] - height - margin[VERTICAL];
+    } else {
+        targetY = (outside[TOP] + outside[BOTTOM] - height) / 2;
+    }
+    if (verbose >= VERBOSE_NORMAL) {
+        printf("aligning mask [%d,%d,%d,%d] (%d,%d): %d, %d\n", mask[LEFT], mask[TOP], mask[RIGHT], mask[BOTTOM], targetX, targetY, targetX - mask[LEFT], targetY - mask[TOP]);
+    }
+    initImage(&newimage, width, height, image->bitdepth, image->color, image->background);
+    copyImageArea(mask[LEFT], mask[TOP], mask[RIGHT], mask[BOTTOM], image, 0, 0, &newimage);
+    clearRect(mask[LEFT], mask[TOP], mask[RIGHT], mask[BOTTOM], image, image->background);
+    copyImageArea(0, 0, width, height, &newimage, targetX, targetY, image);
+    freeImage(&newimage);
 }
 
 
-/* --- mask-detection ----------------------------------------------------- */
+/**
+ * Moves a rectangular area of pixels to be centered inside a specified area coordinates.
+ */
+void centerMaskInsideMask(int mask[EDGES_COUNT], int outside[EDGES_COUNT], struct IMAGE* image) {
+    alignMask(mask, outside, 0, NULL, image);
+}
+
 
 /**
- * Finds one edge of non-black pixels headig from one starting point towards edge direction.
+ * Find the size of one border edge.
  *
- * @return number of shift-steps until blank edge found
+ * @param x1..y2 area inside of which border is to be detected
  */
-int detectEdge(int startX, int startY, int shiftX, int shiftY, int maskScanSize, int maskScanDepth, float maskScanThreshold, struct IMAGE* image) {
-    // either shiftX or shiftY is 0, the other value is -i|+i
+int detectBorderEdge(int outsideMask[EDGES_COUNT], int stepX, int stepY, int size, int threshold, int maxBlack, struct IMAGE* image) {
     int left;
     int top;
     int right;
     int bottom;
-    int half;
-    int halfDepth;
-    int blackness;
-    int total;
-    int count;
+    int max;
+    int cnt;
+    int result;
     
-    half = maskScanSize / 2;
-    total = 0;
-    count = 0;
-    if (shiftY==0) { // vertical border is to be detected, horizontal shifting of scan-bar
-        if (maskScanDepth == -1) {
-            maskScanDepth = image->height;
+    if (stepY == 0) { // horizontal detection
+        if (stepX > 0) {
+            left = outsideMask[LEFT];
+            top = outsideMask[TOP];
+            right = outsideMask[LEFT] + size;
+            bottom = outsideMask[BOTTOM];
+        } else {
+            left = outsideMask[RIGHT] - size;
+            top = outsideMask[TOP];
+            right = outsideMask[RIGHT];
+            bottom = outsideMask[BOTTOM];
         }
-        halfDepth = maskScanDepth / 2;
-        left = startX - half;
-        top = startY - halfDepth;
-        right = startX + half;
-        bottom = startY + halfDepth;
-    } else { // horizontal border is to be detected, vertical shifting of scan-bar
-        if (maskScanDepth == -1) {
-            maskScanDepth = image->width;
+        max = (outsideMask[RIGHT] - outsideMask[LEFT]);
+    } else { // vertical detection
+        if (stepY > 0) {
+            left = outsideMask[LEFT];
+            top = outsideMask[TOP];
+            right = outsideMask[RIGHT];
+            bottom = outsideMask[TOP] + size;
+        } else {
+            left = outsideMask[LEFT];
+            top = outsideMask[BOTTOM] - size;
+            right = outsideMask[RIGHT];
+            bottom = outsideMask[BOTTOM];
         }
-        halfDepth = maskScanDepth / 2;
-        left = startX - halfDepth;
-        top = startY - half;
-        right = startX + halfDepth;
-        bottom = startY + half;
+        max = (outsideMask[BOTTOM] - outsideMask[TOP]);
     }
-    
-    while (TRUE) { // !
-        blackness = 255 - brightnessRect(left, top, right, bottom, image);
-        total += blackness;
-        count++;
-        // is blackness below threshold*average?
-        if ((blackness < ((maskScanThreshold*total)/count))||(blackness==0)) { // this will surely become true when pos reaches the outside of the actual image area and blacknessRect() will deliver 0 because all pixels outside are considered white
-            return count; // ! return here, return absolute value of shifting difference
+    result = 0;
+    while (result < max) {
+        cnt = countPixelsRect(left, top, right, bottom, 0, maxBlack, FALSE, image);
+        if (cnt >= threshold) {
+            return result; // border has been found: regular exit here
         }
-        left += shiftX;
-        right += shiftX;
-        top += shiftY;
-        bottom += shiftY;
+        left += stepX;
+        top += stepY;
+        right += stepX;
+        bottom += stepY;
+        result += abs(stepX+stepY); // (either stepX or stepY is 0)
     }
+    return 0; // no border found between 0..max
 }
 
 
 /**
- * Detects a mask of white borders around a starting point.
- * The result is returned via call-by-reference parameters left, top, right, bottom.
- *
- * @return the detected mask in left, top, right, bottom; or -1, -1, -1, -1 if no mask could be detected
+ * Detects a border of completely non-black pixels around the area outsideBorder[LEFT],outsideBorder[TOP]-outsideBorder[RIGHT],outsideBorder[BOTTOM].
  */
-BOOLEAN detectMask(int startX, int startY, int maskScanDirections, int maskScanSize[DIRECTIONS_COUNT], int maskScanDepth[DIRECTIONS_COUNT], int maskScanStep[DIRECTIONS_COUNT], float maskScanThreshold[DIRECTIONS_COUNT], int maskScanMinimum[DIMENSIONS_COUNT], int maskScanMaximum[DIMENSIONS_COUNT], int* left, int* top, int* right, int* bottom, struct IMAGE* image) {
-    int width;
-    int height;
-    int half[DIRECTIONS_COUNT];
-    BOOLEAN success;
+void detectBorder(int border[EDGES_COUNT], int borderScanDirections, int borderScanSize[DIRECTIONS_COUNT], int borderScanStep[DIRECTIONS_COUNT], int borderScanThreshold[DIRECTIONS_COUNT], float blackThreshold, int outsideMask[EDGES_COUNT], struct IMAGE* image) {
+    int blackThresholdAbs;
     
-    half[HORIZONTAL] = maskScanSize[HORIZONTAL] / 2;
-    half[VERTICAL] = maskScanSize[VERTICAL] / 2;
-    if ((maskScanDirections & 1<<HORIZONTAL) != 0) {
-        *left = startX - maskScanStep[HORIZONTAL] * detectEdge(startX, startY, -maskScanStep[HORIZONTAL], 0, maskScanSize[HORIZONTAL], maskScanDepth[HORIZONTAL], maskScanThreshold[HORIZONTAL], image) - half[HORIZONTAL];
-        *right = startX + maskScanStep[HORIZONTAL] * detectEdge(startX, startY, maskScanStep[HORIZONTAL], 0, maskScanSize[HORIZONTAL], maskScanDepth[HORIZONTAL], maskScanThreshold[HORIZONTAL], image) + half[HORIZONTAL];
-    } else { // full range of sheet
-        *left = 0;
-        *right = image->width - 1;
-    }
-    if ((maskScanDirections & 1<<VERTICAL) != 0) {
-        *top = startY - maskScanStep[VERTICAL] * detectEdge(startX, startY, 0, -maskScanStep[VERTICAL], maskScanSize[VERTICAL], maskScanDepth[VERTICAL], maskScanThreshold[VERTICAL], image) - half[VERTICAL];
-        *bottom = startY + maskScanStep[VERTICAL] * detectEdge(startX, startY, 0, maskScanStep[VERTICAL], maskScanSize[VERTICAL], maskScanDepth[VERTICAL], maskScanThreshold[VERTICAL], image) + half[VERTICAL];
-    } else { // full range of sheet
-        *top = 0;
-        *bottom = image->height - 1;
-    }
+    border[LEFT] = outsideMask[LEFT];
+    border[TOP] = outsideMask[TOP];
+    border[RIGHT] = image->width - outsideMask[RIGHT];
+    border[BOTTOM] = image->height - outsideMask[BOTTOM];
     
-    // if below minimum or above maximum, set to maximum
-    width = *right - *left;
-    height = *bottom - *top;
-    success = TRUE;
-    if ( ((maskScanMinimum[WIDTH] != -1) && (width < maskScanMinimum[WIDTH])) || ((maskScanMaximum[WIDTH] != -1) && (width > maskScanMaximum[WIDTH])) ) {
-        width = maskScanMaximum[WIDTH] / 2;
-        *left = startX - width;
-        *right = startX + width;
-        success = FALSE;;
+    blackThresholdAbs = (int)(WHITE * (1.0 - blackThreshold));
+    requireIntegral(GRAYSCALE, 0, blackThresholdAbs, image); // for countPixelsRect()
+    if (borderScanDirections & 1<<HORIZONTAL) {
+        border[LEFT] += detectBorderEdge(outsideMask, borderScanStep[HORIZONTAL], 0, borderScanSize[HORIZONTAL], borderScanThreshold[HORIZONTAL], blackThresholdAbs, image);
+        border[RIGHT] += detectBorderEdge(outsideMask, -borderScanStep[HORIZONTAL], 0, borderScanSize[HORIZONTAL], borderScanThreshold[HORIZONTAL], blackThresholdAbs, image);
     }
-    if ( ((maskScanMinimum[HEIGHT] != -1) && (height < maskScanMinimum[HEIGHT])) || ((maskScanMaximum[HEIGHT] != -1) && (height > maskScanMaximum[HEIGHT])) ) {
-        height = maskScanMaximum[HEIGHT] / 2;
-        *top = startY - height;
-        *bottom = startY + height;
-        success = FALSE;
+    if (borderScanDirections & 1<<VERTICAL) {
+        border[TOP] += detectBorderEdge(outsideMask, 0, borderScanStep[VERTICAL], borderScanSize[VERTICAL], borderScanThreshold[VERTICAL], blackThresholdAbs, image);
+        border[BOTTOM] += detectBorderEdge(outsideMask, 0, -borderScanStep[VERTICAL], borderScanSize[VERTICAL], borderScanThreshold[VERTICAL], blackThresholdAbs, image);
+    }
+    freeIntegrals(image);
+    if (verbose >= VERBOSE_NORMAL) {
+        printf("border detected: (%d,%d,%d,%d) in [%d,%d,%d,%d]\n", border[LEFT], border[TOP], border[RIGHT], border[BOTTOM], outsideMask[LEFT], outsideMask[TOP], outsideMask[RIGHT], outsideMask[BOTTOM]);
     }
-    return success;
 }
 
 
 /**
- * Detects masks around the points specified in point[].
- *
- * @param mask point to array into which detected masks will be stored
- * @return number of masks stored in mask[][]
+ * Converts a border-tuple to a mask-tuple.
  */
-int detectMasks(int mask[MAX_MASKS][EDGES_COUNT], BOOLEAN maskValid[MAX_MASKS], int point[MAX_POINTS][COORDINATES_COUNT], int pointCount, int maskScanDirections, int maskScanSize[DIRECTIONS_COUNT], int maskScanDepth[DIRECTIONS_COUNT], int maskScanStep[DIRECTIONS_COUNT], float maskScanThreshold[DIRECTIONS_COUNT], int maskScanMinimum[DIMENSIONS_COUNT], int maskScanMaximum[DIMENSIONS_COUNT],  struct IMAGE* image) {
-    int left;
-    int top;
-    int right;
-    int bottom;
-    int i;
-    int maskCount;
-    
-    maskCount = 0;
-    if (maskScanDirections != 0) {
-         for (i = 0; i < pointCount; i++) {
-             maskValid[i] = detectMask(point[i][X], point[i][Y], maskScanDirections, maskScanSize, maskScanDepth, maskScanStep, maskScanThreshold, maskScanMinimum, maskScanMaximum, &left, &top, &right, &bottom, image);
-             if (!(left==-1 || top==-1 || right==-1 || bottom==-1)) {
-                 mask[maskCount][LEFT] = left;
-                 mask[maskCount][TOP] = top;
-                 mask[maskCount][RIGHT] = right;
-                 mask[maskCount][BOTTOM] = bottom;
-                 maskCount++;
-                 if (verbose>=VERBOSE_NORMAL) {
-                     printf("auto-masking (%d,%d): %d,%d,%d,%d", point[i][X], point[i][Y], left, top, right, bottom);
-                     if (maskValid[i] == FALSE) { // (mask had been auto-set to full page size)
-                         printf(" (invalid detection, using full page size)");
-                     }
-                     printf("\n");
-                 }
-             } else {
-                 if (verbose>=VERBOSE_NORMAL) {
-                     printf("auto-masking (%d,%d): NO MASK FOUND\n", point[i][X], point[i][Y]);
-                 }
-             }
-             //if (maskValid[i] == FALSE) { // (mask had been auto-set to full page size)
-             //    if (verbose>=VERBOSE_NORMAL) {
-             //        printf("auto-masking (%d,%d): NO MASK DETECTED\n", point[i][X], point[i][Y]);
-             //    }
-             //}
-         }
+void borderToMask(int border[EDGES_COUNT], int mask[EDGES_COUNT], struct IMAGE* image) {
+    mask[LEFT] = border[LEFT];
+    mask[TOP] = border[TOP];
+    mask[RIGHT] = image->width - border[RIGHT] - 1;
+    mask[BOTTOM] = image->height - border[BOTTOM] - 1;
+    if (verbose >= VERBOSE_DEBUG) {
+        printf("border [%d,%d,%d,%d] -> mask [%d,%d,%d,%d]\n", border[LEFT], border[TOP], border[RIGHT], border[BOTTOM], mask[LEFT], mask[TOP], mask[RIGHT], mask[BOTTOM]);
     }
-    return maskCount;
 }
 
 
 /**
- * Permanently applies image masks. Each pixel which is not covered by at least
- * one mask is set to maskColor.
+ * Applies a border to the whole image. All pixels in the border range at the
+ * edges of the sheet will be cleared.
  */
-void applyMasks(int mask[MAX_MASKS][EDGES_COUNT], int maskCount, int maskColor, struct IMAGE* image) {
-    int x;
-    int y;
-    int i;
-    int left, top, right, bottom;
-    BOOLEAN m;
+void applyBorder(int border[EDGES_COUNT], int borderColor, struct IMAGE* image) {
+    int mask[EDGES_COUNT];
     
-    if (maskCount<=0) {
-        return;
-    }
-    for (y=0; y < image->height; y++) {
-        for (x=0; x < image->width; x++) {
-            // in any mask?
-            m = FALSE;
-            for (i=0; ((m==FALSE) && (i<maskCount)); i++) {
-                left = mask[i][LEFT];
-                top = mask[i][TOP];
-                right = mask[i][RIGHT];
-                bottom = mask[i][BOTTOM];
-                if (y>=top && y<=bottom && x>=left && x<=right) {
-                    m = TRUE;
-                }
-            }
-            if (m == FALSE) {
-                setPixel(maskColor, x, y, image); // delete: set to white
-            }
+    if (border[LEFT]!=0 || border[TOP]!=0 || border[RIGHT]!=0 || border[BOTTOM]!=0) {
+        borderToMask(border, mask, image);
+        if (verbose >= VERBOSE_NORMAL) {
+            printf("applying border (%d,%d,%d,%d) [%d,%d,%d,%d]\n", border[LEFT], border[TOP], border[RIGHT], border[BOTTOM], mask[LEFT], mask[TOP], mask[RIGHT], mask[BOTTOM]);
         }
+        applyMasks(&mask, 1, borderColor, image);
     }
 }
 
 
-/* --- wiping ------------------------------------------------------------- */
+/* --- streaming ---------------------------------------------------------- */
 
 /**
- * Permanently wipes out areas of an images. Each pixel covered by a wipe-area
- * is set to wipeColor.
+ * Sets up a stream to read a sheet in bands of rows. All stages are disabled
+ * and nothing gets written until set up otherwise.
+ *
+ * @param rows number of rows to read at once
  */
-void applyWipes(int area[MAX_MASKS][EDGES_COUNT], int areaCount, int wipeColor, struct IMAGE* image) {
-    int x;
-    int y;
-    int i;
-    int count;
-
-    for (i = 0; i < areaCount; i++) {
-        count = 0;
-        for (y = area[i][TOP]; y <= area[i][BOTTOM]; y++) {
-            for (x = area[i][LEFT]; x <= area[i][RIGHT]; x++) {
-                if ( setPixel(wipeColor, x, y, image) ) {
-                    count++;
-                }
-            }
-        }
-        if (verbose >= VERBOSE_MORE) {
-            printf("wipe [%d,%d,%d,%d]: %d pixels\n", area[i][LEFT], area[i][TOP], area[i][RIGHT], area[i][BOTTOM], count);
-        }
-    }
+void initStream(struct IMAGE* source, int rows, struct STREAM* stream) {
+    memset(stream, 0, sizeof(struct STREAM));
+    stream->source = source;
+    stream->rows = max(1, rows);
+    stream->capacity = stream->rows;
+    stream->outCapacity = stream->rows;
+    initImage(&stream->band, source->width, stream->capacity, source->bitdepth, source->color, WHITE);
+    initImage(&stream->out, source->width, stream->outCapacity, source->bitdepth, source->color, WHITE);
+    stream->band.height = 0;
+    stream->out.height = 0;
 }
 
 
-/* --- mirroring ---------------------------------------------------------- */
-
 /**
- * Mirrors an image either horizontally, vertically, or both.
+ * Frees the memory used by a stream.
  */
-void mirror(int directions, struct IMAGE* image) {
-    int x;
-    int y;
-    int xx;
-    int yy;
-    int pixel1;
-    int pixel2;
-    BOOLEAN horizontal;
-    BOOLEAN vertical;
-    int untilX;
-    int untilY;
-    
-    horizontal = ((directions & 1<<HORIZONTAL) != 0) ? TRUE : FALSE;
-    vertical = ((directions & 1<<VERTICAL) != 0) ? TRUE : FALSE;
-    untilX = ((horizontal==TRUE)&&(vertical==FALSE)) ? ((image->width - 1) >> 1) : (image->width - 1);  // w>>1 == (int)(w-0.5)/2
-    untilY = (vertical==TRUE) ? ((image->height - 1) >> 1) : image->height - 1;
-    for (y = 0; y <= untilY; y++) {
-        yy = (vertical==TRUE) ? (image->height - y - 1) : y;
-        if ((vertical==TRUE) && (horizontal==TRUE) && (y == yy)) { // last middle line in odd-lined image mirrored both h and v
-            untilX = ((image->width - 1) >> 1);
-        }
-        for (x = 0; x <= untilX; x++) {
-            xx = (horizontal==TRUE) ? (image->width - x - 1) : x;
-            pixel1 = getPixel(x, y, image);
-            pixel2 = getPixel(xx, yy, image);
-            setPixel(pixel2, x, y, image);
-            setPixel(pixel1, xx, yy, image);
-        }
-    }
+void freeStream(struct STREAM* stream) {
+    poolFree(stream->band.buffer);
+    poolFree(stream->out.buffer);
+    free(stream->sums);
 }
 
 
-/* --- flip-rotating ------------------------------------------------------ */
-
 /**
- * Rotates an image clockwise or anti-clockwise in 90-degrees.
+ * Adds a set of areas to be filled to a stream.
  *
- * @param direction either -1 (rotate anti-clockwise) or 1 (rotate clockwise)
+ * @param areas either stream->before or stream->after
  */
-void flipRotate(int direction, struct IMAGE* image) {
-    struct IMAGE newimage;
-    int x;
-    int y;
-    int xx;
-    int yy;
-    int pixel;
-    
-    initImage(&newimage, image->height, image->width, image->bitdepth, image->color, WHITE); // exchanged width and height
-    for (y = 0; y < image->height; y++) {
-        xx = ((direction > 0) ? image->height - 1 : 0) - y * direction;
-        for (x = 0; x < image->width; x++) {
-            yy = ((direction < 0) ? image->width - 1 : 0) + x*direction;
-            pixel = getPixel(x, y, image);
-            setPixel(pixel, xx, yy, &newimage);
-        }
+void addAreas(int (*area)[EDGES_COUNT], int count, BOOLEAN outside, struct AREAS areas[MAX_STREAM_AREAS], int* areasCount) {
+    if (count > 0) {
+        areas[*areasCount].area = area;
+        areas[*areasCount].count = count;
+        areas[*areasCount].outside = outside;
+        (*areasCount)++;
     }
-    replaceImage(image, &newimage);
 }
 
 
-/* --- blackfilter -------------------------------------------------------- */
-
 /**
- * Filters out solidly black areas scanning to one direction.
+ * Fills sets of areas of a sheet in some rows of it, in the order of the sets.
  *
- * @param stepX is 0 if stepY!=0
- * @param stepY is 0 if stepX!=0
- * @see blackfilter()
+ * @param top sheet row of the first row of image
  */
-void blackfilterScan(int stepX, int stepY, int size, int dep, float threshold, int exclude[MAX_MASKS][EDGES_COUNT], int excludeCount, int intensity, float blackThreshold, struct IMAGE* image) {
+void fillAreas(struct AREAS areas[MAX_STREAM_AREAS], int areasCount, int color, int top, struct IMAGE* image) {
+    int shifted[MAX_MASKS][EDGES_COUNT];
     int left;
-    int top;
     int right;
-    int bottom;
-    int blackness;
-    int thresholdBlack;
-    int x;
     int y;
-    int shiftX;
-    int shiftY;
-    int l, t, r, b;
-    int total;
-    int diffX;
-    int diffY;
-    int mask[EDGES_COUNT];
-    BOOLEAN alreadyExcludedMessage;
+    int i;
+    int j;
 
-    thresholdBlack = (int)(WHITE * (1.0-blackThreshold));
-    total = size * dep;
-    if (stepX != 0) { // horizontal scanning
-        left = 0;
-        top = 0;
-        right = size -1;
-        bottom = dep - 1;
-        shiftX = 0;
-        shiftY = dep;
-    } else { // vertical scanning
-        left = 0;
-        top = 0;
-        right = dep -1;
-        bottom = size - 1;
-        shiftX = dep;
-        shiftY = 0;
-    }
-    while ((left < image->width) && (top < image->height)) { // individual scanning "stripes" over the whole sheet
-        l = left;
-        t = top;
-        r = right;
-        b = bottom;
-        // make sure last stripe does not reach outside sheet, shift back inside (next +=shift will exit while-loop)
-        if (r >= image->width || b >= image->height) {
-            diffX = r-image->width+1;
-            diffY = b-image->height+1;
-            l -= diffX;
-            t -= diffY;
-            r -= diffX;
-            b -= diffY;
+    for (i = 0; i < areasCount; i++) {
+        for (j = 0; j < areas[i].count; j++) {
+            shifted[j][LEFT] = areas[i].area[j][LEFT];
+            shifted[j][TOP] = areas[i].area[j][TOP] - top;
+            shifted[j][RIGHT] = areas[i].area[j][RIGHT];
+            shifted[j][BOTTOM] = areas[i].area[j][BOTTOM] - top;
         }
-        alreadyExcludedMessage = FALSE;
-        while ((l < image->width) && (t < image->height)) { // single scanning "stripe"
-            blackness = 255 - darknessInverseRect(l, t, r, b, image);
-            if (blackness >= 255*threshold) { // found a solidly black area
-                mask[LEFT] = l;
-                mask[TOP] = t;
-                mask[RIGHT] = r;
-                mask[BOTTOM] = b;
-                if (! masksOverlapAny(mask, exclude, excludeCount) ) {
-                    if (verbose >= VERBOSE_NORMAL) {
-                        printf("black-area flood-fill: [%d,%d,%d,%d]\n", l, t, r, b);
-                        alreadyExcludedMessage = FALSE;
-                    }
-                    // start flood-fill in this area (on each pixel to make sure we get everything, in most cases first flood-fill from first pixel will delete all other black pixels in the area already)
-                    for (y = t; y <= b; y++) {
-                        for (x = l; x <= r; x++) {
-                            floodFill(x, y, pixelValue(WHITE, WHITE, WHITE), 0, thresholdBlack, intensity, image);
-                        }
-                    }
-                } else {
-                    if ((verbose >= VERBOSE_NORMAL) && (!alreadyExcludedMessage)) {
-                        printf("black-area EXCLUDED: [%d,%d,%d,%d]\n", l, t, r, b);
-                        alreadyExcludedMessage = TRUE; // do this only once per scan-stripe, otherwise too many mesages
+        if (areas[i].outside) {
+            applyMasks(shifted, areas[i].count, color, image);
+        } else {
+            for (j = 0; j < areas[i].count; j++) {
+                left = max(shifted[j][LEFT], 0);
+                right = min(shifted[j][RIGHT], image->width - 1);
+                if (left <= right) {
+                    for (y = max(shifted[j][TOP], 0); y <= min(shifted[j][BOTTOM], image->height - 1); y++) {
+                        fillRowSpan(color, left, y, right - left + 1, image);
                     }
                 }
             }
-            l += stepX;
-            t += stepY;
-            r += stepX;
-            b += stepY;
         }
-        left += shiftX;
-        top += shiftY;
-        right += shiftX;
-        bottom += shiftY;
     }
 }
 
 
 /**
- * Filters out solidly black areas, as appearing on bad photocopies.
- * A virtual bar of width 'size' and height 'depth' is horizontally moved 
- * above the middle of the sheet (or the full sheet, if depth ==-1).
+ * Sets up an image for the rows first..last-1 of a sheet, sharing the memory
+ * of the band of a stream which holds them.
  */
-void blackfilter(int blackfilterScanDirections, int blackfilterScanSize[DIRECTIONS_COUNT], int blackfilterScanDepth[DIRECTIONS_COUNT], int blackfilterScanStep[DIRECTIONS_COUNT], float blackfilterScanThreshold, int blackfilterExclude[MAX_MASKS][EDGES_COUNT], int blackfilterExcludeCount, int blackfilterIntensity, float blackThreshold, struct IMAGE* image) {
-    if ((blackfilterScanDirections & 1<<HORIZONTAL) != 0) { // left-to-right scan
-        blackfilterScan(blackfilterScanStep[HORIZONTAL], 0, blackfilterScanSize[HORIZONTAL], blackfilterScanDepth[HORIZONTAL], blackfilterScanThreshold, blackfilterExclude, blackfilterExcludeCount, blackfilterIntensity, blackThreshold, image);
-    }
-    if ((blackfilterScanDirections & 1<<VERTICAL) != 0) { // top-to-bottom scan
-        blackfilterScan(0, blackfilterScanStep[VERTICAL], blackfilterScanSize[VERTICAL], blackfilterScanDepth[VERTICAL], blackfilterScanThreshold, blackfilterExclude, blackfilterExcludeCount, blackfilterIntensity, blackThreshold, image);
-    }
+void bandView(int first, int last, struct IMAGE* view, struct STREAM* stream) {
+    *view = stream->band;
+    view->buffer = &stream->band.buffer[(first - stream->top) * stream->band.stride];
+    view->height = last - first;
+    initChannels(view);
 }
 
 
-/* --- noisefilter -------------------------------------------------------- */
-
 /**
- * Applies a simple noise filter to the image.
- *
- * @param intensity maximum cluster size to delete
+ * Frees what has been calculated for an image which shares its buffer, see
+ * bandView().
  */
-int noisefilter(int intensity, float whiteThreshold, struct IMAGE* image) {
-    int x;
-    int y;
-    int whiteMin;
-    int count;
-    int pixel;
-    int neighbors;
-    
-    whiteMin = (int)(WHITE * whiteThreshold);
-    count = 0;
-    for (y = 0; y < image->height; y++) {
-        for (x = 0; x < image->width; x++) {
-            pixel = getPixelDarknessInverse(x, y, image);
-            if (pixel < whiteMin) { // one dark pixel found
-                neighbors = countPixelNeighbors(x, y, intensity, whiteMin, image); // get number of non-light pixels in neighborhood
-                if (neighbors <= intensity) { // ...not more than 'intensity'?
-                    clearPixelNeighbors(x, y, whiteMin, image); // delete area
-                    count++;
-                }
-            }
-        }
+void freeView(struct IMAGE* view) {
+    freeIntegrals(view);
+    if (view->color) {
+        poolFree(view->bufferGrayscale);
+        poolFree(view->bufferLightness);
+        poolFree(view->bufferDarknessInverse);
     }
-    return count;
+    initChannels(view);
 }
 
 
-/* --- blurfilter --------------------------------------------------------- */
-
 /**
- * Removes noise using a kind of blurfilter, as alternative to the noise
- * filter. This algoithm counts pixels while 'shaking' the area to detect,
- * and clears the area if the amount of white pixels exceeds whiteTreshold.
+ * Reads the rows of the sheet up to row last into the band of a stream, and
+ * fills the areas to be filled before processing. Pages of a memory-mapped
+ * sheet are given back once all their rows have been read.
  */
-int blurfilter(int blurfilterScanSize[DIRECTIONS_COUNT], int blurfilterScanStep[DIRECTIONS_COUNT], float blurfilterIntensity, float whiteThreshold, struct IMAGE* image) {
-    int whiteMin;
-    int left;
-    int top;
-    int right;
-    int bottom;
-    int count;
-    int max;
-    int total;
-    int result;
-    
-    result = 0;
-    whiteMin = (int)(WHITE * whiteThreshold);
-    left = 0;
-    top = 0;
-    right = blurfilterScanSize[HORIZONTAL] - 1;
-    bottom = blurfilterScanSize[VERTICAL] - 1;
-    total = blurfilterScanSize[HORIZONTAL] * blurfilterScanSize[VERTICAL];
-    
-    while (TRUE) { // !
-        max = 0;
-        count = countPixelsRect(left, top, right, bottom, 0, whiteMin, FALSE, image);
-        if (count > max) {
-            max = count;
-        }
-        count = countPixelsRect(left-blurfilterScanStep[HORIZONTAL], top-blurfilterScanStep[VERTICAL], right-blurfilterScanStep[HORIZONTAL], bottom-blurfilterScanStep[VERTICAL], 0, whiteMin, FALSE, image);
-        if (count > max) {
-            max = count;
-        }
-        count = countPixelsRect(left+blurfilterScanStep[HORIZONTAL], top-blurfilterScanStep[VERTICAL], right+blurfilterScanStep[HORIZONTAL], bottom-blurfilterScanStep[VERTICAL], 0, whiteMin, FALSE, image);
-        if (count > max) {
-            max = count;
-        }
-        count = countPixelsRect(left-blurfilterScanStep[HORIZONTAL], top+blurfilterScanStep[VERTICAL], right-blurfilterScanStep[HORIZONTAL], bottom+blurfilterScanStep[VERTICAL], 0, whiteMin, FALSE, image);
-        if (count > max) {
-            max = count;
-        }
-        count = countPixelsRect(left+blurfilterScanStep[HORIZONTAL], top+blurfilterScanStep[VERTICAL], right+blurfilterScanStep[HORIZONTAL], bottom+blurfilterScanStep[VERTICAL], 0, whiteMin, FALSE, image);
-        if (count > max) {
-            max = count;
-        }
-        if ((((float)max)/total) <= blurfilterIntensity) {
-            result += countPixelsRect(left, top, right, bottom, 0, whiteMin, TRUE, image); // also clear
+void readRows(int last, struct STREAM* stream) {
+    struct IMAGE* source;
+    struct IMAGE view;
+    unsigned char* row;
+    size_t end;
+    int first;
+    int y;
+
+    source = stream->source;
+    first = stream->loaded;
+    if (last - stream->top > stream->capacity) {
+        stream->capacity = last - stream->top;
+        stream->band.buffer = (unsigned char*)poolRealloc(stream->band.buffer, stream->capacity * stream->band.stride);
+    }
+    for (y = first; y < last; y++) {
+        row = &stream->band.buffer[(y - stream->top) * stream->band.stride];
+        if (source->packed) {
+            unpackBits(getRow(y, source), 0, source->width, row);
+        } else {
+            memcpy(row, getRow(y, source), stream->band.stride);
         }
-        if (right < image->width) { // not yet at end of row
-            left += blurfilterScanStep[HORIZONTAL];
-            right += blurfilterScanStep[HORIZONTAL];
-        } else { // end of row
-            if (bottom >= image->height) { // has been last row
-                return result; // exit here
-            }
-            // next row:
-            left = 0;
-            right = blurfilterScanSize[HORIZONTAL] - 1;
-            top += blurfilterScanStep[VERTICAL];
-            bottom += blurfilterScanStep[VERTICAL];
+    }
+    stream->band.height = last - stream->top;
+    stream->loaded = last;
+    if (stream->beforeCount > 0) {
+        bandView(first, last, &view, stream);
+        fillAreas(stream->before, stream->beforeCount, stream->maskColor, first, &view);
+        freeView(&view);
+    }
+    if (source->mapping != NULL) {
+        end = (source->buffer - source->mapping) + (size_t)last * source->stride;
+        end &= ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+        if (end > stream->released) {
+            madvise(source->mapping + stream->released, end - stream->released, MADV_DONTNEED);
+            stream->released = end;
         }
     }
 }
 
 
-/* --- grayfilter --------------------------------------------------------- */
-
 /**
- * Clears areas which do not contain any black pixels, but some "gray shade" only.
- * Two conditions have to apply before an area gets deleted: first, not a single black pixel may be contained,
- * second, a minimum threshold of blackness must not be exceeded.
+ * Removes the rows above row keep from the band of a stream.
  */
-int grayfilter(int grayfilterScanSize[DIRECTIONS_COUNT], int grayfilterScanStep[DIRECTIONS_COUNT], float grayfilterThreshold, float blackThreshold, struct IMAGE* image) {
-    int blackMax;
-    int left;
-    int top;
-    int right;
-    int bottom;
-    int count;
-    int lightness;
-    int thresholdAbs;
-    int total;
-    int result;
-    
-    result = 0;
-    blackMax = (int)(WHITE * (1.0-blackThreshold));
-    thresholdAbs = (int)(WHITE * grayfilterThreshold);
-    left = 0;
-    top = 0;
-    right = grayfilterScanSize[HORIZONTAL] - 1;
-    bottom = grayfilterScanSize[VERTICAL] - 1;
-    total = grayfilterScanSize[HORIZONTAL] * grayfilterScanSize[VERTICAL];
-    
-    while (TRUE) { // !
-        count = countPixelsRect(left, top, right, bottom, 0, blackMax, FALSE, image);
-        if (count == 0) {
-            lightness = lightnessRect(left, top, right, bottom, image);
-            if ((WHITE - lightness) < thresholdAbs) { // (lower threshold->more deletion)
-                result += clearRect(left, top, right, bottom, image, WHITE);
-            }
-        }
-        if (left < image->width) { // not yet at end of row
-            left += grayfilterScanStep[HORIZONTAL];
-            right += grayfilterScanStep[HORIZONTAL];
-        } else { // end of row
-            if (bottom >= image->height) { // has been last row
-                return result; // exit here
-            }
-            // next row:
-            left = 0;
-            right = grayfilterScanSize[HORIZONTAL] - 1;
-            top += grayfilterScanStep[VERTICAL];
-            bottom += grayfilterScanStep[VERTICAL];
-        }
+void dropRows(int keep, struct STREAM* stream) {
+    if (keep > stream->top) {
+        memmove(stream->band.buffer, &stream->band.buffer[(keep - stream->top) * stream->band.stride], (stream->loaded - keep) * stream->band.stride);
+        stream->top = keep;
+        stream->band.height = stream->loaded - keep;
     }
 }
 
 
-/* --- border-detection --------------------------------------------------- */
-
 /**
- * Moves a rectangular area of pixels to be centered above the centerX, centerY coordinates.
+ * Applies the noisefilter of a stream to as many rows as possible.
+ *
+ * @param available the rows above are final from the previous stages
+ * @param keep lowered to the first row still needed
+ * @return the rows above are final after this stage
  */
-void centerMask(int centerX, int centerY, int left, int top, int right, int bottom, struct IMAGE* image) {
-    struct IMAGE newimage;
-    int width;
+int streamNoisefilter(int available, int* keep, struct STREAM* stream) {
+    struct IMAGE view;
     int height;
-    int targetX;
-    int targetY;
-    
-    width = right - left + 1;
-    height = bottom - top + 1;
-    targetX = centerX - width/2;
-    targetY = centerY - height/2; 
-    if ((targetX >= 0) && (targetY >= 0) && ((targetX+width) <= image->width) && ((targetY+height) <= image->height)) {
-        if (verbose >= VERBOSE_NORMAL) {
-            printf("centering mask [%d,%d,%d,%d] (%d,%d): %d, %d\n", left, top, right, bottom, centerX, centerY, targetX-left, targetY-top);
-        }
-        initImage(&newimage, width, height, image->bitdepth, image->color, image->background);
-        copyImageArea(left, top, width, height, image, 0, 0, &newimage);
-        clearRect(left, top, right, bottom, image, image->background);
-        copyImageArea(0, 0, width, height, &newimage, targetX, targetY, image);
-        freeImage(&newimage);
-    } else {
-        if (verbose >= VERBOSE_NORMAL) {
-            printf("centering mask [%d,%d,%d,%d] (%d,%d): %d, %d - NO CENTERING (would shift area outside visible image)\n", left, top, right, bottom, centerX, centerY, targetX-left, targetY-top);
-        }
+    int reach;
+    int first;
+    int last;
+    int top;
+
+    if (stream->noisefilterIntensity <= 0) {
+        return available;
+    }
+    height = stream->source->height;
+    // a cluster small enough to be deleted spans no more rows than its number of pixels, and clusters are searched no further
+    reach = stream->noisefilterIntensity + 1;
+    first = stream->noisefilterRow;
+    last = (available == height) ? height : available - reach;
+    if (last > first) {
+        top = max(0, first - reach);
+        bandView(top, min(height, last + reach), &view, stream);
+        stream->noisefilterCount += noisefilterRows(stream->noisefilterIntensity, stream->noisefilterMethod, stream->whiteThreshold, first - top, last - top, &view);
+        freeView(&view);
+        stream->noisefilterRow = last;
+    }
+    *keep = min(*keep, stream->noisefilterRow - reach);
+    return (stream->noisefilterRow == height) ? available : max(0, stream->noisefilterRow - reach);
+}
+
+
+/**
+ * Applies the blurfilter of a stream to as many rows of windows as possible,
+ * see streamNoisefilter().
+ */
+int streamBlurfilter(int available, int* keep, struct STREAM* stream) {
+    struct IMAGE view;
+    int* size;
+    int* step;
+    int height;
+    int rows;
+    int first;
+    int last;
+    int top;
+
+    if (stream->blurfilterScanSize == NULL) {
+        return available;
     }
+    height = stream->source->height;
+    size = stream->blurfilterScanSize;
+    step = stream->blurfilterScanStep;
+    rows = scanCount(height, size[VERTICAL], step[VERTICAL]);
+    first = stream->blurfilterRow;
+    last = first;
+    while ( (last < rows) && ((available == height) || (last * step[VERTICAL] + size[VERTICAL] + step[VERTICAL] <= available)) ) {
+        last++;
+    }
+    if (last > first) { // windows read one step around themselves
+        top = max(0, (first - 1) * step[VERTICAL]);
+        bandView(top, min(height, (last - 1) * step[VERTICAL] + size[VERTICAL] + step[VERTICAL]), &view, stream);
+        stream->blurfilterCount += blurfilterWindows(size, step, stream->blurfilterIntensity, stream->whiteThreshold, first * step[VERTICAL] - top, last - first, &view);
+        freeView(&view);
+        stream->blurfilterRow = last;
+    }
+    *keep = min(*keep, (last - 1) * step[VERTICAL]);
+    return (last == rows) ? available : min(available, last * step[VERTICAL]);
 }
 
 
 /**
- * Moves a rectangular area of pixels to be centered inside a specified area coordinates.
+ * Applies the grayfilter of a stream to as many rows of windows as possible,
+ * see streamNoisefilter().
  */
-void alignMask(int mask[EDGES_COUNT], int outside[EDGES_COUNT], int direction, int margin[DIRECTIONS_COUNT], struct IMAGE* image) {
-    struct IMAGE newimage;
-    int width;
+int streamGrayfilter(int available, int* keep, struct STREAM* stream) {
+    struct IMAGE view;
+    int* size;
+    int* step;
     int height;
-    int targetX;
-    int targetY;
-    
-    width = mask[RIGHT] - mask[LEFT] + 1;
-    height = mask[BOTTOM] - mask[TOP] + 1;
-    if (direction & 1<<LEFT) {
-        targetX = outside[LEFT] + margin[HORIZONTAL];
-    } else if (direction & 1<<RIGHT) {
-        targetX = outside[RIGHT] - width - margin[HORIZONTAL];
-    } else {
-        targetX = (outside[LEFT] + outside[RIGHT] - width) / 2;
+    int rows;
+    int first;
+    int last;
+    int top;
+
+    if (stream->grayfilterScanSize == NULL) {
+        return available;
     }
-    if (direction & 1<<TOP) {
-        targetY = outside[TOP] + margin[VERTICAL];
-    } else if (direction & 1<<BOTTOM) {
-        targetY = outside[BOTTOM] - height - margin[VERTICAL];
-    } else {
-        targetY = (outside[TOP] + outside[BOTTOM] - height) / 2;
+    height = stream->source->height;
+    size = stream->grayfilterScanSize;
+    step = stream->grayfilterScanStep;
+    rows = scanCount(height, size[VERTICAL], step[VERTICAL]);
+    first = stream->grayfilterRow;
+    last = first;
+    while ( (last < rows) && ((available == height) || (last * step[VERTICAL] + size[VERTICAL] <= available)) ) {
+        last++;
     }
-    if (verbose >= VERBOSE_NORMAL) {
-        printf("aligning mask [%d,%d,%d,%d] (%d,%d): %d, %d\n", mask[LEFT], mask[TOP], mask[RIGHT], mask[BOTTOM], targetX, targetY, targetX - mask[LEFT], targetY - mask[TOP]);
+    if (last > first) {
+        top = first * step[VERTICAL];
+        bandView(top, min(height, (last - 1) * step[VERTICAL] + size[VERTICAL]), &view, stream);
+        stream->grayfilterCount += grayfilterWindows(size, step, stream->grayfilterThreshold, stream->blackThreshold, 0, last - first, &view);
+        freeView(&view);
+        stream->grayfilterRow = last;
     }
-    initImage(&newimage, width, height, image->bitdepth, image->color, image->background);
-    copyImageArea(mask[LEFT], mask[TOP], mask[RIGHT], mask[BOTTOM], image, 0, 0, &newimage);
-    clearRect(mask[LEFT], mask[TOP], mask[RIGHT], mask[BOTTOM], image, image->background);
-    copyImageArea(0, 0, width, height, &newimage, targetX, targetY, image);
-    freeImage(&newimage);
+    *keep = min(*keep, last * step[VERTICAL]);
+    return (last == rows) ? available : min(available, last * step[VERTICAL]);
 }
 
 
 /**
- * Moves a rectangular area of pixels to be centered inside a specified area coordinates.
+ * Returns how many rows above or below itself a rotated row of a stream reads
+ * at most.
  */
-void centerMaskInsideMask(int mask[EDGES_COUNT], int outside[EDGES_COUNT], struct IMAGE* image) {
-    alignMask(mask, outside, 0, NULL, image);
+int rotationHalo(struct STREAM* stream) {
+    double centerX;
+    double centerY;
+    int halo;
+    int i;
+
+    halo = 0;
+    for (i = 0; i < stream->rotationCount; i++) {
+        if (stream->rotation[i] != 0.0) {
+            centerX = (stream->rotationMask[i][RIGHT] - stream->rotationMask[i][LEFT]) / 2.0;
+            centerY = (stream->rotationMask[i][BOTTOM] - stream->rotationMask[i][TOP]) / 2.0;
+            // plus the neighbouring pixels read for interpolation
+            halo = max(halo, (int)ceil(centerX * fabs(sin(stream->rotation[i])) + centerY * (1.0 - cos(stream->rotation[i]))) + 2);
+        }
+    }
+    return halo;
 }
 
 
 /**
- * Find the size of one border edge.
- *
- * @param x1..y2 area inside of which border is to be detected
+ * Rotates the part of an area of a stream inside the rows first..last-1 from
+ * the band into out, see rotate().
  */
-int detectBorderEdge(int outsideMask[EDGES_COUNT], int stepX, int stepY, int size, int threshold, int maxBlack, struct IMAGE* image) {
-    int left;
+void rotateRows(int index, int first, int last, struct STREAM* stream) {
+    struct ROTATION rotation;
+    int* area;
+    int bytesPerPixel;
     int top;
-    int right;
     int bottom;
-    int max;
-    int cnt;
-    int result;
-    
-    if (stepY == 0) { // horizontal detection
-        if (stepX > 0) {
-            left = outsideMask[LEFT];
-            top = outsideMask[TOP];
-            right = outsideMask[LEFT] + size;
-            bottom = outsideMask[BOTTOM];
+
+    area = stream->rotationMask[index];
+    top = max(first, area[TOP]);
+    bottom = min(last, area[BOTTOM] + 1);
+    if (top >= bottom) {
+        return;
+    }
+    bytesPerPixel = stream->band.color ? 3 : 1;
+    rotation.cosval = cos(stream->rotation[index]);
+    rotation.sinval = sin(stream->rotation[index]);
+    rotation.width = area[RIGHT] - area[LEFT] + 1;
+    rotation.height = area[BOTTOM] - area[TOP] + 1;
+    rotation.centerX = (rotation.width - 1) / 2.0;
+    rotation.centerY = (rotation.height - 1) / 2.0;
+    rotation.interpolation = stream->interpolation;
+    rotation.supersample = max(1, min(stream->supersample, MAX_SUPERSAMPLE));
+    rotation.first = top - area[TOP];
+    rotation.last = bottom - area[TOP];
+    rotation.rows = 64;
+    rotation.sourceOffset = (long)(area[TOP] - stream->top) * stream->band.stride + area[LEFT] * bytesPerPixel;
+    rotation.targetOffset = (long)(area[TOP] - first) * stream->out.stride + area[LEFT] * bytesPerPixel;
+    rotation.source = &stream->band;
+    rotation.target = &stream->out;
+    runTasks((rotation.last - rotation.first + rotation.rows - 1) / rotation.rows, stream->band.color ? rotateBandColor : rotateBandGray, &rotation); // (streamed sheets have 8 bits per sample)
+}
+
+
+/**
+ * Converts a row of unpacked pixels to the format of a file type.
+ *
+ * @return the number of bytes in target
+ */
+int convertRow(unsigned char* row, int width, BOOLEAN color, int type, int blackThresholdAbs, unsigned char* target) {
+    int x;
+    unsigned char r, g, b;
+
+    if (type == PBM) {
+        if (color) { // (packed in place below)
+            for (x = 0; x < width; x++) {
+                r = row[x * 3];
+                g = row[x * 3 + 1];
+                b = row[x * 3 + 2];
+                target[x] = pixelGrayscale(r, g, b);
+            }
+            row = target;
+        }
+        packBits(row, width, blackThresholdAbs, target);
+        return (width + 7) >> 3;
+    } else if (type == PPM) {
+        if (color) {
+            memcpy(target, row, width * 3);
         } else {
-            left = outsideMask[RIGHT] - size;
-            top = outsideMask[TOP];
-            right = outsideMask[RIGHT];
-            bottom = outsideMask[BOTTOM];
+            for (x = 0; x < width; x++) {
+                target[x * 3] = target[x * 3 + 1] = target[x * 3 + 2] = row[x];
+            }
         }
-        max = (outsideMask[RIGHT] - outsideMask[LEFT]);
-    } else { // vertical detection
-        if (stepY > 0) {
-            left = outsideMask[LEFT];
-            top = outsideMask[TOP];
-            right = outsideMask[RIGHT];
-            bottom = outsideMask[TOP] + size;
+        return width * 3;
+    } else { // PGM
+        if (color) {
+            for (x = 0; x < width; x++) {
+                r = row[x * 3];
+                g = row[x * 3 + 1];
+                b = row[x * 3 + 2];
+                target[x] = pixelGrayscale(r, g, b);
+            }
         } else {
-            left = outsideMask[LEFT];
-            top = outsideMask[BOTTOM] - size;
-            right = outsideMask[RIGHT];
-            bottom = outsideMask[BOTTOM];
+            memcpy(target, row, width);
         }
-        max = (outsideMask[BOTTOM] - outsideMask[TOP]);
+        return width;
     }
-    result = 0;
-    while (result < max) {
-        cnt = countPixelsRect(left, top, right, bottom, 0, maxBlack, FALSE, image);
-        if (cnt >= threshold) {
-            return result; // border has been found: regular exit here
+}
+
+
+/**
+ * Adds a row to the proxy of a stream, see streamRows().
+ */
+void addProxyRow(unsigned char* row, int y, struct STREAM* stream) {
+    struct IMAGE* proxy;
+    unsigned char* p;
+    int bytesPerPixel;
+    int factor;
+    int count;
+    int x;
+    int c;
+
+    proxy = stream->proxy;
+    factor = stream->factor;
+    bytesPerPixel = proxy->color ? 3 : 1;
+    if (stream->sums == NULL) {
+        stream->sums = (int*)calloc(proxy->width * bytesPerPixel, sizeof(int));
+    }
+    for (x = 0; x < stream->band.width; x++) {
+        for (c = 0; c < bytesPerPixel; c++) {
+            stream->sums[(x / factor) * bytesPerPixel + c] += row[x * bytesPerPixel + c];
+        }
+    }
+    if ( ((y + 1) % factor == 0) || (y == stream->source->height - 1) ) { // block complete
+        p = getRow(y / factor, proxy);
+        for (x = 0; x < proxy->width; x++) {
+            count = (y % factor + 1) * (min(stream->band.width, (x + 1) * factor) - x * factor);
+            for (c = 0; c < bytesPerPixel; c++) {
+                p[x * bytesPerPixel + c] = stream->sums[x * bytesPerPixel + c] / count;
+                stream->sums[x * bytesPerPixel + c] = 0;
+            }
         }
-        left += stepX;
-        top += stepY;
-        right += stepX;
-        bottom += stepY;
-        result += abs(stepX+stepY); // (either stepX or stepY is 0)
     }
-    return 0; // no border found between 0..max
 }
 
 
 /**
- * Detects a border of completely non-black pixels around the area outsideBorder[LEFT],outsideBorder[TOP]-outsideBorder[RIGHT],outsideBorder[BOTTOM].
+ * Writes the rows of a stream up to row last: rotates the areas to deskew,
+ * fills the areas to be filled after processing, and converts the rows to
+ * the output file type.
  */
-void detectBorder(int border[EDGES_COUNT], int borderScanDirections, int borderScanSize[DIRECTIONS_COUNT], int borderScanStep[DIRECTIONS_COUNT], int borderScanThreshold[DIRECTIONS_COUNT], float blackThreshold, int outsideMask[EDGES_COUNT], struct IMAGE* image) {
+void writeRows(int last, struct STREAM* stream) {
+    unsigned char* row;
+    unsigned char* converted;
     int blackThresholdAbs;
-    
-    border[LEFT] = outsideMask[LEFT];
-    border[TOP] = outsideMask[TOP];
-    border[RIGHT] = image->width - outsideMask[RIGHT];
-    border[BOTTOM] = image->height - outsideMask[BOTTOM];
-    
-    blackThresholdAbs = (int)(WHITE * (1.0 - blackThreshold));
-    if (borderScanDirections & 1<<HORIZONTAL) {
-        border[LEFT] += detectBorderEdge(outsideMask, borderScanStep[HORIZONTAL], 0, borderScanSize[HORIZONTAL], borderScanThreshold[HORIZONTAL], blackThresholdAbs, image);
-        border[RIGHT] += detectBorderEdge(outsideMask, -borderScanStep[HORIZONTAL], 0, borderScanSize[HORIZONTAL], borderScanThreshold[HORIZONTAL], blackThresholdAbs, image);
+    int first;
+    int length;
+    int y;
+    int i;
+
+    first = stream->written;
+    if (last <= first) {
+        return;
     }
-    if (borderScanDirections & 1<<VERTICAL) {
-        border[TOP] += detectBorderEdge(outsideMask, 0, borderScanStep[VERTICAL], borderScanSize[VERTICAL], borderScanThreshold[VERTICAL], blackThresholdAbs, image);
-        border[BOTTOM] += detectBorderEdge(outsideMask, 0, -borderScanStep[VERTICAL], borderScanSize[VERTICAL], borderScanThreshold[VERTICAL], blackThresholdAbs, image);
+    if (last - first > stream->outCapacity) {
+        stream->outCapacity = last - first;
+        stream->out.buffer = (unsigned char*)poolRealloc(stream->out.buffer, stream->outCapacity * stream->out.stride);
     }
-    if (verbose >= VERBOSE_NORMAL) {
-        printf("border detected: (%d,%d,%d,%d) in [%d,%d,%d,%d]\n", border[LEFT], border[TOP], border[RIGHT], border[BOTTOM], outsideMask[LEFT], outsideMask[TOP], outsideMask[RIGHT], outsideMask[BOTTOM]);
+    stream->out.height = last - first;
+    initChannels(&stream->out);
+    // copied, as the rows may still be read by the filters
+    memcpy(stream->out.buffer, &stream->band.buffer[(first - stream->top) * stream->band.stride], (last - first) * stream->band.stride);
+    for (i = 0; i < stream->rotationCount; i++) {
+        if (stream->rotation[i] != 0.0) {
+            rotateRows(i, first, last, stream);
+        }
+    }
+    fillAreas(stream->after, stream->afterCount, stream->maskColor, first, &stream->out);
+    freeView(&stream->out);
+
+    blackThresholdAbs = WHITE * (1.0 - stream->blackThreshold);
+    converted = (unsigned char*)malloc(stream->out.stride * 3);
+    for (y = first; y < last; y++) {
+        row = getRow(y - first, &stream->out);
+        if (stream->output != NULL) {
+            length = convertRow(row, stream->out.width, stream->out.color, stream->type, blackThresholdAbs, converted);
+            writeOutput(converted, length, stream->output);
+        }
+        if (stream->proxy != NULL) {
+            addProxyRow(row, y, stream);
+        }
     }
+    free(converted);
+    stream->written = last;
 }
 
 
 /**
- * Converts a border-tuple to a mask-tuple.
+ * Processes a sheet in bands of rows, reading it from stream->source and
+ * writing it to stream->output. Each stage set up in the stream processes as
+ * many rows as it can with the rows read so far, and the rows are kept as
+ * long as some stage may still read them. The result is the same as when
+ * applying the stages to the whole sheet, while only some rows are held in
+ * memory at a time.
  */
-void borderToMask(int border[EDGES_COUNT], int mask[EDGES_COUNT], struct IMAGE* image) {
-    mask[LEFT] = border[LEFT];
-    mask[TOP] = border[TOP];
-    mask[RIGHT] = image->width - border[RIGHT] - 1;
-    mask[BOTTOM] = image->height - border[BOTTOM] - 1;
-    if (verbose >= VERBOSE_DEBUG) {
-        printf("border [%d,%d,%d,%d] -> mask [%d,%d,%d,%d]\n", border[LEFT], border[TOP], border[RIGHT], border[BOTTOM], mask[LEFT], mask[TOP], mask[RIGHT], mask[BOTTOM]);
+void streamRows(struct STREAM* stream) {
+    int height;
+    int halo;
+    int available;
+    int keep;
+
+    height = stream->source->height;
+    halo = rotationHalo(stream);
+    while (stream->written < height) {
+        readRows(min(height, stream->loaded + stream->rows), stream);
+        keep = stream->loaded;
+        available = streamNoisefilter(stream->loaded, &keep, stream);
+        available = streamBlurfilter(available, &keep, stream);
+        available = streamGrayfilter(available, &keep, stream);
+        writeRows((available == height) ? height : max(stream->written, available - halo), stream);
+        keep = min(keep, stream->written - halo);
+        dropRows(max(0, keep), stream);
     }
 }
 
 
 /**
- * Applies a border to the whole image. All pixels in the border range at the
- * edges of the sheet will be cleared.
+ * Creates a temporary file to be written through writeOutput(), to be
+ * removed by the caller.
+ *
+ * @param filename returns the name of the file, must hold at least 1024 characters
+ * @return TRUE on success, FALSE on failure
  */
-void applyBorder(int border[EDGES_COUNT], int borderColor, struct IMAGE* image) {
-    int mask[EDGES_COUNT];
-    
-    if (border[LEFT]!=0 || border[TOP]!=0 || border[RIGHT]!=0 || border[BOTTOM]!=0) {
-        borderToMask(border, mask, image);
-        if (verbose >= VERBOSE_NORMAL) {
-            printf("applying border (%d,%d,%d,%d) [%d,%d,%d,%d]\n", border[LEFT], border[TOP], border[RIGHT], border[BOTTOM], mask[LEFT], mask[TOP], mask[RIGHT], mask[BOTTOM]);
-        }
-        applyMasks(&mask, 1, borderColor, image);
+BOOLEAN createTemporaryFile(char* filename, struct OUTPUT_FILE* file) {
+    char* dir;
+    int fd;
+
+    dir = getenv("TMPDIR");
+    snprintf(filename, 1024, "%s/unpaper-XXXXXX", (dir != NULL) ? dir : "/tmp");
+    fd = mkstemp(filename);
+    if (fd == -1) {
+        printf("*** error: Cannot create temporary file %s.\n", filename);
+        return FALSE;
+    }
+    initOutput(fd, file);
+    file->filename[0] = 0;
+    return TRUE;
+}
+
+
+/**
+ * Returns the size of the blocks of pixels to average for a proxy of a sheet
+ * which holds no more pixels than four bands of rows.
+ */
+int proxyFactor(int height, int rows) {
+    int factor;
+
+    factor = 1;
+    while (factor * factor * 4 * rows < height) {
+        factor *= 2;
+    }
+    return factor;
+}
+
+
+/**
+ * Scales down a pair of scan sizes for a proxy, keeping -1 (unset) as it is.
+ */
+void scaleDown(int value[DIRECTIONS_COUNT], int factor, int result[DIRECTIONS_COUNT]) {
+    int i;
+
+    for (i = 0; i < DIRECTIONS_COUNT; i++) {
+        result[i] = (value[i] == -1) ? -1 : max(1, value[i] / factor);
     }
 }
 
@@ -3564,6 +9908,7 @@ int main(int argc, char* argv[]) {
     int blackfilterExclude[MAX_MASKS][EDGES_COUNT];
     int blackfilterIntensity;
     int noisefilterIntensity;
+    int noisefilterMethod;
     int blurfilterScanSize[DIRECTIONS_COUNT];
     int blurfilterScanStep[DIRECTIONS_COUNT];
     float blurfilterIntensity;
@@ -3583,6 +9928,8 @@ int main(int argc, char* argv[]) {
     float deskewScanDepth;
     float deskewScanRange;
     float deskewScanStep;
+    int deskewScanSearch;
+    int deskewMethod;
     float deskewScanDeviation;
     int borderScanDirections;
     int borderScanSize[DIRECTIONS_COUNT];
@@ -3596,6 +9943,10 @@ int main(int argc, char* argv[]) {
     float blackThreshold;
     BOOLEAN writeoutput;
     BOOLEAN qpixels;
+    int deskewInterpolation;
+    int deskewSupersample;
+    int stretchFilter;
+    int tiffCompression;
     BOOLEAN multisheets;
     char* outputTypeName; 
     int noBlackfilterMultiIndex[MAX_MULTI_INDEX];
@@ -3634,7 +9985,31 @@ int main(int argc, char* argv[]) {
     int replaceBlankCount;    
     BOOLEAN overwrite;
     BOOLEAN showTime;
+    BOOLEAN showProfile;
     int dpi;
+    int jobs;
+    int streamBand;
+    BOOLEAN pipeline;
+    VERBOSE_LEVEL verbosity;
+    BOOLEAN streaming;
+    struct SHEET_STAGES stages;
+    BOOLEAN twoPass;
+    struct STREAM stream;
+    struct IMAGE filtered;
+    struct IMAGE proxy;
+    int proxyPoint[MAX_POINTS][COORDINATES_COUNT];
+    int proxyMask[MAX_MASKS][EDGES_COUNT];
+    int proxyScanSize[DIRECTIONS_COUNT];
+    int proxyScanDepth[DIRECTIONS_COUNT];
+    int proxyScanStep[DIRECTIONS_COUNT];
+    int proxyScanMinimum[DIMENSIONS_COUNT];
+    int proxyScanMaximum[DIMENSIONS_COUNT];
+    int streamBorder[3][EDGES_COUNT]; // pre-border, border and post-border as masks
+    double streamRotation[MAX_MASKS];
+    char temporaryFilename[1024];
+    struct OUTPUT_FILE output;
+    int filteredType;
+    int factor;
     
     // --- local variables ---
     int x;
@@ -3658,6 +10033,8 @@ int main(int argc, char* argv[]) {
     char outputFilenamesResolvedBuffer[MAX_PAGES][255]; // count: outputCount;
     char* inputFilenamesResolved[MAX_PAGES];
     char* outputFilenamesResolved[MAX_PAGES];
+    int inputDirectories[MAX_PAGES]; // pages to read from multi-page tiff files
+    int outputDirectories[MAX_PAGES];
     char s1[1023]; // buffers for result of implode()
     char s2[1023];
     char debugFilename[100];
@@ -3672,11 +10049,13 @@ int main(int argc, char* argv[]) {
     int inputType;
     int filterResult;
     double rotation;
+    double edgeRotation[MAX_MASKS][EDGES_COUNT];
     int q;
     struct IMAGE rect;
     struct IMAGE rectTarget;
     int outputType;
     int outputDepth;
+    BOOLEAN keepSamples16;
     int bd;
     BOOLEAN col;
     BOOLEAN success;
@@ -3692,14 +10071,35 @@ int main(int argc, char* argv[]) {
     clock_t time;
     unsigned long int totalTime;
     int totalCount;
-    BOOLEAN ins;
-    BOOLEAN repl;
     int blankCount;
+    int nextInputFileSequencePos; // positions for resolving the input files of the next sheet ahead
+    int nextInputFileSequencePosTotal;
+    int nextInputNr;
+    BOOLEAN nextAnyWildcards;
+    char nextInputFilenamesBuffer[MAX_PAGES][255];
+    char* nextInputFilenames[MAX_PAGES];
+    int nextInputDirectories[MAX_PAGES];
+    struct PREFETCH prefetch; // reads the input files of the next sheet ahead
+    struct WRITER writer; // saves the previous sheet
     int exitCode;
+    BOOLEAN processSheet;
+    struct SHEET_WORKER workers[MAX_JOBS]; // sheets in process by worker processes, in their original order
+    struct SHEET_WORKER* worker; // only set inside a worker process
+    struct SHEET_RESULT result;
+    int workersFirst;
+    int workersCount;
+    int workersChain;
 
     sheet.buffer = NULL;
+    sheet.mapping = NULL;
     page.buffer = NULL;
+    page.mapping = NULL;
+    prefetch.running = FALSE;
+    writer.running = FALSE;
+    writer.success = TRUE;
     exitCode = 0; // error code to return
+    pthread_mutex_init(&pool.mutex, NULL); // (free lists and statistics start out empty)
+    standardOutput = -1;
     bd = 1; // default bitdepth if not resolvable (i.e. usually empty input, so bd=1 is good choice)
     col = FALSE; // default no color if not resolvable
     
@@ -3728,6 +10128,10 @@ int main(int argc, char* argv[]) {
     previousWidth = previousHeight = previousBitdepth = -1;
     previousColor = FALSE;
     first = TRUE;
+    worker = NULL;
+    workersFirst = 0;
+    workersCount = 0;
+    workersChain = -1;
     
     for (nr = startSheet; (endSheet == -1) || (nr <= endSheet); nr++) {
 
@@ -3767,6 +10171,7 @@ int main(int argc, char* argv[]) {
         blackfilterExcludeCount = 0;
         blackfilterIntensity = 20;
         noisefilterIntensity = 4;
+        noisefilterMethod = NOISEFILTER_COMPONENTS;
         blurfilterScanSize[HORIZONTAL] = blurfilterScanSize[VERTICAL] = 100;
         blurfilterScanStep[HORIZONTAL] = blurfilterScanStep[VERTICAL] = 50;
         blurfilterIntensity = 0.01;
@@ -3786,6 +10191,8 @@ int main(int argc, char* argv[]) {
         deskewScanDepth = 0.5;
         deskewScanRange = 5.0;
         deskewScanStep = 0.1;
+        deskewScanSearch = DESKEW_SEARCH_ALL;
+        deskewMethod = DESKEW_METHOD_EDGES;
         deskewScanDeviation = 1.0;
         borderScanDirections = (1<<VERTICAL);
         borderScanSize[HORIZONTAL] = borderScanSize[VERTICAL] = 5;
@@ -3800,12 +10207,16 @@ int main(int argc, char* argv[]) {
         sheetBackground = WHITE;
         writeoutput = TRUE;
         qpixels = TRUE;
+        deskewInterpolation = INTERPOLATION_NEAREST;
+        deskewSupersample = 2;
+        stretchFilter = STRETCH_BOX;
+        tiffCompression = TIFF_COMPRESSION_LZW;
         multisheets = TRUE;
         inputCount = 1;
         outputCount = 1;
         inputFileSequenceCount = 0;
         outputFileSequenceCount = 0;
-        verbose = VERBOSE_NONE;
+        verbosity = VERBOSE_NONE;
         noBlackfilterMultiIndexCount = 0; // 0: allow all, -1: disable all, n: individual entries
         noNoisefilterMultiIndexCount = 0;
         noBlurfilterMultiIndexCount = 0;
@@ -3824,7 +10235,12 @@ int main(int argc, char* argv[]) {
         replaceBlankCount = 0;
         overwrite = FALSE;
         showTime = FALSE;
+        showProfile = FALSE;
         dpi = 300;
+        jobs = 1;
+        threads = 1;
+        streamBand = 0;
+        pipeline = TRUE;
 
 
         // -------------------------------------------------------------------
@@ -3832,7 +10248,7 @@ int main(int argc, char* argv[]) {
         // -------------------------------------------------------------------
         
         i = 1;
-        while ((argc==0) || ((i < argc) && (argv[i][0]=='-'))) {
+        while ((argc==0) || ((i < argc) && (argv[i][0]=='-') && (!isStandardStream(argv[i])))) {
 
             // --help
             if (argc==0 || strcmp(argv[i], "--help")==0 || strcmp(argv[i], "-h")==0 || strcmp(argv[i], "-?")==0 || strcmp(argv[i], "/?")==0 || strcmp(argv[i], "?")==0) {
@@ -4020,6 +10436,34 @@ int main(int argc, char* argv[]) {
             } else if (strcmp(argv[i], "--post-zoom")==0) {
                 sscanf(argv[++i],"%f", &postZoomFactor);
 
+            // --stretch-filter
+            } else if (strcmp(argv[i], "--stretch-filter")==0) {
+                i++;
+                if (strcmp(argv[i], "box")==0) {
+                    stretchFilter = STRETCH_BOX;
+                } else if (strcmp(argv[i], "bilinear")==0) {
+                    stretchFilter = STRETCH_BILINEAR;
+                } else if (strcmp(argv[i], "lanczos")==0) {
+                    stretchFilter = STRETCH_LANCZOS;
+                } else {
+                    printf("*** error: Unknown stretch filter '%s'.\n", argv[i]);
+                    exitCode = 1;
+                }
+
+            // --tiff-compression
+            } else if (strcmp(argv[i], "--tiff-compression")==0) {
+                i++;
+                if (strcmp(argv[i], "lzw")==0) {
+                    tiffCompression = TIFF_COMPRESSION_LZW;
+                } else if (strcmp(argv[i], "deflate")==0) {
+                    tiffCompression = TIFF_COMPRESSION_DEFLATE;
+                } else if (strcmp(argv[i], "none")==0) {
+                    tiffCompression = TIFF_COMPRESSION_NONE;
+                } else {
+                    printf("*** error: Unknown tiff compression '%s'.\n", argv[i]);
+                    exitCode = 1;
+                }
+
 
             // --mask-scan-point  -p
             } else if ((strcmp(argv[i], "-p")==0 || strcmp(argv[i], "--mask-scan-point")==0) && (pointCount < MAX_POINTS)) {
@@ -4153,6 +10597,18 @@ int main(int argc, char* argv[]) {
             } else if (strcmp(argv[i], "-ni")==0 || strcmp(argv[i], "--noisefilter-intensity")==0) {
                 sscanf(argv[++i], "%d", &noisefilterIntensity);
 
+            // --noisefilter-method
+            } else if (strcmp(argv[i], "--noisefilter-method")==0) {
+                i++;
+                if (strcmp(argv[i], "components")==0) {
+                    noisefilterMethod = NOISEFILTER_COMPONENTS;
+                } else if (strcmp(argv[i], "rings")==0) {
+                    noisefilterMethod = NOISEFILTER_RINGS;
+                } else {
+                    printf("*** error: Unknown noisefilter method '%s'.\n", argv[i]);
+                    exitCode = 1;
+                }
+
 
             // --no-blurfilter
             } else if (strcmp(argv[i], "--no-blurfilter")==0) {
@@ -4254,10 +10710,56 @@ int main(int argc, char* argv[]) {
             } else if (strcmp(argv[i], "-dp")==0 || strcmp(argv[i], "--deskew-scan-step")==0) {
                 sscanf(argv[++i],"%f", &deskewScanStep);
 
+            // --deskew-method
+            } else if (strcmp(argv[i], "--deskew-method")==0) {
+                i++;
+                if (strcmp(argv[i], "edges")==0) {
+                    deskewMethod = DESKEW_METHOD_EDGES;
+                } else if (strcmp(argv[i], "projection")==0) {
+                    deskewMethod = DESKEW_METHOD_PROJECTION;
+                } else {
+                    printf("*** error: Unknown deskew method '%s'.\n", argv[i]);
+                    exitCode = 1;
+                }
+
+            // --deskew-scan-search
+            } else if (strcmp(argv[i], "--deskew-scan-search")==0) {
+                i++;
+                if (strcmp(argv[i], "all")==0) {
+                    deskewScanSearch = DESKEW_SEARCH_ALL;
+                } else if (strcmp(argv[i], "refine")==0) {
+                    deskewScanSearch = DESKEW_SEARCH_REFINE;
+                } else {
+                    printf("*** error: Unknown deskew scan search '%s'.\n", argv[i]);
+                    exitCode = 1;
+                }
+
             // --deskew-scan-deviation  -dv
             } else if (strcmp(argv[i], "-dv")==0 || strcmp(argv[i], "--deskew-scan-deviation")==0) {
                 sscanf(argv[++i],"%f", &deskewScanDeviation);
 
+            // --deskew-interpolation
+            } else if (strcmp(argv[i], "--deskew-interpolation")==0) {
+                i++;
+                if (strcmp(argv[i], "nearest")==0) {
+                    deskewInterpolation = INTERPOLATION_NEAREST;
+                } else if (strcmp(argv[i], "bilinear")==0) {
+                    deskewInterpolation = INTERPOLATION_BILINEAR;
+                } else if (strcmp(argv[i], "supersample")==0) {
+                    deskewInterpolation = INTERPOLATION_SUPERSAMPLE;
+                } else {
+                    printf("*** error: Unknown interpolation '%s'.\n", argv[i]);
+                    exitCode = 1;
+                }
+
+            // --deskew-supersample
+            } else if (strcmp(argv[i], "--deskew-supersample")==0) {
+                sscanf(argv[++i], "%d", &deskewSupersample);
+                if ( (deskewSupersample < 1) || (deskewSupersample > MAX_SUPERSAMPLE) ) {
+                    printf("*** error: Supersampling must be between 1 and %d.\n", MAX_SUPERSAMPLE);
+                    exitCode = 1;
+                }
+
             // --no-border-scan
             } else if (strcmp(argv[i], "--no-border-scan")==0) {
                 parseMultiIndex(&i, argv, noBorderScanMultiIndex, &noBorderScanMultiIndexCount);
@@ -4333,7 +10835,7 @@ int main(int argc, char* argv[]) {
                 done = FALSE;
                 while ( (i < argc) && (!done) ) {
                     inputFileSequence[inputFileSequenceCount] = argv[i];
-                    if (inputFileSequence[inputFileSequenceCount][0] == '-') { // is next option
+                    if ( (inputFileSequence[inputFileSequenceCount][0] == '-') && (!isStandardStream(inputFileSequence[inputFileSequenceCount])) ) { // is next option
                         done = TRUE;
                         i--;
                     } else { // continue collecting filenames
@@ -4349,7 +10851,7 @@ int main(int argc, char* argv[]) {
                 done = FALSE;
                 while ( (i < argc) && (!done) ) {
                     outputFileSequence[outputFileSequenceCount] = argv[i];
-                    if (outputFileSequence[outputFileSequenceCount][0] == '-') { // is next option
+                    if ( (outputFileSequence[outputFileSequenceCount][0] == '-') && (!isStandardStream(outputFileSequence[outputFileSequenceCount])) ) { // is next option
                         done = TRUE;
                         i--;
                     } else { // continue collecting filenames
@@ -4393,7 +10895,7 @@ int main(int argc, char* argv[]) {
 
             // --quiet  -q
             } else if (strcmp(argv[i], "-q")==0  || strcmp(argv[i], "--quiet")==0) {
-                verbose = VERBOSE_QUIET;
+                verbosity = VERBOSE_QUIET;
 
             // --overwrite
             } else if (strcmp(argv[i], "--overwrite")==0) {
@@ -4403,40 +10905,119 @@ int main(int argc, char* argv[]) {
             } else if (strcmp(argv[i], "--time")==0) {
                 showTime = TRUE;
 
+            // --profile
+            } else if (strcmp(argv[i], "--profile")==0) {
+                showProfile = TRUE;
+                pipeline = FALSE; // read ahead and saved in the background, loading and saving could not be measured
+
+            // --jobs
+            } else if (strcmp(argv[i], "--jobs")==0) {
+                sscanf(argv[++i], "%d", &jobs);
+                if (jobs < 1) {
+                    jobs = 1;
+                } else if (jobs > MAX_JOBS) {
+                    jobs = MAX_JOBS;
+                }
+
+            // --threads
+            } else if (strcmp(argv[i], "--threads")==0) {
+                sscanf(argv[++i], "%d", &threads);
+                if (threads < 1) {
+                    threads = 1;
+                } else if (threads > MAX_THREADS) {
+                    threads = MAX_THREADS;
+                }
+
+            // --stream
+            } else if (strcmp(argv[i], "--stream")==0) {
+                sscanf(argv[++i], "%d", &streamBand);
+                if (streamBand < 0) {
+                    streamBand = 0;
+                }
+
+            // --no-pipeline
+            } else if (strcmp(argv[i], "--no-pipeline")==0) {
+                pipeline = FALSE;
+
             // --verbose  -v
             } else if (strcmp(argv[i], "-v")==0  || strcmp(argv[i], "--verbose")==0) {
-                verbose = VERBOSE_NORMAL;
+                verbosity = VERBOSE_NORMAL;
 
             // -vv
             } else if (strcmp(argv[i], "-vv")==0) {
-                verbose = VERBOSE_MORE;
+                verbosity = VERBOSE_MORE;
 
             // --debug -vvv (undocumented)
             } else if (strcmp(argv[i], "-vvv")==0 || strcmp(argv[i], "--debug")==0) {
-                verbose = VERBOSE_DEBUG;
+                verbosity = VERBOSE_DEBUG;
 
             // --debug-save -vvvv (undocumented)
             } else if (strcmp(argv[i], "-vvvv")==0 || strcmp(argv[i], "--debug-save")==0) {
-                verbose = VERBOSE_DEBUG_SAVE;
+                verbosity = VERBOSE_DEBUG_SAVE;
 
             // unkown parameter            
             } else {
                 printf("*** error: Unknown parameter '%s'.\n", argv[i]);
                 exitCode = 1;
             }
-            
-            if (exitCode != 0) {
-                printf("Try 'unpaper --help' for options.\n");
-                return exitCode;
+            
+            if (exitCode != 0) {
+                printf("Try 'unpaper --help' for options.\n");
+                finishWriter(&writer);
+                waitSheetWorkers(0, workers, jobs, &workersFirst, &workersCount, &exitCode, &previousWidth, &previousHeight, &previousBitdepth, &previousColor, &totalTime, &totalCount);
+                return exitCode;
+            }
+            i++;
+        }
+
+        
+        // get filenames
+        if (inputFileSequenceCount == 0) { // not yet set via option --input-file-sequence
+            if (i < argc) {
+                inputFileSequence[0] = argv[i++];
+                inputFileSequenceCount = 1;
+            } else {
+                printf("*** error: Missing input filename.\n");
+                printf(HELP);
+                return 1;
+            }
+        }
+        if (outputFileSequenceCount == 0) { // not yet set via option --output-file-sequence
+            if (i < argc) {
+                outputFileSequence[0] = argv[i++];
+                outputFileSequenceCount = 1;
+            } else {
+                printf("*** error: Missing output filename.\n");
+                printf(HELP);
+                return 1;
+            }
+        }                
+
+        // pages get appended to a multi-page tiff output file or standard output one sheet after the other
+        for (j = 0; j < outputFileSequenceCount; j++) {
+            if ( isPagedTiff(outputFileSequence[j]) || isStandardStream(outputFileSequence[j]) ) {
+                jobs = 1;
+            }
+            if ( isStandardStream(outputFileSequence[j]) && (standardOutput == -1) ) { // messages go to standard error from now on
+                fflush(stdout);
+                standardOutput = dup(STDOUT_FILENO);
+                dup2(STDERR_FILENO, STDOUT_FILENO);
+            }
+        }
+        for (j = 0; j < inputFileSequenceCount; j++) {
+            if (isStandardStream(inputFileSequence[j])) { // (images are read in order)
+                jobs = 1;
             }
-            i++;
         }
 
-        
         // -------------------------------------------------------------------
         // --- begin processing                                            ---
         // -------------------------------------------------------------------
 
+        if (verbose != verbosity) { // only set once, the writer thread may be reading it later on
+            verbose = verbosity;
+        }
+
         if (first) {
             if (startSheet < nr) { // startSheet==0
                 nr = startSheet;
@@ -4462,57 +11043,19 @@ int main(int argc, char* argv[]) {
         
         showTime |= (verbose >= VERBOSE_DEBUG); // always show processing time in verbose-debug mode
         
-        // get filenames
-        if (inputFileSequenceCount == 0) { // not yet set via option --input-file-sequence
-            if (i < argc) {
-                inputFileSequence[0] = argv[i++];
-                inputFileSequenceCount = 1;
-            } else {
-                printf("*** error: Missing input filename.\n");
-                printf(HELP);
-                return 1;
-            }
-        }
-        if (outputFileSequenceCount == 0) { // not yet set via option --output-file-sequence
-            if (i < argc) {
-                outputFileSequence[0] = argv[i++];
-                outputFileSequenceCount = 1;
-            } else {
-                printf("*** error: Missing output filename.\n");
-                printf(HELP);
-                return 1;
-            }
-        }                
-
         // resolve filenames for current sheet
         anyWildcards = FALSE;
         allInputFilesMissing = TRUE;
-        blankCount = 0;
+        blankCount = resolveInputFilenames(inputCount, inputFileSequence, inputFileSequenceCount, &inputFileSequencePos, &inputFileSequencePosTotal, &inputNr, insertBlank, insertBlankCount, replaceBlank, replaceBlankCount, inputFilenamesResolvedBuffer, inputFilenamesResolved, inputDirectories, &anyWildcards);
         for (j = 0; j < inputCount; j++) {
-            if ( (!anyWildcards) && (strchr(inputFileSequence[inputFileSequencePos], '%') != 0) ) {
-                anyWildcards = TRUE;
-            }
-            ins = isInMultiIndex(inputFileSequencePosTotal+1, insertBlank, insertBlankCount);
-            repl = isInMultiIndex(inputFileSequencePosTotal+1, replaceBlank, replaceBlankCount);
-            if (!(ins || repl)) {
-                sprintf(inputFilenamesResolvedBuffer[j], inputFileSequence[inputFileSequencePos++], inputNr);
-                inputFilenamesResolved[j] = inputFilenamesResolvedBuffer[j];
-                if ( allInputFilesMissing && ( fileExists(inputFilenamesResolved[j]) ) ) {
-                    allInputFilesMissing = FALSE;
+            if (inputFilenamesResolved[j] != NULL) {
+                if ( isWriting(inputFilenamesResolved[j], &writer) && (!finishWriter(&writer)) ) { // output of the previous sheet is input of this one
+                    exitCode = 2;
                 }
-            } else { // use blank input
-                inputFilenamesResolved[j] = NULL;
-                blankCount++;
-                //allInputFilesMissing = FALSE;
-                if (repl) { // but skip input file sequence pos if replace-mode
-                    inputFileSequencePos++;
+                if ( allInputFilesMissing && ( pageExists(inputFilenamesResolved[j], inputDirectories[j]) ) ) {
+                    allInputFilesMissing = FALSE;
                 }
             }
-            if ( inputFileSequencePos >= inputFileSequenceCount ) { // next 'loop' in input-file-seq
-                inputFileSequencePos = 0;
-                inputNr++;
-            }
-            inputFileSequencePosTotal++;
         }
         if (blankCount == inputCount) {
             allInputFilesMissing = FALSE;
@@ -4530,6 +11073,7 @@ int main(int argc, char* argv[]) {
             if ( (!anyWildcards) && (strchr(outputFileSequence[outputFileSequencePos], '%') != 0) ) {
                 anyWildcards = TRUE;
             }
+            outputDirectories[j] = isPagedTiff(outputFileSequence[outputFileSequencePos]) ? outputNr - 1 : 0;
             sprintf(outputFilenamesResolvedBuffer[j], outputFileSequence[outputFileSequencePos++], outputNr);
             outputFilenamesResolved[j] = outputFilenamesResolvedBuffer[j];
             if ( outputFileSequencePos >= outputFileSequenceCount ) { // next 'loop' in output-file-seq
@@ -4552,7 +11096,58 @@ int main(int argc, char* argv[]) {
             // --- process single sheet                                    ---
             // ---------------------------------------------------------------
 
-            if (isInMultiIndex(nr, sheetMultiIndex, sheetMultiIndexCount) && (!isInMultiIndex(nr, excludeMultiIndex, excludeMultiIndexCount))) {
+            processSheet = isInMultiIndex(nr, sheetMultiIndex, sheetMultiIndexCount) && (!isInMultiIndex(nr, excludeMultiIndex, excludeMultiIndexCount));
+
+            // read ahead the input files of the next sheet while this one is processed
+            finishPrefetch(&prefetch);
+            if ( pipeline && multisheets && (jobs <= 1) && ((endSheet == -1) || (nr < endSheet))
+                 && isInMultiIndex(nr + 1, sheetMultiIndex, sheetMultiIndexCount) && (!isInMultiIndex(nr + 1, excludeMultiIndex, excludeMultiIndexCount)) ) {
+                nextInputFileSequencePos = inputFileSequencePos;
+                nextInputFileSequencePosTotal = inputFileSequencePosTotal;
+                nextInputNr = inputNr;
+                nextAnyWildcards = FALSE;
+                resolveInputFilenames(inputCount, inputFileSequence, inputFileSequenceCount, &nextInputFileSequencePos, &nextInputFileSequencePosTotal, &nextInputNr, insertBlank, insertBlankCount, replaceBlank, replaceBlankCount, nextInputFilenamesBuffer, nextInputFilenames, nextInputDirectories, &nextAnyWildcards);
+                for (j = 0; j < inputCount; j++) {
+                    if (nextInputDirectories[j] > 0) { // (a page of a tiff file read before, or the next images of standard input)
+                        nextInputFilenames[j] = NULL;
+                    }
+                }
+                startPrefetch(inputCount, nextInputFilenames, &prefetch);
+            }
+
+            // hand sheet over to a worker process if processing multiple sheets in parallel
+            if (processSheet && multisheets && (jobs > 1)) {
+                // an all-blank sheet takes its size from the previous sheet, so wait until all previous sheets are done
+                if (!waitSheetWorkers((blankCount == inputCount) ? 0 : jobs - 1, workers, jobs, &workersFirst, &workersCount, &exitCode, &previousWidth, &previousHeight, &previousBitdepth, &previousColor, &totalTime, &totalCount)) {
+                    return exitCode;
+                }
+                j = (workersFirst + workersCount) % jobs;
+                switch (startSheetWorker(&workers[j], &workersChain)) {
+                    case 0: // worker process, continue processing this sheet and report back
+                        worker = &workers[j];
+                        totalTime = 0;
+                        totalCount = 0;
+                        break;
+                    case -1:
+                        printf("*** error: Cannot start worker process for sheet #%d.\n", nr);
+                        exitCode = 2;
+                        endSheet = nr - 1; // exit for-loop
+                        processSheet = FALSE;
+                        break;
+                    default: // main process, continue with next sheet
+                        workersCount++;
+                        processSheet = FALSE;
+                }
+            }
+
+            // report a failed background save of the previous sheet before this one starts, and stop as without the writer
+            if ( processSheet && (!finishWriter(&writer)) ) {
+                exitCode = 2;
+                endSheet = nr - 1; // exit for-loop
+                processSheet = FALSE;
+            }
+
+            if (processSheet) {
 
                 if (verbose >= VERBOSE_NORMAL) {
                     printf("\n-------------------------------------------------------------------------------\n");
@@ -4566,33 +11161,44 @@ int main(int argc, char* argv[]) {
                 }
 
                 // load input image(s)
+                startProfile(showProfile);
                 success = TRUE;
                 for ( j = 0; (success) && (j < inputCount); j++) {
                 
-                    if ( (inputFilenamesResolved[j] == NULL) || fileExists(inputFilenamesResolved[j]) ) {
+                    if ( (inputFilenamesResolved[j] == NULL) || pageExists(inputFilenamesResolved[j], inputDirectories[j]) ) {
 
                         if (inputFilenamesResolved[j] != NULL) { // may be null if --insert-blank or --replace-blank
                         
-                            success = loadImage(inputFilenamesResolved[j], &page, &inputType);
-                            inputTypeName = (char*)FILETYPE_NAMES[inputType];
-                            inputTypeNames[j] = inputTypeName;
-                            sprintf(debugFilename, "_loaded_%d.pnm", inputNr-inputCount+j);
-                            saveDebug(debugFilename, &page);
+                            beginStage();
+                            success = loadImage(inputFilenamesResolved[j], inputDirectories[j], &page, &inputType);
+                            if ( success && profile.enabled && (streamBand == 0) ) { // otherwise the file is read by the first stage to touch it
+                                prefaultMapping(&page);
+                            }
+                            endStage(STAGE_LOAD, &page);
 
                             if (!success) {
                                 printf("*** error: Cannot load image %s.\n", inputFilenamesResolved[j]);
                                 exitCode = 2;
+                                page.buffer = NULL; // nothing to place into the sheet or to free
+                                inputTypeNames[j] = "<none>";
                             } else {
+                                inputTypeName = (char*)FILETYPE_NAMES[inputType];
+                                inputTypeNames[j] = inputTypeName;
+                                sprintf(debugFilename, "_loaded_%d.pnm", inputNr-inputCount+j);
+                                saveDebug(debugFilename, &page);
+
                                 // pre-rotate
                                 if (preRotate != 0) {
                                     if (verbose>=VERBOSE_NORMAL) {
                                         printf("pre-rotating %d degrees.\n", preRotate);
                                     }
+                                    beginStage();
                                     if (preRotate == 90) {
                                         flipRotate(1, &page);
                                     } else if (preRotate == -90) {
                                         flipRotate(-1, &page);
                                     }
+                                    endStage(STAGE_FLIP, &page);
                                 }
 
                                 // if sheet-size is not known yet (and not forced by --sheet-size), set now based on size of (first) input image
@@ -4618,14 +11224,7 @@ int main(int argc, char* argv[]) {
                                                 
                         // place image into sheet buffer
                         if ( (inputCount == 1) && (page.buffer != NULL) && (page.width == w) && (page.height == h) ) { // quick case: single input file == whole sheet
-                            sheet.buffer = page.buffer;
-                            sheet.bufferGrayscale = page.bufferGrayscale;
-                            sheet.bufferLightness = page.bufferLightness;
-                            sheet.bufferDarknessInverse = page.bufferDarknessInverse;
-                            sheet.width = page.width;
-                            sheet.height = page.height;
-                            sheet.bitdepth = page.bitdepth;
-                            sheet.color = page.color;
+                            sheet = page; // copy whole struct, sheet takes over the page's buffers
                             sheet.background = sheetBackground;
                         } else { // generic case: place image onto sheet by copying
                             // allocate sheet-buffer if not done yet
@@ -4640,14 +11239,14 @@ int main(int argc, char* argv[]) {
                                         // bd remains default
                                     }
                                 }
-                                initImage(&sheet, w, h, bd, col, sheetBackground);
+                                initSheetImage(&sheet, w, h, bd, col, sheetBackground);
                                 
                             } else if ((page.buffer != NULL) && ((page.bitdepth > sheet.bitdepth) || ( (!sheet.color) && page.color ))) { // make sure current sheet buffer has enough bitdepth and color-mode
                                 sheetBackup = sheet;
                                 // re-allocate sheet
                                 bd = page.bitdepth;
                                 col = page.color;
-                                initImage(&sheet, w, h, bd, col, sheetBackground);
+                                initSheetImage(&sheet, w, h, bd, col, sheetBackground);
                                 // copy old one
                                 copyImage(&sheetBackup, 0, 0, &sheet);
                                 freeImage(&sheetBackup);
@@ -4688,9 +11287,10 @@ int main(int argc, char* argv[]) {
                     }
                     if ((w == -1) || (h == -1)) {
                         printf("*** error: sheet size unknown, use at least one input file per sheet, or force using --sheet-size.\n");
+                        finishWriter(&writer);
                         return 2;
                     } else {
-                        initImage(&sheet, w, h, bd, col, sheetBackground);
+                        initSheetImage(&sheet, w, h, bd, col, sheetBackground);
                     }
                 }
 
@@ -4721,24 +11321,49 @@ int main(int argc, char* argv[]) {
                         }
                         if (outputType == -1) {
                             printf("*** error: output file format '%s' is not known.\n", outputTypeName);
+                            finishWriter(&writer);
                             return 2;
                         }
                     }
                     if (outputDepth == -1) { // set output depth to be as input depth, if not explicitly set by user
                         outputDepth = sheet.bitdepth;
                     }
+                    // 16-bit samples are only kept for pgm and ppm files
+                    keepSamples16 = ( (outputDepth == 16) && (outputType != PBM) ) ? TRUE : FALSE;
+                    for (i = 0; i < outputCount; i++) {
+                        if ( (outputFilenamesResolved[i] != NULL) && isTiffFilename(outputFilenamesResolved[i]) ) {
+                            keepSamples16 = FALSE;
+                        }
+                    }
+                    changeDepth(keepSamples16 ? 16 : 8, &sheet);
 
                     if (showTime) {
                         startTime = clock();
                     }
 
+                    // streaming, only if the sheet keeps its size and goes to a single output file
+                    streaming = FALSE;
+                    if (streamBand > 0) {
+                        if ( (preRotate == 0) && (preMirror == 0) && (preShift[WIDTH] == 0) && (preShift[HEIGHT] == 0)
+                          && (stretchSize[WIDTH] == -1) && (stretchSize[HEIGHT] == -1) && (zoomFactor == 1.0) && (size[WIDTH] == -1) && (size[HEIGHT] == -1)
+                          && (postMirror == 0) && (postShift[WIDTH] == 0) && (postShift[HEIGHT] == 0) && (postRotate == 0)
+                          && (postStretchSize[WIDTH] == -1) && (postStretchSize[HEIGHT] == -1) && (postZoomFactor == 1.0) && (postSize[WIDTH] == -1) && (postSize[HEIGHT] == -1)
+                          && (outputCount == 1) && (!isTiffFilename(outputFilenamesResolved[0])) && (sheet.low == NULL) ) {
+                            streaming = TRUE;
+                        } else if (verbose >= VERBOSE_NORMAL) {
+                            printf("sheet %d cannot be streamed, processing it in memory.\n", nr);
+                        }
+                    }
+
                     // pre-mirroring
                     if (preMirror != 0) {
                         if (verbose >= VERBOSE_NORMAL) {
                             printf("pre-mirroring ");
                             printDirections(preMirror);
                         }
+                        beginStage();
                         mirror(preMirror, &sheet);
+                        endStage(STAGE_FLIP, &sheet);
                     }
 
                     // pre-shifting
@@ -4746,15 +11371,19 @@ int main(int argc, char* argv[]) {
                         if (verbose >= VERBOSE_NORMAL) {
                             printf("pre-shifting [%d,%d]\n", preShift[WIDTH], preShift[HEIGHT]);
                         }
+                        beginStage();
                         shift(preShift[WIDTH], preShift[HEIGHT], &sheet);
+                        endStage(STAGE_FLIP, &sheet);
                     }
 
-                    // pre-masking
-                    if (preMaskCount > 0) {
+                    // pre-masking (when streaming, as rows are read)
+                    if ((preMaskCount > 0) && (!streaming)) {
                         if (verbose >= VERBOSE_NORMAL) {
                             printf("pre-masking\n ");
                         }
+                        beginStage();
                         applyMasks(preMask, preMaskCount, maskColor, &sheet);
+                        endStage(STAGE_MASKS, &sheet);
                     }
 
 
@@ -4814,6 +11443,11 @@ int main(int argc, char* argv[]) {
                         if (postZoomFactor != 1.0) {
                             printf("post-zoom: %f\n", postZoomFactor);
                         }
+                        if (stretchFilter == STRETCH_BILINEAR) {
+                            printf("stretch-filter: bilinear\n");
+                        } else if (stretchFilter == STRETCH_LANCZOS) {
+                            printf("stretch-filter: lanczos\n");
+                        }
                         if (noBlackfilterMultiIndexCount != -1) {
                             printf("blackfilter-scan-direction: ");
                             printDirections(blackfilterScanDirections);
@@ -4841,6 +11475,9 @@ int main(int argc, char* argv[]) {
                         }
                         if (noNoisefilterMultiIndexCount != -1) {
                             printf("noisefilter-intensity: %d\n", noisefilterIntensity);
+                            if (noisefilterMethod == NOISEFILTER_RINGS) {
+                                printf("noisefilter-method: rings\n");
+                            }
                             if (noNoisefilterMultiIndexCount > 0) {
                                 printf("noisefilter DISABLED for sheets: ");
                                 printMultiIndex(noNoisefilterMultiIndex, noNoisefilterMultiIndexCount);
@@ -4907,7 +11544,18 @@ int main(int argc, char* argv[]) {
                             printf("deskew-scan-depth: %f\n", deskewScanDepth);
                             printf("deskew-scan-range: %f\n", deskewScanRange);
                             printf("deskew-scan-step: %f\n", deskewScanStep);
+                            if (deskewScanSearch == DESKEW_SEARCH_REFINE) {
+                                printf("deskew-scan-search: refine\n");
+                            }
+                            if (deskewMethod == DESKEW_METHOD_PROJECTION) {
+                                printf("deskew-method: projection\n");
+                            }
                             printf("deskew-scan-deviation: %f\n", deskewScanDeviation);
+                            if (deskewInterpolation == INTERPOLATION_BILINEAR) {
+                                printf("deskew-interpolation: bilinear\n");
+                            } else if (deskewInterpolation == INTERPOLATION_SUPERSAMPLE) {
+                                printf("deskew-interpolation: supersample %dx%d\n", deskewSupersample, deskewSupersample);
+                            }
                             if (qpixels==FALSE) {
                                 printf("qpixel-coding DISABLED.\n");
                             }
@@ -4998,6 +11646,14 @@ int main(int argc, char* argv[]) {
                         if (overwrite) {
                             printf("OVERWRITING EXISTING FILES\n");
                         }
+                        if (tiffCompression == TIFF_COMPRESSION_DEFLATE) {
+                            printf("tiff-compression: deflate\n");
+                        } else if (tiffCompression == TIFF_COMPRESSION_NONE) {
+                            printf("tiff-compression: none\n");
+                        }
+                        if (streaming) {
+                            printf("streaming in bands of %d rows\n", streamBand);
+                        }
                         printf("\n");
                     }
                     if (verbose >= VERBOSE_NORMAL) {
@@ -5025,7 +11681,9 @@ int main(int argc, char* argv[]) {
                             h = sheet.height;
                         }
                         saveDebug("./_before-stretch.pnm", &sheet);
-                        stretch(w, h, &sheet);
+                        beginStage();
+                        stretch(w, h, stretchFilter, &sheet);
+                        endStage(STAGE_STRETCH, &sheet);
                         saveDebug("./_after-stretch.pnm", &sheet);
                     } 
                     
@@ -5033,7 +11691,9 @@ int main(int argc, char* argv[]) {
                     if (zoomFactor != 1.0) {
                         w = sheet.width * zoomFactor;
                         h = sheet.height * zoomFactor;
-                        stretch(w, h, &sheet);
+                        beginStage();
+                        stretch(w, h, stretchFilter, &sheet);
+                        endStage(STAGE_STRETCH, &sheet);
                     }
 
                     // size
@@ -5049,7 +11709,9 @@ int main(int argc, char* argv[]) {
                             h = sheet.height;
                         }
                         saveDebug("./_before-resize.pnm", &sheet);
-                        resize(w, h, &sheet);
+                        beginStage();
+                        resize(w, h, stretchFilter, &sheet);
+                        endStage(STAGE_STRETCH, &sheet);
                         saveDebug("./_after-resize.pnm", &sheet);
                     } 
                     
@@ -5145,371 +11807,585 @@ int main(int argc, char* argv[]) {
                         maskScanMaximum[HEIGHT] = sheet.height;
                     }
 
-                    
-                    // pre-wipe
-                    if (!isExcluded(nr, noWipeMultiIndex, noWipeMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount)) {
-                        applyWipes(preWipe, preWipeCount, maskColor, &sheet);
+                    // stages to be done for this sheet, in memory as well as when streaming
+                    stages.blackfilter = stageEnabled(nr, "blackfilter", noBlackfilterMultiIndex, noBlackfilterMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount);
+                    stages.noisefilter = stageEnabled(nr, "noisefilter", noNoisefilterMultiIndex, noNoisefilterMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount);
+                    stages.blurfilter = stageEnabled(nr, "blurfilter", noBlurfilterMultiIndex, noBlurfilterMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount);
+                    stages.maskScan = stageEnabled(nr, "mask-scan", noMaskScanMultiIndex, noMaskScanMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount);
+                    stages.grayfilter = stageEnabled(nr, "grayfilter", noGrayfilterMultiIndex, noGrayfilterMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount);
+                    stages.deskew = stageEnabled(nr, "deskewing", noDeskewMultiIndex, noDeskewMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount);
+                    stages.maskCenter = stageEnabled(nr, "auto-centering", noMaskCenterMultiIndex, noMaskCenterMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount);
+                    stages.wipe = stageEnabled(nr, "wipe", noWipeMultiIndex, noWipeMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount);
+                    stages.border = stageEnabled(nr, "border", noBorderMultiIndex, noBorderMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount);
+                    stages.borderScan = stageEnabled(nr, "border-scan", noBorderScanMultiIndex, noBorderScanMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount);
+                    stages.borderAlign = stageEnabled(nr, "border-centering", noBorderAlignMultiIndex, noBorderAlignMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount);
+                    if ( streaming && (verbose >= VERBOSE_NORMAL) ) {
+                        if (stages.blackfilter) {
+                            printf("blackfilter not available when streaming.\n");
+                        }
+                        if ( stages.maskCenter && (layout != LAYOUT_NONE) ) {
+                            printf("mask centering not available when streaming.\n");
+                        }
+                        if (stages.borderScan) {
+                            printf("border-scan not available when streaming.\n");
+                        }
                     }
 
-                    // pre-border
-                    if (!isExcluded(nr, noBorderMultiIndex, noBorderMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount)) {
-                        applyBorder(preBorder, maskColor, &sheet);
-                    }
+                    if (streaming) {
+                        // pre-mask, pre-wipe and pre-border are applied to the rows as they are read
+                        initStream(&sheet, streamBand, &stream);
+                        stream.maskColor = maskColor;
+                        stream.whiteThreshold = whiteThreshold;
+                        stream.blackThreshold = blackThreshold;
+                        addAreas(preMask, preMaskCount, TRUE, stream.before, &stream.beforeCount);
+                        if (stages.wipe) {
+                            addAreas(preWipe, preWipeCount, FALSE, stream.before, &stream.beforeCount);
+                        }
+                        if ( stages.border && (preBorder[LEFT]!=0 || preBorder[TOP]!=0 || preBorder[RIGHT]!=0 || preBorder[BOTTOM]!=0) ) {
+                            borderToMask(preBorder, streamBorder[0], &sheet);
+                            addAreas(&streamBorder[0], 1, TRUE, stream.before, &stream.beforeCount);
+                        }
 
-                    // black area filter
-                    if (!isExcluded(nr, noBlackfilterMultiIndex, noBlackfilterMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount)) {
-                        saveDebug("./_before-blackfilter.pnm", &sheet);
-                        blackfilter(blackfilterScanDirections, blackfilterScanSize, blackfilterScanDepth, blackfilterScanStep, blackfilterScanThreshold, blackfilterExclude, blackfilterExcludeCount, blackfilterIntensity, blackThreshold, &sheet);
-                        saveDebug("./_after-blackfilter.pnm", &sheet);
-                    } else {
-                        if (verbose >= VERBOSE_MORE) {
-                            printf("+ blackfilter DISABLED for sheet %d\n", nr);
+                        if (stages.noisefilter) {
+                            stream.noisefilterIntensity = noisefilterIntensity;
+                            stream.noisefilterMethod = noisefilterMethod;
+                        }
+                        if (stages.blurfilter) {
+                            stream.blurfilterScanSize = blurfilterScanSize;
+                            stream.blurfilterScanStep = blurfilterScanStep;
+                            stream.blurfilterIntensity = blurfilterIntensity;
                         }
-                    }
 
-                    // noise filter
-                    if (!isExcluded(nr, noNoisefilterMultiIndex, noNoisefilterMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount)) {
-                        if (verbose >= VERBOSE_NORMAL) {
-                            printf("noise-filter ...");
+                        // masks have to be known before the grayfilter: filter into a temporary file first,
+                        // and detect masks and rotation on a downscaled copy of the result
+                        twoPass = stages.maskScan || (maskCount > 0);
+                        if (twoPass) {
+                            factor = proxyFactor(sheet.height, streamBand);
+                            initImage(&proxy, (sheet.width + factor - 1) / factor, (sheet.height + factor - 1) / factor, 8, sheet.color, WHITE);
+                            stream.proxy = &proxy;
+                            stream.factor = factor;
+                            stream.type = sheet.color ? PPM : PGM;
+                            if (!createTemporaryFile(temporaryFilename, &output)) {
+                                finishWriter(&writer);
+                                return 2;
+                            }
+                            stream.output = &output;
+                            writeHeader(stream.type, sheet.width, sheet.height, WHITE, &output);
+                            beginStage();
+                            streamRows(&stream);
+                            closeOutput(&output); // (an incomplete file fails to load)
+                            endStage(STAGE_STREAM, &sheet);
+                            if ( (stream.noisefilterIntensity > 0) && (verbose >= VERBOSE_NORMAL) ) {
+                                printf("noise-filter ... deleted %d clusters.\n", stream.noisefilterCount);
+                            }
+                            if ( (stream.blurfilterScanSize != NULL) && (verbose >= VERBOSE_NORMAL) ) {
+                                printf("blur-filter... deleted %d pixels.\n", stream.blurfilterCount);
+                            }
+                            freeStream(&stream);
+                            beginStage();
+                            success = loadImage(temporaryFilename, 0, &filtered, &filteredType);
+                            endStage(STAGE_LOAD, &filtered);
+                            unlink(temporaryFilename); // stays mapped
+                            if (!success) {
+                                printf("*** error: Cannot load image %s.\n", temporaryFilename);
+                                finishWriter(&writer);
+                                return 2;
+                            }
+
+                            // mask-detection
+                            if (stages.maskScan) {
+                                for (i = 0; i < pointCount; i++) {
+                                    proxyPoint[i][X] = point[i][X] / factor;
+                                    proxyPoint[i][Y] = point[i][Y] / factor;
+                                }
+                                scaleDown(maskScanSize, factor, proxyScanSize);
+                                scaleDown(maskScanDepth, factor, proxyScanDepth);
+                                scaleDown(maskScanStep, factor, proxyScanStep);
+                                scaleDown(maskScanMinimum, factor, proxyScanMinimum);
+                                scaleDown(maskScanMaximum, factor, proxyScanMaximum);
+                                beginStage();
+                                maskCount = detectMasks(proxyMask, maskValid, proxyPoint, pointCount, maskScanDirections, proxyScanSize, proxyScanDepth, proxyScanStep, maskScanThreshold, proxyScanMinimum, proxyScanMaximum, &proxy);
+                                endStage(STAGE_MASKS, &proxy);
+                                for (i = 0; i < maskCount; i++) {
+                                    mask[i][LEFT] = proxyMask[i][LEFT] * factor;
+                                    mask[i][TOP] = proxyMask[i][TOP] * factor;
+                                    mask[i][RIGHT] = proxyMask[i][RIGHT] * factor + factor - 1;
+                                    mask[i][BOTTOM] = proxyMask[i][BOTTOM] * factor + factor - 1;
+                                }
+                            }
+                            for (i = 0; i < maskCount; i++) { // areas to rotate have to be inside the sheet
+                                mask[i][LEFT] = max(0, mask[i][LEFT]);
+                                mask[i][TOP] = max(0, mask[i][TOP]);
+                                mask[i][RIGHT] = min(sheet.width - 1, mask[i][RIGHT]);
+                                mask[i][BOTTOM] = min(sheet.height - 1, mask[i][BOTTOM]);
+                                proxyMask[i][LEFT] = mask[i][LEFT] / factor;
+                                proxyMask[i][TOP] = mask[i][TOP] / factor;
+                                proxyMask[i][RIGHT] = mask[i][RIGHT] / factor;
+                                proxyMask[i][BOTTOM] = mask[i][BOTTOM] / factor;
+                            }
+                            beginStage();
+                            applyMasks(proxyMask, maskCount, maskColor, &proxy);
+                            endStage(STAGE_MASKS, &proxy);
+                            if (stages.grayfilter) { // as rotation is detected after the grayfilter
+                                scaleDown(grayfilterScanSize, factor, proxyScanSize);
+                                scaleDown(grayfilterScanStep, factor, proxyScanStep);
+                                beginStage();
+                                grayfilter(proxyScanSize, proxyScanStep, grayfilterThreshold, blackThreshold, &proxy);
+                                endStage(STAGE_GRAYFILTER, &proxy);
+                            }
+
+                            // rotation-detection
+                            if ( stages.deskew && (maskCount > 0) ) {
+                                beginStage();
+                                detectRotations(deskewMethod, deskewScanEdges, deskewScanRange, deskewScanStep, deskewScanSearch, max(1, deskewScanSize / factor), deskewScanDepth, proxyMask, maskCount, edgeRotation, &proxy);
+                                endStage(STAGE_DESKEW, &proxy);
+                                for (i = 0; i < maskCount; i++) {
+                                    rotation = - maskRotation(deskewMethod, deskewScanEdges, edgeRotation[i], deskewScanDeviation, mask[i][LEFT], mask[i][TOP], mask[i][RIGHT], mask[i][BOTTOM]);
+                                    if (verbose >= VERBOSE_NORMAL) {
+                                        if (rotation != 0.0) {
+                                            printf("rotate (%d,%d): %f\n", point[i][X], point[i][Y], rotation);
+                                        } else {
+                                            printf("rotate (%d,%d): -\n", point[i][X], point[i][Y]);
+                                        }
+                                    }
+                                    streamRotation[i] = degreesToRadians(rotation);
+                                }
+                            }
+                            freeImage(&proxy);
+
+                            // second pass on the filtered sheet
+                            initStream(&filtered, streamBand, &stream);
+                            stream.maskColor = maskColor;
+                            stream.whiteThreshold = whiteThreshold;
+                            stream.blackThreshold = blackThreshold;
+                            addAreas(mask, maskCount, TRUE, stream.before, &stream.beforeCount);
+                            if (stages.deskew) {
+                                stream.rotationMask = mask;
+                                stream.rotation = streamRotation;
+                                stream.rotationCount = maskCount;
+                                if ( (qpixels == TRUE) && (deskewInterpolation == INTERPOLATION_NEAREST) ) { // same result as rotating qpixels
+                                    stream.interpolation = INTERPOLATION_SUPERSAMPLE;
+                                    stream.supersample = 2;
+                                } else {
+                                    stream.interpolation = deskewInterpolation;
+                                    stream.supersample = deskewSupersample;
+                                }
+                            }
                         }
-                        saveDebug("./_before-noisefilter.pnm", &sheet);
-                        filterResult = noisefilter(noisefilterIntensity, whiteThreshold, &sheet);
-                        saveDebug("./_after-noisefilter.pnm", &sheet);
-                        if (verbose >= VERBOSE_NORMAL) {
-                            printf(" deleted %d clusters.\n", filterResult);
+
+                        if (stages.grayfilter) {
+                            stream.grayfilterScanSize = grayfilterScanSize;
+                            stream.grayfilterScanStep = grayfilterScanStep;
+                            stream.grayfilterThreshold = grayfilterThreshold;
                         }
-                    } else {
-                        if (verbose >= VERBOSE_MORE) {
-                            printf("+ noisefilter DISABLED for sheet %d\n", nr);
+
+                        // wipe and border are applied to the rows as they are written
+                        if (stages.wipe) {
+                            addAreas(wipe, wipeCount, FALSE, stream.after, &stream.afterCount);
+                        }
+                        if ( stages.border && (border[LEFT]!=0 || border[TOP]!=0 || border[RIGHT]!=0 || border[BOTTOM]!=0) ) {
+                            borderToMask(border, streamBorder[1], &sheet);
+                            addAreas(&streamBorder[1], 1, TRUE, stream.after, &stream.afterCount);
+                        }
+                        if (stages.wipe) {
+                            addAreas(postWipe, postWipeCount, FALSE, stream.after, &stream.afterCount);
+                        }
+                        if ( stages.border && (postBorder[LEFT]!=0 || postBorder[TOP]!=0 || postBorder[RIGHT]!=0 || postBorder[BOTTOM]!=0) ) {
+                            borderToMask(postBorder, streamBorder[2], &sheet);
+                            addAreas(&streamBorder[2], 1, TRUE, stream.after, &stream.afterCount);
                         }
-                    }
 
-                    // blur filter
-                    if (!isExcluded(nr, noBlurfilterMultiIndex, noBlurfilterMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount)) {
-                        if (verbose >= VERBOSE_NORMAL) {
-                            printf("blur-filter...");
+                        // --- write output file ---
+                        if ( (worker != NULL) && (!awaitPreviousSheets(worker)) ) { // sequential processing would not have got to this sheet
+                            writeoutput = FALSE;
+                            exitCode = 2;
                         }
-                        saveDebug("./_before-blurfilter.pnm", &sheet);
-                        filterResult = blurfilter(blurfilterScanSize, blurfilterScanStep, blurfilterIntensity, whiteThreshold, &sheet);
-                        saveDebug("./_after-blurfilter.pnm", &sheet);
-                        if (verbose >= VERBOSE_NORMAL) {
-                            printf(" deleted %d pixels.\n", filterResult);
+                        stream.type = outputType;
+                        if (writeoutput == TRUE) {
+                            if (verbose >= VERBOSE_NORMAL) {
+                                printf("writing output.\n");
+                            }
+                            if (createImageFile(outputFilenamesResolved[0], outputType, sheet.width, sheet.height, overwrite, &sheet, &output)) {
+                                stream.output = &output;
+                            } else {
+                                printf("*** error: Could not save image data to file %s.\n", outputFilenamesResolved[0]);
+                                exitCode = 2;
+                            }
+                        }
+                        beginStage();
+                        streamRows(&stream);
+                        if ( (stream.output != NULL) && (!closeOutput(&output)) ) {
+                            printf("*** error: Could not save image data to file %s.\n", outputFilenamesResolved[0]);
+                            exitCode = 2;
+                        }
+                        endStage(STAGE_STREAM, &sheet);
+                        if (!twoPass) {
+                            if ( (stream.noisefilterIntensity > 0) && (verbose >= VERBOSE_NORMAL) ) {
+                                printf("noise-filter ... deleted %d clusters.\n", stream.noisefilterCount);
+                            }
+                            if ( (stream.blurfilterScanSize != NULL) && (verbose >= VERBOSE_NORMAL) ) {
+                                printf("blur-filter... deleted %d pixels.\n", stream.blurfilterCount);
+                            }
+                        }
+                        if ( (stream.grayfilterScanSize != NULL) && (verbose >= VERBOSE_NORMAL) ) {
+                            printf("gray-filter... deleted %d pixels.\n", stream.grayfilterCount);
+                        }
+                        freeStream(&stream);
+                        if (twoPass) {
+                            freeImage(&filtered);
+                        }
+                        if (showTime) {
+                            endTime = clock();
                         }
                     } else {
-                        if (verbose >= VERBOSE_MORE) {
-                            printf("+ blurfilter DISABLED for sheet %d\n", nr);
+                        // pre-wipe
+                        if (stages.wipe) {
+                            applyWipes(preWipe, preWipeCount, maskColor, &sheet);
                         }
-                    }
 
-                    // mask-detection
-                    if (!isExcluded(nr, noMaskScanMultiIndex, noMaskScanMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount)) {
-                        maskCount = detectMasks(mask, maskValid, point, pointCount, maskScanDirections, maskScanSize, maskScanDepth, maskScanStep, maskScanThreshold, maskScanMinimum, maskScanMaximum, &sheet);
-                    } else {
-                        if (verbose >= VERBOSE_MORE) {
-                            printf("+ mask-scan DISABLED for sheet %d\n", nr);
+                        // pre-border
+                        if (stages.border) {
+                            applyBorder(preBorder, maskColor, &sheet);
                         }
-                    }
 
-                    // permamently apply masks
-                    if (maskCount > 0) {
-                        saveDebug("./_before-masking.pnm", &sheet);
-                        applyMasks(mask, maskCount, maskColor, &sheet);
-                        saveDebug("./_after-masking.pnm", &sheet);
-                    }
+                        // black area filter
+                        if (stages.blackfilter) {
+                            saveDebug("./_before-blackfilter.pnm", &sheet);
+                            beginStage();
+                            blackfilter(blackfilterScanDirections, blackfilterScanSize, blackfilterScanDepth, blackfilterScanStep, blackfilterScanThreshold, blackfilterExclude, blackfilterExcludeCount, blackfilterIntensity, blackThreshold, &sheet);
+                            endStage(STAGE_BLACKFILTER, &sheet);
+                            saveDebug("./_after-blackfilter.pnm", &sheet);
+                        }
 
-                    // gray filter
-                    if (!isExcluded(nr, noGrayfilterMultiIndex, noGrayfilterMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount)) {
-                        if (verbose >= VERBOSE_NORMAL) {
-                            printf("gray-filter...");
+                        // noise filter
+                        if (stages.noisefilter) {
+                            if (verbose >= VERBOSE_NORMAL) {
+                                printf("noise-filter ...");
+                            }
+                            saveDebug("./_before-noisefilter.pnm", &sheet);
+                            beginStage();
+                            filterResult = noisefilter(noisefilterIntensity, noisefilterMethod, whiteThreshold, &sheet);
+                            endStage(STAGE_NOISEFILTER, &sheet);
+                            saveDebug("./_after-noisefilter.pnm", &sheet);
+                            if (verbose >= VERBOSE_NORMAL) {
+                                printf(" deleted %d clusters.\n", filterResult);
+                            }
                         }
-                        saveDebug("./_before-grayfilter.pnm", &sheet);
-                        filterResult = grayfilter(grayfilterScanSize, grayfilterScanStep, grayfilterThreshold, blackThreshold, &sheet);
-                        saveDebug("./_after-grayfilter.pnm", &sheet);
-                        if (verbose >= VERBOSE_NORMAL) {
-                            printf(" deleted %d pixels.\n", filterResult);
+
+                        // blur filter
+                        if (stages.blurfilter) {
+                            if (verbose >= VERBOSE_NORMAL) {
+                                printf("blur-filter...");
+                            }
+                            saveDebug("./_before-blurfilter.pnm", &sheet);
+                            beginStage();
+                            filterResult = blurfilter(blurfilterScanSize, blurfilterScanStep, blurfilterIntensity, whiteThreshold, &sheet);
+                            endStage(STAGE_BLURFILTER, &sheet);
+                            saveDebug("./_after-blurfilter.pnm", &sheet);
+                            if (verbose >= VERBOSE_NORMAL) {
+                                printf(" deleted %d pixels.\n", filterResult);
+                            }
                         }
-                    } else {
-                        if (verbose >= VERBOSE_MORE) {
-                            printf("+ grayfilter DISABLED for sheet %d\n", nr);
+
+                        // mask-detection
+                        if (stages.maskScan) {
+                            beginStage();
+                            maskCount = detectMasks(mask, maskValid, point, pointCount, maskScanDirections, maskScanSize, maskScanDepth, maskScanStep, maskScanThreshold, maskScanMinimum, maskScanMaximum, &sheet);
+                            endStage(STAGE_MASKS, &sheet);
                         }
-                    }
 
-                    // rotation-detection
-                    if ((!isExcluded(nr, noDeskewMultiIndex, noDeskewMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount))) {
-                        saveDebug("./_before-deskew.pnm", &sheet);
-                        originalSheet = sheet; // copy struct entries ('clone')
-                        // convert to qpixels
-                        if (qpixels==TRUE) {
-                            if (verbose>=VERBOSE_NORMAL) {
-                                printf("converting to qpixels.\n");
-                            }
-                            initImage(&qpixelSheet, sheet.width * 2, sheet.height * 2, sheet.bitdepth, sheet.color, sheetBackground);
-                            convertToQPixels(&sheet, &qpixelSheet);
-                            sheet = qpixelSheet;
-                            q = 2; // qpixel-factor for coordinates in both directions
-                        } else {
-                            q = 1;
+                        // permamently apply masks
+                        if (maskCount > 0) {
+                            saveDebug("./_before-masking.pnm", &sheet);
+                            beginStage();
+                            applyMasks(mask, maskCount, maskColor, &sheet);
+                            endStage(STAGE_MASKS, &sheet);
+                            saveDebug("./_after-masking.pnm", &sheet);
                         }
 
-                        // detect masks again, we may get more precise results now after first masking and grayfilter
-                        if (!isExcluded(nr, noMaskScanMultiIndex, noMaskScanMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount)) {
-                            maskCount = detectMasks(mask, maskValid, point, pointCount, maskScanDirections, maskScanSize, maskScanDepth, maskScanStep, maskScanThreshold, maskScanMinimum, maskScanMaximum, &originalSheet);
-                        } else {
-                            if (verbose >= VERBOSE_MORE) {
-                                printf("(mask-scan before deskewing disabled)\n");
+                        // gray filter
+                        if (stages.grayfilter) {
+                            if (verbose >= VERBOSE_NORMAL) {
+                                printf("gray-filter...");
+                            }
+                            saveDebug("./_before-grayfilter.pnm", &sheet);
+                            beginStage();
+                            filterResult = grayfilter(grayfilterScanSize, grayfilterScanStep, grayfilterThreshold, blackThreshold, &sheet);
+                            endStage(STAGE_GRAYFILTER, &sheet);
+                            saveDebug("./_after-grayfilter.pnm", &sheet);
+                            if (verbose >= VERBOSE_NORMAL) {
+                                printf(" deleted %d pixels.\n", filterResult);
                             }
                         }
 
-                        // auto-deskew each mask
-                        for (i = 0; i < maskCount; i++) {
+                        // rotation-detection
+                        if (stages.deskew) {
+                            saveDebug("./_before-deskew.pnm", &sheet);
+                            originalSheet = sheet; // copy struct entries ('clone')
+                            // convert to qpixels (not needed when supersampling, which reads the sheet directly)
+                            if ( (qpixels==TRUE) && (deskewInterpolation != INTERPOLATION_SUPERSAMPLE) ) {
+                                if (verbose>=VERBOSE_NORMAL) {
+                                    printf("converting to qpixels.\n");
+                                }
+                                beginStage();
+                                initImage(&qpixelSheet, sheet.width * 2, sheet.height * 2, sheet.bitdepth, sheet.color, sheetBackground);
+                                convertToQPixels(&sheet, &qpixelSheet);
+                                endStage(STAGE_QPIXELS, &qpixelSheet);
+                                sheet = qpixelSheet;
+                                q = 2; // qpixel-factor for coordinates in both directions
+                            } else {
+                                q = 1;
+                            }
+
+                            // detect masks again, we may get more precise results now after first masking and grayfilter
+                            if (stages.maskScan) {
+                                beginStage();
+                                maskCount = detectMasks(mask, maskValid, point, pointCount, maskScanDirections, maskScanSize, maskScanDepth, maskScanStep, maskScanThreshold, maskScanMinimum, maskScanMaximum, &originalSheet);
+                                endStage(STAGE_MASKS, &originalSheet);
+                            } else {
+                                if (verbose >= VERBOSE_MORE) {
+                                    printf("(mask-scan before deskewing disabled)\n");
+                                }
+                            }
 
-                            // if ( maskValid[i] == TRUE ) { // point may have been invalidated if mask has not been auto-detected
+                            // detect rotation of all masks at once, on the original buffer (not qpixels)
+                            saveDebug("./_before-deskew-detect.pnm", &originalSheet);
+                            beginStage();
+                            detectRotations(deskewMethod, deskewScanEdges, deskewScanRange, deskewScanStep, deskewScanSearch, deskewScanSize, deskewScanDepth, mask, maskCount, edgeRotation, &originalSheet);
+                            endStage(STAGE_DESKEW, &originalSheet);
+                            saveDebug("./_after-deskew-detect.pnm", &originalSheet);
 
-                                // for rotation detection, original buffer is used (not qpixels)
-                                saveDebug("./_before-deskew-detect.pnm", &originalSheet);
-                                rotation = - detectRotation(deskewScanEdges, deskewScanRange, deskewScanStep, deskewScanSize, deskewScanDepth, deskewScanDeviation, mask[i][LEFT], mask[i][TOP], mask[i][RIGHT], mask[i][BOTTOM], &originalSheet);
-                                saveDebug("./_after-deskew-detect.pnm", &originalSheet);
+                            // auto-deskew each mask
+                            for (i = 0; i < maskCount; i++) {
 
-                                if (rotation != 0.0) {
-                                    if (verbose>=VERBOSE_NORMAL) {
-                                        printf("rotate (%d,%d): %f\n", point[i][X], point[i][Y], rotation);
-                                    }
-                                    initImage(&rect, (mask[i][RIGHT]-mask[i][LEFT]+1)*q, (mask[i][BOTTOM]-mask[i][TOP]+1)*q, sheet.bitdepth, sheet.color, sheetBackground);
-                                    initImage(&rectTarget, rect.width, rect.height, sheet.bitdepth, sheet.color, sheetBackground);
+                                // if ( maskValid[i] == TRUE ) { // point may have been invalidated if mask has not been auto-detected
 
-                                    // copy area to rotate into rSource
-                                    copyImageArea(mask[i][LEFT]*q, mask[i][TOP]*q, rect.width, rect.height, &sheet, 0, 0, &rect);
+                                    rotation = - maskRotation(deskewMethod, deskewScanEdges, edgeRotation[i], deskewScanDeviation, mask[i][LEFT], mask[i][TOP], mask[i][RIGHT], mask[i][BOTTOM]);
 
-                                    // rotate
-                                    rotate(degreesToRadians(rotation), &rect, &rectTarget);
+                                    if (rotation != 0.0) {
+                                        if (verbose>=VERBOSE_NORMAL) {
+                                            printf("rotate (%d,%d): %f\n", point[i][X], point[i][Y], rotation);
+                                        }
+                                        beginStage();
+                                        initImage(&rect, (mask[i][RIGHT]-mask[i][LEFT]+1)*q, (mask[i][BOTTOM]-mask[i][TOP]+1)*q, sheet.bitdepth, sheet.color, sheetBackground);
+                                        initImage(&rectTarget, rect.width, rect.height, sheet.bitdepth, sheet.color, sheetBackground);
 
-                                    // copy result back into whole image
-                                    copyImageArea(0, 0, rectTarget.width, rectTarget.height, &rectTarget, mask[i][LEFT]*q, mask[i][TOP]*q, &sheet);
+                                        // copy area to rotate into rSource
+                                        copyImageArea(mask[i][LEFT]*q, mask[i][TOP]*q, rect.width, rect.height, &sheet, 0, 0, &rect);
 
-                                    freeImage(&rect);
-                                    freeImage(&rectTarget);
-                                } else {
-                                    if (verbose >= VERBOSE_NORMAL) {
-                                        printf("rotate (%d,%d): -\n", point[i][X], point[i][Y]);
+                                        // rotate
+                                        rotate(degreesToRadians(rotation), deskewInterpolation, deskewSupersample, &rect, &rectTarget);
+
+                                        // copy result back into whole image
+                                        copyImageArea(0, 0, rectTarget.width, rectTarget.height, &rectTarget, mask[i][LEFT]*q, mask[i][TOP]*q, &sheet);
+                                        if (q == 1) {
+                                            originalSheet = sheet; // (buffer may have been unpacked)
+                                        }
+                                        endStage(STAGE_ROTATE, &rect);
+
+                                        freeImage(&rect);
+                                        freeImage(&rectTarget);
+                                    } else {
+                                        if (verbose >= VERBOSE_NORMAL) {
+                                            printf("rotate (%d,%d): -\n", point[i][X], point[i][Y]);
+                                        }
                                     }
-                                }
 
-                            // }
-                        } 
+                                // }
+                            } 
 
-                        // convert back from qpixels
-                        if (qpixels == TRUE) {
-                            if (verbose >= VERBOSE_NORMAL) {
-                                printf("converting back from qpixels.\n");
+                            // convert back from qpixels
+                            if (q == 2) {
+                                if (verbose >= VERBOSE_NORMAL) {
+                                    printf("converting back from qpixels.\n");
+                                }
+                                beginStage();
+                                convertFromQPixels(&qpixelSheet, &originalSheet);
+                                endStage(STAGE_QPIXELS, &qpixelSheet);
+                                freeImage(&qpixelSheet);
+                                sheet = originalSheet;
                             }
-                            convertFromQPixels(&qpixelSheet, &originalSheet);
-                            freeImage(&qpixelSheet);
-                            sheet = originalSheet;
-                        }
-                        saveDebug("./_after-deskew.pnm", &sheet);
-                    } else {
-                        if (verbose >= VERBOSE_MORE) {
-                            printf("+ deskewing DISABLED for sheet %d\n", nr);
+                            saveDebug("./_after-deskew.pnm", &sheet);
                         }
-                    }
 
-                    // auto-center masks on either single-page or double-page layout
-                    if ( (!isExcluded(nr, noMaskCenterMultiIndex, noMaskCenterMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount)) && (layout != LAYOUT_NONE) && (maskCount == pointCount) ) { // (maskCount==pointCount to make sure all masks had correctly been detected)
-                        // perform auto-masking again to get more precise masks after rotation                    
-                        if (!isExcluded(nr, noMaskScanMultiIndex, noMaskScanMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount)) {
-                            maskCount = detectMasks(mask, maskValid, point, pointCount, maskScanDirections, maskScanSize, maskScanDepth, maskScanStep, maskScanThreshold, maskScanMinimum, maskScanMaximum, &sheet);
-                        } else {
-                            if (verbose >= VERBOSE_MORE) {
-                                printf("(mask-scan before centering disabled)\n");
+                        // auto-center masks on either single-page or double-page layout
+                        if ( stages.maskCenter && (layout != LAYOUT_NONE) && (maskCount == pointCount) ) { // (maskCount==pointCount to make sure all masks had correctly been detected)
+                            // perform auto-masking again to get more precise masks after rotation                    
+                            if (stages.maskScan) {
+                                beginStage();
+                                maskCount = detectMasks(mask, maskValid, point, pointCount, maskScanDirections, maskScanSize, maskScanDepth, maskScanStep, maskScanThreshold, maskScanMinimum, maskScanMaximum, &sheet);
+                                endStage(STAGE_MASKS, &sheet);
+                            } else {
+                                if (verbose >= VERBOSE_MORE) {
+                                    printf("(mask-scan before centering disabled)\n");
+                                }
                             }
-                        }
 
-                        saveDebug("./_before-centering.pnm", &sheet);
-                        // center masks on the sheet, according to their page position
-                        for (i = 0; i < maskCount; i++) {
-                            centerMask(point[i][X], point[i][Y], mask[i][LEFT], mask[i][TOP], mask[i][RIGHT], mask[i][BOTTOM], &sheet);
-                        }
-                        saveDebug("./_after-centering.pnm", &sheet);
-                    } else {
-                        if (verbose >= VERBOSE_MORE) {
+                            saveDebug("./_before-centering.pnm", &sheet);
+                            // center masks on the sheet, according to their page position
+                            beginStage();
+                            for (i = 0; i < maskCount; i++) {
+                                centerMask(point[i][X], point[i][Y], mask[i][LEFT], mask[i][TOP], mask[i][RIGHT], mask[i][BOTTOM], &sheet);
+                            }
+                            endStage(STAGE_MASKS, &sheet);
+                            saveDebug("./_after-centering.pnm", &sheet);
+                        } else if ( stages.maskCenter && (verbose >= VERBOSE_MORE) ) { // (if disabled by option, stageEnabled() has told so)
                             printf("+ auto-centering DISABLED for sheet %d\n", nr);
                         }
-                    }
 
-                    // explicit wipe
-                    if (!isExcluded(nr, noWipeMultiIndex, noWipeMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount)) {
-                        applyWipes(wipe, wipeCount, maskColor, &sheet);
-                    } else {
-                        if (verbose >= VERBOSE_MORE) {
-                            printf("+ wipe DISABLED for sheet %d\n", nr);
+                        // explicit wipe
+                        if (stages.wipe) {
+                            applyWipes(wipe, wipeCount, maskColor, &sheet);
                         }
-                    }
 
-                    // explicit border
-                    if (!isExcluded(nr, noBorderMultiIndex, noBorderMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount)) {
-                        applyBorder(border, maskColor, &sheet);
-                    } else {
-                        if (verbose >= VERBOSE_MORE) {
-                            printf("+ border DISABLED for sheet %d\n", nr);
+                        // explicit border
+                        if (stages.border) {
+                            applyBorder(border, maskColor, &sheet);
                         }
-                    }
 
-                    // border-detection
-                    if (!isExcluded(nr, noBorderScanMultiIndex, noBorderScanMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount)) {
-                        saveDebug("./_before-border.pnm", &sheet);
-                        for (i = 0; i < outsideBorderscanMaskCount; i++) {
-                            detectBorder(autoborder[i], borderScanDirections, borderScanSize, borderScanStep, borderScanThreshold, blackThreshold, outsideBorderscanMask[i], &sheet);
-                            borderToMask(autoborder[i], autoborderMask[i], &sheet);
-                        }
-                        applyMasks(autoborderMask, outsideBorderscanMaskCount, maskColor, &sheet);
-                        for (i = 0; i < outsideBorderscanMaskCount; i++) {
-                            // border-centering
-                            if (!isExcluded(nr, noBorderAlignMultiIndex, noBorderAlignMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount)) {
-                                alignMask(autoborderMask[i], outsideBorderscanMask[i], borderAlign, borderAlignMargin, &sheet);
-                            } else {
-                                if (verbose >= VERBOSE_MORE) {
-                                    printf("+ border-centering DISABLED for sheet %d\n", nr);
+                        // border-detection
+                        if (stages.borderScan) {
+                            saveDebug("./_before-border.pnm", &sheet);
+                            beginStage();
+                            for (i = 0; i < outsideBorderscanMaskCount; i++) {
+                                detectBorder(autoborder[i], borderScanDirections, borderScanSize, borderScanStep, borderScanThreshold, blackThreshold, outsideBorderscanMask[i], &sheet);
+                                borderToMask(autoborder[i], autoborderMask[i], &sheet);
+                            }
+                            applyMasks(autoborderMask, outsideBorderscanMaskCount, maskColor, &sheet);
+                            for (i = 0; i < outsideBorderscanMaskCount; i++) {
+                                // border-centering
+                                if (stages.borderAlign) {
+                                    alignMask(autoborderMask[i], outsideBorderscanMask[i], borderAlign, borderAlignMargin, &sheet);
                                 }
                             }
+                            endStage(STAGE_BORDER, &sheet);
+                            saveDebug("./_after-border.pnm", &sheet);
                         }
-                        saveDebug("./_after-border.pnm", &sheet);
-                    } else {
-                        if (verbose >= VERBOSE_MORE) {
-                            printf("+ border-scan DISABLED for sheet %d\n", nr);
-                        }
-                    }
-
-                    // post-wipe
-                    if (!isExcluded(nr, noWipeMultiIndex, noWipeMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount)) {
-                        applyWipes(postWipe, postWipeCount, maskColor, &sheet);
-                    }
-
-                    // post-border
-                    if (!isExcluded(nr, noBorderMultiIndex, noBorderMultiIndexCount, ignoreMultiIndex, ignoreMultiIndexCount)) {
-                        applyBorder(postBorder, maskColor, &sheet);
-                    }
 
-                    // post-mirroring
-                    if (postMirror != 0) {
-                        if (verbose >= VERBOSE_NORMAL) {
-                            printf("post-mirroring ");
-                            printDirections(postMirror);
+                        // post-wipe
+                        if (stages.wipe) {
+                            applyWipes(postWipe, postWipeCount, maskColor, &sheet);
                         }
-                        mirror(postMirror, &sheet);
-                    }
 
-                    // post-shifting
-                    if ((postShift[WIDTH] != 0) || ((postShift[HEIGHT] != 0))) {
-                        if (verbose >= VERBOSE_NORMAL) {
-                            printf("post-shifting [%d,%d]\n", postShift[WIDTH], postShift[HEIGHT]);
+                        // post-border
+                        if (stages.border) {
+                            applyBorder(postBorder, maskColor, &sheet);
                         }
-                        shift(postShift[WIDTH], postShift[HEIGHT], &sheet);
-                    }
 
-                    // post-rotating
-                    if (postRotate != 0) {
-                        if (verbose >= VERBOSE_NORMAL) {
-                            printf("post-rotating %d degrees.\n", postRotate);
-                        }
-                        if (postRotate == 90) {
-                            flipRotate(1, &sheet);
-                        } else if (postRotate == -90) {
-                            flipRotate(-1, &sheet);
+                        // post-mirroring
+                        if (postMirror != 0) {
+                            if (verbose >= VERBOSE_NORMAL) {
+                                printf("post-mirroring ");
+                                printDirections(postMirror);
+                            }
+                            beginStage();
+                            mirror(postMirror, &sheet);
+                            endStage(STAGE_FLIP, &sheet);
                         }
-                    }
 
-                    // post-stretch
-                    if ((postStretchSize[WIDTH] != -1) || (postStretchSize[HEIGHT] != -1)) {
-                        if (postStretchSize[WIDTH] != -1) {
-                            w = postStretchSize[WIDTH];
-                        } else {
-                            w = sheet.width;
-                        }
-                        if (postStretchSize[HEIGHT] != -1) {
-                            h = postStretchSize[HEIGHT];
-                        } else {
-                            h = sheet.height;
+                        // post-shifting
+                        if ((postShift[WIDTH] != 0) || ((postShift[HEIGHT] != 0))) {
+                            if (verbose >= VERBOSE_NORMAL) {
+                                printf("post-shifting [%d,%d]\n", postShift[WIDTH], postShift[HEIGHT]);
+                            }
+                            beginStage();
+                            shift(postShift[WIDTH], postShift[HEIGHT], &sheet);
+                            endStage(STAGE_FLIP, &sheet);
                         }
-                        stretch(w, h, &sheet);
-                    } 
-                    
-                    // post-zoom
-                    if (postZoomFactor != 1.0) {
-                        w = sheet.width * postZoomFactor;
-                        h = sheet.height * postZoomFactor;
-                        stretch(w, h, &sheet);
-                    }
 
-                    // post-size
-                    if ((postSize[WIDTH] != -1) || (postSize[HEIGHT] != -1)) {
-                        if (postSize[WIDTH] != -1) {
-                            w = postSize[WIDTH];
-                        } else {
-                            w = sheet.width;
+                        // post-rotating
+                        if (postRotate != 0) {
+                            if (verbose >= VERBOSE_NORMAL) {
+                                printf("post-rotating %d degrees.\n", postRotate);
+                            }
+                            beginStage();
+                            if (postRotate == 90) {
+                                flipRotate(1, &sheet);
+                            } else if (postRotate == -90) {
+                                flipRotate(-1, &sheet);
+                            }
+                            endStage(STAGE_FLIP, &sheet);
                         }
-                        if (postSize[HEIGHT] != -1) {
-                            h = postSize[HEIGHT];
-                        } else {
-                            h = sheet.height;
+
+                        // post-stretch
+                        if ((postStretchSize[WIDTH] != -1) || (postStretchSize[HEIGHT] != -1)) {
+                            if (postStretchSize[WIDTH] != -1) {
+                                w = postStretchSize[WIDTH];
+                            } else {
+                                w = sheet.width;
+                            }
+                            if (postStretchSize[HEIGHT] != -1) {
+                                h = postStretchSize[HEIGHT];
+                            } else {
+                                h = sheet.height;
+                            }
+                            beginStage();
+                            stretch(w, h, stretchFilter, &sheet);
+                            endStage(STAGE_STRETCH, &sheet);
+                        } 
+                    
+                        // post-zoom
+                        if (postZoomFactor != 1.0) {
+                            w = sheet.width * postZoomFactor;
+                            h = sheet.height * postZoomFactor;
+                            beginStage();
+                            stretch(w, h, stretchFilter, &sheet);
+                            endStage(STAGE_STRETCH, &sheet);
                         }
-                        resize(w, h, &sheet);
-                    } 
+
+                        // post-size
+                        if ((postSize[WIDTH] != -1) || (postSize[HEIGHT] != -1)) {
+                            if (postSize[WIDTH] != -1) {
+                                w = postSize[WIDTH];
+                            } else {
+                                w = sheet.width;
+                            }
+                            if (postSize[HEIGHT] != -1) {
+                                h = postSize[HEIGHT];
+                            } else {
+                                h = sheet.height;
+                            }
+                            beginStage();
+                            resize(w, h, stretchFilter, &sheet);
+                            endStage(STAGE_STRETCH, &sheet);
+                        } 
                     
-                    if (showTime) {
-                        endTime = clock();
-                    }
+                        if (showTime) {
+                            endTime = clock();
+                        }
 
-                    // --- write output file ---
+                        // --- write output file ---
+                        if ( (worker != NULL) && (!awaitPreviousSheets(worker)) ) { // sequential processing would not have got to this sheet
+                            writeoutput = FALSE;
+                            exitCode = 2;
+                        }
 
-                    // write split pages output
+                        // write split pages output
 
-                    if (writeoutput == TRUE) {    
-                        if (verbose >= VERBOSE_NORMAL) {
-                            printf("writing output.\n");
-                        }
-                        // write files
-                        saveDebug("./_before-save.pnm", &sheet);
-                        success = TRUE;
-                        page.width = sheet.width / outputCount;
-                        page.height = sheet.height;
-                        page.bitdepth = sheet.bitdepth;
-                        page.color = sheet.color;
-                        for ( j = 0; success && (j < outputCount); j++) {
-                            // get pagebuffer
-                            if ( outputCount == 1 ) {
-                                page.buffer = sheet.buffer;
-                                page.bufferGrayscale = sheet.bufferGrayscale;
-                                page.bufferLightness = sheet.bufferLightness;
-                                page.bufferDarknessInverse = sheet.bufferDarknessInverse;
-                            } else { // generic case: copy page-part of sheet into own buffer
-                                if (page.color) {
-                                    page.buffer = (unsigned char*)malloc( page.width * page.height * 3 );
-                                    page.bufferGrayscale = (unsigned char*)malloc( page.width * page.height );
-                                    page.bufferLightness = (unsigned char*)malloc( page.width * page.height );
-                                    page.bufferDarknessInverse = (unsigned char*)malloc( page.width * page.height );
-                                } else {
-                                    page.buffer = (unsigned char*)malloc( page.width * page.height );
-                                    page.bufferGrayscale = page.buffer;
-                                    page.bufferLightness = page.buffer;
-                                    page.bufferDarknessInverse = page.buffer;
-                                }
-                                copyImageArea(page.width * j, 0, page.width, page.height, &sheet, 0, 0, &page);
-                            }
-                            
-                            success = saveImage(outputFilenamesResolved[j], &page, outputType, overwrite, blackThreshold);
-                            
-                            if ( outputCount > 1 ) {
-                                freeImage(&page);
+                        if (writeoutput == TRUE) {    
+                            if (verbose >= VERBOSE_NORMAL) {
+                                printf("writing output.\n");
                             }
-                            if (success == FALSE) {
-                                printf("*** error: Could not save image data to file %s.\n", outputFilenamesResolved[j]);
+                            // write files
+                            saveDebug("./_before-save.pnm", &sheet);
+                            beginStage();
+                            if ( pipeline && (jobs <= 1) ) { // saved while the next sheet is processed
+                                if (!startWriter(&sheet, outputCount, outputFilenamesResolved, outputDirectories, outputType, tiffCompression, overwrite, blackThreshold, &writer)) {
+                                    exitCode = 2;
+                                }
+                                sheet.buffer = NULL; // owned by the writer now
+                            } else if (!saveSheet(&sheet, outputCount, outputFilenamesResolved, outputDirectories, outputType, tiffCompression, overwrite, blackThreshold)) {
                                 exitCode = 2;
                             }
+                            endStage(STAGE_SAVE, &sheet);
                         }
                     }
 
-                    freeImage(&sheet);
+                    if (sheet.buffer != NULL) {
+                        freeImage(&sheet);
+                    }
                     sheet.buffer = NULL;
+                    poolTrim(); // keep buffers for the sizes needed by the next sheet
 
                     if (showTime) {
                         if (startTime > endTime) { // clock overflow
@@ -5521,12 +12397,39 @@ int main(int argc, char* argv[]) {
                         totalCount++;
                         printf("- processing time:  %f s\n", (float)time/CLOCKS_PER_SEC);
                     }
+                    finishProfile(nr);
+                } else if (sheet.buffer != NULL) { // discard the pages placed before one failed to load
+                    freeImage(&sheet);
+                }
+
+                if (worker != NULL) { // report back to main process and terminate
+                    result.exitCode = exitCode;
+                    result.previousWidth = previousWidth;
+                    result.previousHeight = previousHeight;
+                    result.previousBitdepth = previousBitdepth;
+                    result.previousColor = previousColor;
+                    result.totalTime = totalTime;
+                    result.totalCount = totalCount;
+                    result.profiled = profile.enabled;
+                    result.stages = profile.sheet;
+                    finishSheetWorker(worker, &result);
                 }
             }
         }
     }
+    finishPrefetch(&prefetch);
+    if (!finishWriter(&writer)) {
+        exitCode = 2;
+    }
+    if (!waitSheetWorkers(0, workers, jobs, &workersFirst, &workersCount, &exitCode, &previousWidth, &previousHeight, &previousBitdepth, &previousColor, &totalTime, &totalCount)) {
+        return exitCode;
+    }
     if ( showTime && (totalCount > 1) ) {
        printf("- total processing time of all %d sheets:  %f s  (average:  %f s)\n", totalCount, (double)totalTime/CLOCKS_PER_SEC, (double)totalTime/totalCount/CLOCKS_PER_SEC);
     }
+    printProfileSummary();
+    if (verbose >= VERBOSE_MORE) {
+        printf("buffer pool: %lu buffers reused, %lu allocated, peak %lu bytes.\n", pool.hits, pool.misses, (unsigned long)pool.peak);
+    }
     return exitCode;
 }